@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+#define AR_ROUND(size) \
+    (((size) + AR_ALIGNMENT - 1) / AR_ALIGNMENT * AR_ALIGNMENT)
+
+/* A freed small allocation */
+typedef struct ArenaFree ArenaFree;
+
+struct ArenaFree {
+    ArenaFree *next;
+};
+
+/* Header at the start of each block. A block only holds
+ * allocations of a single size class */
+struct ArenaBlock {
+    Arena *arena; /* Arena the block belongs to */
+    ArenaBlock *prev; /* All blocks of the arena */
+    ArenaBlock *next;
+    ArenaBlock *prev_partial; /* Blocks of the same size class with */
+    ArenaBlock *next_partial; /* space for more allocations */
+    ArenaFree *free_list; /* Freed allocations */
+    size_t used; /* Bytes of the block carved into allocations */
+    size_t live; /* Allocations in use */
+    size_t size_class;
+    int partial; /* In the partial list of its size class */
+};
+
+/* Header preceding each large allocation */
+struct ArenaLarge {
+    Arena *arena;
+    ArenaLarge *prev;
+    ArenaLarge *next;
+};
+
+#define AR_BLOCK_HEADER_SIZE AR_ROUND(sizeof(ArenaBlock))
+#define AR_LARGE_HEADER_SIZE AR_ROUND(sizeof(ArenaLarge))
+
+static size_t ar_size_class(size_t size);
+static size_t ar_class_size(size_t size_class);
+static void *ar_alloc_small(Arena *, size_t size);
+static void *ar_alloc_large(Arena *, size_t size);
+static void ar_free_small(Arena *, void *ptr, size_t size);
+static ArenaBlock *ar_new_block(Arena *, size_t size_class);
+static void ar_free_block(Arena *, ArenaBlock *);
+static void ar_add_partial(Arena *, ArenaBlock *);
+static void ar_remove_partial(Arena *, ArenaBlock *);
+static ArenaBlock *ar_block(const void *ptr);
+static ArenaLarge *ar_large_header(const void *ptr);
+
+void ar_init(Arena *arena)
+{
+    memset(arena, 0, sizeof(Arena));
+}
+
+void *ar_alloc(Arena *arena, size_t size)
+{
+    assert(size > 0);
+
+    if (size <= AR_MAX_SMALL_SIZE) {
+        return ar_alloc_small(arena, size);
+    }
+
+    return ar_alloc_large(arena, size);
+}
+
+void *ar_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL) {
+        return ar_alloc(arena, new_size);
+    }
+
+    assert(ar_owner(ptr, old_size) == arena);
+
+    if (old_size > AR_MAX_SMALL_SIZE && new_size > AR_MAX_SMALL_SIZE) {
+        ArenaLarge *header = ar_large_header(ptr);
+        ArenaLarge *prev = header->prev;
+        ArenaLarge *next = header->next;
+        header = realloc(header, AR_LARGE_HEADER_SIZE + new_size);
+
+        if (header == NULL) {
+            return NULL;
+        }
+
+        /* Relink the allocation as it may have moved */
+        if (prev == NULL) {
+            arena->large = header;
+        } else {
+            prev->next = header;
+        }
+
+        if (next != NULL) {
+            next->prev = header;
+        }
+
+        arena->allocated = arena->allocated - old_size + new_size;
+
+        return (char *)header + AR_LARGE_HEADER_SIZE;
+    } else if (old_size <= AR_MAX_SMALL_SIZE &&
+               new_size <= AR_MAX_SMALL_SIZE &&
+               ar_size_class(old_size) == ar_size_class(new_size)) {
+        return ptr;
+    }
+
+    void *new_ptr = ar_alloc(arena, new_size);
+
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    ar_free(arena, ptr, old_size);
+
+    return new_ptr;
+}
+
+/* size must be the size the allocation was made with */
+void ar_free(Arena *arena, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    assert(ar_owner(ptr, size) == arena);
+
+    if (size <= AR_MAX_SMALL_SIZE) {
+        ar_free_small(arena, ptr, size);
+        return;
+    }
+
+    ArenaLarge *header = ar_large_header(ptr);
+
+    if (header->prev == NULL) {
+        arena->large = header->next;
+    } else {
+        header->prev->next = header->next;
+    }
+
+    if (header->next != NULL) {
+        header->next->prev = header->prev;
+    }
+
+    arena->allocated -= size;
+    free(header);
+}
+
+/* The arena an allocation of size bytes was made from */
+Arena *ar_owner(const void *ptr, size_t size)
+{
+    if (size <= AR_MAX_SMALL_SIZE) {
+        return ar_block(ptr)->arena;
+    }
+
+    return ar_large_header(ptr)->arena;
+}
+
+/* Create an arena whose allocations can be released together by
+ * ar_free_child without affecting the rest of the parent arena.
+ * Child arenas are also released when their parent is released */
+Arena *ar_new_child(Arena *arena)
+{
+    Arena *child = ar_alloc(arena, sizeof(Arena));
+
+    if (child == NULL) {
+        return NULL;
+    }
+
+    ar_init(child);
+    child->next_child = arena->children;
+
+    if (arena->children != NULL) {
+        arena->children->prev_child = child;
+    }
+
+    arena->children = child;
+
+    return child;
+}
+
+void ar_free_child(Arena *arena, Arena *child)
+{
+    if (child == NULL) {
+        return;
+    }
+
+    if (child->prev_child == NULL) {
+        arena->children = child->next_child;
+    } else {
+        child->prev_child->next_child = child->next_child;
+    }
+
+    if (child->next_child != NULL) {
+        child->next_child->prev_child = child->prev_child;
+    }
+
+    ar_release(child);
+    ar_free(arena, child, sizeof(Arena));
+}
+
+/* Free every allocation made from the arena and its
+ * children, after which it can be used again */
+void ar_release(Arena *arena)
+{
+    Arena *child = arena->children;
+    Arena *next_child;
+
+    while (child != NULL) {
+        next_child = child->next_child;
+        ar_release(child);
+        child = next_child;
+    }
+
+    ArenaBlock *block = arena->blocks;
+    ArenaBlock *next_block;
+
+    while (block != NULL) {
+        next_block = block->next;
+        free(block);
+        block = next_block;
+    }
+
+    ArenaLarge *large = arena->large;
+    ArenaLarge *next_large;
+
+    while (large != NULL) {
+        next_large = large->next;
+        free(large);
+        large = next_large;
+    }
+
+    ar_init(arena);
+}
+
+static size_t ar_size_class(size_t size)
+{
+    return (size - 1) / AR_ALIGNMENT;
+}
+
+static size_t ar_class_size(size_t size_class)
+{
+    return (size_class + 1) * AR_ALIGNMENT;
+}
+
+static void *ar_alloc_small(Arena *arena, size_t size)
+{
+    size_t size_class = ar_size_class(size);
+    ArenaBlock *block = arena->partial[size_class];
+
+    if (block == NULL && (block = ar_new_block(arena, size_class)) == NULL) {
+        return NULL;
+    }
+
+    void *ptr;
+    size = ar_class_size(size_class);
+
+    if (block->free_list != NULL) {
+        ptr = block->free_list;
+        block->free_list = block->free_list->next;
+    } else {
+        ptr = (char *)block + block->used;
+        block->used += size;
+    }
+
+    block->live++;
+
+    if (block->free_list == NULL && AR_BLOCK_SIZE - block->used < size) {
+        ar_remove_partial(arena, block);
+    }
+
+    return ptr;
+}
+
+static void *ar_alloc_large(Arena *arena, size_t size)
+{
+    ArenaLarge *header = malloc(AR_LARGE_HEADER_SIZE + size);
+
+    if (header == NULL) {
+        return NULL;
+    }
+
+    header->arena = arena;
+    header->prev = NULL;
+    header->next = arena->large;
+
+    if (arena->large != NULL) {
+        arena->large->prev = header;
+    }
+
+    arena->large = header;
+    arena->allocated += size;
+
+    return (char *)header + AR_LARGE_HEADER_SIZE;
+}
+
+/* A block whose allocations have all been freed is released unless
+ * it's the only block of its size class with space, so that a
+ * single allocation being made and freed repeatedly doesn't
+ * allocate and free a block each time */
+static void ar_free_small(Arena *arena, void *ptr, size_t size)
+{
+    ArenaBlock *block = ar_block(ptr);
+    ArenaFree *entry = ptr;
+
+    assert(block->size_class == ar_size_class(size));
+    (void)size;
+
+    entry->next = block->free_list;
+    block->free_list = entry;
+    block->live--;
+
+    if (!block->partial) {
+        ar_add_partial(arena, block);
+    }
+
+    if (block->live == 0 &&
+        (block->prev_partial != NULL || block->next_partial != NULL)) {
+        ar_free_block(arena, block);
+    }
+}
+
+static ArenaBlock *ar_new_block(Arena *arena, size_t size_class)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, AR_BLOCK_SIZE, AR_BLOCK_SIZE) != 0) {
+        return NULL;
+    }
+
+    ArenaBlock *block = mem;
+    memset(block, 0, sizeof(ArenaBlock));
+    block->arena = arena;
+    block->used = AR_BLOCK_HEADER_SIZE;
+    block->size_class = size_class;
+
+    block->next = arena->blocks;
+
+    if (arena->blocks != NULL) {
+        arena->blocks->prev = block;
+    }
+
+    arena->blocks = block;
+    arena->allocated += AR_BLOCK_SIZE;
+    ar_add_partial(arena, block);
+
+    return block;
+}
+
+static void ar_free_block(Arena *arena, ArenaBlock *block)
+{
+    if (block->partial) {
+        ar_remove_partial(arena, block);
+    }
+
+    if (block->prev == NULL) {
+        arena->blocks = block->next;
+    } else {
+        block->prev->next = block->next;
+    }
+
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    arena->allocated -= AR_BLOCK_SIZE;
+    free(block);
+}
+
+static void ar_add_partial(Arena *arena, ArenaBlock *block)
+{
+    ArenaBlock **partial = &arena->partial[block->size_class];
+
+    block->prev_partial = NULL;
+    block->next_partial = *partial;
+
+    if (*partial != NULL) {
+        (*partial)->prev_partial = block;
+    }
+
+    *partial = block;
+    block->partial = 1;
+}
+
+static void ar_remove_partial(Arena *arena, ArenaBlock *block)
+{
+    if (block->prev_partial == NULL) {
+        arena->partial[block->size_class] = block->next_partial;
+    } else {
+        block->prev_partial->next_partial = block->next_partial;
+    }
+
+    if (block->next_partial != NULL) {
+        block->next_partial->prev_partial = block->prev_partial;
+    }
+
+    block->prev_partial = block->next_partial = NULL;
+    block->partial = 0;
+}
+
+static ArenaBlock *ar_block(const void *ptr)
+{
+    return (ArenaBlock *)((uintptr_t)ptr & ~(uintptr_t)(AR_BLOCK_SIZE - 1));
+}
+
+static ArenaLarge *ar_large_header(const void *ptr)
+{
+    return (ArenaLarge *)((const char *)ptr - AR_LARGE_HEADER_SIZE);
+}
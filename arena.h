@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_ARENA_H
+#define WED_ARENA_H
+
+#include <stddef.h>
+
+/* A slab allocator for large numbers of small records, such as undo
+ * history. Small allocations are carved from blocks holding a single
+ * size class and returned to their block's free list when freed, so
+ * they're reused without calling malloc or free. A block is released
+ * once all its allocations are freed. Larger allocations use malloc but
+ * are tracked so that everything an arena holds is released at once by
+ * ar_release. Callers pass the size of an allocation when freeing it */
+
+/* All allocations are aligned to AR_ALIGNMENT bytes */
+#define AR_ALIGNMENT 16
+/* Allocations up to this size are carved from blocks */
+#define AR_MAX_SMALL_SIZE 256
+#define AR_SIZE_CLASSES (AR_MAX_SMALL_SIZE / AR_ALIGNMENT)
+/* Blocks are aligned to their size so the block an
+ * allocation belongs to is found from its address */
+#define AR_BLOCK_SIZE (16 * 1024)
+
+typedef struct Arena Arena;
+typedef struct ArenaBlock ArenaBlock;
+typedef struct ArenaLarge ArenaLarge;
+
+struct Arena {
+    ArenaBlock *blocks; /* Blocks small allocations are carved from */
+    ArenaBlock *partial[AR_SIZE_CLASSES]; /* Blocks of each size class
+                                             with space for more
+                                             allocations */
+    ArenaLarge *large; /* Allocations above AR_MAX_SMALL_SIZE */
+    size_t allocated; /* Bytes allocated by malloc */
+    Arena *children; /* Arenas created by ar_new_child */
+    Arena *prev_child; /* Siblings in the children list of the parent */
+    Arena *next_child;
+};
+
+void ar_init(Arena *);
+void *ar_alloc(Arena *, size_t size);
+void *ar_realloc(Arena *, void *ptr, size_t old_size, size_t new_size);
+void ar_free(Arena *, void *ptr, size_t size);
+Arena *ar_owner(const void *ptr, size_t size);
+Arena *ar_new_child(Arena *);
+void ar_free_child(Arena *, Arena *child);
+void ar_release(Arena *);
+
+#endif
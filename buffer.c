@@ -17,11 +17,13 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <assert.h>
 #include "session.h"
@@ -35,9 +37,52 @@
 #define FILE_BUF_SIZE 1024
 #define DETECT_FF_LINE_NUM 5
 
+/* History read from an undo file before it's added to a buffer */
+typedef struct {
+    BufferChanges *changes;
+    BufferChange *history;
+} UndoFileHistory;
+
+/* Progress through a run of edits made by bf_apply_edits, shared
+ * between the marks repositioned after it in order of offset */
+typedef struct {
+    const BufferEdit *edits;
+    size_t edit_num;
+    int backward; /* Each edit is made before the one preceding it */
+    size_t next; /* Edits before this, or from it when backward, move
+                    every mark still to be repositioned the same way */
+    size_t added; /* Bytes those edits insert */
+    size_t removed; /* Bytes those edits delete */
+} EditSweep;
+
+static Status bf_read_file_stream(Buffer *, const FileInfo *,
+                                  FILE *input_file);
+static int bf_map_file(Buffer *, int fd);
+static Status bf_read_initial(Buffer *, int fd, int *eof);
+static void bf_stop_line_count(Buffer *);
+static Status bf_append_loaded_text(Buffer *, const char *text,
+                                    size_t length);
 static Status bf_add_new_line_at_buffer_end(Buffer *);
-static Status bf_input_stream_read(InputStream *, char buf[], size_t buf_len,
-                                   size_t *bytes_read);
+static Status bf_check_can_write(const Buffer *, const char *file_path);
+static WriteDurability bf_get_write_durability(const Buffer *);
+static const struct stat *bf_get_base_stat(const Buffer *);
+static void bf_set_base_file(Buffer *, const char *file_path);
+static void bf_journal_inserted_text(Buffer *, size_t offset, size_t length);
+static void bf_journal_saved(Buffer *, const char *file_path,
+                             size_t journal_mark);
+static int bf_undo_file_saving(Buffer *);
+static void bf_undo_file_saved(Buffer *, const char *file_path,
+                               BufferChangeState, uint64_t hash);
+static Status bf_load_undo_file(Buffer *);
+static Status bf_load_undo_segment(void *context, const char *changes,
+                                   size_t length);
+static void bf_undo_history_dropped(Buffer *);
+static Status bf_replay_journal_record(void *context, JournalRecordType,
+                                       size_t offset, const char *text,
+                                       size_t length);
+static Status bf_input_stream_read(InputStream *, const char **text,
+                                   size_t *length);
+static void bf_input_stream_consume(InputStream *, size_t bytes);
 static Status bf_input_stream_close(InputStream *);
 static Status bf_output_stream_write(OutputStream *, const char buf[],
                                      size_t buf_len, size_t *bytes_written);
@@ -53,15 +98,25 @@ static Status bf_advance_bp_to_line_offset(Buffer *, BufferPos *,
                                            int is_select);
 static void bf_update_line_col_offset(Buffer *, const BufferPos *);
 static Status bf_add_mark(Buffer *, Mark *);
-static Mark *bf_get_mark(const Buffer *, const BufferPos *);
+static Mark *bf_get_mark(Buffer *, const BufferPos *, size_t *index);
 static int bf_remove_pos_mark(Buffer *, const BufferPos *, int free);
 static int bf_remove_mark(Buffer *, Mark *, int free);
+static void bf_order_marks(Buffer *);
+static void bf_sort_marks(List *marks, size_t start);
+static size_t bf_first_mark_from(const List *marks, size_t offset);
 static Status bf_update_marks(Buffer *, const BufferPos *change_pos,
                               TextChangeType change_type, size_t change_length,
                               size_t change_lines);
 static void bf_update_mark(Mark *, const BufferPos *change_pos,
                            TextChangeType change_type, size_t change_length,
                            size_t change_lines);
+static size_t bf_edit_run(const BufferEdit *, size_t edit_num,
+                          int *backward);
+static size_t bf_sweep_offset(EditSweep *, size_t offset, MarkProperties);
+static void bf_sweep_add(EditSweep *, const BufferEdit *);
+static int bf_edit_passed(const BufferEdit *, size_t offset);
+static size_t bf_edit_offset(size_t offset, MarkProperties,
+                             const BufferEdit *);
 static Status bf_insert_expanded_tab(Buffer *, int advance_cursor);
 static Status bf_auto_indent(Buffer *, int advance_cursor);
 static Status bf_convert_fileformat(TextSelection *in_ts, TextSelection *out_ts, 
@@ -77,13 +132,14 @@ Buffer *bf_new(const FileInfo *file_info, const HashMap *config)
     RETURN_IF_NULL(buffer);
 
     memset(buffer, 0, sizeof(Buffer));
+    buffer->stream_fd = -1;
 
     if ((buffer->config = new_hashmap()) == NULL) {
         bf_free(buffer);
         return NULL;
     }
 
-    if ((buffer->marks = new_hashmap()) == NULL) {
+    if ((buffer->marks = list_new()) == NULL) {
         bf_free(buffer);
         return NULL;
     }
@@ -98,11 +154,25 @@ Buffer *bf_new(const FileInfo *file_info, const HashMap *config)
         return NULL;
     }
 
+    cf_snapshot_config(buffer->config, CL_BUFFER, &buffer->config_snapshot);
+
+    GapBufferStorage storage;
+    bf_determine_textstore(cf_string(buffer->config, CV_TEXTSTORE), &storage);
+
+    if (!gb_set_storage(buffer->data, storage)) {
+        bf_free(buffer);
+        return NULL;
+    }
+
+    bf_set_alloc_policy(buffer);
+
     buffer->file_info = *file_info;
     buffer->file_format = FF_UNIX;
-    bp_init(&buffer->pos, buffer->data, &buffer->file_format, buffer->config);
-    bp_init(&buffer->select_start, buffer->data,
-            &buffer->file_format, buffer->config);
+    bp_init_col_cache(&buffer->col_cache);
+    bp_init(&buffer->pos, buffer->data, &buffer->file_format,
+            &buffer->config_snapshot, &buffer->col_cache);
+    bp_init(&buffer->select_start, buffer->data, &buffer->file_format,
+            &buffer->config_snapshot, &buffer->col_cache);
     bf_select_reset(buffer);
     bs_init_default_opt(&buffer->search);
     bc_init(&buffer->changes);
@@ -142,13 +212,22 @@ void bf_free(Buffer *buffer)
         return;
     }
 
+    st_free_status(bf_finish_write_file(buffer, NULL));
+    st_free_status(bf_cancel_load(buffer));
+    bf_stop_line_count(buffer);
+    bf_stop_follow(buffer);
+    bf_stop_stream(buffer);
+    /* The buffer is being closed so its edits no longer need
+     * to be recovered */
+    jn_free(buffer->journal, 1);
+    uf_free(buffer->undo_file);
     bs_free(&buffer->search);
     fi_free(&buffer->file_info);
     cf_free_config(buffer->config);
     gb_free(buffer->data);
     bc_free(&buffer->changes);
-    free_hashmap_values(buffer->marks, (void (*)(void *))bp_free_mark);
-    free_hashmap(buffer->marks);
+    bp_free_col_cache(&buffer->col_cache);
+    list_free_all_custom(buffer->marks, (ListEntryFree)bp_free_mark);
     bv_free(buffer->bv);
 
     free(buffer);
@@ -167,16 +246,50 @@ Status bf_clear(Buffer *buffer)
     return bf_delete(buffer, bf_length(buffer));
 }
 
+/* Discard the text and its history. The text is cleared directly
+ * rather than deleted, as nothing needs a copy of it, so mapped
+ * text is released without first being read into memory */
 Status bf_reset(Buffer *buffer)
 {
-    bc_disable(&buffer->changes); 
-    Status status = bf_clear(buffer);
-    bc_enable(&buffer->changes);
-    RETURN_IF_FAIL(status);
+    bf_stop_line_count(buffer);
+    bf_select_reset(buffer);
+    bp_to_buffer_start(&buffer->pos);
+    gb_clear(buffer->data);
+
+    if (gb_length(buffer->data) != 0) {
+        return OUT_OF_MEMORY("Unable to clear buffer");
+    }
+
+    size_t mark_num = list_size(buffer->marks);
+    Mark *mark;
+
+    for (size_t k = 0; k < mark_num; k++) {
+        mark = list_get(buffer->marks, k);
+
+        if (mark->pos->line_no != 0) {
+            *mark->pos = buffer->pos;
+        }
+    }
 
+    buffer->is_draw_dirty = 1;
+    bp_invalidate_col_cache(&buffer->col_cache, 0);
+    bf_update_line_col_offset(buffer, &buffer->pos);
+
+    Status status = STATUS_SUCCESS;
     bc_free(&buffer->changes);
     bc_init(&buffer->changes);
 
+    gb_untrack_changes(buffer->data);
+    buffer->has_base_stat = 0;
+
+    if (buffer->journal != NULL) {
+        status = jn_rebase(buffer->journal, jn_position(buffer->journal));
+    }
+
+    if (buffer->undo_file != NULL) {
+        uf_reset(buffer->undo_file);
+    }
+
     return status;
 }
 
@@ -186,25 +299,15 @@ FileFormat bf_detect_fileformat(const Buffer *buffer)
 {
     FileFormat file_format = FF_UNIX;
 
-    if (gb_lines(buffer->data) > 0) {
-        size_t lines = MIN(gb_lines(buffer->data), DETECT_FF_LINE_NUM);
-        size_t unix_le = 0;
-        size_t dos_le = 0;
-        size_t point = 0;
-
-        do {
-            if (!gb_find_next(buffer->data, point, &point, '\n')) {
-                break;
-            }
-
-            if (point > 0 && gb_get_at(buffer->data, point - 1) == '\r') {
-                dos_le++; 
-            } else {
-                unix_le++;
-            }
+    /* Count the line endings in the first lines of the buffer. The
+     * total line count isn't needed, which avoids reading all the text
+     * of a mapped file (see gb_map_file) */
+    size_t end = gb_line_start(buffer->data, DETECT_FF_LINE_NUM);
 
-            point++;
-        } while (--lines != 0);
+    if (end > 0) {
+        size_t lines = gb_lines_before(buffer->data, end);
+        size_t dos_le = gb_count_crlf(buffer->data, 0, end);
+        size_t unix_le = lines - dos_le;
 
         if (dos_le > unix_le) {
             file_format = FF_WINDOWS;
@@ -217,7 +320,10 @@ FileFormat bf_detect_fileformat(const Buffer *buffer)
 /* Reset buffer and load configured file into buffer */
 Status bf_load_file(Buffer *buffer)
 {
+    RETURN_IF_FAIL(bf_cancel_load(buffer));
+    bf_stop_follow(buffer);
     RETURN_IF_FAIL(bf_reset(buffer));
+    buffer->load_incomplete = 0;
 
     if (!fi_file_exists(&buffer->file_info)) {
         /* If the file represented by this buffer doesn't exist
@@ -232,189 +338,1223 @@ Status bf_load_file(Buffer *buffer)
 
     bc_enable(&buffer->changes);
 
+    if (STATUS_IS_SUCCESS(status)) {
+        gb_track_changes(buffer->data);
+        bf_set_base_file(buffer, buffer->file_info.abs_path);
+    }
+
     return status;
 }
 
-/* Read file content info buffer at current position */
-Status bf_read_file(Buffer *buffer, const FileInfo *file_info)
+/* Reset buffer and load the start of the configured file, then read
+ * the rest of the file on a worker thread. The buffer can be used while
+ * loading continues. bf_continue_load adds text read by the worker to
+ * the buffer each time notify_fd is signalled. Files which can be
+ * memory mapped are mapped instead, as this is quicker still */
+Status bf_load_file_async(Buffer *buffer, int notify_fd)
 {
+    RETURN_IF_FAIL(bf_cancel_load(buffer));
+    bf_stop_follow(buffer);
+    RETURN_IF_FAIL(bf_reset(buffer));
+    buffer->load_incomplete = 0;
+
+    const FileInfo *file_info = &buffer->file_info;
+
     if (!fi_file_exists(file_info)) {
-        return st_get_error(ERR_FILE_DOESNT_EXIST, "File doesn't exist: %s",
-                            file_info->rel_path);
+        return STATUS_SUCCESS;
     }
 
-    FILE *input_file = fopen(file_info->abs_path, "rb");
+    int fd = open(file_info->abs_path, O_RDONLY);
 
-    if (input_file == NULL) {
+    if (fd == -1) {
         return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
                             "Unable to open file %s for reading - %s", 
                             file_info->file_name, strerror(errno));
-    } 
+    }
 
-    size_t old_size = bf_length(buffer);
-    size_t new_size = old_size + file_info->file_stat.st_size;
+    size_t size = file_info->file_stat.st_size;
 
-    /* Attempt to allocate necessary memory before loading into gap buffer */
-    if (!gb_preallocate(buffer->data, new_size)) {
+    /* Changes are tracked relative to this file once it's loaded */
+    if (fstat(fd, &buffer->base_stat) == -1) {
+        buffer->base_stat = file_info->file_stat;
+    }
+
+    if (bf_map_file(buffer, fd)) {
+        gb_track_changes(buffer->data);
+        buffer->has_base_stat = 1;
+        bf_set_is_draw_dirty(buffer, 1);
+
+        Status status = fl_start_counting(&buffer->line_counter, fd,
+                                          bf_length(buffer),
+                                          GB_LINE_BLOCK_SIZE, notify_fd);
+
+        /* The mapping is still indexed as it's read if the
+         * lines can't be counted in the background */
+        if (!STATUS_IS_SUCCESS(status)) {
+            st_free_status(status);
+            close(fd);
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    /* Allocate the memory required up front so that the
+     * text isn't repeatedly copied as the buffer grows */
+    if (!gb_preallocate(buffer->data, size)) {
+        close(fd);
         return OUT_OF_MEMORY("File is too large to load into memory");
     }
 
+    int eof;
+    Status status = bf_read_initial(buffer, fd, &eof);
+
+    if (!STATUS_IS_SUCCESS(status) || eof) {
+        close(fd);
+
+        if (STATUS_IS_SUCCESS(status)) {
+            gb_track_changes(buffer->data);
+            buffer->has_base_stat = 1;
+        }
+
+        bf_set_is_draw_dirty(buffer, 1);
+        return status;
+    }
+
+    status = fl_start(&buffer->loader, fd, bf_length(buffer), size,
+                      notify_fd);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        close(fd);
+        buffer->load_incomplete = 1;
+    }
+
+    bf_set_is_draw_dirty(buffer, 1);
+
+    return status;
+}
+
+/* Read enough of the file to fill the screen */
+static Status bf_read_initial(Buffer *buffer, int fd, int *eof)
+{
+    char *buf = malloc(FL_INITIAL_READ_SIZE);
+
+    if (buf == NULL) {
+        return OUT_OF_MEMORY("Unable to load file");
+    }
+
     Status status = STATUS_SUCCESS;
-    char buf[FILE_BUF_SIZE];
-    size_t read;
+    size_t length = 0;
+    ssize_t bytes = 0;
 
-    gb_set_point(buffer->data, buffer->pos.offset);
+    while (length < FL_INITIAL_READ_SIZE) {
+        bytes = read(fd, buf + length, FL_INITIAL_READ_SIZE - length);
 
-    do {
-        read = fread(buf, sizeof(char), FILE_BUF_SIZE, input_file);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        if (ferror(input_file)) {
             status = st_get_error(ERR_UNABLE_TO_READ_FILE,
                                   "Unable to read from file %s - %s", 
-                                  file_info->file_name, strerror(errno));
+                                  buffer->file_info.file_name,
+                                  strerror(errno));
             break;
-        } 
+        } else if (bytes == 0) {
+            break;
+        }
 
-        /* Add text to gap buffer and advance internal point */
-        if (!gb_add(buffer->data, buf, read)) {
-            status = OUT_OF_MEMORY("Unable to populate buffer");
+        length += bytes;
+    }
+
+    *eof = (bytes == 0);
+
+    if (STATUS_IS_SUCCESS(status)) {
+        status = bf_append_loaded_text(buffer, buf, length);
+    }
+
+    free(buf);
+
+    return status;
+}
+
+int bf_load_in_progress(const Buffer *buffer)
+{
+    return buffer->loader != NULL;
+}
+
+/* Percentage of file loaded */
+int bf_load_progress(const Buffer *buffer)
+{
+    if (buffer->loader == NULL) {
+        return 100;
+    }
+
+    return fl_progress(buffer->loader);
+}
+
+int bf_load_incomplete(const Buffer *buffer)
+{
+    return buffer->load_incomplete;
+}
+
+/* Add text read by the worker to the end of the buffer and
+ * complete the load once the whole file has been read */
+Status bf_continue_load(Buffer *buffer)
+{
+    if (buffer->loader == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    FLChunk *chunks = fl_take_chunks(buffer->loader);
+    Status status = STATUS_SUCCESS;
+
+    for (FLChunk *chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        status = bf_append_loaded_text(buffer, chunk->text, chunk->length);
+
+        if (!STATUS_IS_SUCCESS(status)) {
             break;
         }
-    } while (read == FILE_BUF_SIZE);
+    }
 
-    fclose(input_file);
+    fl_free_chunks(chunks);
 
-    size_t bytes_inserted = bf_length(buffer) - old_size;
+    if (!STATUS_IS_SUCCESS(status)) {
+        st_free_status(bf_cancel_load(buffer));
+        return status;
+    }
 
-    if (bytes_inserted > 0) {
-        ONLY_OVERWRITE_SUCCESS(
-            status,
-            bc_add_text_insert(&buffer->changes, bytes_inserted, &buffer->pos)
-        );
+    if (fl_finished(buffer->loader)) {
+        status = fl_finish(buffer->loader);
+        buffer->loader = NULL;
+        buffer->load_incomplete = !STATUS_IS_SUCCESS(status);
+
+        /* Loaded text isn't recorded as a change, so if the buffer
+         * hasn't been edited while loading it matches the file */
+        if (STATUS_IS_SUCCESS(status) && !bf_is_dirty(buffer)) {
+            gb_track_changes(buffer->data);
+            buffer->has_base_stat = 1;
+        }
     }
 
-    bf_set_is_draw_dirty(buffer, 1);
+    return status;
+}
+
+/* Stop loading the file. The buffer retains the text loaded so far */
+Status bf_cancel_load(Buffer *buffer)
+{
+    if (buffer->loader == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    Status status = fl_finish(buffer->loader);
+    buffer->loader = NULL;
+    buffer->load_incomplete = 1;
 
     return status;
 }
 
-/* Add new line to buffer end if one doesn't exist */
-static Status bf_add_new_line_at_buffer_end(Buffer *buffer)
+int bf_counting_lines(const Buffer *buffer)
 {
-    size_t buffer_len = gb_length(buffer->data);
+    return buffer->line_counter != NULL;
+}
 
-    if (buffer_len == 0 ||
-        gb_get_at(buffer->data, buffer_len - 1) == '\n') {
+/* Index the lines of a mapped file counted by the worker. Counting
+ * stops once all lines are indexed, including when the text is
+ * indexed or copied into memory on the main thread first */
+Status bf_continue_line_count(Buffer *buffer)
+{
+    if (buffer->line_counter == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    FLChunk *chunks = fl_take_chunks(buffer->line_counter);
+
+    for (FLChunk *chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        gb_add_block_lines(buffer->data, chunk->first_block,
+                           chunk->block_lines, chunk->block_num);
+    }
+
+    fl_free_chunks(chunks);
+
+    int complete;
+    gb_lines_indexed(buffer->data, &complete);
+
+    if (!complete && !fl_finished(buffer->line_counter)) {
+        return STATUS_SUCCESS;
+    }
+
+    Status status = fl_finish(buffer->line_counter);
+    buffer->line_counter = NULL;
+
+    return status;
+}
+
+static void bf_stop_line_count(Buffer *buffer)
+{
+    if (buffer->line_counter != NULL) {
+        st_free_status(fl_finish(buffer->line_counter));
+        buffer->line_counter = NULL;
+    }
+}
+
+/* Append text added to the file to the buffer as it is written,
+ * for example when viewing a log file. bf_continue_follow adds the
+ * new text each time notify_fd is signalled */
+Status bf_follow_file(Buffer *buffer, int notify_fd)
+{
+    if (buffer->follower != NULL) {
+        return STATUS_SUCCESS;
+    } else if (bf_load_in_progress(buffer)) {
+        return st_get_error(ERR_FILE_LOAD_IN_PROGRESS,
+                            "Unable to follow %s while it is loading",
+                            buffer->file_info.file_name);
+    } else if (!fi_file_exists(&buffer->file_info)) {
+        return st_get_error(ERR_FILE_DOESNT_EXIST, "File doesn't exist: %s",
+                            buffer->file_info.rel_path);
+    }
+
+    size_t offset;
+
+    /* An unmodified buffer contains the file as far as it was read,
+     * otherwise follow on from the file as it was last loaded or saved */
+    if (!bf_is_dirty(buffer) && !bf_load_incomplete(buffer)) {
+        offset = bf_length(buffer);
+    } else if (buffer->has_base_stat) {
+        offset = buffer->base_stat.st_size;
+    } else {
+        offset = buffer->file_info.file_stat.st_size;
+    }
+
+    /* Followed files such as logs are often truncated or rotated and
+     * reading a mapping of a truncated file raises SIGBUS, so the text
+     * is copied into memory instead */
+    if (gb_is_mapped(buffer->data) && !gb_preallocate(buffer->data, 0)) {
+        return OUT_OF_MEMORY("Unable to load file into memory");
+    }
+
+    return ff_start(&buffer->follower, buffer->file_info.abs_path, offset,
+                    notify_fd);
+}
+
+int bf_following(const Buffer *buffer)
+{
+    return buffer->follower != NULL;
+}
+
+/* Add text appended to the file to the end of the buffer. If the file
+ * has been truncated or replaced the buffer is reset to its new
+ * content, unless the buffer has unsaved changes in which case
+ * following stops so they aren't lost. When the cursor is at the end
+ * of the buffer it remains there so the latest text stays in view */
+Status bf_continue_follow(Buffer *buffer)
+{
+    if (buffer->follower == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    int restarted;
+    FLChunk *chunks = ff_take_chunks(buffer->follower, &restarted);
+
+    if (chunks == NULL && !restarted) {
+        return STATUS_SUCCESS;
+    }
+
+    if (restarted && bf_is_dirty(buffer)) {
+        fl_free_chunks(chunks);
+        bf_stop_follow(buffer);
+        return st_get_error(ERR_FOLLOWED_FILE_REPLACED,
+                            "Stopped following %s as it was truncated or "
+                            "replaced and the buffer has unsaved changes",
+                            buffer->file_info.file_name);
+    }
+
+    int at_end = bp_at_buffer_end(&buffer->pos);
+    Status status = STATUS_SUCCESS;
+
+    if (restarted) {
+        status = bf_reset(buffer);
+        buffer->change_state = bc_get_current_state(&buffer->changes);
+        buffer->load_incomplete = 0;
+        at_end = 0;
+    }
+
+    for (FLChunk *chunk = chunks;
+         chunk != NULL && STATUS_IS_SUCCESS(status); chunk = chunk->next) {
+        status = bf_append_loaded_text(buffer, chunk->text, chunk->length);
+    }
+
+    fl_free_chunks(chunks);
+    RETURN_IF_FAIL(status);
+
+    /* The buffer matches the file again so the next save
+     * only needs to write the changed text */
+    if (!bf_is_dirty(buffer) && !bf_load_incomplete(buffer)) {
+        gb_track_changes(buffer->data);
+        bf_set_base_file(buffer, buffer->file_info.abs_path);
+
+        if (buffer->journal != NULL) {
+            st_free_status(jn_rebase(buffer->journal,
+                                     jn_position(buffer->journal)));
+        }
+    }
+
+    if (at_end) {
+        status = bf_to_buffer_end(buffer, 0);
+    }
+
+    return status;
+}
+
+void bf_stop_follow(Buffer *buffer)
+{
+    ff_stop(buffer->follower);
+    buffer->follower = NULL;
+}
+
+/* Read fd into the end of the buffer as input becomes available,
+ * for example when output is piped into wed. The buffer takes
+ * ownership of fd. bf_continue_stream is called whenever fd is
+ * readable */
+Status bf_stream_file(Buffer *buffer, int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(fd);
+        return st_get_error(ERR_UNABLE_TO_READ_FILE,
+                            "Unable to read from %s - %s",
+                            buffer->file_info.file_name, strerror(errno));
+    }
+
+    bf_stop_stream(buffer);
+    buffer->stream_fd = fd;
+
+    return STATUS_SUCCESS;
+}
+
+/* Returns the fd being streamed into the buffer or -1 */
+int bf_stream_fd(const Buffer *buffer)
+{
+    return buffer->stream_fd;
+}
+
+/* Append at most max_bytes of the input currently available so that
+ * a fast producer can't stop the display being updated. The stream is
+ * closed once the end of the input is reached */
+Status bf_continue_stream(Buffer *buffer, size_t max_bytes)
+{
+    if (buffer->stream_fd == -1) {
         return STATUS_SUCCESS;
     }
 
-    const char *new_line = bf_new_line_str(buffer->file_format);
+    size_t buf_size = MIN(max_bytes, FL_READ_CHUNK_SIZE);
+    char *buf = malloc(buf_size);
+
+    if (buf == NULL) {
+        return OUT_OF_MEMORY("Unable to read input");
+    }
+
+    /* Keep the cursor at the end so the latest input stays in view */
+    int at_end = bf_length(buffer) > 0 && bp_at_buffer_end(&buffer->pos);
+    Status status = STATUS_SUCCESS;
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < max_bytes) {
+        bytes = read(buffer->stream_fd, buf, MIN(buf_size, max_bytes - total));
+
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                                      "Unable to read from %s - %s",
+                                      buffer->file_info.file_name,
+                                      strerror(errno));
+                bf_stop_stream(buffer);
+            }
+
+            break;
+        } else if (bytes == 0) {
+            bf_stop_stream(buffer);
+            break;
+        }
+
+        status = bf_append_loaded_text(buffer, buf, bytes);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            bf_stop_stream(buffer);
+            break;
+        }
+
+        total += bytes;
+    }
+
+    free(buf);
+
+    if (at_end && total > 0) {
+        ONLY_OVERWRITE_SUCCESS(status, bf_to_buffer_end(buffer, 0));
+    }
+
+    return status;
+}
+
+void bf_stop_stream(Buffer *buffer)
+{
+    if (buffer->stream_fd != -1) {
+        close(buffer->stream_fd);
+        buffer->stream_fd = -1;
+    }
+}
+
+/* Loaded text is always added at the buffer end. Any edits made while
+ * loading is in progress are before this point so only marks need to
+ * be updated. The text is part of the file so isn't recorded as a
+ * change that can be undone */
+static Status bf_append_loaded_text(Buffer *buffer, const char *text,
+                                    size_t length)
+{
+    /* Marks are updated using only the offset and line number of an
+     * insert, so avoid calculating the column of the last line which
+     * can be very long */
+    BufferPos end_pos = buffer->pos;
+    end_pos.offset = gb_length(buffer->data);
+    end_pos.line_no = gb_lines(buffer->data) + 1;
+
+    size_t lines_before = gb_lines(buffer->data);
+    gb_set_point(buffer->data, end_pos.offset);
+
+    if (!gb_insert(buffer->data, text, length)) {
+        return OUT_OF_MEMORY("Unable to load file");
+    }
+
+    size_t lines_after = gb_lines(buffer->data);
+    buffer->is_draw_dirty = 1;
+
+    return bf_update_marks(buffer, &end_pos, TCT_INSERT, length,
+                           lines_after - lines_before);
+}
+
+/* Read file content info buffer at current position */
+Status bf_read_file(Buffer *buffer, const FileInfo *file_info)
+{
+    if (!fi_file_exists(file_info)) {
+        return st_get_error(ERR_FILE_DOESNT_EXIST, "File doesn't exist: %s",
+                            file_info->rel_path);
+    }
+
+    FILE *input_file = fopen(file_info->abs_path, "rb");
+
+    if (input_file == NULL) {
+        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                            "Unable to open file %s for reading - %s", 
+                            file_info->file_name, strerror(errno));
+    } 
+
+    size_t old_size = bf_length(buffer);
+    Status status = STATUS_SUCCESS;
+
+    bp_invalidate_col_cache(&buffer->col_cache, buffer->pos.offset);
+
+    if (!bf_map_file(buffer, fileno(input_file))) {
+        status = bf_read_file_stream(buffer, file_info, input_file);
+    }
+
+    fclose(input_file);
+
+    size_t bytes_inserted = bf_length(buffer) - old_size;
+
+    if (bytes_inserted > 0) {
+        ONLY_OVERWRITE_SUCCESS(
+            status,
+            bc_add_text_insert(&buffer->changes, bytes_inserted, &buffer->pos)
+        );
+
+        /* Loading a buffer's own file isn't undoable and isn't an edit */
+        if (bc_enabled(&buffer->changes)) {
+            bf_journal_inserted_text(buffer, buffer->pos.offset,
+                                     bytes_inserted);
+        }
+    }
+
+    bf_set_is_draw_dirty(buffer, 1);
+
+    return status;
+}
+
+/* Copy file content into buffer at current position */
+static Status bf_read_file_stream(Buffer *buffer, const FileInfo *file_info,
+                                  FILE *input_file)
+{
+    size_t new_size = bf_length(buffer) + file_info->file_stat.st_size;
+
+    /* Attempt to allocate necessary memory before loading into gap buffer */
+    if (!gb_preallocate(buffer->data, new_size)) {
+        return OUT_OF_MEMORY("File is too large to load into memory");
+    }
+
+    Status status = STATUS_SUCCESS;
+    char buf[FILE_BUF_SIZE];
+    size_t read;
+
+    gb_set_point(buffer->data, buffer->pos.offset);
+
+    do {
+        read = fread(buf, sizeof(char), FILE_BUF_SIZE, input_file);
+
+        if (ferror(input_file)) {
+            status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                                  "Unable to read from file %s - %s", 
+                                  file_info->file_name, strerror(errno));
+            break;
+        } 
+
+        /* Add text to gap buffer and advance internal point */
+        if (!gb_add(buffer->data, buf, read)) {
+            status = OUT_OF_MEMORY("Unable to populate buffer");
+            break;
+        }
+    } while (read == FILE_BUF_SIZE);
+
+    return status;
+}
+
+/* Large files loaded into an empty buffer are memory mapped.
+ * The text is only copied into memory if the buffer is modified */
+static int bf_map_file(Buffer *buffer, int fd)
+{
+    struct stat file_stat;
+
+    /* Use the current file size in case the file has changed
+     * since it was last checked */
+    if (fd == -1 || fstat(fd, &file_stat) == -1 ||
+        fl_load_method(&file_stat, bf_can_map_file(buffer), 0) != FLM_MAP) {
+        return 0;
+    }
+
+    return gb_map_file(buffer->data, fd, file_stat.st_size);
+}
+
+/* Files can only be mapped into an empty gap buffer */
+int bf_can_map_file(const Buffer *buffer)
+{
+    return bf_length(buffer) == 0 &&
+           gb_get_storage(buffer->data) == GBS_GAP;
+}
+
+/* Add new line to buffer end if one doesn't exist */
+static Status bf_add_new_line_at_buffer_end(Buffer *buffer)
+{
+    size_t buffer_len = gb_length(buffer->data);
+
+    if (buffer_len == 0 ||
+        gb_get_at(buffer->data, buffer_len - 1) == '\n') {
+        return STATUS_SUCCESS;
+    }
+
+    const char *new_line = bf_new_line_str(buffer->file_format);
+
+    BufferPos tmp = buffer->pos;
+    bp_to_buffer_end(&buffer->pos);
+
+    Status status = bf_insert_string(buffer, new_line, strlen(new_line), 0);
+
+    buffer->pos = tmp;
+
+    return status;
+}
+
+/* Write buffer to file_path, waiting for the write to complete */
+Status bf_write_file(Buffer *buffer, const char *file_path)
+{
+    assert(!is_null_or_empty(file_path));
+
+    RETURN_IF_FAIL(bf_check_can_write(buffer, file_path));
+    RETURN_IF_FAIL(bf_finish_write_file(buffer, NULL));
+    RETURN_IF_FAIL(bf_add_new_line_at_buffer_end(buffer));
+
+    size_t journal_mark = buffer->journal != NULL ?
+                          jn_position(buffer->journal) : 0;
+    uint64_t hash = 0;
+    Status status = fw_write_file(buffer->data, file_path,
+                                  bf_get_write_durability(buffer),
+                                  bf_get_base_stat(buffer),
+                                  bf_undo_file_saving(buffer) ? &hash
+                                                              : NULL);
+
+    if (STATUS_IS_SUCCESS(status)) {
+        buffer->change_state = bc_get_current_state(&buffer->changes);
+        gb_track_changes(buffer->data);
+        bf_set_base_file(buffer, file_path);
+        bf_journal_saved(buffer, file_path, journal_mark);
+        bf_undo_file_saved(buffer, file_path, buffer->change_state, hash);
+    }
+
+    return status;
+}
+
+/* Write a snapshot of the buffer to file_path on a worker thread.
+ * The buffer can continue to be modified while the write is in
+ * progress. bf_finish_write_file must be called to collect the
+ * result once notify_fd has been signalled with completion */
+Status bf_write_file_async(Buffer *buffer, const char *file_path,
+                           int notify_fd)
+{
+    assert(!is_null_or_empty(file_path));
+
+    RETURN_IF_FAIL(bf_check_can_write(buffer, file_path));
+    RETURN_IF_FAIL(bf_finish_write_file(buffer, NULL));
+    RETURN_IF_FAIL(bf_add_new_line_at_buffer_end(buffer));
+
+    int hash_content = bf_undo_file_saving(buffer);
+    GapBuffer *snapshot = gb_snapshot(buffer->data);
+
+    if (snapshot == NULL) {
+        return OUT_OF_MEMORY("Unable to create buffer snapshot");
+    }
+
+    Status status = fw_start(&buffer->writer, snapshot, file_path,
+                             bf_get_write_durability(buffer),
+                             bf_get_base_stat(buffer), hash_content,
+                             notify_fd);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        gb_free(snapshot);
+        return status;
+    }
+
+    buffer->write_state = bc_get_current_state(&buffer->changes);
+
+    if (buffer->journal != NULL) {
+        buffer->journal_mark = jn_position(buffer->journal);
+    }
+
+    /* Further changes are relative to the snapshot, which becomes
+     * the file's content if the write succeeds */
+    gb_track_changes(buffer->data);
+    buffer->has_base_stat = 0;
+
+    return STATUS_SUCCESS;
+}
+
+/* A buffer which doesn't contain the whole of its file
+ * can't be written back to that file */
+static Status bf_check_can_write(const Buffer *buffer, const char *file_path)
+{
+    if (bf_load_in_progress(buffer)) {
+        return st_get_error(ERR_FILE_LOAD_IN_PROGRESS,
+                            "Unable to write %s while it is loading",
+                            buffer->file_info.file_name);
+    } else if (!bf_load_incomplete(buffer)) {
+        return STATUS_SUCCESS;
+    }
+
+    FileInfo file_info;
+    RETURN_IF_FAIL(fi_init(&file_info, file_path));
+
+    int same_file = fi_equal(&file_info, &buffer->file_info);
+    fi_free(&file_info);
+
+    if (same_file) {
+        return st_get_error(ERR_FILE_LOAD_INCOMPLETE,
+                            "Only part of %s was loaded so it can't be "
+                            "overwritten", buffer->file_info.file_name);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+int bf_write_in_progress(const Buffer *buffer)
+{
+    return buffer->writer != NULL;
+}
+
+int bf_write_finished(const Buffer *buffer)
+{
+    return buffer->writer != NULL && fw_finished(buffer->writer);
+}
+
+/* Percentage of buffer snapshot written */
+int bf_write_progress(const Buffer *buffer)
+{
+    if (buffer->writer == NULL) {
+        return 100;
+    }
+
+    return fw_progress(buffer->writer);
+}
+
+/* Wait for any write in progress to complete. The buffer is only
+ * considered unmodified if it hasn't changed since the snapshot
+ * that was written was taken */
+Status bf_finish_write_file(Buffer *buffer, char **file_path_ptr)
+{
+    if (file_path_ptr != NULL) {
+        *file_path_ptr = NULL;
+    }
+
+    if (buffer->writer == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    char *file_path;
+    uint64_t hash;
+    Status status = fw_finish(buffer->writer, &file_path, &hash);
+    buffer->writer = NULL;
+
+    if (STATUS_IS_SUCCESS(status)) {
+        buffer->change_state = buffer->write_state;
+        bf_set_base_file(buffer, file_path);
+        bf_journal_saved(buffer, file_path, buffer->journal_mark);
+        bf_undo_file_saved(buffer, file_path, buffer->write_state, hash);
+    } else {
+        gb_untrack_changes(buffer->data);
+    }
+
+    if (file_path_ptr != NULL) {
+        *file_path_ptr = file_path;
+    } else {
+        free(file_path);
+    }
+
+    return status;
+}
+
+static WriteDurability bf_get_write_durability(const Buffer *buffer)
+{
+    WriteDurability durability = WD_FILE;
+    fw_determine_durability(cf_string(buffer->config, CV_SAVEDURABILITY),
+                            &durability);
+
+    return durability;
+}
+
+/* Returns the attributes of the file that the buffer's tracked changes
+ * are relative to, or NULL if the whole buffer should be written */
+static const struct stat *bf_get_base_stat(const Buffer *buffer)
+{
+    if (!buffer->has_base_stat || !cf_bool(buffer->config,
+                                           CV_INCREMENTALSAVE)) {
+        return NULL;
+    }
+
+    return &buffer->base_stat;
+}
+
+/* The buffer text as it was when changes started being tracked is
+ * the content of file_path */
+static void bf_set_base_file(Buffer *buffer, const char *file_path)
+{
+    buffer->has_base_stat = file_path != NULL &&
+                            stat(file_path, &buffer->base_stat) == 0;
+
+    if (!buffer->has_base_stat) {
+        gb_untrack_changes(buffer->data);
+    }
+}
+
+/* Costly features in large files are limited by their budgets */
+void bf_set_large_file(Buffer *buffer, int large_file)
+{
+    buffer->large_file = large_file;
+
+    if (!large_file) {
+        buffer->degraded_features = 0;
+    }
+}
+
+int bf_is_large_file(const Buffer *buffer)
+{
+    return buffer->large_file;
+}
+
+/* The budget for a feature in milliseconds or bytes,
+ * or 0 if the feature isn't limited */
+long bf_feature_budget(const Buffer *buffer, LargeFileFeature feature)
+{
+    if (!buffer->large_file) {
+        return 0;
+    }
+
+    switch (feature) {
+        case LFF_SYNTAX:
+            return buffer->config_snapshot.syntaxbudget;
+        case LFF_SEARCH_HIGHLIGHT:
+            return buffer->config_snapshot.searchbudget;
+        case LFF_BRACKET_MATCH:
+            return buffer->config_snapshot.bracketbudget * 1024;
+        case LFF_UNDO:
+            return buffer->config_snapshot.undobudget * 1024;
+        default:
+            break;
+    }
+
+    assert(!"Invalid LargeFileFeature value");
+
+    return 0;
+}
+
+/* Syntax and search highlighting are disabled once they
+ * exceed their budget */
+int bf_feature_enabled(const Buffer *buffer, LargeFileFeature feature)
+{
+    return !(buffer->degraded_features & feature);
+}
+
+/* Returns true if cost is below the feature's budget,
+ * otherwise the feature is marked as degraded */
+int bf_within_budget(Buffer *buffer, LargeFileFeature feature, long cost)
+{
+    long budget = bf_feature_budget(buffer, feature);
+
+    if (budget == 0 || cost < budget) {
+        return 1;
+    }
+
+    buffer->degraded_features |= feature;
+
+    return 0;
+}
+
+/* Called when a budget is changed so the feature
+ * is tried again under the new budget */
+void bf_restore_feature(Buffer *buffer, LargeFileFeature feature)
+{
+    buffer->degraded_features &= ~feature;
+    buffer->is_draw_dirty = 1;
+}
+
+/* Bytes of memory used by the buffer's undo history */
+size_t bf_undo_memory(const Buffer *buffer)
+{
+    return buffer->changes.memory;
+}
+
+/* Compress and spill older undo history so it uses no more than
+ * memory_budget bytes of memory, or the buffer's own undomemory budget
+ * if lower. History beyond undolimit is dropped, after which the saved
+ * state may no longer be reachable by undo */
+Status bf_limit_undo_memory(Buffer *buffer, size_t memory_budget)
+{
+    size_t buffer_budget = buffer->config_snapshot.undomemory * 1024 * 1024;
+    size_t history_limit = buffer->config_snapshot.undolimit * 1024 * 1024;
+
+    if (buffer_budget > 0 && buffer_budget < memory_budget) {
+        memory_budget = buffer_budget;
+    }
+
+    if (history_limit == 0) {
+        history_limit = SIZE_MAX;
+    }
+
+    int history_dropped;
+    RETURN_IF_FAIL(bc_limit_memory(&buffer->changes, memory_budget,
+                                   history_limit, &history_dropped));
+
+    if (!history_dropped) {
+        return STATUS_SUCCESS;
+    }
+
+    bf_undo_history_dropped(buffer);
+    BufferChangeState modified = { .change = NULL, .version = 1 };
+
+    if (!bc_has_state(&buffer->changes, buffer->change_state)) {
+        buffer->change_state = modified;
+    }
+
+    if (bf_write_in_progress(buffer) &&
+        !bc_has_state(&buffer->changes, buffer->write_state)) {
+        buffer->write_state = modified;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+const char *bf_feature_name(LargeFileFeature feature)
+{
+    switch (feature) {
+        case LFF_SYNTAX:
+            return "syntax";
+        case LFF_SEARCH_HIGHLIGHT:
+            return "search";
+        case LFF_BRACKET_MATCH:
+            return "bracket";
+        case LFF_UNDO:
+            return "undo";
+        default:
+            break;
+    }
+
+    assert(!"Invalid LargeFileFeature value");
+
+    return "";
+}
+
+/* Start journaling edits to the buffer's file. resume_length is the
+ * valid length of a journal that has just been replayed, or 0 */
+Status bf_enable_journal(Buffer *buffer, size_t resume_length)
+{
+    if (buffer->journal != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    const FileInfo *file_info = &buffer->file_info;
+    const char *file_path = fi_file_exists(file_info) ?
+                            file_info->abs_path : file_info->rel_path;
+
+    return jn_new(&buffer->journal, file_path, resume_length);
+}
+
+/* Apply the edits recorded in the journal for the buffer's file as a
+ * single change that can be undone */
+Status bf_replay_journal(Buffer *buffer, size_t *records,
+                         size_t *valid_length)
+{
+    const FileInfo *file_info = &buffer->file_info;
+    const char *file_path = fi_file_exists(file_info) ?
+                            file_info->abs_path : file_info->rel_path;
+
+    RETURN_IF_FAIL(bc_start_grouped_changes(&buffer->changes));
+
+    Status status = jn_replay(file_path, bf_replay_journal_record, buffer,
+                              records, valid_length);
+
+    bc_end_grouped_changes(&buffer->changes);
+
+    if (!STATUS_IS_SUCCESS(status) && *records > 0) {
+        st_free_status(bc_undo(&buffer->changes, buffer));
+    }
+
+    ONLY_OVERWRITE_SUCCESS(status, bf_to_buffer_start(buffer, 0));
+
+    return status;
+}
+
+static Status bf_replay_journal_record(void *context, JournalRecordType type,
+                                       size_t offset, const char *text,
+                                       size_t length)
+{
+    Buffer *buffer = context;
+    size_t buffer_len = bf_length(buffer);
+
+    if (offset > buffer_len ||
+        (type == JRT_DELETE && length > buffer_len - offset)) {
+        return st_get_error(ERR_INVALID_JOURNAL,
+                            "Journal for %s contains an invalid edit",
+                            buffer->file_info.file_name);
+    }
+
+    BufferPos pos = bp_init_from_offset(offset, &buffer->pos);
+    RETURN_IF_FAIL(bf_set_bp(buffer, &pos));
+
+    if (type == JRT_INSERT) {
+        return bf_insert_string(buffer, text, length, 0);
+    }
+
+    return bf_delete(buffer, length);
+}
+
+/* Record text added directly to the gap buffer */
+static void bf_journal_inserted_text(Buffer *buffer, size_t offset,
+                                     size_t length)
+{
+    if (buffer->journal == NULL) {
+        return;
+    }
+
+    GBSegmentIter iter;
+    const char *text;
+    size_t segment_length;
+
+    gb_segment_iter_init(&iter, buffer->data, offset, length);
+
+    while (gb_segment_iter_next(&iter, &text, &segment_length)) {
+        st_free_status(jn_add_insert(buffer->journal, offset, text,
+                                     segment_length));
+        offset += segment_length;
+    }
+}
+
+/* file_path now contains the buffer text as it was when the journal
+ * was at journal_mark, so only later edits need to be kept. Saving to
+ * a different file leaves the journal unchanged */
+static void bf_journal_saved(Buffer *buffer, const char *file_path,
+                             size_t journal_mark)
+{
+    if (buffer->journal == NULL) {
+        return;
+    }
+
+    struct stat saved_stat, journal_stat;
+
+    if (stat(file_path, &saved_stat) == 0 &&
+        stat(buffer->journal->file_path, &journal_stat) == 0 &&
+        saved_stat.st_dev == journal_stat.st_dev &&
+        saved_stat.st_ino == journal_stat.st_ino) {
+        st_free_status(jn_rebase(buffer->journal, journal_mark));
+    }
+}
+
+/* Keep the buffer's undo history in an undo file between sessions */
+Status bf_enable_undo_file(Buffer *buffer)
+{
+    if (buffer->undo_file != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    const FileInfo *file_info = &buffer->file_info;
+    const char *file_path = fi_file_exists(file_info) ?
+                            file_info->abs_path : file_info->rel_path;
+
+    return uf_new(&buffer->undo_file, file_path);
+}
+
+/* Undo the latest change. Once every change made since the file was
+ * opened has been undone, history saved by earlier sessions is loaded
+ * from the undo file so it can be undone as well */
+Status bf_undo(Buffer *buffer)
+{
+    if (!bc_can_undo(&buffer->changes)) {
+        RETURN_IF_FAIL(bf_load_undo_file(buffer));
+    }
 
-    BufferPos tmp = buffer->pos;
-    bp_to_buffer_end(&buffer->pos);
+    return bc_undo(&buffer->changes, buffer);
+}
 
-    Status status = bf_insert_string(buffer, new_line, strlen(new_line), 0);
+/* Called before the buffer is saved. Returns true if the text written
+ * should be hashed, which identifies the saved file in the undo file.
+ * The file writer hashes the text so that for an asynchronous save
+ * it's done on the worker thread */
+static int bf_undo_file_saving(Buffer *buffer)
+{
+    if (buffer->undo_file == NULL) {
+        return 0;
+    }
 
-    buffer->pos = tmp;
+    /* The undo file is checked against the file as it was
+     * opened before the file is overwritten */
+    st_free_status(uf_attach(buffer->undo_file, buffer->has_base_stat ?
+                                                &buffer->base_stat : NULL));
+    bc_seal(&buffer->changes);
 
-    return status;
+    return 1;
 }
 
-/* Write buffer to temporary file in same directory as file_path
- * then rename temporary file to file_path */
-Status bf_write_file(Buffer *buffer, const char *file_path)
+/* Append the changes made up to saved_state to the undo file. Saving
+ * to a different file leaves the undo file unchanged */
+static void bf_undo_file_saved(Buffer *buffer, const char *file_path,
+                               BufferChangeState saved_state, uint64_t hash)
 {
-    assert(!is_null_or_empty(file_path));
+    UndoFile *undo_file = buffer->undo_file;
 
-    RETURN_IF_FAIL(bf_add_new_line_at_buffer_end(buffer));
-
-    const FileInfo *file_info = &buffer->file_info;
+    if (undo_file == NULL) {
+        return;
+    }
 
-    size_t tmp_file_path_len = strlen(file_path) + 6 + 1;
-    char *tmp_file_path = malloc(tmp_file_path_len);
+    struct stat saved_stat, undo_stat;
 
-    if (tmp_file_path == NULL) {
-        return OUT_OF_MEMORY("Unable to create temporary file path");
+    if (stat(file_path, &saved_stat) != 0 ||
+        stat(undo_file->file_path, &undo_stat) != 0 ||
+        saved_stat.st_dev != undo_stat.st_dev ||
+        saved_stat.st_ino != undo_stat.st_ino) {
+        return;
     }
 
-    snprintf(tmp_file_path, tmp_file_path_len, "%sXXXXXX", file_path);
+    char *changes;
+    size_t length;
+    int found, rewrite;
+    Status status = bc_save_changes(&buffer->changes, undo_file->persisted,
+                                    saved_state, &changes, &length, &found,
+                                    &rewrite);
 
-    int output_file = mkstemp(tmp_file_path);
+    if (STATUS_IS_SUCCESS(status)) {
+        if (found) {
+            status = uf_append(undo_file, &saved_stat, hash, changes,
+                               length, rewrite);
+        } else {
+            /* The saved state was undone while being written so the
+             * undo file no longer describes the file */
+            uf_history_dropped(undo_file);
+        }
+    }
 
-    if (output_file == -1) {
-        free(tmp_file_path);
-        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
-                            "Unable to open temporary file for writing - %s",
-                            strerror(errno));
+    if (STATUS_IS_SUCCESS(status) && found) {
+        undo_file->persisted = saved_state;
     }
 
-    Status status = STATUS_SUCCESS;
-    size_t buffer_len = gb_length(buffer->data);
-    size_t bytes_remaining = buffer_len;
-    size_t bytes_retrieved;
-    char buf[FILE_BUF_SIZE];
+    free(changes);
+    st_free_status(status);
+}
 
-    /* Read text from gap buffer and write to temporary file */
+/* History saved by earlier sessions ends with the buffer content as
+ * the file was opened, which is the content once every change made
+ * since has been undone. The hash of the content is checked against
+ * the undo file before the history is placed on the undo stack */
+static Status bf_load_undo_file(Buffer *buffer)
+{
+    UndoFile *undo_file = buffer->undo_file;
 
-    while (bytes_remaining > 0) {
-        bytes_retrieved = gb_get_range(buffer->data,
-                                       buffer_len - bytes_remaining,
-                                       buf, FILE_BUF_SIZE);
+    if (undo_file == NULL || !uf_can_load(undo_file) ||
+        bf_load_in_progress(buffer) || bf_load_incomplete(buffer)) {
+        return STATUS_SUCCESS;
+    }
 
-        if (write(output_file, buf, bytes_retrieved) <= 0) {
-            status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
-                                  "Unable to write to temporary file - %s",
-                                  strerror(errno));
-            break;
-        }
+    RETURN_IF_FAIL(uf_attach(undo_file, buffer->has_base_stat ?
+                                        &buffer->base_stat : NULL));
 
-        bytes_remaining -= bytes_retrieved;
-    }
+    BufferChanges *changes = &buffer->changes;
+    int unmodified = !bc_has_state_changed(changes, buffer->change_state);
+    int write_unmodified = bf_write_in_progress(buffer) &&
+                           !bc_has_state_changed(changes,
+                                                 buffer->write_state);
+    UndoFileHistory loaded = { changes, NULL };
 
-    close(output_file);
+    Status status = uf_load(undo_file, uf_hash_text(buffer->data),
+                            bf_load_undo_segment, &loaded);
 
     if (!STATUS_IS_SUCCESS(status)) {
-        goto cleanup;
+        bc_free_history(changes, loaded.history);
+        return status;
     }
 
-    struct stat file_stat;
+    if (loaded.history == NULL) {
+        return STATUS_SUCCESS;
+    }
 
-    if (stat(file_path, &file_stat) == 0) {
-        /* Set permissions and ownership of temporary file
-         * to match existing file */
+    bc_add_history(changes, loaded.history);
+    bc_seal(changes);
 
-        if (chmod(tmp_file_path, file_stat.st_mode) == -1) {
-            status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
-                                  "Unable to set file permissions - %s", 
-                                  strerror(errno));
-            goto cleanup;
-        }
+    BufferChangeState current = bc_get_current_state(changes);
 
-        if (chown(tmp_file_path, file_stat.st_uid, file_stat.st_gid) == -1) {
-            status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
-                                  "Unable to set owner - %s",
-                                  strerror(errno));
-            goto cleanup;
-        }
+    if (unmodified) {
+        buffer->change_state = current;
     }
 
-    /* Overwrite existing file atomically */
-    if (rename(tmp_file_path, file_path) == -1) {
-        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
-                              "Unable to overwrite file %s - %s",
-                              file_info->rel_path, strerror(errno)); 
+    if (write_unmodified) {
+        buffer->write_state = current;
     }
 
-cleanup:
-    if (STATUS_IS_SUCCESS(status)) {
-        buffer->change_state = bc_get_current_state(&buffer->changes);
-    } else {
-        remove(tmp_file_path);
+    /* Until now the undo file ended with the empty undo stack */
+    if (undo_file->persisted.change == NULL) {
+        undo_file->persisted = current;
     }
 
-    free(tmp_file_path);
+    return STATUS_SUCCESS;
+}
 
-    return status;
+static Status bf_load_undo_segment(void *context, const char *changes,
+                                   size_t length)
+{
+    UndoFileHistory *loaded = context;
+    return bc_load_changes(loaded->changes, &loaded->history, changes,
+                           length);
+}
+
+static void bf_undo_history_dropped(Buffer *buffer)
+{
+    if (buffer->undo_file != NULL) {
+        uf_history_dropped(buffer->undo_file);
+    }
 }
 
 char *bf_to_string(const Buffer *buffer)
@@ -462,6 +1602,20 @@ size_t bf_lines(const Buffer *buffer)
     return gb_lines(buffer->data) + 1;
 }
 
+/* Return the number of lines, or while the lines of a mapped file are
+ * being counted in the background the number counted so far, in which
+ * case complete is false. Unlike bf_lines this never reads the whole
+ * of a mapped file so can be used each time the buffer is drawn */
+size_t bf_known_lines(const Buffer *buffer, int *complete)
+{
+    if (buffer->line_counter == NULL) {
+        *complete = 1;
+        return bf_lines(buffer);
+    }
+
+    return gb_lines_indexed(buffer->data, complete) + 1;
+}
+
 size_t bf_length(const Buffer *buffer)
 {
     return gb_length(buffer->data);
@@ -518,24 +1672,30 @@ int bf_offset_in_range(const Range *range, size_t offset)
     return (offset >= range->start.offset && offset < range->end.offset);
 }
 
-static Status bf_input_stream_read(InputStream *is, char buf[], size_t buf_len,
-                                   size_t *bytes_read)
+static Status bf_input_stream_read(InputStream *is, const char **text,
+                                   size_t *length)
 {
     BufferInputStream *bis = (BufferInputStream *)is;
     size_t offset = bis->read_pos.offset;
     size_t limit_offset = bis->end_pos.offset;
 
     if (offset < limit_offset) {
-        buf_len = MIN(buf_len, limit_offset - offset);
-        *bytes_read = gb_get_range(bis->buffer->data, offset, buf, buf_len);
-        bis->read_pos.offset += *bytes_read;
+        *length = gb_get_segment(bis->buffer->data, offset, text);
+        *length = MIN(*length, limit_offset - offset);
     } else {
-        *bytes_read = 0;
+        *length = 0;
     }
 
     return STATUS_SUCCESS;
 }
 
+static void bf_input_stream_consume(InputStream *is, size_t bytes)
+{
+    BufferInputStream *bis = (BufferInputStream *)is;
+    bis->read_pos.offset += bytes;
+    bf_marks_moved(bis->buffer);
+}
+
 static Status bf_input_stream_close(InputStream *is)
 {
     BufferInputStream *bis = (BufferInputStream *)is;
@@ -551,6 +1711,7 @@ Status bf_get_buffer_input_stream(BufferInputStream *bis, Buffer *buffer,
     *bis = (BufferInputStream) {
         .is = {
             .read = bf_input_stream_read,
+            .consume = bf_input_stream_consume,
             .close = bf_input_stream_close
         },
         .buffer = buffer,
@@ -625,7 +1786,8 @@ Status bf_get_buffer_output_stream(BufferOutputStream *bos, Buffer *buffer,
 CharacterClass bf_character_class(const Buffer *buffer, const BufferPos *pos)
 {
     CharInfo char_info;
-    en_utf8_char_info(&char_info, CIP_DEFAULT, pos, buffer->config);
+    en_utf8_char_info(&char_info, CIP_DEFAULT, pos,
+                      &buffer->config_snapshot);
 
     if (char_info.byte_length == 1) {
         uchar character = bp_get_uchar(pos);
@@ -680,6 +1842,44 @@ void bf_set_fileformat(Buffer *buffer, FileFormat file_format)
     buffer->file_format = file_format;
 }
 
+int bf_determine_textstore(const char *ts_name, GapBufferStorage *storage)
+{
+    assert(!is_null_or_empty(ts_name));
+
+    if (strncmp(ts_name, "gap", 4) == 0) {
+        *storage = GBS_GAP;
+        return 1;
+    } else if (strncmp(ts_name, "piecetable", 11) == 0) {
+        *storage = GBS_PIECE_TABLE;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Switch the layout used to store buffer text */
+Status bf_set_textstore(Buffer *buffer, GapBufferStorage storage)
+{
+    if (!gb_set_storage(buffer->data, storage)) {
+        return OUT_OF_MEMORY("Unable to convert buffer text storage");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Update the gap buffer allocation policy from the buffer config */
+void bf_set_alloc_policy(Buffer *buffer)
+{
+    GBAllocPolicy policy = {
+        .growth = cf_int(buffer->config, CV_GAPGROWTH),
+        .shrink = cf_int(buffer->config, CV_GAPSHRINK),
+        .huge_page_min = (size_t)cf_int(buffer->config, CV_HUGEPAGEMIN) *
+                         1024 * 1024
+    };
+
+    gb_set_alloc_policy(buffer->data, &policy);
+}
+
 const char *bf_new_line_str(FileFormat file_format)
 {
     if (file_format == FF_UNIX) {
@@ -695,7 +1895,7 @@ const char *bf_new_line_str(FileFormat file_format)
 
 int bf_bp_at_screen_line_start(const Buffer *buffer, const BufferPos *pos)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         size_t screen_col_no = (pos->col_no - 1) % buffer->bv->cols;
 
         if (screen_col_no == 0) {
@@ -723,7 +1923,7 @@ int bf_bp_at_screen_line_start(const Buffer *buffer, const BufferPos *pos)
 
 int bf_bp_at_screen_line_end(const Buffer *buffer, const BufferPos *pos)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         size_t screen_col_no = pos->col_no % buffer->bv->cols;
 
         if (screen_col_no == 0) {
@@ -811,7 +2011,7 @@ Status bf_set_bp(Buffer *buffer, const BufferPos *pos)
 Status bf_change_line(Buffer *buffer, BufferPos *pos, Direction direction,
                       int is_cursor)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         return bf_change_screen_line(buffer, pos, direction, is_cursor);
     }
 
@@ -915,6 +2115,16 @@ static Status bf_advance_bp_to_line_offset(Buffer *buffer, BufferPos *pos,
                                            int is_select)
 {
     size_t global_col_offset = buffer->line_col_offset;
+
+    if (!buffer->config_snapshot.linewrap) {
+        /* Column checkpoints allow the column to be found
+         * without stepping through each character of long lines */
+        bp_advance_to_col(pos, global_col_offset + 1);
+        buffer->line_col_offset = global_col_offset;
+
+        return STATUS_SUCCESS;
+    }
+
     size_t current_col_offset = bv_screen_col_no(buffer, pos) - 1;
     Direction direction = DIRECTION_RIGHT;
 
@@ -1031,7 +2241,7 @@ Status bf_change_multi_char(Buffer *buffer, BufferPos *pos, Direction direction,
  * can be persisted when changing line */
 static void bf_update_line_col_offset(Buffer *buffer, const BufferPos *pos)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         if (buffer->bv != NULL) {
             buffer->line_col_offset = (pos->col_no - 1) % buffer->bv->cols;
         }
@@ -1043,7 +2253,7 @@ static void bf_update_line_col_offset(Buffer *buffer, const BufferPos *pos)
 Status bf_to_line_start(Buffer *buffer, BufferPos *pos, int is_select,
                         int is_cursor)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         return bf_bp_to_screen_line_start(buffer, pos, is_select, is_cursor);
     }
 
@@ -1089,7 +2299,7 @@ Status bf_bp_to_screen_line_start(Buffer *buffer, BufferPos *pos,
 
 Status bf_to_line_end(Buffer *buffer, int is_select)
 {
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         return bf_bp_to_screen_line_end(buffer, &buffer->pos, is_select, 1);
     }
 
@@ -1271,6 +2481,7 @@ Status bf_change_page(Buffer *buffer, Direction direction)
 
     if (buffer->bv->screen_start.line_no != buffer->pos.line_no) {
         buffer->bv->screen_start = buffer->pos;
+        bf_marks_moved(buffer);
         RETURN_IF_FAIL(bf_bp_to_screen_line_start(buffer,
                                                   &buffer->bv->screen_start,
                                                   0, 0));
@@ -1331,29 +2542,53 @@ static Status bf_add_mark(Buffer *buffer, Mark *mark)
         return st_get_error(ERR_INVALID_MARK, "NULL mark");        
     }
 
-    char addr[50];
-    snprintf(addr, sizeof(addr), "%p", (void *)mark->pos);
-
-    if (hashmap_get(buffer->marks, addr) != NULL) {
+    if (bf_get_mark(buffer, mark->pos, NULL) != NULL) {
         return st_get_error(ERR_DUPLICATE_MARK, "Mark already tracked");
-    } else if (!hashmap_set(buffer->marks, addr, mark)) {
+    }
+
+    size_t index = bf_first_mark_from(buffer->marks, mark->pos->offset);
+    int added = index < list_size(buffer->marks) ?
+                list_add_at(buffer->marks, mark, index) :
+                list_add(buffer->marks, mark);
+
+    if (!added) {
         return OUT_OF_MEMORY("Unable to save mark" );
     }
 
     return STATUS_SUCCESS;
 }
 
-static Mark *bf_get_mark(const Buffer *buffer, const BufferPos *pos)
+/* Binary search for the mark referencing pos among the
+ * marks at its offset. index is set to the mark's index */
+static Mark *bf_get_mark(Buffer *buffer, const BufferPos *pos,
+                         size_t *index)
 {
-    char addr[50];
-    snprintf(addr, sizeof(addr), "%p", (void *)pos);
+    bf_order_marks(buffer);
+
+    size_t mark_num = list_size(buffer->marks);
+    Mark *mark;
+
+    for (size_t k = bf_first_mark_from(buffer->marks, pos->offset);
+         k < mark_num; k++) {
+        mark = list_get(buffer->marks, k);
+
+        if (mark->pos == pos) {
+            if (index != NULL) {
+                *index = k;
+            }
 
-    return hashmap_get(buffer->marks, addr);
+            return mark;
+        } else if (mark->pos->offset != pos->offset) {
+            break;
+        }
+    }
+
+    return NULL;
 }
 
 static int bf_remove_pos_mark(Buffer *buffer, const BufferPos *pos, int free)
 {
-    Mark *mark = bf_get_mark(buffer, pos);
+    Mark *mark = bf_get_mark(buffer, pos, NULL);
     return bf_remove_mark(buffer, mark, free);
 }
 
@@ -1363,10 +2598,13 @@ static int bf_remove_mark(Buffer *buffer, Mark *mark, int free)
         return 0;
     }
 
-    char addr[50];
-    snprintf(addr, sizeof(addr), "%p", (void *)mark->pos);
+    size_t index;
+    int deleted = 0;
 
-    int deleted = hashmap_delete(buffer->marks, addr);
+    if (bf_get_mark(buffer, mark->pos, &index) == mark) {
+        list_remove_at(buffer->marks, index);
+        deleted = 1;
+    }
 
     if (free) {
         bp_free_mark(mark);
@@ -1375,32 +2613,87 @@ static int bf_remove_mark(Buffer *buffer, Mark *mark, int free)
     return deleted;
 }
 
-static Status bf_update_marks(Buffer *buffer, const BufferPos *change_pos,
-                              TextChangeType change_type, size_t change_length,
-                              size_t change_lines)
+/* Called by the owners of marked positions after moving them directly,
+ * e.g. when scrolling, as the marks may then be out of order */
+void bf_marks_moved(Buffer *buffer)
 {
-    /* TODO Need HashMapIterator implementation to avoid heap allocation
-     * just to loop through hash entries */
-    const char **mark_refs = hashmap_get_keys(buffer->marks);
+    buffer->marks_moved = 1;
+}
 
-    if (mark_refs == NULL) {
-        return OUT_OF_MEMORY("Unable to allocate mark list");
+/* Restore the order of marks moved by their owners */
+static void bf_order_marks(Buffer *buffer)
+{
+    if (buffer->marks_moved) {
+        bf_sort_marks(buffer->marks, 0);
+        buffer->marks_moved = 0;
     }
+}
 
-    size_t mark_num = hashmap_size(buffer->marks);
-    Mark *mark;
+/* Insertion sort the marks from index start onwards. Edits keep marks
+ * in order except for marks at the same offset, so after an edit only
+ * the marks it updated are sorted, in a single pass */
+static void bf_sort_marks(List *marks, size_t start)
+{
+    Mark *mark, *prev;
+    size_t j;
 
-    for (size_t k = 0; k < mark_num; k++) {
-        mark = (Mark *)hashmap_get(buffer->marks, mark_refs[k]);
-        assert(mark != NULL);
+    for (size_t k = MAX(start, 1); k < list_size(marks); k++) {
+        mark = list_get(marks, k);
+
+        for (j = k; j > start; j--) {
+            prev = list_get(marks, j - 1);
+
+            if (prev->pos->offset <= mark->pos->offset) {
+                break;
+            }
+
+            list_set(marks, prev, j);
+        }
+
+        list_set(marks, mark, j);
+    }
+}
+
+/* Binary search for the index of the first mark at or after offset */
+static size_t bf_first_mark_from(const List *marks, size_t offset)
+{
+    size_t start = 0;
+    size_t end = list_size(marks);
+    size_t mid;
+    const Mark *mark;
+
+    while (start < end) {
+        mid = start + (end - start) / 2;
+        mark = list_get(marks, mid);
 
-        if (mark != NULL) {
-            bf_update_mark(mark, change_pos, change_type,
-                           change_length, change_lines);
+        if (mark->pos->offset < offset) {
+            start = mid + 1;
+        } else {
+            end = mid;
         }
     }
 
-    free(mark_refs);
+    return start;
+}
+
+/* Only marks at or after the change position can be affected,
+ * so the update starts from the first of them */
+static Status bf_update_marks(Buffer *buffer, const BufferPos *change_pos,
+                              TextChangeType change_type, size_t change_length,
+                              size_t change_lines)
+{
+    bp_invalidate_col_cache(&buffer->col_cache, change_pos->offset);
+    bf_order_marks(buffer);
+
+    size_t mark_num = list_size(buffer->marks);
+    size_t first = bf_first_mark_from(buffer->marks, change_pos->offset);
+
+    for (size_t k = first; k < mark_num; k++) {
+        bf_update_mark(list_get(buffer->marks, k), change_pos, change_type,
+                       change_length, change_lines);
+    }
+
+    bf_sort_marks(buffer->marks, first);
 
     return STATUS_SUCCESS;
 }
@@ -1455,7 +2748,7 @@ static void bf_update_mark(Mark *mark, const BufferPos *change_pos,
 static Status bf_insert_expanded_tab(Buffer *buffer, int advance_cursor)
 {
     static char spaces[CFG_TABWIDTH_MAX + 1];
-    size_t tabwidth = cf_int(buffer->config, CV_TABWIDTH);
+    size_t tabwidth = buffer->config_snapshot.tabwidth;
     tabwidth = tabwidth - ((buffer->pos.col_no - 1) % tabwidth);
     memset(spaces, ' ', tabwidth);
     spaces[tabwidth] = '\0';
@@ -1519,10 +2812,10 @@ Status bf_insert_character(Buffer *buffer, const char *character,
                             "Invalid character %s", character);
     }
 
-    if (*character == '\t' && cf_bool(buffer->config, CV_EXPANDTAB)) {
+    if (*character == '\t' && buffer->config_snapshot.expandtab) {
         return bf_insert_expanded_tab(buffer, advance_cursor);
     } else if (*character == '\n') {
-        if (cf_bool(buffer->config, CV_AUTOINDENT)) {
+        if (buffer->config_snapshot.autoindent) {
             return bf_auto_indent(buffer, advance_cursor);
         } else {
             character = bf_new_line_str(buffer->file_format);
@@ -1589,6 +2882,11 @@ Status bf_insert_string(Buffer *buffer, const char *string,
     bf_update_marks(buffer, &buffer->pos, TCT_INSERT, string_length,
                     lines_after - lines_before);
 
+    if (buffer->journal != NULL) {
+        st_free_status(jn_add_insert(buffer->journal, start_pos.offset,
+                                     string, string_length));
+    }
+
     status = bc_add_text_insert(&buffer->changes, string_length, &start_pos);
 
     if (!STATUS_IS_SUCCESS(status)) {
@@ -1670,6 +2968,11 @@ Status bf_delete(Buffer *buffer, size_t byte_num)
 
     char *deleted_str = NULL;
     int undo_enabled = bc_enabled(&buffer->changes);
+    /* Text deleted in a single change above the undo budget is
+     * compressed and spilled to disk from the copy made here rather
+     * than also being copied into the undo history */
+    int spill_deletion = undo_enabled &&
+                         !bf_within_budget(buffer, LFF_UNDO, byte_num);
 
     if (undo_enabled) {
         deleted_str = malloc(byte_num);
@@ -1685,6 +2988,7 @@ Status bf_delete(Buffer *buffer, size_t byte_num)
     gb_set_point(buffer->data, pos->offset);
 
     if (!gb_delete(buffer->data, byte_num)) {
+        free(deleted_str);
         return OUT_OF_MEMORY("Unable to delete character");
     }
 
@@ -1694,20 +2998,297 @@ Status bf_delete(Buffer *buffer, size_t byte_num)
     bf_update_marks(buffer, &buffer->pos, TCT_DELETE, byte_num,
                     lines_before - lines_after);
 
+    if (buffer->journal != NULL) {
+        st_free_status(jn_add_delete(buffer->journal, pos->offset,
+                                     byte_num));
+    }
+
     Status status = STATUS_SUCCESS;
 
-    if (undo_enabled) {
+    if (spill_deletion) {
+        status = bc_add_spilled_text_delete(&buffer->changes, deleted_str,
+                                            byte_num, pos);
+    } else if (undo_enabled) {
         status = bc_add_text_delete(&buffer->changes, deleted_str,
                                     byte_num, pos); 
-
-        free(deleted_str);
     }
 
+    free(deleted_str);
+
     bf_update_line_col_offset(buffer, pos);
 
     return status;
 }
 
+/* Apply edits in order as a single change to the buffer. Only the span
+ * of text between the first and last offsets the edits touch is
+ * affected, so it's rebuilt separately with each edit made at its own
+ * gap. The span then replaces the original text in one go, after which
+ * marks and the cursor are repositioned once. The cursor is left at the
+ * last edit as it would be if each had been applied using bf_set_bp
+ * followed by bf_insert_string or bf_delete */
+Status bf_apply_edits(Buffer *buffer, const BufferEdit *edits,
+                      size_t edit_num)
+{
+    if (edit_num == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    size_t length = gb_length(buffer->data);
+    size_t start = length;
+    size_t tail = length;
+    size_t inserted = 0;
+    const BufferEdit *edit;
+
+    /* Determine the span of text edited, which starts at the lowest
+     * offset and ends at the least distance from the buffer end */
+    for (size_t k = 0; k < edit_num; k++) {
+        edit = &edits[k];
+
+        if (edit->offset > length ||
+            (edit->change_type == TCT_DELETE &&
+             edit->length > length - edit->offset)) {
+            return st_get_error(ERR_INVALID_BUFFERPOS,
+                                "Invalid Buffer Position");
+        }
+
+        start = MIN(start, edit->offset);
+
+        if (edit->change_type == TCT_INSERT) {
+            tail = MIN(tail, length - edit->offset);
+            length += edit->length;
+            inserted += edit->length;
+        } else {
+            tail = MIN(tail, length - edit->offset - edit->length);
+            length -= edit->length;
+        }
+    }
+
+    size_t old_length = gb_length(buffer->data) - tail - start;
+    GBSpan span;
+
+    if (!gb_span_init(&span, buffer->data, start, old_length, inserted)) {
+        return OUT_OF_MEMORY("Unable to apply changes");
+    }
+
+    for (size_t k = 0; k < edit_num; k++) {
+        edit = &edits[k];
+
+        if (edit->change_type == TCT_INSERT) {
+            gb_span_insert(&span, edit->offset - start, edit->text,
+                           edit->length);
+        } else {
+            gb_span_delete(&span, edit->offset - start, edit->length,
+                           edit->text);
+        }
+    }
+
+    size_t new_length;
+    const char *text = gb_span_text(&span, &new_length);
+
+    /* Text before the span is unchanged so this position remains
+     * valid and is used to reposition everything after it */
+    BufferPos start_pos = bp_init_from_offset(start, &buffer->pos);
+    gb_set_point(buffer->data, start);
+
+    if (!gb_replace(buffer->data, old_length, text, new_length)) {
+        gb_span_free(&span);
+        return OUT_OF_MEMORY("Unable to apply changes");
+    }
+
+    buffer->is_draw_dirty = 1;
+    bp_invalidate_col_cache(&buffer->col_cache, start);
+
+    if (buffer->journal != NULL) {
+        st_free_status(jn_add_delete(buffer->journal, start, old_length));
+        st_free_status(jn_add_insert(buffer->journal, start, text,
+                                     new_length));
+    }
+
+    gb_span_free(&span);
+
+    bf_order_marks(buffer);
+
+    size_t mark_num = list_size(buffer->marks);
+    size_t first = bf_first_mark_from(buffer->marks, start);
+    EditSweep sweep;
+    Mark *mark;
+
+    /* Marks are swept through each run of edits made in one direction,
+     * which for the groups of changes undone and redone is usually all
+     * of them. A run can reorder marks which shared an offset, so they're
+     * sorted again after each */
+    for (size_t k = 0; k < edit_num; k += sweep.edit_num) {
+        sweep = (EditSweep) { .edits = edits + k };
+        sweep.edit_num = bf_edit_run(sweep.edits, edit_num - k,
+                                     &sweep.backward);
+        sweep.next = sweep.backward ? sweep.edit_num : 0;
+
+        for (size_t j = first; j < mark_num; j++) {
+            mark = list_get(buffer->marks, j);
+
+            if (mark->pos->line_no != 0) {
+                mark->pos->offset = bf_sweep_offset(&sweep, mark->pos->offset,
+                                                    mark->prop);
+            }
+        }
+
+        bf_sort_marks(buffer->marks, first);
+    }
+
+    BufferPos known_pos = start_pos;
+
+    for (size_t k = first; k < mark_num; k++) {
+        mark = list_get(buffer->marks, k);
+
+        if (mark->pos->line_no != 0 &&
+            !(mark->prop & MP_ADJUST_OFFSET_ONLY)) {
+            *mark->pos = bp_init_from_offset(mark->pos->offset, &known_pos);
+            known_pos = *mark->pos;
+        }
+    }
+
+    if (bf_selection_started(buffer)) {
+        bf_select_reset(buffer);
+    }
+
+    buffer->pos = bp_init_from_offset(edits[edit_num - 1].offset,
+                                      &start_pos);
+    bf_update_line_col_offset(buffer, &buffer->pos);
+
+    return STATUS_SUCCESS;
+}
+
+/* Return how many edits from the start of edits are each made at or
+ * after the end of the one preceding it, or else each entirely before
+ * the one preceding it, setting backward to which */
+static size_t bf_edit_run(const BufferEdit *edits, size_t edit_num,
+                          int *backward)
+{
+    int forward_run = 1, backward_run = 1;
+    int forward, back;
+    const BufferEdit *prev, *edit;
+    size_t k;
+
+    for (k = 1; k < edit_num; k++) {
+        prev = &edits[k - 1];
+        edit = &edits[k];
+        forward = forward_run && edit->offset >= prev->offset +
+                  (prev->change_type == TCT_INSERT ? prev->length : 0);
+        back = backward_run && edit->offset +
+               (edit->change_type == TCT_DELETE ? edit->length : 0) <=
+               prev->offset;
+
+        if (!forward && !back) {
+            break;
+        }
+
+        forward_run = forward;
+        backward_run = back;
+    }
+
+    *backward = !forward_run;
+
+    return k;
+}
+
+/* Map the offset of a mark through a run of edits. Marks are mapped in
+ * order of offset, so the edits every mark after this one is moved
+ * past by the same amount are only followed once. Otherwise only the
+ * few edits which start at or around the mark are followed */
+static size_t bf_sweep_offset(EditSweep *sweep, size_t offset,
+                              MarkProperties prop)
+{
+    const BufferEdit *edit;
+    size_t k;
+
+    if (!sweep->backward) {
+        /* Edits are made in order of offset, so none after the first
+         * which starts beyond the mark reach it */
+        offset = offset + sweep->added - sweep->removed;
+
+        for (k = sweep->next; k < sweep->edit_num; k++) {
+            edit = &sweep->edits[k];
+
+            if (edit->offset > offset) {
+                break;
+            } else if (k == sweep->next && bf_edit_passed(edit, offset)) {
+                sweep->next++;
+                bf_sweep_add(sweep, edit);
+            }
+
+            offset = bf_edit_offset(offset, prop, edit);
+        }
+
+        return offset;
+    }
+
+    /* Edits are made in reverse order of offset, so those which start
+     * beyond the mark, which are made first, don't reach it. Of the
+     * rest, once it's moved past one it's moved past those after */
+    while (sweep->next > 0 &&
+           sweep->edits[sweep->next - 1].offset <= offset) {
+        bf_sweep_add(sweep, &sweep->edits[--sweep->next]);
+    }
+
+    size_t added = sweep->added;
+    size_t removed = sweep->removed;
+
+    for (k = sweep->next; k < sweep->edit_num; k++) {
+        edit = &sweep->edits[k];
+
+        if (bf_edit_passed(edit, offset)) {
+            break;
+        } else if (edit->change_type == TCT_INSERT) {
+            added -= edit->length;
+        } else {
+            removed -= edit->length;
+        }
+
+        offset = bf_edit_offset(offset, prop, edit);
+    }
+
+    return offset + added - removed;
+}
+
+static void bf_sweep_add(EditSweep *sweep, const BufferEdit *edit)
+{
+    if (edit->change_type == TCT_INSERT) {
+        sweep->added += edit->length;
+    } else {
+        sweep->removed += edit->length;
+    }
+}
+
+/* Whether an edit moves offset, and any offset after it, by its length
+ * regardless of the properties of a mark, leaving it beyond the offset
+ * the edit is made at */
+static int bf_edit_passed(const BufferEdit *edit, size_t offset)
+{
+    if (edit->change_type == TCT_INSERT) {
+        return offset > edit->offset;
+    }
+
+    return offset > edit->offset + edit->length;
+}
+
+/* Follow an offset through an edit in the same way
+ * bf_update_mark adjusts a mark for a single change */
+static size_t bf_edit_offset(size_t offset, MarkProperties prop,
+                             const BufferEdit *edit)
+{
+    if (edit->length == 0 || offset < edit->offset ||
+        ((prop & MP_NO_ADJUST_ON_BUFFER_POS) && offset == edit->offset)) {
+        return offset;
+    } else if (edit->change_type == TCT_INSERT) {
+        return offset + edit->length;
+    } else if (offset < edit->offset + edit->length) {
+        return edit->offset;
+    }
+
+    return offset - edit->length;
+}
+
 Status bf_delete_character(Buffer *buffer)
 {
     size_t byte_length;
@@ -1719,7 +3300,7 @@ Status bf_delete_character(Buffer *buffer)
     } else {
         CharInfo char_info;
         en_utf8_char_info(&char_info, CIP_DEFAULT, 
-                          &buffer->pos, buffer->config);
+                          &buffer->pos, &buffer->config_snapshot);
         byte_length = char_info.byte_length;
     }
 
@@ -2152,8 +3733,8 @@ Status bf_indent(Buffer *buffer, Direction direction)
             case DIRECTION_LEFT:
                 {
                     CharInfo char_info;
-                    size_t space_remaining = cf_int(buffer->config,
-                                                    CV_TABWIDTH);
+                    size_t space_remaining =
+                        buffer->config_snapshot.tabwidth;
 
                     while (bf_character_class(buffer, &buffer->pos) 
                            == CCLASS_WHITESPACE &&
@@ -2161,7 +3742,8 @@ Status bf_indent(Buffer *buffer, Direction direction)
                            !bp_at_line_end(&buffer->pos)) {
                         
                         en_utf8_char_info(&char_info, CIP_SCREEN_LENGTH,
-                                          &buffer->pos, buffer->config);
+                                          &buffer->pos,
+                                          &buffer->config_snapshot);
 
                         if (char_info.screen_length <= space_remaining) {
                             status = bf_delete_character(buffer);
@@ -2287,14 +3869,27 @@ Status bf_jump_to_matching_bracket(Buffer *buffer)
             }
     }
 
-    size_t buffer_len = bf_length(buffer);
+    /* In large files only the bracket budget's worth of
+     * text either side of the cursor is scanned */
+    size_t budget = bf_feature_budget(buffer, LFF_BRACKET_MATCH);
+    size_t scan_start = 0;
+    size_t scan_end = bf_length(buffer);
+
+    if (budget > 0) {
+        scan_start = offset > budget ? offset - budget : 0;
+        scan_end = MIN(scan_end, offset + budget);
+    }
+
+    size_t start_offset = offset;
     size_t scope = 0;
     int match_found = 0;
     char iter;
+    GBCursor cursor;
+    gb_cursor_init(&cursor, buffer->data);
 
     if (direction == DIRECTION_RIGHT) {
-        while (++offset < buffer_len) {
-            iter = gb_get_at(buffer->data, offset);
+        while (++offset < scan_end) {
+            iter = gb_cursor_get_at(&cursor, offset);
 
             if (iter == current_char) {
                 scope++;
@@ -2308,8 +3903,8 @@ Status bf_jump_to_matching_bracket(Buffer *buffer)
             }
         }
     } else {
-        while (offset > 0) {
-            iter = gb_get_at(buffer->data, --offset);
+        while (offset > scan_start) {
+            iter = gb_cursor_get_at(&cursor, --offset);
 
             if (iter == current_char) {
                 scope++;
@@ -2325,6 +3920,8 @@ Status bf_jump_to_matching_bracket(Buffer *buffer)
     }
 
     if (!match_found) {
+        bf_within_budget(buffer, LFF_BRACKET_MATCH,
+                         ABS_DIFF(offset, start_offset));
         return STATUS_SUCCESS;
     }
 
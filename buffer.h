@@ -24,7 +24,14 @@
 #include "shared.h"
 #include "status.h"
 #include "file.h"
+#include "file_writer.h"
+#include "file_loader.h"
+#include "file_follower.h"
+#include "journal.h"
+#include "undo_file.h"
 #include "hashmap.h"
+#include "list.h"
+#include "config_snapshot.h"
 #include "encoding.h"
 #include "gap_buffer.h"
 #include "buffer_pos.h"
@@ -59,6 +66,28 @@ typedef struct {
     size_t str_len;
 } TextSelection;
 
+/* An edit applied by bf_apply_edits. Its offset is relative to
+ * the buffer as left by the edits applied before it */
+typedef struct {
+    TextChangeType change_type; /* Insert or delete */
+    size_t offset; /* Where the edit is made */
+    size_t length; /* Length of text inserted or deleted */
+    char *text; /* Text inserted, or where text deleted is copied
+                   to when not NULL */
+} BufferEdit;
+
+/* Features which can be costly when editing large files. Each has a
+ * budget which, once exceeded in a large file, degrades the feature */
+typedef enum {
+    LFF_SYNTAX = 1, /* Syntax highlighting */
+    LFF_SEARCH_HIGHLIGHT = 1 << 1, /* Highlighting all search matches */
+    LFF_BRACKET_MATCH = 1 << 2, /* Jumping to a matching bracket */
+    LFF_UNDO = 1 << 3 /* Keeping text deleted in one change in memory
+                        for undo */
+} LargeFileFeature;
+
+#define LFF_ENTRY_NUM 4
+
 typedef struct Buffer Buffer;
 
 /* The in memory representation of a file */
@@ -69,6 +98,8 @@ struct Buffer {
     Buffer *next; /* Next buffer in this session */
     size_t line_col_offset; /* Global cursor line offset */
     HashMap *config; /* Stores config variables */
+    ConfigSnapshot config_snapshot; /* Typed copies of variables
+                                       read on hot paths */
     BufferChangeState change_state; /* Reference to state when buffer was
                                        last written */
     int is_draw_dirty; /* Any modification performed since last draw */
@@ -77,8 +108,42 @@ struct Buffer {
     BufferChanges changes; /* Undo/Redo */
     FileFormat file_format; /* Unix or Windows line endings */
     RegexInstance mask; /* Inserted text can match mask */
-    HashMap *marks; /* Buffer marks */
+    List *marks; /* Buffer marks ordered by offset */
+    int marks_moved; /* Marks may be out of order as their positions have
+                        been moved directly since they were last sorted
+                        (see bf_marks_moved) */
     BufferView *bv; /* In memory display of buffer */
+    FileWriter *writer; /* Writes a snapshot of the buffer in the
+                           background when saving */
+    BufferChangeState write_state; /* State of buffer when the
+                                      snapshot being written was taken */
+    FileLoader *loader; /* Reads the rest of the file in the background
+                           when loading large files */
+    FileLoader *line_counter; /* Counts the lines of a mapped file in the
+                                 background so the mapping needn't be
+                                 read on the main thread to index it */
+    int load_incomplete; /* Loading was cancelled or failed so the buffer
+                            only contains the start of the file */
+    struct stat base_stat; /* Attributes of the file the changes tracked
+                              in data are relative to */
+    int has_base_stat; /* True if base_stat is set, in which case only
+                          changed text needs to be written when saving
+                          to the same unmodified file */
+    Journal *journal; /* Records edits so they can be recovered after
+                         a crash, or NULL if journaling is disabled */
+    size_t journal_mark; /* Journal position when the snapshot being
+                            written was taken */
+    UndoFile *undo_file; /* Keeps undo history between sessions,
+                            or NULL if disabled */
+    FileFollower *follower; /* Appends text added to the file to the
+                               buffer when following the file */
+    int stream_fd; /* Pipe read into the end of the buffer as input
+                      arrives, or -1 */
+    int large_file; /* Buffer exceeds the large file thresholds so
+                       costly features are limited by their budgets */
+    int degraded_features; /* Bit mask of LargeFileFeature values that
+                              have exceeded their budget */
+    ColumnCache col_cache; /* Column checkpoints for long lines */
 };
 
 /* The following two stream implementations make it possible to filter buffer
@@ -108,12 +173,48 @@ Status bf_clear(Buffer *);
 Status bf_reset(Buffer *);
 FileFormat bf_detect_fileformat(const Buffer *);
 Status bf_load_file(Buffer *);
+Status bf_load_file_async(Buffer *, int notify_fd);
+int bf_load_in_progress(const Buffer *);
+int bf_can_map_file(const Buffer *);
+int bf_load_progress(const Buffer *);
+int bf_load_incomplete(const Buffer *);
+Status bf_continue_load(Buffer *);
+Status bf_cancel_load(Buffer *);
+int bf_counting_lines(const Buffer *);
+Status bf_continue_line_count(Buffer *);
+Status bf_follow_file(Buffer *, int notify_fd);
+int bf_following(const Buffer *);
+Status bf_continue_follow(Buffer *);
+void bf_stop_follow(Buffer *);
+Status bf_stream_file(Buffer *, int fd);
+int bf_stream_fd(const Buffer *);
+Status bf_continue_stream(Buffer *, size_t max_bytes);
+void bf_stop_stream(Buffer *);
 Status bf_read_file(Buffer *, const FileInfo *);
+void bf_set_large_file(Buffer *, int large_file);
+int bf_is_large_file(const Buffer *);
+long bf_feature_budget(const Buffer *, LargeFileFeature);
+int bf_feature_enabled(const Buffer *, LargeFileFeature);
+int bf_within_budget(Buffer *, LargeFileFeature, long cost);
+void bf_restore_feature(Buffer *, LargeFileFeature);
+size_t bf_undo_memory(const Buffer *);
+Status bf_limit_undo_memory(Buffer *, size_t memory_budget);
+const char *bf_feature_name(LargeFileFeature);
+Status bf_enable_journal(Buffer *, size_t resume_length);
+Status bf_replay_journal(Buffer *, size_t *records, size_t *valid_length);
+Status bf_enable_undo_file(Buffer *);
+Status bf_undo(Buffer *);
 Status bf_write_file(Buffer *, const char *file_path);
+Status bf_write_file_async(Buffer *, const char *file_path, int notify_fd);
+int bf_write_in_progress(const Buffer *);
+int bf_write_finished(const Buffer *);
+int bf_write_progress(const Buffer *);
+Status bf_finish_write_file(Buffer *, char **file_path_ptr);
 char *bf_to_string(const Buffer *);
 char *bf_join_lines_string(const Buffer *, const char *seperator);
 int bf_is_empty(const Buffer *);
 size_t bf_lines(const Buffer *);
+size_t bf_known_lines(const Buffer *, int *complete);
 size_t bf_length(const Buffer *);
 int bf_is_view_initialised(const Buffer *);
 int bf_is_dirty(const Buffer *);
@@ -131,6 +232,9 @@ FileFormat bf_get_fileformat(const Buffer *);
 int bf_determine_fileformat(const char *ff_name, FileFormat *);
 const char *bf_determine_fileformat_str(FileFormat);
 void bf_set_fileformat(Buffer *, FileFormat);
+int bf_determine_textstore(const char *ts_name, GapBufferStorage *);
+Status bf_set_textstore(Buffer *, GapBufferStorage);
+void bf_set_alloc_policy(Buffer *);
 const char *bf_new_line_str(FileFormat);
 int bf_bp_at_screen_line_start(const Buffer *, const BufferPos *);
 int bf_bp_at_screen_line_end(const Buffer *, const BufferPos *);
@@ -159,12 +263,14 @@ Status bf_change_page(Buffer *, Direction);
 Status bf_to_buffer_start(Buffer *, int is_select);
 Status bf_to_buffer_end(Buffer *, int is_select);
 Status bf_add_new_mark(Buffer *, BufferPos *, MarkProperties);
+void bf_marks_moved(Buffer *);
 Status bf_insert_character(Buffer *, const char *character, int advance_cursor);
 Status bf_insert_string(Buffer *, const char *string, 
                         size_t string_length, int advance_cursor);
 Status bf_replace_string(Buffer *, size_t replace_length, const char *string, 
                          size_t string_length, int advance_cursor);
 Status bf_delete(Buffer *, size_t byte_num);
+Status bf_apply_edits(Buffer *, const BufferEdit *, size_t edit_num);
 Status bf_delete_character(Buffer *);
 Status bf_select_continue(Buffer *);
 Status bf_select_reset(Buffer *);
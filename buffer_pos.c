@@ -20,6 +20,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdint.h>
 #include "buffer_pos.h"
 #include "util.h"
 #include "status.h"
@@ -37,12 +38,26 @@ typedef enum {
 
 static int bp_is_char_before(const BufferPos *, size_t offset, char ch);
 static void calc_new_col(BufferPos *, size_t new_offset);
+static void bp_to_offset(BufferPos *, size_t offset);
+static void bp_to_line(BufferPos *, size_t line_no);
 static NearestPos bp_determine_nearest_pos(size_t pos, size_t start, 
                                            size_t known, size_t end);
+static ColLine *bp_get_col_line(const BufferPos *, BufferPos *line_start,
+                                size_t min_length);
+static void bp_reset_col_line(ColLine *, size_t line_start);
+static void bp_extend_col_line(ColLine *, const BufferPos *, size_t offset,
+                               size_t col_no);
+static int bp_add_col_checkpoint(ColLine *, const BufferPos *);
+static const ColCheckpoint *bp_checkpoint_before_offset(const ColLine *,
+                                                        size_t offset);
+static const ColCheckpoint *bp_checkpoint_before_col(const ColLine *,
+                                                     size_t col_no);
+static void bp_seek_offset(BufferPos *, size_t offset);
+static void bp_seek_col(BufferPos *, size_t col_no);
 
 int bp_init(BufferPos *pos, const GapBuffer *data, 
             const FileFormat *file_format,
-            const HashMap *config)
+            const ConfigSnapshot *config, ColumnCache *col_cache)
 {
     assert(pos != NULL);
     assert(data != NULL);
@@ -55,10 +70,52 @@ int bp_init(BufferPos *pos, const GapBuffer *data,
     pos->data = data;
     pos->file_format = file_format;
     pos->config = config;
+    pos->col_cache = col_cache;
 
     return 1;
 }
 
+void bp_init_col_cache(ColumnCache *col_cache)
+{
+    memset(col_cache, 0, sizeof(ColumnCache));
+}
+
+void bp_free_col_cache(ColumnCache *col_cache)
+{
+    for (size_t k = 0; k < BP_COL_CACHE_LINES; k++) {
+        free(col_cache->lines[k].checkpoints);
+    }
+
+    bp_init_col_cache(col_cache);
+}
+
+/* Text at or after offset has been inserted or deleted. Checkpoints
+ * before offset remain valid as their columns only depend on the text
+ * before them and the byte at their offset */
+void bp_invalidate_col_cache(ColumnCache *col_cache, size_t offset)
+{
+    ColLine *line;
+
+    for (size_t k = 0; k < BP_COL_CACHE_LINES; k++) {
+        line = &col_cache->lines[k];
+
+        if (line->checkpoint_num == 0) {
+            continue;
+        } else if (offset <= line->line_start) {
+            line->checkpoint_num = 0;
+            continue;
+        }
+
+        while (line->checkpoints[line->checkpoint_num - 1].offset >= offset) {
+            line->checkpoint_num--;
+        }
+
+        if (line->line_end_known && offset <= line->line_end) {
+            line->line_end_known = 0;
+        }
+    }
+}
+
 Mark *bp_new_mark(BufferPos *pos, MarkProperties prop)
 {
     Mark *mark = malloc(sizeof(Mark));
@@ -176,7 +233,17 @@ int bp_at_first_line(const BufferPos *pos)
 
 int bp_at_last_line(const BufferPos *pos)
 {
-    return pos->line_no == gb_lines(pos->data) + 1;
+    int complete;
+    size_t lines = gb_lines_indexed(pos->data, &complete);
+
+    if (complete) {
+        return pos->line_no == lines + 1;
+    }
+
+    /* Check for a following new line rather than count all
+     * the lines of mapped text which isn't fully indexed */
+    size_t next;
+    return !gb_find_next(pos->data, pos->offset, &next, '\n');
 }
 
 int bp_at_buffer_start(const BufferPos *pos)
@@ -235,15 +302,18 @@ void bp_prev_char(BufferPos *pos)
 
         bp_recalc_col(pos);
     } else {
-        size_t prev_offset = en_utf8_previous_char_offset(pos);
+        GBCursor cursor;
+        gb_cursor_init(&cursor, pos->data);
+        size_t prev_offset = en_utf8_cursor_previous_char_offset(pos,
+                                                                 &cursor);
         pos->offset -= prev_offset;
 
-        if (bp_get_char(pos) == '\t') {
+        if (gb_cursor_get_at(&cursor, pos->offset) == '\t') {
             bp_recalc_col(pos);
         } else {
             CharInfo char_info;
-            en_utf8_char_info(&char_info, CIP_SCREEN_LENGTH, 
-                              pos, pos->config);
+            en_utf8_cursor_char_info(&char_info, CIP_SCREEN_LENGTH, 
+                                     pos, &cursor, pos->config);
 
             if (char_info.byte_length == prev_offset) {
                 pos->col_no -= char_info.screen_length;
@@ -254,8 +324,8 @@ void bp_prev_char(BufferPos *pos)
 
                 while (remaining_bytes > 0) {
                     pos->offset += char_info.byte_length; 
-                    en_utf8_char_info(&char_info, CIP_SCREEN_LENGTH, 
-                                      pos, pos->config);
+                    en_utf8_cursor_char_info(&char_info, CIP_SCREEN_LENGTH, 
+                                             pos, &cursor, pos->config);
                     remaining_bytes -= char_info.byte_length;
                 }
 
@@ -299,24 +369,290 @@ void bp_to_line_end(BufferPos *pos)
         line_end_offset = gb_length(pos->data);
     }
 
+    if (line_end_offset - pos->offset >= BP_COL_CHECKPOINT_INTERVAL) {
+        bp_seek_offset(pos, line_end_offset);
+    }
+
     calc_new_col(pos, line_end_offset);
 }
 
 void bp_recalc_col(BufferPos *pos)
 {
     BufferPos tmp = *pos; 
-    bp_to_line_start(&tmp);
+    ColLine *line = bp_get_col_line(pos, &tmp, BP_COL_CHECKPOINT_INTERVAL);
+
+    if (line != NULL) {
+        bp_extend_col_line(line, pos, pos->offset, SIZE_MAX);
+        const ColCheckpoint *checkpoint =
+            bp_checkpoint_before_offset(line, pos->offset);
+        tmp.offset = checkpoint->offset;
+        tmp.col_no = checkpoint->col_no;
+    }
+
     calc_new_col(&tmp, pos->offset);
     *pos = tmp;
 }
 
+/* Returns the cached line pos is on. If the line isn't cached it's
+ * added when at least min_length bytes precede pos on the line.
+ * When NULL is returned line_start is set to the start of the line */
+static ColLine *bp_get_col_line(const BufferPos *pos, BufferPos *line_start,
+                                size_t min_length)
+{
+    ColumnCache *col_cache = pos->col_cache;
+    ColLine *line;
+    size_t k;
+
+    *line_start = *pos;
+
+    if (col_cache == NULL) {
+        bp_to_line_start(line_start);
+        return NULL;
+    }
+
+    size_t tab_width = pos->config->tabwidth;
+
+    if (tab_width != col_cache->tab_width) {
+        bp_invalidate_col_cache(col_cache, 0);
+        col_cache->tab_width = tab_width;
+    }
+
+    /* Text between a line's checkpoints is known not to contain a new
+     * line, so in most cases the line start doesn't need to be found */
+    for (k = 0; k < BP_COL_CACHE_LINES; k++) {
+        line = &col_cache->lines[k];
+
+        if (line->checkpoint_num > 0 && line->line_start <= pos->offset &&
+            (pos->offset <=
+                 line->checkpoints[line->checkpoint_num - 1].offset ||
+             (line->line_end_known && pos->offset <= line->line_end))) {
+            line->last_used = ++col_cache->uses;
+            return line;
+        }
+    }
+
+    bp_to_line_start(line_start);
+    ColLine *unused = &col_cache->lines[0];
+
+    for (k = 0; k < BP_COL_CACHE_LINES; k++) {
+        line = &col_cache->lines[k];
+
+        if (line->checkpoint_num > 0 &&
+            line->line_start == line_start->offset) {
+            line->last_used = ++col_cache->uses;
+            return line;
+        } else if (line->checkpoint_num == 0 ||
+                   (unused->checkpoint_num > 0 &&
+                    line->last_used < unused->last_used)) {
+            unused = line;
+        }
+    }
+
+    if (pos->offset - line_start->offset < min_length) {
+        return NULL;
+    }
+
+    if (unused->allocated == 0) {
+        unused->checkpoints = malloc(sizeof(ColCheckpoint) * 16);
+
+        if (unused->checkpoints == NULL) {
+            return NULL;
+        }
+
+        unused->allocated = 16;
+    }
+
+    bp_reset_col_line(unused, line_start->offset);
+    unused->last_used = ++col_cache->uses;
+
+    return unused;
+}
+
+static void bp_reset_col_line(ColLine *line, size_t line_start)
+{
+    line->line_start = line_start;
+    line->checkpoints[0].offset = line_start;
+    line->checkpoints[0].col_no = 1;
+    line->checkpoint_num = 1;
+    line->line_end_known = 0;
+}
+
+/* Add checkpoints until the last checkpoint is within
+ * BP_COL_CHECKPOINT_INTERVAL bytes of offset, reaches col_no
+ * or the line end is reached */
+static void bp_extend_col_line(ColLine *line, const BufferPos *pos,
+                               size_t offset, size_t col_no)
+{
+    const ColCheckpoint *last = &line->checkpoints[line->checkpoint_num - 1];
+    BufferPos walk = *pos;
+    walk.offset = last->offset;
+    walk.col_no = last->col_no;
+
+    size_t next = walk.offset + BP_COL_CHECKPOINT_INTERVAL;
+    size_t buffer_len = gb_length(pos->data);
+    size_t run;
+    CharInfo char_info;
+    GBCursor cursor;
+    gb_cursor_init(&cursor, pos->data);
+
+    while (!line->line_end_known && next <= offset && walk.col_no < col_no) {
+        if (walk.offset == buffer_len ||
+            gb_cursor_getu_at(&cursor, walk.offset) == '\n') {
+            line->line_end = walk.offset;
+            line->line_end_known = 1;
+            break;
+        }
+
+        run = gb_plain_run(pos->data, walk.offset, next - walk.offset);
+
+        if (run > 0) {
+            walk.col_no += run;
+            walk.offset += run;
+        } else {
+            en_utf8_cursor_char_info(&char_info, CIP_SCREEN_LENGTH,
+                                     &walk, &cursor, walk.config);
+            walk.col_no += char_info.screen_length;
+            walk.offset += char_info.byte_length;
+        }
+
+        if (walk.offset >= next) {
+            if (!bp_add_col_checkpoint(line, &walk)) {
+                break;
+            }
+
+            next = walk.offset + BP_COL_CHECKPOINT_INTERVAL;
+        }
+    }
+}
+
+static int bp_add_col_checkpoint(ColLine *line, const BufferPos *pos)
+{
+    if (line->checkpoint_num == line->allocated) {
+        size_t allocated = line->allocated * 2;
+        ColCheckpoint *checkpoints = realloc(line->checkpoints,
+                                             sizeof(ColCheckpoint) *
+                                             allocated);
+
+        if (checkpoints == NULL) {
+            return 0;
+        }
+
+        line->checkpoints = checkpoints;
+        line->allocated = allocated;
+    }
+
+    ColCheckpoint *checkpoint = &line->checkpoints[line->checkpoint_num++];
+    checkpoint->offset = pos->offset;
+    checkpoint->col_no = pos->col_no;
+
+    return 1;
+}
+
+/* Returns the last checkpoint at or before offset */
+static const ColCheckpoint *bp_checkpoint_before_offset(const ColLine *line,
+                                                        size_t offset)
+{
+    size_t start = 0;
+    size_t end = line->checkpoint_num;
+    size_t mid;
+
+    while (end - start > 1) {
+        mid = start + (end - start) / 2;
+
+        if (line->checkpoints[mid].offset <= offset) {
+            start = mid;
+        } else {
+            end = mid;
+        }
+    }
+
+    return &line->checkpoints[start];
+}
+
+/* Returns the last checkpoint before col_no. Zero width characters
+ * mean more than one position can have the same column, so the
+ * position found is before the first with col_no */
+static const ColCheckpoint *bp_checkpoint_before_col(const ColLine *line,
+                                                     size_t col_no)
+{
+    size_t start = 0;
+    size_t end = line->checkpoint_num;
+    size_t mid;
+
+    while (end - start > 1) {
+        mid = start + (end - start) / 2;
+
+        if (line->checkpoints[mid].col_no < col_no) {
+            start = mid;
+        } else {
+            end = mid;
+        }
+    }
+
+    return &line->checkpoints[start];
+}
+
+/* Move pos forward to the last checkpoint at or before offset
+ * on the same line */
+static void bp_seek_offset(BufferPos *pos, size_t offset)
+{
+    BufferPos line_start;
+    ColLine *line = bp_get_col_line(pos, &line_start, 0);
+
+    if (line == NULL) {
+        return;
+    }
+
+    bp_extend_col_line(line, pos, offset, SIZE_MAX);
+    const ColCheckpoint *checkpoint = bp_checkpoint_before_offset(line,
+                                                                  offset);
+
+    if (checkpoint->offset > pos->offset) {
+        pos->offset = checkpoint->offset;
+        pos->col_no = checkpoint->col_no;
+    }
+}
+
+/* Move pos forward to the last checkpoint before col_no
+ * on the same line */
+static void bp_seek_col(BufferPos *pos, size_t col_no)
+{
+    BufferPos line_start;
+    ColLine *line = bp_get_col_line(pos, &line_start, 0);
+
+    if (line == NULL) {
+        return;
+    }
+
+    bp_extend_col_line(line, pos, SIZE_MAX, col_no);
+    const ColCheckpoint *checkpoint = bp_checkpoint_before_col(line, col_no);
+
+    if (checkpoint->offset > pos->offset) {
+        pos->offset = checkpoint->offset;
+        pos->col_no = checkpoint->col_no;
+    }
+}
+
+/* Runs of plain ASCII text are skipped without decoding
+ * as each byte occupies a single column */
 static void calc_new_col(BufferPos *pos, size_t new_offset)
 {
     CharInfo char_info;
+    GBCursor cursor;
+    gb_cursor_init(&cursor, pos->data);
+    size_t run;
 
     while (pos->offset < new_offset) {
-        en_utf8_char_info(&char_info, CIP_SCREEN_LENGTH, 
-                          pos, pos->config);
+        run = gb_plain_run(pos->data, pos->offset, new_offset - pos->offset);
+        pos->col_no += run;
+        pos->offset += run;
+
+        if (pos->offset == new_offset) {
+            break;
+        }
+
+        en_utf8_cursor_char_info(&char_info, CIP_SCREEN_LENGTH, 
+                                 pos, &cursor, pos->config);
         pos->col_no += char_info.screen_length;
         pos->offset += char_info.byte_length;
     }
@@ -372,44 +708,22 @@ void bp_to_buffer_end(BufferPos *pos)
 
 void bp_advance_to_offset(BufferPos *pos, size_t offset)
 {
-    BufferPos tmp = *pos;
-    offset = MIN(offset, gb_length(pos->data));
-
-    while (tmp.offset < offset) {
-        *pos = tmp;
-
-        if (!bp_next_line(&tmp)) {
-            break;
-        }
-    }
-
-    if (tmp.offset == offset) {
-        pos->line_no = tmp.line_no;
-    }
-
-    pos->offset = offset;
-    bp_recalc_col(pos);
+    bp_to_offset(pos, offset);
 }
 
 void bp_reverse_to_offset(BufferPos *pos, size_t offset)
 {
-    BufferPos tmp = *pos;
-
-    bp_to_line_start(&tmp);
-
-    while (tmp.offset > offset) {
-        *pos = tmp;
-
-        if (!bp_prev_line(&tmp)) {
-            break;
-        }
-    }
+    bp_to_offset(pos, offset);
+}
 
-    if (tmp.offset <= offset) {
-        pos->line_no = tmp.line_no;
-    }
+/* The line index allows the line containing offset to be
+ * determined without scanning the text in between */
+static void bp_to_offset(BufferPos *pos, size_t offset)
+{
+    offset = MIN(offset, gb_length(pos->data));
 
     pos->offset = offset;
+    pos->line_no = gb_lines_before(pos->data, offset) + 1;
     bp_recalc_col(pos);
 }
 
@@ -418,10 +732,8 @@ void bp_advance_to_line(BufferPos *pos, size_t line_no)
     size_t lines = gb_lines(pos->data) + 1;
     line_no = CORRECT_LINE_NO(line_no, lines);
 
-    while (pos->line_no < line_no) {
-        if (!bp_next_line(pos)) {
-            break;
-        }
+    if (pos->line_no < line_no) {
+        bp_to_line(pos, line_no);
     }
 }
 
@@ -436,10 +748,8 @@ void bp_reverse_to_line(BufferPos *pos, size_t line_no, int end_of_line)
         line_no++;
     }
 
-    while (pos->line_no > line_no) {
-        if (!bp_prev_line(pos)) {
-            break;
-        }
+    if (pos->line_no > line_no) {
+        bp_to_line(pos, line_no);
     }
 
     if (end_of_line) {
@@ -448,12 +758,33 @@ void bp_reverse_to_line(BufferPos *pos, size_t line_no, int end_of_line)
     }
 }
 
+/* Move directly to the start of line_no using the line index */
+static void bp_to_line(BufferPos *pos, size_t line_no)
+{
+    pos->offset = gb_line_start(pos->data, line_no - 1);
+    pos->line_no = line_no;
+    pos->col_no = 1;
+}
+
 void bp_advance_to_col(BufferPos *pos, size_t col_no)
 {
     col_no = CORRECT_COL_NO(col_no);
 
+    if (col_no - MIN(col_no, pos->col_no) > BP_COL_CHECKPOINT_INTERVAL) {
+        bp_seek_col(pos, col_no);
+    }
+
+    size_t run;
+
     while (pos->col_no < col_no && !bp_at_line_end(pos)) {
-        bp_next_char(pos);
+        run = gb_plain_run(pos->data, pos->offset, col_no - pos->col_no);
+
+        if (run > 0) {
+            pos->col_no += run;
+            pos->offset += run;
+        } else {
+            bp_next_char(pos);
+        }
     }
 }
 
@@ -488,26 +819,10 @@ void bp_reverse_to_line_col(BufferPos *pos, size_t line_no, size_t col_no)
 
 BufferPos bp_init_from_offset(size_t offset, const BufferPos *known_pos)
 {
-    size_t buffer_len = gb_length(known_pos->data);
-    offset = MIN(offset, buffer_len);
     BufferPos pos = *known_pos;
 
-    NearestPos nearest_pos = bp_determine_nearest_pos(offset, 0,
-                                                      known_pos->offset,
-                                                      buffer_len);
-
-    if (nearest_pos == NP_BUFFER_END) {
-        bp_to_buffer_end(&pos);
-        bp_reverse_to_offset(&pos, offset);    
-    } else if (nearest_pos == NP_KNOWN_POS) {
-        if (known_pos->offset > offset) {
-            bp_reverse_to_offset(&pos, offset);    
-        } else if (known_pos->offset < offset) {
-            bp_advance_to_offset(&pos, offset);
-        }
-    } else {
-        bp_to_buffer_start(&pos);
-        bp_advance_to_offset(&pos, offset);
+    if (offset != known_pos->offset) {
+        bp_to_offset(&pos, offset);
     }
 
     return pos;
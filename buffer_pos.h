@@ -23,12 +23,50 @@
 #include "encoding.h"
 #include "hashmap.h"
 
+/* Columns are recorded at checkpoints this many bytes apart along
+ * long lines so that the column of a position can be calculated
+ * without scanning from the start of its line */
+#define BP_COL_CHECKPOINT_INTERVAL 4096
+/* Number of long lines checkpoints are kept for */
+#define BP_COL_CACHE_LINES 8
+
+/* The column at a character boundary */
+typedef struct {
+    size_t offset; /* Offset of character boundary */
+    size_t col_no; /* Column number at offset */
+} ColCheckpoint;
+
+/* Checkpoints along a single line */
+typedef struct {
+    size_t line_start; /* Offset of line start */
+    ColCheckpoint *checkpoints; /* Ordered by offset. The first checkpoint
+                                   is the line start and subsequent
+                                   checkpoints are at least
+                                   BP_COL_CHECKPOINT_INTERVAL bytes apart */
+    size_t checkpoint_num; /* Number of checkpoints, 0 if unused */
+    size_t allocated; /* Number of checkpoints allocated */
+    int line_end_known; /* True if line_end is set */
+    size_t line_end; /* Offset of line end */
+    size_t last_used; /* Used to replace the least recently used line */
+} ColLine;
+
+/* Sparse cache of the columns of positions on the long lines of a
+ * buffer. Edits invalidate the checkpoints at or after the offset
+ * changed, as only the text before a checkpoint determines its column */
+typedef struct {
+    ColLine lines[BP_COL_CACHE_LINES]; /* Cached lines */
+    size_t tab_width; /* Tab width the columns were calculated with */
+    size_t uses; /* Incremented each time a line is used */
+} ColumnCache;
+
 /* Represents position in buffer.
  * Each instance is specific to a buffer */
 struct BufferPos {
     const GapBuffer *data; /* Underlying gap buffer that stores text */
     const FileFormat *file_format; /* Reference to file format buffer uses */
-    const HashMap *config; /* Reference to buffers config */
+    const ConfigSnapshot *config; /* Reference to buffers config */
+    ColumnCache *col_cache; /* Reference to buffers column cache,
+                               can be NULL */
     size_t offset; /* Offset into text */
     size_t line_no; /* Corresponding line number for this offset */
     size_t col_no; /* Corresponding column number for this offset */
@@ -55,7 +93,10 @@ typedef struct {
 } Range;
 
 int bp_init(BufferPos *, const GapBuffer *, const FileFormat *,
-            const HashMap *config);
+            const ConfigSnapshot *config, ColumnCache *);
+void bp_init_col_cache(ColumnCache *);
+void bp_free_col_cache(ColumnCache *);
+void bp_invalidate_col_cache(ColumnCache *, size_t offset);
 Mark *bp_new_mark(BufferPos *, MarkProperties);
 void bp_free_mark(Mark *);
 char bp_get_char(const BufferPos *);
@@ -103,7 +103,8 @@ void bv_free(BufferView *bv)
 
 void bv_update_view(const Session *sess, Buffer *buffer)
 {
-    int line_wrap = cf_bool(buffer->config, CV_LINEWRAP);
+    int line_wrap = buffer->config_snapshot.linewrap;
+    size_t screen_start = buffer->bv->screen_start.offset;
     int scrolled;
 
     if (line_wrap) {
@@ -113,6 +114,10 @@ void bv_update_view(const Session *sess, Buffer *buffer)
         scrolled |= bv_horizontal_scroll(buffer);
     }
 
+    if (buffer->bv->screen_start.offset != screen_start) {
+        bf_marks_moved(buffer);
+    }
+
     if (bf_is_draw_dirty(buffer) || scrolled || buffer->bv->resized) {
         bv_populate_buffer_data(buffer);
         bv_populate_syntax_data(sess, buffer);
@@ -303,7 +308,7 @@ static SyntaxMatches *bv_get_syntax_matches(const Session *sess,
 {
     const SyntaxDefinition *syn_def = se_get_syntax_def(sess, buffer);
 
-    if (syn_def == NULL) {
+    if (syn_def == NULL || !bf_feature_enabled(buffer, LFF_SYNTAX)) {
         return NULL;
     }
 
@@ -334,22 +339,39 @@ static SyntaxMatches *bv_get_syntax_matches(const Session *sess,
                          bv->rows + SYNTAX_CACHE_LINES, 0);
 
     size_t syn_examine_length = syn_end.offset - syn_start.offset;
-    char *syn_examine_text = malloc(syn_examine_length + 1);
+    const char *syn_examine_text = "";
+    char *syn_examine_copy = NULL;
 
-    if (syn_examine_text == NULL) {
-        return NULL;
+    /* The text can be used in place unless it's split
+     * across more than one segment of the buffer */
+    if (gb_get_segment(buffer->data, syn_start.offset,
+                       &syn_examine_text) < syn_examine_length) {
+        syn_examine_copy = malloc(syn_examine_length + 1);
+
+        if (syn_examine_copy == NULL) {
+            return NULL;
+        }
+
+        syn_examine_length = gb_get_range(buffer->data, syn_start.offset, 
+                                          syn_examine_copy,
+                                          syn_examine_length);
+        syn_examine_copy[syn_examine_length] = '\0';
+        syn_examine_text = syn_examine_copy;
     }
 
-    syn_examine_length = gb_get_range(buffer->data, syn_start.offset, 
-                                      syn_examine_text, syn_examine_length);
-    syn_examine_text[syn_examine_length] = '\0';
+    struct timespec start;
+    get_monotonic_time(&start);
 
     SyntaxMatches *syn_matches = syn_def->generate_matches(syn_def,
                                                            syn_examine_text,
                                                            syn_examine_length,
                                                            syn_start.offset);
 
-    free(syn_examine_text);
+    free(syn_examine_copy);
+
+    /* Highlighting is turned off in large files where
+     * matching takes too long */
+    bf_within_budget(buffer, LFF_SYNTAX, elapsed_ms(&start));
 
     bv->change_state = bc_get_current_state(&buffer->changes);
 
@@ -418,7 +440,7 @@ static void bv_set_cell(Cell *cell, size_t offset, size_t col_no,
 static void bv_populate_buffer_data(const Buffer *buffer)
 {
     BufferView *bv = buffer->bv;
-    int line_wrap = cf_bool(buffer->config, CV_LINEWRAP);
+    int line_wrap = buffer->config_snapshot.linewrap;
     BufferPos draw_pos = bv->screen_start;
     size_t buffer_len = bf_length(buffer);
     size_t row = 0;
@@ -426,15 +448,26 @@ static void bv_populate_buffer_data(const Buffer *buffer)
 
     Line *line;
     Cell *cell;
+    /* Cell of the last character drawn, which zero width
+     * characters following it are added to */
+    Cell *base_cell = NULL;
+    Cell *prev_base_cell;
+    /* End of a run of plain ASCII text whose characters
+     * are drawn without being decoded */
+    size_t plain_end;
     CharInfo char_info;
+    GBCursor cursor;
+    gb_cursor_init(&cursor, buffer->data);
 
     bv_clear_view(bv);
 
     while (row < bv->rows && draw_pos.offset <= buffer_len) {
         line = &bv->lines[row];
+        plain_end = 0;
 
         if (bp_at_line_start(&draw_pos)) {
             line->line_no = draw_pos.line_no;
+            base_cell = NULL;
         }
 
         if (bv->horizontal_scroll > 0) {
@@ -449,12 +482,34 @@ static void bv_populate_buffer_data(const Buffer *buffer)
                !bp_at_line_end(&draw_pos)) {
             cell = &line->cells[col];
 
-            en_utf8_char_info(&char_info, CIP_SCREEN_LENGTH, &draw_pos,
-                              buffer->config);
+            if (draw_pos.offset >= plain_end) {
+                plain_end = draw_pos.offset +
+                            gb_plain_run(buffer->data, draw_pos.offset,
+                                         bv->cols - col);
+            }
+
+            if (draw_pos.offset < plain_end) {
+                char_info = (CharInfo) {
+                    .is_valid = 1,
+                    .byte_length = 1,
+                    .screen_length = 1,
+                    .is_printable = 1
+                };
+            } else {
+                en_utf8_cursor_char_info(&char_info, CIP_SCREEN_LENGTH,
+                                         &draw_pos, &cursor,
+                                         &buffer->config_snapshot);
+            }
+            prev_base_cell = base_cell;
+            base_cell = NULL;
 
             uchar character[CELL_TEXT_LENGTH] = { '\0' };
-            gb_get_range(draw_pos.data, draw_pos.offset, (char *)character,
-                         char_info.byte_length);
+
+            for (size_t k = 0; k < char_info.byte_length &&
+                               k < CELL_TEXT_LENGTH - 1; k++) {
+                character[k] = gb_cursor_getu_at(&cursor,
+                                                 draw_pos.offset + k);
+            }
 
             if (!char_info.is_valid) {
                 /* Unicode replacement character */
@@ -526,6 +581,19 @@ static void bv_populate_buffer_data(const Buffer *buffer)
                         }
                     }
                 }
+            } else if (char_info.screen_length == 0) {
+                /* Combining marks and other zero width characters are
+                 * drawn along with the character they follow */
+                if (prev_base_cell != NULL &&
+                    prev_base_cell->text_len + char_info.byte_length <
+                    CELL_TEXT_LENGTH) {
+                    memcpy(prev_base_cell->text + prev_base_cell->text_len,
+                           character, char_info.byte_length);
+                    prev_base_cell->text_len += char_info.byte_length;
+                    prev_base_cell->text[prev_base_cell->text_len] = '\0';
+                }
+
+                base_cell = prev_base_cell;
             } else {
                 size_t line_remaining = bv->cols - col;
 
@@ -570,6 +638,7 @@ static void bv_populate_buffer_data(const Buffer *buffer)
                     cell->offset = draw_pos.offset;
                     cell->col_no = draw_pos.col_no;
                     col += char_info.screen_length;
+                    base_cell = cell;
                 }
             }
 
@@ -733,7 +802,7 @@ static void bv_populate_selection_data(Buffer *buffer)
 
 static void bv_populate_colorcolumn_data(Buffer *buffer)
 {
-    const size_t color_column = cf_int(buffer->config, CV_COLORCOLUMN);
+    const size_t color_column = buffer->config_snapshot.colorcolumn;
 
     if (color_column == 0) {
         return;
@@ -856,7 +925,7 @@ size_t bv_screen_col_no(const Buffer *buffer, const BufferPos *pos)
     const BufferView *bv = buffer->bv;
     size_t col_no;
 
-    if (cf_bool(buffer->config, CV_LINEWRAP)) {
+    if (buffer->config_snapshot.linewrap) {
         col_no = ((pos->col_no - 1) % bv->cols) + 1;
     } else {
         col_no = pos->col_no;
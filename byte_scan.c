@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include "byte_scan.h"
+
+/* Vector kernels are only built for x86 with GCC compatible compilers
+ * as they rely on function target attributes to allow SSE2 and AVX2
+ * code to be compiled without changing the flags used for wed */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    size_t (*count)(const char *text, size_t length, char c);
+    size_t (*count_crlf)(const char *text, size_t length);
+    const char *(*find_rev)(const char *text, size_t length, char c);
+    const char *(*find_non_printable)(const char *text, size_t length);
+} BSKernel;
+
+static size_t bs_count_scalar(const char *text, size_t length, char c);
+static size_t bs_count_crlf_scalar(const char *text, size_t length);
+static const char *bs_find_rev_scalar(const char *text, size_t length,
+                                      char c);
+static const char *bs_find_non_printable_scalar(const char *text,
+                                                size_t length);
+static void bs_init(void);
+
+#if BS_X86
+static size_t bs_count_sse2(const char *text, size_t length, char c);
+static size_t bs_count_crlf_sse2(const char *text, size_t length);
+static const char *bs_find_rev_sse2(const char *text, size_t length, char c);
+static const char *bs_find_non_printable_sse2(const char *text,
+                                              size_t length);
+static size_t bs_count_avx2(const char *text, size_t length, char c);
+static size_t bs_count_crlf_avx2(const char *text, size_t length);
+static const char *bs_find_rev_avx2(const char *text, size_t length, char c);
+static const char *bs_find_non_printable_avx2(const char *text,
+                                              size_t length);
+#endif
+
+static const BSKernel bs_kernels[BSK_ENTRY_NUM] = {
+    [BSK_SCALAR] = {
+        bs_count_scalar, bs_count_crlf_scalar, bs_find_rev_scalar,
+        bs_find_non_printable_scalar
+    },
+#if BS_X86
+    [BSK_SSE2] = {
+        bs_count_sse2, bs_count_crlf_sse2, bs_find_rev_sse2,
+        bs_find_non_printable_sse2
+    },
+    [BSK_AVX2] = {
+        bs_count_avx2, bs_count_crlf_avx2, bs_find_rev_avx2,
+        bs_find_non_printable_avx2
+    },
+#endif
+};
+
+static const BSKernel *bs_kernel = NULL;
+static ByteScanKernel bs_kernel_type = BSK_SCALAR;
+
+/* Select the fastest kernel supported by the CPU */
+static void bs_init(void)
+{
+    for (ByteScanKernel kernel = BSK_ENTRY_NUM; kernel-- > 0;) {
+        if (bs_set_kernel(kernel)) {
+            return;
+        }
+    }
+}
+
+int bs_kernel_supported(ByteScanKernel kernel)
+{
+    switch (kernel) {
+        case BSK_SCALAR:
+            return 1;
+#if BS_X86
+        case BSK_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case BSK_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+ByteScanKernel bs_get_kernel(void)
+{
+    if (bs_kernel == NULL) {
+        bs_init();
+    }
+
+    return bs_kernel_type;
+}
+
+/* Override the kernel selected. Returns 0 if the
+ * kernel isn't supported on this CPU */
+int bs_set_kernel(ByteScanKernel kernel)
+{
+    if (kernel >= BSK_ENTRY_NUM || !bs_kernel_supported(kernel)) {
+        return 0;
+    }
+
+    bs_kernel = &bs_kernels[kernel];
+    bs_kernel_type = kernel;
+
+    return 1;
+}
+
+/* Count occurrences of c */
+size_t bs_count(const char *text, size_t length, char c)
+{
+    if (bs_kernel == NULL) {
+        bs_init();
+    }
+
+    return bs_kernel->count(text, length, c);
+}
+
+/* Count \n characters which are preceded by \r. Only
+ * pairs entirely within text are counted */
+size_t bs_count_crlf(const char *text, size_t length)
+{
+    if (bs_kernel == NULL) {
+        bs_init();
+    }
+
+    return bs_kernel->count_crlf(text, length);
+}
+
+/* Find the last occurrence of c */
+const char *bs_find_rev(const char *text, size_t length, char c)
+{
+    if (bs_kernel == NULL) {
+        bs_init();
+    }
+
+    return bs_kernel->find_rev(text, length, c);
+}
+
+/* Find the first byte which isn't a printable ASCII
+ * character i.e. outside the range 0x20 to 0x7E */
+const char *bs_find_non_printable(const char *text, size_t length)
+{
+    if (bs_kernel == NULL) {
+        bs_init();
+    }
+
+    return bs_kernel->find_non_printable(text, length);
+}
+
+static size_t bs_count_scalar(const char *text, size_t length, char c)
+{
+    const char *end = text + length;
+    size_t count = 0;
+
+    while (text < end && (text = memchr(text, c, end - text)) != NULL) {
+        count++;
+        text++;
+    }
+
+    return count;
+}
+
+static size_t bs_count_crlf_scalar(const char *text, size_t length)
+{
+    size_t count = 0;
+
+    for (size_t k = 1; k < length; k++) {
+        if (text[k] == '\n' && text[k - 1] == '\r') {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static const char *bs_find_rev_scalar(const char *text, size_t length,
+                                      char c)
+{
+    while (length-- > 0) {
+        if (text[length] == c) {
+            return text + length;
+        }
+    }
+
+    return NULL;
+}
+
+static const char *bs_find_non_printable_scalar(const char *text,
+                                                size_t length)
+{
+    unsigned char c;
+
+    for (size_t k = 0; k < length; k++) {
+        c = (unsigned char)text[k];
+
+        if (c < 0x20 || c > 0x7E) {
+            return text + k;
+        }
+    }
+
+    return NULL;
+}
+
+#if BS_X86
+
+/* Matches are accumulated in byte lanes by subtracting the comparison
+ * result (0 or -1). The lanes are summed using _mm_sad_epu8 before
+ * they can overflow i.e. at least every 255 iterations */
+__attribute__((target("sse2")))
+static size_t bs_count_sse2(const char *text, size_t length, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t k = 0;
+
+    while (length - k >= 16) {
+        size_t iterations = (length - k) / 16;
+        __m128i lanes = zero;
+
+        if (iterations > 255) {
+            iterations = 255;
+        }
+
+        for (; iterations > 0; iterations--, k += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(text + k));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(chunk, needle));
+        }
+
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += (size_t)_mm_cvtsi128_si32(sums) +
+                 (size_t)_mm_extract_epi16(sums, 4);
+    }
+
+    return count + bs_count_scalar(text + k, length - k, c);
+}
+
+__attribute__((target("sse2")))
+static size_t bs_count_crlf_sse2(const char *text, size_t length)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t k = 1;
+
+    /* Compare each byte with \n and the byte before it with \r */
+    for (; k + 16 <= length; k += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + k));
+        __m128i prev = _mm_loadu_si128((const __m128i *)(text + k - 1));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(chunk, lf),
+                                      _mm_cmpeq_epi8(prev, cr));
+        count += __builtin_popcount(_mm_movemask_epi8(match));
+    }
+
+    if (k >= length) {
+        return count;
+    }
+
+    return count + bs_count_crlf_scalar(text + k - 1, length - k + 1);
+}
+
+__attribute__((target("sse2")))
+static const char *bs_find_rev_sse2(const char *text, size_t length, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    unsigned int mask;
+
+    while (length >= 16) {
+        length -= 16;
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + length));
+        mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+        if (mask != 0) {
+            return text + length + 31 - __builtin_clz(mask);
+        }
+    }
+
+    return bs_find_rev_scalar(text, length, c);
+}
+
+/* Bytes are compared as signed values so those above 0x7F are
+ * negative and found by the same comparison as control characters */
+__attribute__((target("sse2")))
+static const char *bs_find_non_printable_sse2(const char *text,
+                                              size_t length)
+{
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    unsigned int mask;
+    size_t k = 0;
+
+    for (; k + 16 <= length; k += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + k));
+        mask = (unsigned int)_mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmplt_epi8(chunk, space),
+                                 _mm_cmpeq_epi8(chunk, del)));
+
+        if (mask != 0) {
+            return text + k + __builtin_ctz(mask);
+        }
+    }
+
+    return bs_find_non_printable_scalar(text + k, length - k);
+}
+
+__attribute__((target("avx2")))
+static size_t bs_count_avx2(const char *text, size_t length, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned long long sums[4];
+    size_t count = 0;
+    size_t k = 0;
+
+    while (length - k >= 32) {
+        size_t iterations = (length - k) / 32;
+        __m256i lanes = zero;
+
+        if (iterations > 255) {
+            iterations = 255;
+        }
+
+        for (; iterations > 0; iterations--, k += 32) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + k));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(chunk, needle));
+        }
+
+        _mm256_storeu_si256((__m256i *)sums, _mm256_sad_epu8(lanes, zero));
+        count += sums[0] + sums[1] + sums[2] + sums[3];
+    }
+
+    return count + bs_count_sse2(text + k, length - k, c);
+}
+
+__attribute__((target("avx2")))
+static size_t bs_count_crlf_avx2(const char *text, size_t length)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t k = 1;
+
+    for (; k + 32 <= length; k += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + k));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(text + k - 1));
+        __m256i match = _mm256_and_si256(_mm256_cmpeq_epi8(chunk, lf),
+                                         _mm256_cmpeq_epi8(prev, cr));
+        count += __builtin_popcount(
+                    (unsigned int)_mm256_movemask_epi8(match));
+    }
+
+    if (k >= length) {
+        return count;
+    }
+
+    return count + bs_count_crlf_sse2(text + k - 1, length - k + 1);
+}
+
+__attribute__((target("avx2")))
+static const char *bs_find_rev_avx2(const char *text, size_t length, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    unsigned int mask;
+
+    while (length >= 32) {
+        length -= 32;
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + length));
+        mask = (unsigned int)_mm256_movemask_epi8(
+                                _mm256_cmpeq_epi8(chunk, needle));
+
+        if (mask != 0) {
+            return text + length + 31 - __builtin_clz(mask);
+        }
+    }
+
+    return bs_find_rev_sse2(text, length, c);
+}
+
+__attribute__((target("avx2")))
+static const char *bs_find_non_printable_avx2(const char *text,
+                                              size_t length)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    unsigned int mask;
+    size_t k = 0;
+
+    for (; k + 32 <= length; k += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + k));
+        mask = (unsigned int)_mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpgt_epi8(space, chunk),
+                                    _mm256_cmpeq_epi8(chunk, del)));
+
+        if (mask != 0) {
+            return text + k + __builtin_ctz(mask);
+        }
+    }
+
+    return bs_find_non_printable_sse2(text + k, length - k);
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_BYTE_SCAN_H
+#define WED_BYTE_SCAN_H
+
+#include <stddef.h>
+
+/* Implementations of the scan functions below. The fastest
+ * kernel supported by the CPU is selected on first use */
+typedef enum {
+    BSK_SCALAR,
+    BSK_SSE2,
+    BSK_AVX2,
+    BSK_ENTRY_NUM
+} ByteScanKernel;
+
+size_t bs_count(const char *text, size_t length, char c);
+size_t bs_count_crlf(const char *text, size_t length);
+const char *bs_find_rev(const char *text, size_t length, char c);
+const char *bs_find_non_printable(const char *text, size_t length);
+ByteScanKernel bs_get_kernel(void);
+int bs_set_kernel(ByteScanKernel);
+int bs_kernel_supported(ByteScanKernel);
+
+#endif
@@ -93,6 +93,7 @@ static Status cm_buffer_join_lines(const CommandArgs *);
 static Status cm_buffer_indent(const CommandArgs *);
 static Status cm_buffer_save_file(const CommandArgs *);
 static Status cm_buffer_save_as(const CommandArgs *);
+static Status cm_save_buffer(Session *, int wait);
 static Status cm_save_file_prompt(Session *, char **file_path_ptr);
 static void cm_generate_find_prompt(const BufferSearch *,
                                     char prompt_text[MAX_CMD_PROMPT_LENGTH]);
@@ -137,6 +138,9 @@ static Status cm_buffer_filter(const CommandArgs *);
 static Status cm_buffer_read(const CommandArgs *);
 static Status cm_session_write(const CommandArgs *);
 static Status cm_session_exec(const CommandArgs *);
+static Status cm_buffer_meminfo(const CommandArgs *);
+static Status cm_buffer_cancel_load(const CommandArgs *);
+static Status cm_buffer_follow(const CommandArgs *);
 
 /* Allow the following to exceed 80 columns.
  * This format is easier to read and maipulate in visual block mode in vim */
@@ -194,6 +198,7 @@ static const CommandDefinition cm_commands[] = {
     [CMD_SESSION_CHANGE_BUFFER]          = { NULL    , cm_session_change_buffer         , CMDSIG_NO_ARGS                       , CMDT_CMD_INPUT,   NULL, NULL },
     [CMD_SUSPEND]                        = { NULL    , cm_suspend                       , CMDSIG_NO_ARGS                       , CMDT_SUSPEND,     NULL, NULL },
     [CMD_SESSION_END]                    = { NULL    , cm_session_end                   , CMDSIG_NO_ARGS                       , CMDT_EXIT,        NULL, NULL },
+    [CMD_BUFFER_CANCEL_LOAD]             = { NULL    , cm_buffer_cancel_load            , CMDSIG_NO_ARGS                       , CMDT_SESS_MOD,    NULL, NULL },
     /* Commands that by default are not mapped to key bindings and are instead exposed as functions */
     [CMD_SESSION_ECHO]                   = { "echo"  , cm_session_echo                  , CMDSIG_VAR_ARGS                      , CMDT_SESS_MOD,    "variable", "Displays arguments in the status bar" },
     [CMD_SESSION_MAP]                    = { "map"   , cm_session_map                   , CMDSIG(2, VAL_TYPE_STR, VAL_TYPE_STR), CMDT_SESS_MOD,    "string KEYS, string KEYS", "Maps a sequence of keys to another sequence of keys" },
@@ -202,7 +207,9 @@ static const CommandDefinition cm_commands[] = {
     [CMD_BUFFER_FILTER]                  = { "filter", cm_buffer_filter                 , CMDSIG(1, VAL_TYPE_SHELL_COMMAND)    , CMDT_BUFFER_MOD,  "shell command CMD", "Filter buffer through shell command" },
     [CMD_BUFFER_READ]                    = { "read"  , cm_buffer_read                   , CMDSIG(1, VAL_TYPE_STR | VAL_TYPE_SHELL_COMMAND), CMDT_BUFFER_MOD, "shell command CMD or string FILE", "Read command output or file content into buffer" },
     [CMD_BUFFER_WRITE]                   = { "write" , cm_session_write                 , CMDSIG(1, VAL_TYPE_STR | VAL_TYPE_SHELL_COMMAND), CMDT_SESS_MOD, "shell command CMD or string FILE", "Write buffer content to command or file" },
-    [CMD_SESSION_EXEC]                   = { "exec"  , cm_session_exec                  , CMDSIG(1, VAL_TYPE_SHELL_COMMAND), CMDT_SESS_MOD, "shell command CMD", "Run shell command" }
+    [CMD_SESSION_EXEC]                   = { "exec"  , cm_session_exec                  , CMDSIG(1, VAL_TYPE_SHELL_COMMAND), CMDT_SESS_MOD, "shell command CMD", "Run shell command" },
+    [CMD_BUFFER_MEMINFO]                 = { "meminfo", cm_buffer_meminfo               , CMDSIG_NO_ARGS                       , CMDT_SESS_MOD,    "none", "Display buffer text memory allocation statistics" },
+    [CMD_BUFFER_FOLLOW]                  = { "follow", cm_buffer_follow                 , CMDSIG_NO_ARGS                       , CMDT_SESS_MOD,    "none", "Toggle appending text added to the file to the buffer" }
 };
 
 static const OperationDefinition cm_operations[] = {
@@ -277,6 +284,7 @@ static const OperationDefinition cm_operations[] = {
     [OP_CHANGE_BUFFER] = { "<wed-change-buffer>", OM_NORMAL, CMD_NO_ARGS, 0, CMD_SESSION_CHANGE_BUFFER, "Change file" },
     [OP_SUSPEND] = { "<wed-suspend>", OM_NORMAL, CMD_NO_ARGS, 0, CMD_SUSPEND, "Suspend" },
     [OP_EXIT] = { "<wed-exit>", OM_NORMAL, CMD_NO_ARGS, 0, CMD_SESSION_END, "Exit" },
+    [OP_CANCEL_LOAD] = { "<wed-cancel-load>", OM_NORMAL, CMD_NO_ARGS, 0, CMD_BUFFER_CANCEL_LOAD, "Stop loading file" },
     [OP_TOGGLE_SEARCH_TYPE] = { "<wed-toggle-search-type>", OM_PROMPT, CMD_NO_ARGS, 0, CMD_BUFFER_TOGGLE_SEARCH_TYPE, "Toggle search type" },
     [OP_TOGGLE_SEARCH_CASE_SENSITIVITY] = { "<wed-toggle-search-case-sensitivity>", OM_PROMPT, CMD_NO_ARGS, 0, CMD_BUFFER_TOGGLE_SEARCH_CASE, "Toggle search case sensitivity" },
     [OP_TOGGLE_SEARCH_DIRECTION] = { "<wed-toggle-search-direction>", OM_PROMPT, CMD_NO_ARGS, 0, CMD_BUFFER_TOGGLE_SEARCH_DIRECTION, "Toggle search direction" },
@@ -364,6 +372,7 @@ static const KeyMapping cm_key_mappings[] = {
     { KMT_OPERATION, "<C-_>",         { OP_CHANGE_BUFFER                    } },
     { KMT_OPERATION, "<M-z>",         { OP_SUSPEND                          } },
     { KMT_OPERATION, "<Escape>",      { OP_EXIT                             } },
+    { KMT_OPERATION, "<C-k>",         { OP_CANCEL_LOAD                      } },
     { KMT_OPERATION, "<C-t>",         { OP_TOGGLE_SEARCH_TYPE               } },
     { KMT_OPERATION, "<C-s>",         { OP_TOGGLE_SEARCH_CASE_SENSITIVITY   } },
     { KMT_OPERATION, "<C-d>",         { OP_TOGGLE_SEARCH_DIRECTION          } },
@@ -1020,7 +1029,7 @@ static Status cm_buffer_undo(const CommandArgs *cmd_args)
     Session *sess = cmd_args->sess;
 
     Buffer *buffer = sess->active_buffer;
-    return bc_undo(&buffer->changes, buffer);
+    return bf_undo(buffer);
 }
 
 static Status cm_buffer_redo(const CommandArgs *cmd_args)
@@ -1078,59 +1087,34 @@ static Status cm_buffer_indent(const CommandArgs *cmd_args)
 
 static Status cm_buffer_save_file(const CommandArgs *cmd_args)
 {
-    Session *sess = cmd_args->sess;
+    return cm_save_buffer(cmd_args->sess, 0);
+}
 
+/* Saves the active buffer. Unless wait is true the buffer is written in
+ * the background and the session is notified when the save completes */
+static Status cm_save_buffer(Session *sess, int wait)
+{
     Buffer *buffer = sess->active_buffer;
-    Status status = STATUS_SUCCESS;
-    int file_path_exists = fi_has_file_path(&buffer->file_info);
-    int file_exists_on_disk = fi_file_exists(&buffer->file_info);
     char *file_path;
 
-    if (!file_path_exists) {
+    if (!fi_has_file_path(&buffer->file_info)) {
         RETURN_IF_FAIL(cm_save_file_prompt(sess, &file_path));
 
         if (pr_prompt_cancelled(sess->prompt)) {
             return STATUS_SUCCESS;
         }
-    } else if (file_exists_on_disk) {
-        file_path = buffer->file_info.abs_path;
-    } else {
-        file_path = buffer->file_info.rel_path;
-    }
 
-    status = bf_write_file(buffer, file_path);
-    
-    if (!STATUS_IS_SUCCESS(status)) {
-        if (!file_path_exists) {
-            free(file_path);
-        }
+        Status status = se_save_buffer(sess, buffer, file_path, wait);
+        free(file_path);
 
         return status;
-    }
-
-    if (!file_path_exists || !file_exists_on_disk) {
-        /* Now that file exists on disk, initalise FileInfo for it */
-        FileInfo tmp = buffer->file_info;
-        status = fi_init(&buffer->file_info, file_path);
-        fi_free(&tmp);
-
-        if (!file_path_exists) {
-            free(file_path);
-        }
-
-        RETURN_IF_FAIL(status);
-
-        se_determine_filetypes_if_unset(sess, buffer);
+    } else if (fi_file_exists(&buffer->file_info)) {
+        file_path = buffer->file_info.abs_path;
     } else {
-        fi_refresh_file_attributes(&buffer->file_info);
+        file_path = buffer->file_info.rel_path;
     }
 
-    char msg[MAX_MSG_SIZE];
-    snprintf(msg, MAX_MSG_SIZE, "Save successful: %zu lines, %zu bytes written",
-                                bf_lines(buffer), bf_length(buffer));
-    se_add_msg(sess, msg);
-
-    return status;
+    return se_save_buffer(sess, buffer, file_path, wait);
 }
 
 static Status cm_buffer_save_as(const CommandArgs *cmd_args)
@@ -1282,8 +1266,16 @@ static Status cm_prepare_search(Session *sess, const BufferPos *start_pos,
         strcmp(buffer->search.opt.pattern, pattern) != 0) {
         status = bs_reinit(&buffer->search, start_pos, pattern, pattern_len);
 
-        if (STATUS_IS_SUCCESS(status) && allow_find_all) {
-            status = bs_find_all(&buffer->search, &buffer->pos);
+        if (STATUS_IS_SUCCESS(status) && allow_find_all &&
+            bf_feature_enabled(buffer, LFF_SEARCH_HIGHLIGHT)) {
+            long budget = bf_feature_budget(buffer, LFF_SEARCH_HIGHLIGHT);
+            struct timespec start;
+            get_monotonic_time(&start);
+
+            status = bs_find_all(&buffer->search, &buffer->pos, budget);
+
+            bf_within_budget(buffer, LFF_SEARCH_HIGHLIGHT,
+                             elapsed_ms(&start));
         }
     }
 
@@ -1782,11 +1774,17 @@ static Status cm_session_save_all(const CommandArgs *cmd_args)
     int re_enable_msgs = se_disable_msgs(sess);
 
     while (buffer != NULL) {
+        status = se_finish_buffer_save(sess, buffer);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            break;
+        }
+
         if (bf_is_dirty(buffer)) {
             se_set_active_buffer(sess, buffer_index);
             sess->ui->update(sess->ui);
             
-            status = cm_buffer_save_file(cmd_args);
+            status = cm_save_buffer(sess, 1);
             
             if (!STATUS_IS_SUCCESS(status)) {
                 break;
@@ -1828,6 +1826,9 @@ static Status cm_session_close_buffer(const CommandArgs *cmd_args)
     CommandArgs close_args = *cmd_args;
     close_args.args[0] = INT_VAL(0);
 
+    /* A save in progress may leave the buffer unmodified */
+    RETURN_IF_FAIL(se_finish_buffer_save(sess, buffer));
+
     if (bf_is_dirty(buffer)) {
         char prompt_text[50];
         char *fmt = "Save changes to %.*s (Y/n)?";
@@ -1844,7 +1845,7 @@ static Status cm_session_close_buffer(const CommandArgs *cmd_args)
         } else if (response == QR_CANCEL) {
             return STATUS_SUCCESS;
         } else if (response == QR_YES) {
-            RETURN_IF_FAIL(cm_buffer_save_file(&close_args));
+            RETURN_IF_FAIL(cm_save_buffer(sess, 1));
         }
 
         if (pr_prompt_cancelled(sess->prompt)) {
@@ -2594,3 +2595,43 @@ static Status cm_session_exec(const CommandArgs *cmd_args)
     return status;
 }
 
+static Status cm_buffer_meminfo(const CommandArgs *cmd_args)
+{
+    Session *sess = cmd_args->sess;
+    Buffer *buffer = sess->active_buffer;
+    char msg[MAX_MSG_SIZE];
+
+    if (gb_get_storage(buffer->data) == GBS_PIECE_TABLE) {
+        se_add_msg(sess, "Text stored in piece table");
+    } else {
+        GBAllocStats stats;
+        gb_get_alloc_stats(buffer->data, &stats);
+
+        snprintf(msg, MAX_MSG_SIZE, "Text memory: %zu bytes allocated for "
+                 "%zu bytes, %zu grows, %zu shrinks%s", stats.allocated,
+                 bf_length(buffer), stats.grows, stats.shrinks,
+                 stats.huge_pages ? ", huge pages" : "");
+        se_add_msg(sess, msg);
+    }
+
+    UndoMemoryStats undo_stats;
+    bc_get_memory_stats(&buffer->changes, &undo_stats);
+
+    snprintf(msg, MAX_MSG_SIZE, "Undo memory: %zu changes, %zu bytes "
+             "in memory, %zu compressed, %zu bytes spilled to disk",
+             undo_stats.changes, undo_stats.memory, undo_stats.compressed,
+             undo_stats.spilled);
+    se_add_msg(sess, msg);
+
+    return STATUS_SUCCESS;
+}
+
+static Status cm_buffer_cancel_load(const CommandArgs *cmd_args)
+{
+    return se_cancel_buffer_load(cmd_args->sess);
+}
+
+static Status cm_buffer_follow(const CommandArgs *cmd_args)
+{
+    return se_toggle_buffer_follow(cmd_args->sess);
+}
@@ -96,7 +96,10 @@ typedef enum {
     CMD_BUFFER_FILTER,
     CMD_BUFFER_READ,
     CMD_BUFFER_WRITE,
-    CMD_SESSION_EXEC
+    CMD_SESSION_EXEC,
+    CMD_BUFFER_MEMINFO,
+    CMD_BUFFER_CANCEL_LOAD,
+    CMD_BUFFER_FOLLOW
 } Command;
 
 /* Operations are instances of commands i.e. they define a command with
@@ -173,6 +176,7 @@ typedef enum {
     OP_CHANGE_BUFFER,
     OP_SUSPEND,
     OP_EXIT,
+    OP_CANCEL_LOAD,
     OP_TOGGLE_SEARCH_TYPE,
     OP_TOGGLE_SEARCH_CASE_SENSITIVITY,
     OP_TOGGLE_SEARCH_DIRECTION,
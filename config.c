@@ -59,6 +59,20 @@ static Status cf_fileformat_validator(ConfigEntity, Value);
 static Status cf_fileformat_on_change_event(ConfigEntity, Value, Value);
 static Status cf_sdt_validator(ConfigEntity, Value);
 static Status cf_colorcolumn_validator(ConfigEntity, Value);
+static Status cf_textstore_validator(ConfigEntity, Value);
+static Status cf_textstore_on_change_event(ConfigEntity, Value, Value);
+static Status cf_gapgrowth_validator(ConfigEntity, Value);
+static Status cf_gapshrink_validator(ConfigEntity, Value);
+static Status cf_hugepagemin_validator(ConfigEntity, Value);
+static Status cf_alloc_policy_on_change_event(ConfigEntity, Value, Value);
+static Status cf_savedurability_validator(ConfigEntity, Value);
+static Status cf_progressiveload_validator(ConfigEntity, Value);
+static Status cf_largefile_validator(ConfigEntity, Value);
+static Status cf_budget_validator(ConfigEntity, Value);
+static Status cf_syntaxbudget_on_change_event(ConfigEntity, Value, Value);
+static Status cf_searchbudget_on_change_event(ConfigEntity, Value, Value);
+static Status cf_bracketbudget_on_change_event(ConfigEntity, Value, Value);
+static Status cf_undobudget_on_change_event(ConfigEntity, Value, Value);
 
 static const ConfigVariableDescriptor cf_default_config[CV_ENTRY_NUM] = {
     [CV_LINEWRAP] = { "linewrap" , "lw" , CL_SESSION | CL_BUFFER, BOOL_VAL_STRUCT(1) , NULL , NULL, "Enables/Disables line wrap" },
@@ -74,7 +88,25 @@ static const ConfigVariableDescriptor cf_default_config[CV_ENTRY_NUM] = {
     [CV_SHDATADIR] = { "shdatadir", "shdd", CL_SESSION, STR_VAL_STRUCT(""), NULL, NULL, "Directory path containing language definition files" },
     [CV_FILETYPE] = { "filetype" , "ft" , CL_BUFFER , STR_VAL_STRUCT("") , cf_filetype_validator , cf_filetype_on_change_event, "Sets the type of the current file" },
     [CV_SYNTAXTYPE] = { "syntaxtype", "st" , CL_BUFFER , STR_VAL_STRUCT("") , cf_syntaxtype_validator, cf_syntaxtype_on_change_event, "Set the syntax definition to use for highlighting" },
-    [CV_FILEFORMAT] = { "fileformat", "ff" , CL_BUFFER , STR_VAL_STRUCT("unix") , cf_fileformat_validator, cf_fileformat_on_change_event, "Sets line endings used by file" }
+    [CV_FILEFORMAT] = { "fileformat", "ff" , CL_BUFFER , STR_VAL_STRUCT("unix") , cf_fileformat_validator, cf_fileformat_on_change_event, "Sets line endings used by file" },
+    [CV_TEXTSTORE] = { "textstore", "ts" , CL_SESSION | CL_BUFFER, STR_VAL_STRUCT("gap"), cf_textstore_validator, cf_textstore_on_change_event, "Sets how buffer text is stored in memory" },
+    [CV_GAPGROWTH] = { "gapgrowth", "gg" , CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(GB_DEFAULT_GROWTH), cf_gapgrowth_validator, cf_alloc_policy_on_change_event, "Sets the gap size after growing as a percentage of buffer size" },
+    [CV_GAPSHRINK] = { "gapshrink", "gs" , CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(GB_DEFAULT_SHRINK), cf_gapshrink_validator, cf_alloc_policy_on_change_event, "Sets how many times larger than the growth size the gap must be before memory is released" },
+    [CV_HUGEPAGEMIN] = { "hugepagemin", "hpm", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(0), cf_hugepagemin_validator, cf_alloc_policy_on_change_event, "Sets buffer size in MB from which huge pages are used (0 disables)" },
+    [CV_SAVEDURABILITY] = { "savedurability", "sd", CL_SESSION | CL_BUFFER, STR_VAL_STRUCT("file"), cf_savedurability_validator, NULL, "Sets how saved files are synced to disk" },
+    [CV_PROGRESSIVELOAD] = { "progressiveload", "pl", CL_SESSION, INT_VAL_STRUCT(CFG_PROGRESSIVELOAD_DEFAULT), cf_progressiveload_validator, NULL, "Sets file size in MB from which files are loaded in the background (0 disables)" },
+    [CV_INCREMENTALSAVE] = { "incrementalsave", "is", CL_SESSION | CL_BUFFER, BOOL_VAL_STRUCT(1), NULL, NULL, "Enables/Disables only writing changed text when saving" },
+    [CV_JOURNAL] = { "journal", "jn", CL_SESSION, BOOL_VAL_STRUCT(1), NULL, NULL, "Enables/Disables journaling edits so they can be recovered after a crash" },
+    [CV_LARGEFILE] = { "largefile", "lf", CL_SESSION, INT_VAL_STRUCT(CFG_LARGEFILE_DEFAULT), cf_largefile_validator, NULL, "Sets file size in MB from which costly features are limited by their budgets (0 disables)" },
+    [CV_LARGEFILELINES] = { "largefilelines", "lfl", CL_SESSION, INT_VAL_STRUCT(CFG_LARGEFILELINES_DEFAULT), cf_largefile_validator, NULL, "Sets line count from which costly features are limited by their budgets (0 disables)" },
+    [CV_SYNTAXBUDGET] = { "syntaxbudget", "syb", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(50), cf_budget_validator, cf_syntaxbudget_on_change_event, "Sets milliseconds syntax matching can take in large files before highlighting is disabled (0 for no limit)" },
+    [CV_SEARCHBUDGET] = { "searchbudget", "seb", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(100), cf_budget_validator, cf_searchbudget_on_change_event, "Sets milliseconds finding all search matches can take in large files before highlighting matches is disabled (0 for no limit)" },
+    [CV_BRACKETBUDGET] = { "bracketbudget", "brb", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(1024), cf_budget_validator, cf_bracketbudget_on_change_event, "Sets KB scanned for a matching bracket in large files (0 for no limit)" },
+    [CV_UNDOBUDGET] = { "undobudget", "ub", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(4096), cf_budget_validator, cf_undobudget_on_change_event, "Sets KB of text deleted in one change that is kept in memory for undo in large files, larger deletions are spilled to disk (0 for no limit)" },
+    [CV_UNDOMEMORY] = { "undomemory", "um", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(64), cf_budget_validator, NULL, "Sets MB of memory undo history can use before older changes are compressed and spilled to disk (0 for no limit)" },
+    [CV_UNDOSESSIONMEMORY] = { "undosessionmemory", "usm", CL_SESSION, INT_VAL_STRUCT(256), cf_budget_validator, NULL, "Sets MB of memory undo history can use across all buffers (0 for no limit)" },
+    [CV_UNDOLIMIT] = { "undolimit", "ul", CL_SESSION | CL_BUFFER, INT_VAL_STRUCT(0), cf_budget_validator, NULL, "Sets MB of text, in memory and on disk, undo history can hold before the oldest changes are dropped (0 for no limit)" },
+    [CV_UNDOFILE] = { "undofile", "uf", CL_SESSION, BOOL_VAL_STRUCT(0), NULL, NULL, "Enables/Disables saving undo history so changes can be undone after a file is reopened" }
 };
 
 static const size_t cf_var_num = ARRAY_SIZE(cf_default_config,
@@ -119,6 +151,8 @@ Status cf_init_session_config(Session *sess)
     if (!cf_populate_config(NULL, config, CL_SESSION)) {
         return OUT_OF_MEMORY("Unable to load config");
     }
+
+    cf_snapshot_config(config, CL_SESSION, &sess->config_snapshot);
     
     se_add_error(sess, cf_load_config_if_exists(sess, CFG_SYSTEM_DIR,
                                                 "/" CFG_FILE_NAME));
@@ -224,6 +258,31 @@ int cf_populate_config(const HashMap *src_config, HashMap *dst_config,
     return 1;
 }
 
+/* Copy the variables read on hot paths into typed fields.
+ * Session only variables are copied at the CL_SESSION level */
+void cf_snapshot_config(const HashMap *config, ConfigLevel config_level,
+                        ConfigSnapshot *snapshot)
+{
+    snapshot->linewrap = cf_bool(config, CV_LINEWRAP);
+    snapshot->lineno = cf_bool(config, CV_LINENO);
+    snapshot->tabwidth = cf_int(config, CV_TABWIDTH);
+    snapshot->expandtab = cf_bool(config, CV_EXPANDTAB);
+    snapshot->autoindent = cf_bool(config, CV_AUTOINDENT);
+    snapshot->colorcolumn = cf_int(config, CV_COLORCOLUMN);
+    snapshot->syntaxbudget = cf_int(config, CV_SYNTAXBUDGET);
+    snapshot->searchbudget = cf_int(config, CV_SEARCHBUDGET);
+    snapshot->bracketbudget = cf_int(config, CV_BRACKETBUDGET);
+    snapshot->undobudget = cf_int(config, CV_UNDOBUDGET);
+    snapshot->undomemory = cf_int(config, CV_UNDOMEMORY);
+    snapshot->undolimit = cf_int(config, CV_UNDOLIMIT);
+
+    if (config_level == CL_SESSION) {
+        snapshot->largefile = cf_int(config, CV_LARGEFILE);
+        snapshot->largefilelines = cf_int(config, CV_LARGEFILELINES);
+        snapshot->undosessionmemory = cf_int(config, CV_UNDOSESSIONMEMORY);
+    }
+}
+
 static const char *cf_get_config_type_string(ConfigType config_type)
 {
     static const char *config_types[] = {
@@ -370,6 +429,15 @@ Status cf_set_var(ConfigEntity entity, ConfigLevel config_level,
     Value old_value = var->default_value;
     RETURN_IF_FAIL(va_deep_copy_value(value, &var->default_value));
 
+    /* Update the snapshot before any handler can read it */
+    if (config_level & CL_SESSION) {
+        cf_snapshot_config(entity.sess->config, CL_SESSION,
+                           &entity.sess->config_snapshot);
+    } else {
+        cf_snapshot_config(entity.buffer->config, CL_BUFFER,
+                           &entity.buffer->config_snapshot);
+    }
+
     Status status = STATUS_SUCCESS;
 
     if (var->on_change_event != NULL) {
@@ -694,3 +762,192 @@ static Status cf_colorcolumn_validator(ConfigEntity entity, Value value)
     return STATUS_SUCCESS;
 }
 
+static Status cf_textstore_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+    GapBufferStorage storage;
+
+    if (!bf_determine_textstore(SVAL(value), &storage)) {
+        return st_get_error(ERR_INVALID_TEXTSTORE,
+                            "Invalid text store \"%s\"",
+                            SVAL(value));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_gapgrowth_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < 0 || IVAL(value) > CFG_GAPGROWTH_MAX) {
+        return st_get_error(ERR_INVALID_GAPGROWTH,
+                            "gapgrowth value must be in range 0 - %d inclusive",
+                            CFG_GAPGROWTH_MAX);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_gapshrink_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < CFG_GAPSHRINK_MIN || IVAL(value) > CFG_GAPSHRINK_MAX) {
+        return st_get_error(ERR_INVALID_GAPSHRINK,
+                            "gapshrink value must be in range %d - %d inclusive",
+                            CFG_GAPSHRINK_MIN, CFG_GAPSHRINK_MAX);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_hugepagemin_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < 0) {
+        return st_get_error(ERR_INVALID_HUGEPAGEMIN,
+                            "hugepagemin must be greater than or equal to 0");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_savedurability_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+    WriteDurability durability;
+
+    if (!fw_determine_durability(SVAL(value), &durability)) {
+        return st_get_error(ERR_INVALID_SAVEDURABILITY,
+                            "Invalid save durability \"%s\"",
+                            SVAL(value));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_progressiveload_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < 0) {
+        return st_get_error(ERR_INVALID_PROGRESSIVELOAD,
+                            "progressiveload must be greater than or equal to 0");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_largefile_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < 0) {
+        return st_get_error(ERR_INVALID_LARGEFILE,
+                            "Large file thresholds must be greater than "
+                            "or equal to 0");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_budget_validator(ConfigEntity entity, Value value)
+{
+    (void)entity;
+
+    if (IVAL(value) < 0) {
+        return st_get_error(ERR_INVALID_BUDGET,
+                            "Budgets must be greater than or equal to 0");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Changing a budget for a buffer re-enables the feature it
+ * applies to, allowing features to be restored individually */
+static Status cf_syntaxbudget_on_change_event(ConfigEntity entity,
+                                              Value old_val, Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    if (entity.buffer != NULL) {
+        bf_restore_feature(entity.buffer, LFF_SYNTAX);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_searchbudget_on_change_event(ConfigEntity entity,
+                                              Value old_val, Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    if (entity.buffer != NULL) {
+        bf_restore_feature(entity.buffer, LFF_SEARCH_HIGHLIGHT);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_bracketbudget_on_change_event(ConfigEntity entity,
+                                               Value old_val, Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    if (entity.buffer != NULL) {
+        bf_restore_feature(entity.buffer, LFF_BRACKET_MATCH);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_undobudget_on_change_event(ConfigEntity entity,
+                                            Value old_val, Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    if (entity.buffer != NULL) {
+        bf_restore_feature(entity.buffer, LFF_UNDO);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_alloc_policy_on_change_event(ConfigEntity entity,
+                                              Value old_val, Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    if (entity.buffer != NULL) {
+        bf_set_alloc_policy(entity.buffer);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status cf_textstore_on_change_event(ConfigEntity entity, Value old_val,
+                                           Value new_val)
+{
+    (void)old_val;
+    (void)new_val;
+
+    Buffer *buffer = entity.buffer;
+
+    if (buffer == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    /* Use the buffer level value so that setting the session
+     * level value doesn't convert the active buffer */
+    GapBufferStorage storage;
+    bf_determine_textstore(cf_string(buffer->config, CV_TEXTSTORE), &storage);
+
+    return bf_set_textstore(buffer, storage);
+}
@@ -33,6 +33,12 @@
 
 #define CFG_TABWIDTH_MIN 1
 #define CFG_TABWIDTH_MAX 8
+#define CFG_GAPGROWTH_MAX 1000
+#define CFG_GAPSHRINK_MIN 2
+#define CFG_GAPSHRINK_MAX 100
+#define CFG_PROGRESSIVELOAD_DEFAULT 64
+#define CFG_LARGEFILE_DEFAULT 32
+#define CFG_LARGEFILELINES_DEFAULT 1000000
 
 /* Some variables apply at the session and buffer levels
  * e.g. ln=0; in ~/.wedrc turns off line numbers for all buffers.
@@ -70,6 +76,24 @@ typedef enum {
     CV_FILETYPE,
     CV_SYNTAXTYPE,
     CV_FILEFORMAT,
+    CV_TEXTSTORE,
+    CV_GAPGROWTH,
+    CV_GAPSHRINK,
+    CV_HUGEPAGEMIN,
+    CV_SAVEDURABILITY,
+    CV_PROGRESSIVELOAD,
+    CV_INCREMENTALSAVE,
+    CV_JOURNAL,
+    CV_LARGEFILE,
+    CV_LARGEFILELINES,
+    CV_SYNTAXBUDGET,
+    CV_SEARCHBUDGET,
+    CV_BRACKETBUDGET,
+    CV_UNDOBUDGET,
+    CV_UNDOMEMORY,
+    CV_UNDOSESSIONMEMORY,
+    CV_UNDOLIMIT,
+    CV_UNDOFILE,
     CV_ENTRY_NUM
 } ConfigVariable;
 
@@ -103,6 +127,8 @@ ConfigLevel cf_get_config_levels(ConfigVariable);
 Status cf_init_session_config(Session *);
 int cf_populate_config(const HashMap *src_config, HashMap *dst_config,
                        ConfigLevel);
+void cf_snapshot_config(const HashMap *config, ConfigLevel,
+                        ConfigSnapshot *);
 void cf_load_config_def(Session *, ConfigType, const char *config_name);
 void cf_free_config(HashMap *config);
 Status cf_load_config(Session *, const char *config_file_path);
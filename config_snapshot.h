@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_CONFIG_SNAPSHOT_H
+#define WED_CONFIG_SNAPSHOT_H
+
+#include <stddef.h>
+
+/* Typed copies of config variables which are read on hot paths, such
+ * as per character or per draw. A Session and each Buffer have a
+ * snapshot which cf_set_var refreshes whenever a variable changes, so
+ * these values can be read directly rather than looked up by name */
+typedef struct {
+    int linewrap; /* CV_LINEWRAP */
+    int lineno; /* CV_LINENO */
+    size_t tabwidth; /* CV_TABWIDTH */
+    int expandtab; /* CV_EXPANDTAB */
+    int autoindent; /* CV_AUTOINDENT */
+    size_t colorcolumn; /* CV_COLORCOLUMN */
+    long syntaxbudget; /* CV_SYNTAXBUDGET */
+    long searchbudget; /* CV_SEARCHBUDGET */
+    long bracketbudget; /* CV_BRACKETBUDGET */
+    long undobudget; /* CV_UNDOBUDGET */
+    size_t undomemory; /* CV_UNDOMEMORY */
+    size_t undolimit; /* CV_UNDOLIMIT */
+    /* Session level only */
+    size_t largefile; /* CV_LARGEFILE */
+    size_t largefilelines; /* CV_LARGEFILELINES */
+    size_t undosessionmemory; /* CV_UNDOSESSIONMEMORY */
+} ConfigSnapshot;
+
+#endif
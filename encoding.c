@@ -19,36 +19,48 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
-#include <wchar.h>
 #include <ctype.h>
 #include "shared.h"
 #include "buffer.h"
-#include "config.h"
 #include "gap_buffer.h"
+#include "unicode.h"
 #include "util.h"
 
 static void en_ascii_char_info(CharInfo *, CharInfoProperties,
-                               const BufferPos *, const HashMap *config,
-                               uchar c);
-static int en_utf8_is_valid_character(const BufferPos *,
+                               const BufferPos *, GBCursor *,
+                               const ConfigSnapshot *config, uchar c);
+static int en_utf8_is_valid_character(const BufferPos *, GBCursor *,
                                       size_t *char_byte_length);
 static uint en_utf8_code_point(const uchar *character, uint byte_length);
+static int en_utf8_follows_zwj(const BufferPos *, GBCursor *);
 
 void en_utf8_char_info(CharInfo *char_info, CharInfoProperties cip, 
-                      const BufferPos *pos, const HashMap *config)
+                      const BufferPos *pos, const ConfigSnapshot *config)
+{
+    GBCursor cursor;
+    gb_cursor_init(&cursor, pos->data);
+    en_utf8_cursor_char_info(char_info, cip, pos, &cursor, config);
+}
+
+/* Same as en_utf8_char_info but reads the buffer through cursor. Callers
+ * examining many characters in sequence should reuse a cursor across
+ * calls so that buffer text isn't located again for each byte */
+void en_utf8_cursor_char_info(CharInfo *char_info, CharInfoProperties cip,
+                              const BufferPos *pos, GBCursor *cursor,
+                              const ConfigSnapshot *config)
 {
     memset(char_info, 0, sizeof(CharInfo));
-    uchar c = gb_getu_at(pos->data, pos->offset);
+    uchar c = gb_cursor_getu_at(cursor, pos->offset);
 
     if (c < 128) {
         /* More efficient processing of ASCII characters. Somewhat 
          * Anglocentric but it speeds up traversing very
          * long lines i.e. single 10MB+ lines */
-        en_ascii_char_info(char_info, cip, pos, config, c);
+        en_ascii_char_info(char_info, cip, pos, cursor, config, c);
         return;
     }
 
-    if (en_utf8_is_valid_character(pos, &char_info->byte_length)) {
+    if (en_utf8_is_valid_character(pos, cursor, &char_info->byte_length)) {
         char_info->is_valid = 1;
     } else {
         char_info->byte_length = 1;
@@ -56,8 +68,8 @@ void en_utf8_char_info(CharInfo *char_info, CharInfoProperties cip,
         /* Determine length of invalid character */
         while (((pos->offset + char_info->byte_length) < gb_length(pos->data))
                 && 
-                ((uchar)gb_get_at(pos->data,
-                                  pos->offset + char_info->byte_length)
+                (gb_cursor_getu_at(cursor,
+                                   pos->offset + char_info->byte_length)
                         & 0xC0) == 0x80) {
             char_info->byte_length++;
         }
@@ -73,23 +85,28 @@ void en_utf8_char_info(CharInfo *char_info, CharInfoProperties cip,
         } else {
             uchar ch[4] = { '\0' };
             assert(char_info->byte_length <= ARRAY_SIZE(ch, uchar));
-            gb_get_range(pos->data, pos->offset, (char *)ch,
-                         char_info->byte_length);
-            uint code_point = en_utf8_code_point(ch, char_info->byte_length);    
-            int screen_length = wcwidth(code_point);
-
-            if (screen_length < 0) {
-                char_info->screen_length = 1;
-            } else {
-                char_info->screen_length = screen_length;
+
+            for (size_t k = 0; k < char_info->byte_length; k++) {
+                ch[k] = gb_cursor_getu_at(cursor, pos->offset + k);
+            }
+
+            uint code_point = en_utf8_code_point(ch, char_info->byte_length);
+            uchar properties = uc_properties(code_point);
+            char_info->screen_length = UC_WIDTH(properties);
+
+            /* A pictograph joined to the previous one by a zero width
+             * joiner is drawn as part of a single emoji */
+            if ((properties & UC_EXTENDED_PICTOGRAPHIC) &&
+                en_utf8_follows_zwj(pos, cursor)) {
+                char_info->screen_length = 0;
             }
         }
     }
 }
 
 static void en_ascii_char_info(CharInfo *char_info, CharInfoProperties cip,
-                               const BufferPos *pos, const HashMap *config,
-                               uchar c)
+                               const BufferPos *pos, GBCursor *cursor,
+                               const ConfigSnapshot *config, uchar c)
 {
     assert(c < 128);
 
@@ -103,10 +120,10 @@ static void en_ascii_char_info(CharInfo *char_info, CharInfoProperties cip,
             char_info->screen_length = 0;
         } else if (c == '\r' &&
                    *pos->file_format == FF_WINDOWS &&
-                   gb_get_at(pos->data, pos->offset + 1) == '\n') {
+                   gb_cursor_get_at(cursor, pos->offset + 1) == '\n') {
             char_info->screen_length = 0;
         } else if (c == '\t') {
-            size_t tabwidth = cf_int(config, CV_TABWIDTH);
+            size_t tabwidth = config->tabwidth;
             char_info->screen_length =
                 tabwidth - ((pos->col_no - 1) % tabwidth);
         } else if (c < 32 || c == 127) {
@@ -119,9 +136,10 @@ static void en_ascii_char_info(CharInfo *char_info, CharInfoProperties cip,
 }
 
 static int en_utf8_is_valid_character(const BufferPos *pos,
+                                      GBCursor *cursor,
                                       size_t *char_byte_length)
 {
-    uchar byte = gb_get_at(pos->data, pos->offset);
+    uchar byte = gb_cursor_getu_at(cursor, pos->offset);
     size_t byte_space_left = gb_length(pos->data) - pos->offset;
     *char_byte_length = 0;
 
@@ -138,7 +156,7 @@ static int en_utf8_is_valid_character(const BufferPos *pos,
             return 0;
         }
 
-        uchar byte2 = gb_get_at(pos->data, pos->offset + 1);
+        uchar byte2 = gb_cursor_getu_at(cursor, pos->offset + 1);
 
         if (byte == 0xE0 && byte2 < 0xA0) {
             return 0;
@@ -150,7 +168,7 @@ static int en_utf8_is_valid_character(const BufferPos *pos,
             return 0;
         }
 
-        uchar byte2 = gb_get_at(pos->data, pos->offset + 1);
+        uchar byte2 = gb_cursor_getu_at(cursor, pos->offset + 1);
 
         if ((byte == 0xF0 && byte2 < 0x90) ||
             (byte == 0xF4 && byte2 >= 0x90)) {
@@ -165,7 +183,7 @@ static int en_utf8_is_valid_character(const BufferPos *pos,
     }
 
     for (uint k = 1; k < *char_byte_length; k++) {
-        if (((uchar)gb_get_at(pos->data, pos->offset + k) & 0xC0) != 0x80) {
+        if ((gb_cursor_getu_at(cursor, pos->offset + k) & 0xC0) != 0x80) {
             return 0;
         }
     }
@@ -196,36 +214,39 @@ static uint en_utf8_code_point(const uchar *character, uint byte_length)
    return 0;
 }
 
-/* TODO need to handle combining characters */
-/*static int utf8_is_combining_char(uint code_point)
+static int en_utf8_follows_zwj(const BufferPos *pos, GBCursor *cursor)
 {
-    if (code_point < combining[0]) {
+    /* U+200D ZERO WIDTH JOINER */
+    static const uchar zwj[] = { 0xE2, 0x80, 0x8D };
+    size_t zwj_length = ARRAY_SIZE(zwj, uchar);
+
+    if (pos->offset < zwj_length) {
         return 0;
     }
 
-    int start = 0;
-    int end = (sizeof(combining) / sizeof(uint)) - 1;
-    int mid;
-
-    while (start <= end) {
-        mid = (start + end) / 2;  
-
-        if (combining[mid] < code_point) {
-            start = mid + 1;
-        } else if (combining[mid] > code_point) {
-            end = mid - 1; 
-        } else {
-            return 1;
+    for (size_t k = 0; k < zwj_length; k++) {
+        if (gb_cursor_getu_at(cursor, pos->offset - zwj_length + k) !=
+            zwj[k]) {
+            return 0;
         }
     }
 
-    return 0;
-}*/
+    return 1;
+}
 
 /* Determines how many bytes back we must go to get to the previous character.
  * This function does not attempt to detect invalid byte sequences,
  * see bp_prev_char in buffer_pos.c for usage of this function */
 size_t en_utf8_previous_char_offset(const BufferPos *pos)
+{
+    GBCursor cursor;
+    gb_cursor_init(&cursor, pos->data);
+
+    return en_utf8_cursor_previous_char_offset(pos, &cursor);
+}
+
+size_t en_utf8_cursor_previous_char_offset(const BufferPos *pos,
+                                           GBCursor *cursor)
 {
     if (pos->offset == 0) {
         return 0;
@@ -236,7 +257,7 @@ size_t en_utf8_previous_char_offset(const BufferPos *pos)
     do {
         offset--;
     } while (offset > 0 &&
-             ((uchar)gb_get_at(pos->data, offset) & 0xC0) == 0x80);
+             (gb_cursor_getu_at(cursor, offset) & 0xC0) == 0x80);
 
     return pos->offset - offset;
 }
@@ -22,9 +22,10 @@
 #include <stddef.h>
 #include <assert.h>
 #include "shared.h"
-#include "hashmap.h"
+#include "config_snapshot.h"
 
 struct BufferPos;
+struct GBCursor;
 
 /* Line endings supported by wed */
 /* There are currently no plans to support the old mac line endings. Use
@@ -51,7 +52,13 @@ typedef struct {
 } CharInfo;
 
 void en_utf8_char_info(CharInfo *, CharInfoProperties,
-                       const struct BufferPos *, const HashMap *config);
+                       const struct BufferPos *,
+                       const ConfigSnapshot *config);
+void en_utf8_cursor_char_info(CharInfo *, CharInfoProperties,
+                              const struct BufferPos *, struct GBCursor *,
+                              const ConfigSnapshot *config);
 size_t en_utf8_previous_char_offset(const struct BufferPos *);
+size_t en_utf8_cursor_previous_char_offset(const struct BufferPos *,
+                                           struct GBCursor *);
 
 #endif
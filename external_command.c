@@ -144,11 +144,10 @@ Status ec_run_command(const char *cmd, InputStream *is, OutputStream *os,
     }
 
     OutputStream *output_streams[] = { NULL, os, es };
-    char in_buf[4096];
+    const char *in_text;
     char out_buf[4096];
     size_t in_bytes;
     size_t out_bytes;
-    int pending_write = 0;
 
     if (is == NULL) {
         close(fds[0].fd);
@@ -169,9 +168,9 @@ Status ec_run_command(const char *cmd, InputStream *is, OutputStream *os,
         }
 
         if (fds[0].fd != -1 && fds[0].revents & POLLOUT) {
-            if (!pending_write) {
-                status = is->read(is, in_buf, sizeof(in_buf), &in_bytes);
-            }
+            /* Output written to the same buffer can invalidate the
+             * input text so it's retrieved again before each write */
+            status = is->read(is, &in_text, &in_bytes);
 
             if (!STATUS_IS_SUCCESS(status)) {
                 break;
@@ -179,7 +178,7 @@ Status ec_run_command(const char *cmd, InputStream *is, OutputStream *os,
                 close(fds[0].fd);
                 fds[0].fd = -1;
             } else {
-                ssize_t written = write(fds[0].fd, in_buf, in_bytes);
+                ssize_t written = write(fds[0].fd, in_text, in_bytes);
 
                 if (written == -1) {
                     if (errno != EAGAIN) {
@@ -188,11 +187,9 @@ Status ec_run_command(const char *cmd, InputStream *is, OutputStream *os,
                                      "Unable to write to child process "
                                      "stdin: %s", strerror(errno));
                         break;
-                    } else {
-                        pending_write = 1;
                     }
                 } else {
-                    pending_write = 0;
+                    is->consume(is, written);
                 }
             }
         }
@@ -23,9 +23,12 @@
 
 typedef struct InputStream InputStream;
 
+/* Input is read without being copied. read sets text to the next
+ * unconsumed input, which is only valid until the source is next
+ * modified, and consume marks bytes of it as used */
 struct InputStream {
-    Status (*read)(InputStream *is, char buf[], size_t buf_len,
-                   size_t *bytes_read);
+    Status (*read)(InputStream *is, const char **text, size_t *length);
+    void (*consume)(InputStream *is, size_t bytes);
     Status (*close)(InputStream *is);
 };
 
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define FF_INOTIFY 1
+#endif
+#include "file_follower.h"
+#include "util.h"
+
+static int ff_open_file(FileFollower *);
+static void ff_watch_directory(FileFollower *);
+static void *ff_run(void *);
+static int ff_stopped(FileFollower *);
+static void ff_check_file(FileFollower *);
+static void ff_restart(FileFollower *);
+static void ff_read_new_text(FileFollower *);
+static void ff_wait(FileFollower *);
+static int ff_read_events(FileFollower *);
+static void ff_notify(const FileFollower *);
+
+/* Start following file_path on a worker thread. offset is the number
+ * of bytes of the file already read, so only text after offset is
+ * queued unless the file is found to have been truncated or replaced */
+Status ff_start(FileFollower **follower_ptr, const char *file_path,
+                size_t offset, int notify_fd)
+{
+    FileFollower *follower = malloc(sizeof(FileFollower));
+
+    if (follower == NULL) {
+        return OUT_OF_MEMORY("Unable to follow file");
+    }
+
+    memset(follower, 0, sizeof(FileFollower));
+    follower->fd = follower->event_fd = -1;
+    follower->wake_pipe[0] = follower->wake_pipe[1] = -1;
+    follower->notify_fd = notify_fd;
+    follower->file_path = strdup(file_path);
+
+    if (follower->file_path == NULL) {
+        free(follower);
+        return OUT_OF_MEMORY("Unable to follow file");
+    }
+
+    const char *file_name = strrchr(follower->file_path, '/');
+    follower->file_name = file_name == NULL ? follower->file_path
+                                            : file_name + 1;
+
+    Status status = STATUS_SUCCESS;
+
+    if (!ff_open_file(follower) ||
+        lseek(follower->fd, offset, SEEK_SET) == -1 ||
+        pipe(follower->wake_pipe) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                              "Unable to follow file %s - %s",
+                              follower->file_name, strerror(errno));
+        goto cleanup;
+    }
+
+    follower->offset = offset;
+    ff_watch_directory(follower);
+    pthread_mutex_init(&follower->mutex, NULL);
+    pthread_cond_init(&follower->cond, NULL);
+
+    /* Block all signals in the worker so they continue to be
+     * delivered to the main thread where pselect handles them */
+    sigset_t block_set, old_set;
+    sigfillset(&block_set);
+    pthread_sigmask(SIG_SETMASK, &block_set, &old_set);
+
+    int err = pthread_create(&follower->thread, NULL, ff_run, follower);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (err != 0) {
+        pthread_cond_destroy(&follower->cond);
+        pthread_mutex_destroy(&follower->mutex);
+        status = st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                              "Unable to follow file %s - %s",
+                              follower->file_name, strerror(err));
+        goto cleanup;
+    }
+
+    *follower_ptr = follower;
+
+    return STATUS_SUCCESS;
+
+cleanup:
+    for (size_t k = 0; k < 2; k++) {
+        if (follower->wake_pipe[k] != -1) {
+            close(follower->wake_pipe[k]);
+        }
+    }
+
+    if (follower->fd != -1) {
+        close(follower->fd);
+    }
+
+    if (follower->event_fd != -1) {
+        close(follower->event_fd);
+    }
+
+    free(follower->file_path);
+    free(follower);
+
+    return status;
+}
+
+/* Open the file currently at file_path, replacing any file
+ * previously opened */
+static int ff_open_file(FileFollower *follower)
+{
+    int fd = open(follower->file_path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+
+    if (fd == -1) {
+        return 0;
+    } else if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    if (follower->fd != -1) {
+        close(follower->fd);
+    }
+
+    follower->fd = fd;
+    follower->dev = file_stat.st_dev;
+    follower->ino = file_stat.st_ino;
+    follower->offset = 0;
+
+    return 1;
+}
+
+/* Watching the directory rather than the file itself means
+ * events are still received once the file is replaced */
+static void ff_watch_directory(FileFollower *follower)
+{
+#if FF_INOTIFY
+    size_t dir_length = follower->file_name - follower->file_path;
+    char *dir_path = dir_length == 0 ? strdup(".") :
+                     strndup(follower->file_path, MAX(dir_length - 1, 1));
+
+    if (dir_path == NULL) {
+        return;
+    }
+
+    follower->event_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (follower->event_fd != -1 &&
+        inotify_add_watch(follower->event_fd, dir_path,
+                          IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                          IN_MOVED_TO) == -1) {
+        close(follower->event_fd);
+        follower->event_fd = -1;
+    }
+
+    free(dir_path);
+#else
+    (void)follower;
+#endif
+}
+
+static void *ff_run(void *arg)
+{
+    FileFollower *follower = arg;
+
+    while (!ff_stopped(follower)) {
+        ff_check_file(follower);
+        ff_read_new_text(follower);
+        ff_wait(follower);
+    }
+
+    return NULL;
+}
+
+static int ff_stopped(FileFollower *follower)
+{
+    pthread_mutex_lock(&follower->mutex);
+    int stop = follower->stop;
+    pthread_mutex_unlock(&follower->mutex);
+
+    return stop;
+}
+
+/* Restart from the beginning of the file if it has been
+ * replaced or truncated. If the file has been removed the
+ * open file continues to be followed until it is recreated */
+static void ff_check_file(FileFollower *follower)
+{
+    struct stat file_stat;
+
+    if (stat(follower->file_path, &file_stat) == 0 &&
+        (file_stat.st_dev != follower->dev ||
+         file_stat.st_ino != follower->ino)) {
+        if (ff_open_file(follower)) {
+            ff_restart(follower);
+        }
+    } else if (fstat(follower->fd, &file_stat) == 0 &&
+               (size_t)file_stat.st_size < follower->offset) {
+        if (lseek(follower->fd, 0, SEEK_SET) != -1) {
+            follower->offset = 0;
+            ff_restart(follower);
+        }
+    }
+}
+
+/* Text queued from the previous file content is no longer needed */
+static void ff_restart(FileFollower *follower)
+{
+    pthread_mutex_lock(&follower->mutex);
+
+    fl_free_chunks(follower->head);
+    follower->head = follower->tail = NULL;
+    follower->queued = 0;
+    follower->restarted = 1;
+
+    pthread_cond_signal(&follower->cond);
+    pthread_mutex_unlock(&follower->mutex);
+
+    ff_notify(follower);
+}
+
+/* Queue any text added to the file. Each read only covers new text
+ * so the work done is proportional to the amount appended */
+static void ff_read_new_text(FileFollower *follower)
+{
+    FLChunk *chunk;
+    ssize_t bytes;
+    int stop;
+
+    for (;;) {
+        pthread_mutex_lock(&follower->mutex);
+
+        while (follower->queued >= FL_MAX_QUEUED_CHUNKS &&
+               !follower->stop) {
+            pthread_cond_wait(&follower->cond, &follower->mutex);
+        }
+
+        stop = follower->stop;
+        pthread_mutex_unlock(&follower->mutex);
+
+        if (stop) {
+            return;
+        }
+
+        chunk = malloc(sizeof(FLChunk) + FF_READ_CHUNK_SIZE);
+
+        if (chunk == NULL) {
+            /* Try again on the next change */
+            return;
+        }
+
+        do {
+            bytes = read(follower->fd, chunk->text, FF_READ_CHUNK_SIZE);
+        } while (bytes == -1 && errno == EINTR);
+
+        if (bytes <= 0) {
+            free(chunk);
+            return;
+        }
+
+        chunk->next = NULL;
+        chunk->length = bytes;
+        chunk->block_lines = NULL;
+        chunk->block_num = 0;
+        chunk->first_block = 0;
+        follower->offset += bytes;
+
+        pthread_mutex_lock(&follower->mutex);
+
+        if (follower->tail == NULL) {
+            follower->head = chunk;
+        } else {
+            follower->tail->next = chunk;
+        }
+
+        follower->tail = chunk;
+        follower->queued++;
+
+        pthread_mutex_unlock(&follower->mutex);
+
+        ff_notify(follower);
+    }
+}
+
+/* Wait until the file changes, the poll interval expires
+ * or the worker is stopped */
+static void ff_wait(FileFollower *follower)
+{
+    struct pollfd fds[2] = {
+        { .fd = follower->wake_pipe[0], .events = POLLIN },
+        { .fd = follower->event_fd, .events = POLLIN }
+    };
+    int res;
+
+    do {
+        fds[1].fd = follower->event_fd;
+        res = poll(fds, follower->event_fd == -1 ? 1 : 2,
+                   FF_POLL_INTERVAL_MS);
+    } while ((res == -1 && errno == EINTR) ||
+             (res > 0 && !(fds[0].revents & POLLIN) &&
+              !ff_read_events(follower)));
+}
+
+/* Returns true if any of the events received relate to the followed
+ * file. Events for other files in the same directory are ignored */
+static int ff_read_events(FileFollower *follower)
+{
+#if FF_INOTIFY
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } events;
+    const struct inotify_event *event;
+    ssize_t bytes;
+    int relevant = 0;
+
+    while ((bytes = read(follower->event_fd, events.data,
+                         sizeof(events.data))) > 0) {
+        for (char *next = events.data; next < events.data + bytes;
+             next += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)next;
+
+            if (event->mask & IN_IGNORED) {
+                /* The directory was removed so fall back to polling */
+                close(follower->event_fd);
+                follower->event_fd = -1;
+                return 1;
+            } else if ((event->mask & IN_Q_OVERFLOW) ||
+                       (event->len > 0 &&
+                        strcmp(event->name, follower->file_name) == 0)) {
+                relevant = 1;
+            }
+        }
+    }
+
+    return relevant;
+#else
+    (void)follower;
+    return 1;
+#endif
+}
+
+/* The notify fd is non-blocking so if the reader has fallen
+ * behind notifications are simply dropped */
+static void ff_notify(const FileFollower *follower)
+{
+    if (follower->notify_fd == -1) {
+        return;
+    }
+
+    char byte = 0;
+    ssize_t written = write(follower->notify_fd, &byte, 1);
+    (void)written;
+}
+
+/* Remove all queued chunks, returning them in file order. restarted is
+ * set if the chunks replace rather than follow on from the text
+ * previously taken. The caller frees the chunks with fl_free_chunks */
+FLChunk *ff_take_chunks(FileFollower *follower, int *restarted)
+{
+    pthread_mutex_lock(&follower->mutex);
+
+    FLChunk *chunks = follower->head;
+    follower->head = follower->tail = NULL;
+    follower->queued = 0;
+    *restarted = follower->restarted;
+    follower->restarted = 0;
+
+    pthread_cond_signal(&follower->cond);
+    pthread_mutex_unlock(&follower->mutex);
+
+    return chunks;
+}
+
+/* Stop the worker then free the follower along
+ * with any uncollected chunks */
+void ff_stop(FileFollower *follower)
+{
+    if (follower == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&follower->mutex);
+    follower->stop = 1;
+    pthread_cond_signal(&follower->cond);
+    pthread_mutex_unlock(&follower->mutex);
+
+    char byte = 0;
+    ssize_t written = write(follower->wake_pipe[1], &byte, 1);
+    (void)written;
+
+    pthread_join(follower->thread, NULL);
+
+    fl_free_chunks(follower->head);
+    pthread_cond_destroy(&follower->cond);
+    pthread_mutex_destroy(&follower->mutex);
+    close(follower->wake_pipe[0]);
+    close(follower->wake_pipe[1]);
+
+    if (follower->fd != -1) {
+        close(follower->fd);
+    }
+
+    if (follower->event_fd != -1) {
+        close(follower->event_fd);
+    }
+
+    free(follower->file_path);
+    free(follower);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_FILE_FOLLOWER_H
+#define WED_FILE_FOLLOWER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "status.h"
+#include "file_loader.h"
+
+/* The file is also checked this often in case file system
+ * events aren't available or aren't delivered */
+#define FF_POLL_INTERVAL_MS 1000
+/* Maximum number of bytes read into a single chunk */
+#define FF_READ_CHUNK_SIZE (64 * 1024)
+
+/* Follows a file which is being appended to, such as a log file.
+ * A worker thread waits for the file to change (using inotify where
+ * available) and queues only the bytes added since it was last read.
+ * If the file is truncated or replaced, for example when a log is
+ * rotated, reading restarts from the beginning of the file now at
+ * file_path and the restart is reported to the main thread */
+typedef struct {
+    char *file_path; /* Path of followed file */
+    const char *file_name; /* File name component of file_path */
+    int fd; /* Open file being followed */
+    dev_t dev; /* Device and inode of fd, used to detect the */
+    ino_t ino; /* file being replaced */
+    size_t offset; /* Number of bytes of fd read */
+    int event_fd; /* inotify instance watching the file's directory,
+                     or -1 if not available */
+    int wake_pipe[2]; /* Written to when the worker is stopped */
+    int notify_fd; /* A byte is written to this fd whenever
+                      chunks are queued. Can be -1 */
+    pthread_t thread; /* Worker thread */
+    pthread_mutex_t mutex; /* Guards fields below */
+    pthread_cond_t cond; /* Signalled when chunks are taken or
+                            the worker is stopped */
+    FLChunk *head; /* First queued chunk */
+    FLChunk *tail; /* Last queued chunk */
+    size_t queued; /* Number of queued chunks */
+    int restarted; /* The queued chunks start from the beginning of
+                      the file rather than following on from the
+                      text already taken */
+    int stop; /* Set by the main thread to stop the worker */
+} FileFollower;
+
+Status ff_start(FileFollower **, const char *file_path, size_t offset,
+                int notify_fd);
+FLChunk *ff_take_chunks(FileFollower *, int *restarted);
+void ff_stop(FileFollower *);
+
+#endif
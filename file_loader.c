@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <assert.h>
+#include "file_loader.h"
+#include "byte_scan.h"
+#include "util.h"
+
+static Status fl_create(FileLoader **, int fd, size_t offset, size_t size,
+                        size_t block_size, int notify_fd);
+static void *fl_run(void *);
+static FLChunk *fl_read_chunk(FileLoader *, Status *);
+static FLChunk *fl_count_chunk(FileLoader *, FLChunk *, Status *);
+static void fl_queue_chunk(FileLoader *, FLChunk *);
+static void fl_notify(const FileLoader *);
+
+/* Choose how to load a file. Mapping is preferred whenever can_map
+ * is true, i.e. the buffer is empty and uses gap buffer storage, and
+ * otherwise files of at least progressive_min_size bytes are loaded in
+ * the background. A progressive_min_size of 0 disables background
+ * loading. Files which are mapped are also loaded in the background if
+ * mapping fails (see bf_load_file_async) */
+FileLoadMethod fl_load_method(const struct stat *file_stat, int can_map,
+                              size_t progressive_min_size)
+{
+    size_t size = file_stat->st_size;
+
+    if (can_map && S_ISREG(file_stat->st_mode) && size >= FL_MAP_MIN_SIZE) {
+        return FLM_MAP;
+    } else if (progressive_min_size > 0 && size >= progressive_min_size) {
+        return FLM_PROGRESSIVE;
+    }
+
+    return FLM_READ;
+}
+
+/* Start reading fd from its current offset on a worker thread.
+ * offset is the number of bytes already read, which together with
+ * size is used to report progress. On success the loader takes
+ * ownership of fd which is closed by fl_finish */
+Status fl_start(FileLoader **loader_ptr, int fd, size_t offset, size_t size,
+                int notify_fd)
+{
+    return fl_create(loader_ptr, fd, offset, size, 0, notify_fd);
+}
+
+/* Count the new lines in each block_size block of the first size
+ * bytes of fd, from its start, on a worker thread. This lets the lines
+ * of a mapped file be indexed without reading it on the main thread
+ * (see gb_add_block_lines). On success the loader takes ownership of
+ * fd which is closed by fl_finish */
+Status fl_start_counting(FileLoader **loader_ptr, int fd, size_t size,
+                         size_t block_size, int notify_fd)
+{
+    /* Chunks must hold whole blocks */
+    assert(block_size > 0 && FL_READ_CHUNK_SIZE % block_size == 0);
+
+    return fl_create(loader_ptr, fd, 0, size, block_size, notify_fd);
+}
+
+static Status fl_create(FileLoader **loader_ptr, int fd, size_t offset,
+                        size_t size, size_t block_size, int notify_fd)
+{
+    FileLoader *loader = malloc(sizeof(FileLoader));
+
+    if (loader == NULL) {
+        return OUT_OF_MEMORY("Unable to create file loader");
+    }
+
+    memset(loader, 0, sizeof(FileLoader));
+
+    loader->fd = fd;
+    loader->size = size;
+    loader->block_size = block_size;
+    loader->read = offset;
+    loader->notify_fd = notify_fd;
+    loader->status = STATUS_SUCCESS;
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+
+    /* Block all signals in the worker so they continue to be
+     * delivered to the main thread where pselect handles them */
+    sigset_t block_set, old_set;
+    sigfillset(&block_set);
+    pthread_sigmask(SIG_SETMASK, &block_set, &old_set);
+
+    int err = pthread_create(&loader->thread, NULL, fl_run, loader);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (err != 0) {
+        pthread_cond_destroy(&loader->cond);
+        pthread_mutex_destroy(&loader->mutex);
+        free(loader);
+        return st_get_error(ERR_UNABLE_TO_READ_FILE,
+                            "Unable to start loading file - %s",
+                            strerror(err));
+    }
+
+    *loader_ptr = loader;
+
+    return STATUS_SUCCESS;
+}
+
+static void *fl_run(void *arg)
+{
+    FileLoader *loader = arg;
+    Status status = STATUS_SUCCESS;
+    FLChunk *chunk;
+    int cancelled;
+
+    do {
+        pthread_mutex_lock(&loader->mutex);
+
+        while (loader->queued >= FL_MAX_QUEUED_CHUNKS &&
+               !loader->cancelled) {
+            pthread_cond_wait(&loader->cond, &loader->mutex);
+        }
+
+        cancelled = loader->cancelled;
+        pthread_mutex_unlock(&loader->mutex);
+
+        if (cancelled) {
+            break;
+        }
+
+        chunk = fl_read_chunk(loader, &status);
+
+        if (chunk != NULL && loader->block_size > 0) {
+            chunk = fl_count_chunk(loader, chunk, &status);
+        }
+
+        if (chunk != NULL) {
+            fl_queue_chunk(loader, chunk);
+            fl_notify(loader);
+        }
+    } while (chunk != NULL && STATUS_IS_SUCCESS(status));
+
+    pthread_mutex_lock(&loader->mutex);
+    loader->status = status;
+    loader->finished = 1;
+    pthread_mutex_unlock(&loader->mutex);
+
+    fl_notify(loader);
+
+    return NULL;
+}
+
+/* Returns NULL at the end of the file or on error, in which
+ * case status is set */
+static FLChunk *fl_read_chunk(FileLoader *loader, Status *status)
+{
+    FLChunk *chunk = malloc(sizeof(FLChunk) + FL_READ_CHUNK_SIZE);
+
+    if (chunk == NULL) {
+        *status = OUT_OF_MEMORY("Unable to load file");
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->length = 0;
+    chunk->block_lines = NULL;
+    chunk->block_num = 0;
+    chunk->first_block = 0;
+    size_t limit = FL_READ_CHUNK_SIZE;
+    ssize_t bytes;
+
+    /* Only the part of the file which was mapped is counted */
+    if (loader->block_size > 0) {
+        limit = MIN(limit, loader->size - MIN(loader->read, loader->size));
+    }
+
+    /* Fill the chunk so that slow file systems returning
+     * short reads don't produce many small chunks */
+    while (chunk->length < limit) {
+        bytes = read(loader->fd, chunk->text + chunk->length,
+                     limit - chunk->length);
+
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            *status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                                   "Unable to read from file - %s",
+                                   strerror(errno));
+            break;
+        } else if (bytes == 0) {
+            break;
+        }
+
+        chunk->length += bytes;
+    }
+
+    if (chunk->length == 0) {
+        free(chunk);
+        return NULL;
+    }
+
+    return chunk;
+}
+
+/* Replace a chunk read by the worker with one holding the new line
+ * count of each of its blocks. Returns NULL on error, in which case
+ * status is set */
+static FLChunk *fl_count_chunk(FileLoader *loader, FLChunk *chunk,
+                               Status *status)
+{
+    size_t block_size = loader->block_size;
+    size_t block_num = (chunk->length + block_size - 1) / block_size;
+    FLChunk *counted = malloc(sizeof(FLChunk));
+    size_t *block_lines = malloc(block_num * sizeof(size_t));
+
+    if (counted == NULL || block_lines == NULL) {
+        free(counted);
+        free(block_lines);
+        free(chunk);
+        *status = OUT_OF_MEMORY("Unable to count lines");
+        return NULL;
+    }
+
+    size_t start;
+
+    for (size_t k = 0; k < block_num; k++) {
+        start = k * block_size;
+        block_lines[k] = bs_count(chunk->text + start,
+                                  MIN(block_size, chunk->length - start),
+                                  '\n');
+    }
+
+    counted->next = NULL;
+    counted->length = chunk->length;
+    counted->block_lines = block_lines;
+    counted->block_num = block_num;
+    /* The worker is the only thread which updates read */
+    counted->first_block = loader->read / block_size;
+    free(chunk);
+
+    return counted;
+}
+
+static void fl_queue_chunk(FileLoader *loader, FLChunk *chunk)
+{
+    pthread_mutex_lock(&loader->mutex);
+
+    if (loader->tail == NULL) {
+        loader->head = chunk;
+    } else {
+        loader->tail->next = chunk;
+    }
+
+    loader->tail = chunk;
+    loader->queued++;
+    loader->read += chunk->length;
+
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+/* The notify fd is non-blocking so if the reader has fallen
+ * behind notifications are simply dropped */
+static void fl_notify(const FileLoader *loader)
+{
+    if (loader->notify_fd == -1) {
+        return;
+    }
+
+    char byte = 0;
+    ssize_t written = write(loader->notify_fd, &byte, 1);
+    (void)written;
+}
+
+/* Remove all queued chunks, returning them in file order.
+ * The caller frees them with fl_free_chunks */
+FLChunk *fl_take_chunks(FileLoader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+
+    FLChunk *chunks = loader->head;
+    loader->head = loader->tail = NULL;
+    loader->queued = 0;
+
+    pthread_cond_signal(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+
+    return chunks;
+}
+
+void fl_free_chunks(FLChunk *chunk)
+{
+    FLChunk *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk->block_lines);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/* True once the whole file has been read and collected */
+int fl_finished(FileLoader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    int finished = loader->finished && loader->head == NULL;
+    pthread_mutex_unlock(&loader->mutex);
+
+    return finished;
+}
+
+/* Returns percentage of file read */
+int fl_progress(FileLoader *loader)
+{
+    if (loader->size == 0) {
+        return 100;
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+    size_t bytes_read = loader->read;
+    pthread_mutex_unlock(&loader->mutex);
+
+    /* The file may have grown since its size was checked */
+    return (int)(MIN(bytes_read, loader->size) / (double)loader->size * 100);
+}
+
+/* Stop the worker reading any more of the file. Chunks already
+ * queued can still be collected */
+void fl_cancel(FileLoader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    loader->cancelled = 1;
+    pthread_cond_signal(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+/* Cancel the load if it is still in progress, wait for the worker
+ * to exit then free the loader along with any uncollected chunks */
+Status fl_finish(FileLoader *loader)
+{
+    fl_cancel(loader);
+    pthread_join(loader->thread, NULL);
+
+    Status status = loader->status;
+
+    fl_free_chunks(loader->head);
+    pthread_cond_destroy(&loader->cond);
+    pthread_mutex_destroy(&loader->mutex);
+    close(loader->fd);
+    free(loader);
+
+    return status;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_FILE_LOADER_H
+#define WED_FILE_LOADER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "status.h"
+
+/* The start of a file is read before loading continues in the
+ * background so that the first screen can be displayed immediately */
+#define FL_INITIAL_READ_SIZE (64 * 1024)
+/* The worker reads the file in chunks of this size */
+#define FL_READ_CHUNK_SIZE (1024 * 1024)
+/* The worker waits once this many chunks are queued so that memory
+ * use is bounded when the main thread can't keep up */
+#define FL_MAX_QUEUED_CHUNKS 16
+/* Regular files of at least this size are memory mapped when the
+ * buffer storage allows it, as mapping is quicker than reading */
+#define FL_MAP_MIN_SIZE (1024 * 1024)
+
+/* How a file is loaded into a buffer */
+typedef enum {
+    FLM_READ, /* Read entirely before the buffer is used */
+    FLM_MAP, /* Memory mapped (see gb_map_file) */
+    FLM_PROGRESSIVE /* Read in the background (see fl_start) */
+} FileLoadMethod;
+
+/* A chunk of file content read by the worker */
+typedef struct FLChunk {
+    struct FLChunk *next; /* Next chunk in file order */
+    size_t length; /* Number of bytes in text */
+    size_t *block_lines; /* When counting lines the new line count of
+                            each block read, in which case text is
+                            empty. Otherwise NULL */
+    size_t block_num; /* Number of entries in block_lines */
+    size_t first_block; /* Index in the file of the first block counted */
+    char text[]; /* File content */
+} FLChunk;
+
+/* Reads a file on a worker thread. Chunks are queued in file order
+ * and collected by the main thread with fl_take_chunks, which is the
+ * only thread that modifies the buffer being loaded */
+typedef struct {
+    int fd; /* File being read from its current offset,
+               owned by loader */
+    size_t size; /* Expected file size used to report progress */
+    size_t block_size; /* When non zero only the new lines in each block
+                          of this many bytes are counted and reading
+                          stops after size bytes (see fl_start_counting) */
+    int notify_fd; /* A byte is written to this fd whenever a chunk
+                      is queued and on completion. Can be -1 */
+    pthread_t thread; /* Worker thread */
+    pthread_mutex_t mutex; /* Guards fields below */
+    pthread_cond_t cond; /* Signalled when chunks are taken or
+                            the load is cancelled */
+    FLChunk *head; /* First queued chunk */
+    FLChunk *tail; /* Last queued chunk */
+    size_t queued; /* Number of queued chunks */
+    size_t read; /* Number of bytes read so far */
+    int cancelled; /* Set by the main thread to stop the worker */
+    int finished; /* True once the worker has completed */
+    Status status; /* Result of load */
+} FileLoader;
+
+FileLoadMethod fl_load_method(const struct stat *, int can_map,
+                              size_t progressive_min_size);
+Status fl_start(FileLoader **, int fd, size_t offset, size_t size,
+                int notify_fd);
+Status fl_start_counting(FileLoader **, int fd, size_t size,
+                         size_t block_size, int notify_fd);
+FLChunk *fl_take_chunks(FileLoader *);
+void fl_free_chunks(FLChunk *);
+int fl_finished(FileLoader *);
+int fl_progress(FileLoader *);
+void fl_cancel(FileLoader *);
+Status fl_finish(FileLoader *);
+
+#endif
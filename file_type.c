@@ -102,8 +102,8 @@ void ft_free(FileType *file_type)
     free(file_type);
 }
 
-Status ft_matches(FileType *file_type, FileInfo *file_info, char *file_buf,
-                  size_t file_buf_size, int *matches)
+Status ft_matches(FileType *file_type, FileInfo *file_info,
+                  const char *file_buf, size_t file_buf_size, int *matches)
 {
     const char *path;
     *matches = 0;
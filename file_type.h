@@ -44,7 +44,7 @@ Status ft_init(FileType **file_type_ptr, const char *name,
                const char *display_name, const Regex *file_pattern_regex,
                const Regex *file_content_regex);
 void ft_free(FileType *);
-Status ft_matches(FileType *, FileInfo *, char *file_buf,
+Status ft_matches(FileType *, FileInfo *, const char *file_buf,
                   size_t file_buf_size, int *matches);
 
 #endif
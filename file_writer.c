@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* copy_file_range isn't part of POSIX */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <assert.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "file_writer.h"
+#include "undo_file.h"
+#include "util.h"
+
+/* Maximum number of segments passed to each writev call */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define FW_MAX_IOVECS IOV_MAX
+#else
+#define FW_MAX_IOVECS 64
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define FW_COPY_FILE_RANGE 1
+#endif
+
+static Status fw_write(const GapBuffer *, const char *file_path,
+                       WriteDurability, const struct stat *base_stat,
+                       uint64_t *hash, FileWriter *);
+static Status fw_write_text(const GapBuffer *, int output_file,
+                            FileWriter *);
+static Status fw_write_incremental(const GapBuffer *, const char *file_path,
+                                   const struct stat *base_stat,
+                                   int output_file, FileWriter *,
+                                   int *written);
+static size_t fw_dirty_bytes(const GBDirtyRanges *, size_t length);
+static int fw_same_file(const struct stat *, const struct stat *);
+static int fw_clone_file(int input_file, int output_file, size_t length);
+#if FW_COPY_FILE_RANGE
+static Status fw_copy_file(int input_file, int output_file, size_t length,
+                           FileWriter *, long long *last_notify,
+                           size_t *copied);
+#endif
+static Status fw_write_range(const GapBuffer *, size_t start, size_t end,
+                             int output_file, FileWriter *,
+                             long long *last_notify);
+static int fw_writev(int output_file, struct iovec *, int iov_num);
+static void fw_record_progress(FileWriter *, size_t written,
+                               long long *last_notify);
+static Status fw_set_file_attributes(const char *tmp_file_path,
+                                     const char *file_path);
+static Status fw_sync_directory(const char *file_path);
+static void *fw_run(void *);
+static void fw_notify(const FileWriter *);
+static long long fw_time_ns(void);
+
+static const char *fw_durability_names[WD_ENTRY_NUM] = {
+    [WD_NONE]      = "none",
+    [WD_FILE]      = "file",
+    [WD_DIRECTORY] = "directory"
+};
+
+/* Write text to file on the current thread. When base_stat is non-NULL
+ * and matches file_path, the dirty ranges of data are relative to that
+ * file, which allows only the changed text to be written. When hash is
+ * non-NULL it's set to the hash of the text written */
+Status fw_write_file(const GapBuffer *data, const char *file_path,
+                     WriteDurability durability,
+                     const struct stat *base_stat, uint64_t *hash)
+{
+    return fw_write(data, file_path, durability, base_stat, hash, NULL);
+}
+
+/* Write text to temporary file in same directory as file_path
+ * then rename temporary file to file_path. When writer is
+ * non-NULL progress is recorded in it */
+static Status fw_write(const GapBuffer *data, const char *file_path,
+                       WriteDurability durability,
+                       const struct stat *base_stat, uint64_t *hash,
+                       FileWriter *writer)
+{
+    assert(!is_null_or_empty(file_path));
+
+    size_t tmp_file_path_len = strlen(file_path) + 6 + 1;
+    char *tmp_file_path = malloc(tmp_file_path_len);
+
+    if (tmp_file_path == NULL) {
+        return OUT_OF_MEMORY("Unable to create temporary file path");
+    }
+
+    snprintf(tmp_file_path, tmp_file_path_len, "%sXXXXXX", file_path);
+
+    int output_file = mkstemp(tmp_file_path);
+
+    if (output_file == -1) {
+        free(tmp_file_path);
+        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                            "Unable to open temporary file for writing - %s",
+                            strerror(errno));
+    }
+
+    Status status = STATUS_SUCCESS;
+    int written = 0;
+
+    if (base_stat != NULL) {
+        status = fw_write_incremental(data, file_path, base_stat,
+                                      output_file, writer, &written);
+    }
+
+    if (STATUS_IS_SUCCESS(status) && !written) {
+        status = fw_write_text(data, output_file, writer);
+    }
+
+    /* Hashed here so an asynchronous write does so on the worker */
+    if (STATUS_IS_SUCCESS(status) && hash != NULL) {
+        *hash = uf_hash_text(data);
+    }
+
+    if (STATUS_IS_SUCCESS(status) && durability >= WD_FILE &&
+        fsync(output_file) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to sync temporary file - %s",
+                              strerror(errno));
+    }
+
+    /* Delayed write errors can be reported by close */
+    if (close(output_file) == -1 && STATUS_IS_SUCCESS(status)) {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to write to temporary file - %s",
+                              strerror(errno));
+    }
+
+    GOTO_IF_FAIL(status, cleanup);
+
+    status = fw_set_file_attributes(tmp_file_path, file_path);
+    GOTO_IF_FAIL(status, cleanup);
+
+    /* Overwrite existing file atomically */
+    if (rename(tmp_file_path, file_path) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to overwrite file %s - %s",
+                              file_path, strerror(errno));
+        goto cleanup;
+    }
+
+    if (durability >= WD_DIRECTORY) {
+        status = fw_sync_directory(file_path);
+    }
+
+    free(tmp_file_path);
+
+    return status;
+
+cleanup:
+    remove(tmp_file_path);
+    free(tmp_file_path);
+
+    return status;
+}
+
+/* Write buffer text directly to file. Unmodified text mapped from a
+ * file is copied by the kernel where possible */
+static Status fw_write_text(const GapBuffer *data, int output_file,
+                            FileWriter *writer)
+{
+    size_t length = gb_length(data);
+    size_t written = 0;
+    long long last_notify = fw_time_ns();
+    int input_file = gb_mapped_fd(data);
+
+    /* A buffer that is still mapped is identical to the start of
+     * the file it was loaded from. If copying isn't supported or
+     * the file is now shorter the rest is written from memory */
+#if FW_COPY_FILE_RANGE
+    if (input_file != -1) {
+        RETURN_IF_FAIL(fw_copy_file(input_file, output_file, length, writer,
+                                    &last_notify, &written));
+    }
+#else
+    (void)input_file;
+#endif
+
+    return fw_write_range(data, written, length, output_file, writer,
+                          &last_notify);
+}
+
+/* Saving incrementally is only attempted when at most
+ * this fraction of the text has changed */
+#define FW_INCREMENTAL_MAX_DIRTY_RATIO 0.5
+
+/* Clone the existing file then write only the text that has changed
+ * since the text was last the same as the file. This is only possible
+ * when the file hasn't been modified since then, which is checked using
+ * base_stat. When the file can't be cloned or too much of the text has
+ * changed written is left false and nothing is written */
+static Status fw_write_incremental(const GapBuffer *data,
+                                   const char *file_path,
+                                   const struct stat *base_stat,
+                                   int output_file, FileWriter *writer,
+                                   int *written)
+{
+    const GBDirtyRanges *dirty = gb_dirty_ranges(data);
+
+    if (dirty == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    size_t length = gb_length(data);
+    size_t dirty_bytes = fw_dirty_bytes(dirty, length);
+
+    if (dirty_bytes > length * FW_INCREMENTAL_MAX_DIRTY_RATIO) {
+        return STATUS_SUCCESS;
+    }
+
+    int input_file = open(file_path, O_RDONLY);
+
+    if (input_file == -1) {
+        return STATUS_SUCCESS;
+    }
+
+    struct stat file_stat;
+    int cloned = fstat(input_file, &file_stat) == 0 &&
+                 fw_same_file(&file_stat, base_stat) &&
+                 (size_t)file_stat.st_size == dirty->base_length &&
+                 fw_clone_file(input_file, output_file, dirty->base_length);
+
+    close(input_file);
+
+    if (!cloned) {
+        /* Discard anything partially copied */
+        if (ftruncate(output_file, 0) == -1 ||
+            lseek(output_file, 0, SEEK_SET) == -1) {
+            return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                                "Unable to write to temporary file - %s",
+                                strerror(errno));
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    *written = 1;
+    long long last_notify = fw_time_ns();
+    fw_record_progress(writer, length - dirty_bytes, &last_notify);
+
+    size_t base_end = MIN(dirty->base_length, length);
+    size_t start, end;
+
+    /* Overwrite changed text then append any text beyond the
+     * end of the file, or truncate the file if it's now shorter */
+    for (size_t k = 0; k <= dirty->range_num; k++) {
+        if (k < dirty->range_num) {
+            start = dirty->ranges[k].start;
+            end = MIN(dirty->ranges[k].end, base_end);
+        } else {
+            start = base_end;
+            end = length;
+        }
+
+        if (start >= end) {
+            continue;
+        }
+
+        if (lseek(output_file, start, SEEK_SET) == -1) {
+            return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                                "Unable to write to temporary file - %s",
+                                strerror(errno));
+        }
+
+        RETURN_IF_FAIL(fw_write_range(data, start, end, output_file,
+                                      writer, &last_notify));
+    }
+
+    if (length < dirty->base_length &&
+        ftruncate(output_file, length) == -1) {
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to truncate temporary file - %s",
+                            strerror(errno));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Number of bytes fw_write_incremental writes */
+static size_t fw_dirty_bytes(const GBDirtyRanges *dirty, size_t length)
+{
+    size_t base_end = MIN(dirty->base_length, length);
+    size_t dirty_bytes = length - base_end;
+
+    for (size_t k = 0; k < dirty->range_num; k++) {
+        if (dirty->ranges[k].start < base_end) {
+            dirty_bytes += MIN(dirty->ranges[k].end, base_end) -
+                           dirty->ranges[k].start;
+        }
+    }
+
+    return dirty_bytes;
+}
+
+/* Checks a file is unchanged by comparing its attributes
+ * to those from when its content was last known */
+static int fw_same_file(const struct stat *file_stat,
+                        const struct stat *base_stat)
+{
+    return file_stat->st_dev == base_stat->st_dev &&
+           file_stat->st_ino == base_stat->st_ino &&
+           file_stat->st_size == base_stat->st_size &&
+           file_stat->st_mtim.tv_sec == base_stat->st_mtim.tv_sec &&
+           file_stat->st_mtim.tv_nsec == base_stat->st_mtim.tv_nsec;
+}
+
+/* Make output_file a copy of input_file. A reflink shares the file's
+ * extents in O(1) time on file systems that support it, otherwise
+ * copy_file_range copies in the kernel, which some file systems also
+ * implement by sharing extents */
+static int fw_clone_file(int input_file, int output_file, size_t length)
+{
+#ifdef FICLONE
+    if (ioctl(output_file, FICLONE, input_file) == 0) {
+        return 1;
+    }
+#endif
+
+#if FW_COPY_FILE_RANGE
+    size_t copied = 0;
+    Status status = fw_copy_file(input_file, output_file, length, NULL,
+                                 NULL, &copied);
+
+    if (STATUS_IS_SUCCESS(status)) {
+        return copied == length;
+    }
+
+    st_free_status(status);
+#else
+    (void)length;
+#endif
+
+    return 0;
+}
+
+#if FW_COPY_FILE_RANGE
+/* Copy up to length bytes from the start of input_file without
+ * passing through user space. copied is set to the number of bytes
+ * copied, which is less than length when copying isn't supported
+ * between the files or input_file is shorter than expected */
+static Status fw_copy_file(int input_file, int output_file, size_t length,
+                           FileWriter *writer, long long *last_notify,
+                           size_t *copied)
+{
+    loff_t offset = 0;
+    ssize_t bytes;
+
+    while ((size_t)offset < length) {
+        bytes = copy_file_range(input_file, &offset, output_file, NULL,
+                                MIN(length - (size_t)offset,
+                                    FW_WRITE_CHUNK_SIZE), 0);
+
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOSYS || errno == EXDEV ||
+                       errno == EINVAL || errno == EOPNOTSUPP ||
+                       errno == EBADF) {
+                break;
+            }
+
+            return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                                "Unable to write to temporary file - %s",
+                                strerror(errno));
+        } else if (bytes == 0) {
+            break;
+        }
+
+        fw_record_progress(writer, bytes, last_notify);
+    }
+
+    *copied = offset;
+
+    return STATUS_SUCCESS;
+}
+#endif
+
+/* Write text from start to end at the current file offset. Segments
+ * are gathered so each writev call writes up to FW_WRITE_CHUNK_SIZE
+ * bytes however fragmented the text is */
+static Status fw_write_range(const GapBuffer *data, size_t start,
+                             size_t end, int output_file,
+                             FileWriter *writer, long long *last_notify)
+{
+    GBSegmentIter iter;
+    struct iovec iov[FW_MAX_IOVECS];
+    const char *text = NULL;
+    size_t segment_length = 0;
+    size_t batch;
+    size_t chunk;
+    int iov_num;
+
+    gb_segment_iter_init(&iter, data, start, end - start);
+
+    while (start < end) {
+        iov_num = 0;
+        batch = 0;
+
+        while (iov_num < FW_MAX_IOVECS && batch < FW_WRITE_CHUNK_SIZE) {
+            if (segment_length == 0 &&
+                !gb_segment_iter_next(&iter, &text, &segment_length)) {
+                break;
+            }
+
+            chunk = MIN(segment_length, FW_WRITE_CHUNK_SIZE - batch);
+
+            if (chunk > 0) {
+                iov[iov_num].iov_base = (char *)text;
+                iov[iov_num].iov_len = chunk;
+                iov_num++;
+            }
+
+            text += chunk;
+            segment_length -= chunk;
+            batch += chunk;
+        }
+
+        if (batch == 0) {
+            break;
+        }
+
+        if (!fw_writev(output_file, iov, iov_num)) {
+            return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                                "Unable to write to temporary file - %s",
+                                strerror(errno));
+        }
+
+        start += batch;
+        fw_record_progress(writer, batch, last_notify);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Write all of iov, continuing after partial writes.
+ * Returns false and sets errno on failure */
+static int fw_writev(int output_file, struct iovec *iov, int iov_num)
+{
+    ssize_t written;
+
+    while (iov_num > 0) {
+        written = writev(output_file, iov, iov_num);
+
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return 0;
+        }
+
+        /* Skip segments written in full then advance
+         * into any segment that was partially written */
+        while (iov_num > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_num--;
+        }
+
+        if (iov_num > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 1;
+}
+
+static void fw_record_progress(FileWriter *writer, size_t written,
+                               long long *last_notify)
+{
+    if (writer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->written += written;
+    pthread_mutex_unlock(&writer->mutex);
+
+    long long now = fw_time_ns();
+
+    if (now - *last_notify >= FW_NOTIFY_INTERVAL_NS) {
+        fw_notify(writer);
+        *last_notify = now;
+    }
+}
+
+/* Set permissions and ownership of temporary file
+ * to match existing file */
+static Status fw_set_file_attributes(const char *tmp_file_path,
+                                     const char *file_path)
+{
+    struct stat file_stat;
+
+    if (stat(file_path, &file_stat) == -1) {
+        return STATUS_SUCCESS;
+    }
+
+    if (chmod(tmp_file_path, file_stat.st_mode) == -1) {
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to set file permissions - %s",
+                            strerror(errno));
+    }
+
+    if (chown(tmp_file_path, file_stat.st_uid, file_stat.st_gid) == -1) {
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to set owner - %s",
+                            strerror(errno));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* The directory entry created by rename is only
+ * durable once the directory itself is synced */
+static Status fw_sync_directory(const char *file_path)
+{
+    const char *sep = strrchr(file_path, '/');
+    char *dir_path;
+
+    if (sep == NULL) {
+        dir_path = strdup(".");
+    } else if (sep == file_path) {
+        dir_path = strdup("/");
+    } else {
+        dir_path = strdup(file_path);
+
+        if (dir_path != NULL) {
+            dir_path[sep - file_path] = '\0';
+        }
+    }
+
+    if (dir_path == NULL) {
+        return OUT_OF_MEMORY("Unable to create directory path");
+    }
+
+    Status status = STATUS_SUCCESS;
+    int dir = open(dir_path, O_RDONLY);
+
+    if (dir == -1 || fsync(dir) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to sync directory %s - %s",
+                              dir_path, strerror(errno));
+    }
+
+    if (dir != -1) {
+        close(dir);
+    }
+
+    free(dir_path);
+
+    return status;
+}
+
+/* Start writing data to file_path on a worker thread. On success
+ * the writer takes ownership of data which is freed by fw_finish.
+ * When hash_content is true data is also hashed on the worker */
+Status fw_start(FileWriter **writer_ptr, GapBuffer *data,
+                const char *file_path, WriteDurability durability,
+                const struct stat *base_stat, int hash_content,
+                int notify_fd)
+{
+    assert(!is_null_or_empty(file_path));
+
+    FileWriter *writer = malloc(sizeof(FileWriter));
+
+    if (writer == NULL) {
+        return OUT_OF_MEMORY("Unable to create file writer");
+    }
+
+    memset(writer, 0, sizeof(FileWriter));
+
+    if ((writer->file_path = strdup(file_path)) == NULL) {
+        free(writer);
+        return OUT_OF_MEMORY("Unable to create file writer");
+    }
+
+    writer->data = data;
+    writer->durability = durability;
+
+    if (base_stat != NULL) {
+        writer->base_stat = *base_stat;
+        writer->has_base_stat = 1;
+    }
+
+    writer->hash_content = hash_content;
+    writer->notify_fd = notify_fd;
+    writer->status = STATUS_SUCCESS;
+    pthread_mutex_init(&writer->mutex, NULL);
+
+    /* Block all signals in the worker so they continue to be
+     * delivered to the main thread where pselect handles them */
+    sigset_t block_set, old_set;
+    sigfillset(&block_set);
+    pthread_sigmask(SIG_SETMASK, &block_set, &old_set);
+
+    int err = pthread_create(&writer->thread, NULL, fw_run, writer);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (err != 0) {
+        pthread_mutex_destroy(&writer->mutex);
+        free(writer->file_path);
+        free(writer);
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to start writing file - %s",
+                            strerror(err));
+    }
+
+    *writer_ptr = writer;
+
+    return STATUS_SUCCESS;
+}
+
+static void *fw_run(void *arg)
+{
+    FileWriter *writer = arg;
+
+    Status status = fw_write(writer->data, writer->file_path,
+                             writer->durability,
+                             writer->has_base_stat ? &writer->base_stat
+                                                   : NULL,
+                             writer->hash_content ? &writer->hash : NULL,
+                             writer);
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->status = status;
+    writer->finished = 1;
+    pthread_mutex_unlock(&writer->mutex);
+
+    fw_notify(writer);
+
+    return NULL;
+}
+
+/* The notify fd is non-blocking so if the reader has fallen
+ * behind notifications are simply dropped */
+static void fw_notify(const FileWriter *writer)
+{
+    if (writer->notify_fd == -1) {
+        return;
+    }
+
+    char byte = 0;
+    ssize_t written = write(writer->notify_fd, &byte, 1);
+    (void)written;
+}
+
+static long long fw_time_ns(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    return (long long)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+}
+
+int fw_finished(FileWriter *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    int finished = writer->finished;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return finished;
+}
+
+/* Returns percentage of text written */
+int fw_progress(FileWriter *writer)
+{
+    size_t length = gb_length(writer->data);
+
+    if (length == 0) {
+        return 100;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    size_t written = writer->written;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return (int)(written / (double)length * 100);
+}
+
+/* Wait for the write to complete then free the writer. If file_path_ptr
+ * is non-NULL it is set to the path written, which the caller frees.
+ * If hash is non-NULL it is set to the hash of the text written when
+ * the writer was started with hash_content true */
+Status fw_finish(FileWriter *writer, char **file_path_ptr, uint64_t *hash)
+{
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->mutex);
+
+    Status status = writer->status;
+
+    if (hash != NULL) {
+        *hash = writer->hash;
+    }
+
+    if (file_path_ptr != NULL) {
+        *file_path_ptr = writer->file_path;
+    } else {
+        free(writer->file_path);
+    }
+
+    gb_free(writer->data);
+    free(writer);
+
+    return status;
+}
+
+int fw_determine_durability(const char *durability_name,
+                            WriteDurability *durability)
+{
+    for (WriteDurability k = 0; k < WD_ENTRY_NUM; k++) {
+        if (strcmp(durability_name, fw_durability_names[k]) == 0) {
+            *durability = k;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_FILE_WRITER_H
+#define WED_FILE_WRITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "gap_buffer.h"
+#include "status.h"
+
+/* Minimum time between progress notifications */
+#define FW_NOTIFY_INTERVAL_NS 100000000
+/* Text is written in chunks no larger than this
+ * so progress can be reported */
+#define FW_WRITE_CHUNK_SIZE (1024 * 1024)
+
+/* How much effort is made to ensure written data
+ * survives a crash or power loss */
+typedef enum {
+    WD_NONE, /* Leave flushing data to the OS */
+    WD_FILE, /* fsync file before it replaces the original */
+    WD_DIRECTORY, /* Also fsync the directory containing the file
+                     so the rename itself is persisted */
+    WD_ENTRY_NUM
+} WriteDurability;
+
+/* Writes text to a file on a worker thread. The text written
+ * is owned by the writer and must not be modified while the
+ * write is in progress, which is typically ensured by writing
+ * a snapshot of a buffer */
+typedef struct {
+    GapBuffer *data; /* Text being written */
+    char *file_path; /* Destination file path */
+    WriteDurability durability; /* fsync behaviour */
+    struct stat base_stat; /* Attributes of file_path when the dirty
+                              ranges of data were last reset */
+    int has_base_stat; /* True if only changed text should be written
+                          when file_path still matches base_stat */
+    int hash_content; /* True if data is hashed once it's written */
+    int notify_fd; /* A byte is written to this fd on progress
+                      and completion. Can be -1 */
+    pthread_t thread; /* Worker thread */
+    pthread_mutex_t mutex; /* Guards fields below */
+    size_t written; /* Number of bytes written so far */
+    int finished; /* True once the worker has completed */
+    Status status; /* Result of write */
+    uint64_t hash; /* Hash of data when hash_content is true
+                      (see uf_hash_text) */
+} FileWriter;
+
+Status fw_write_file(const GapBuffer *, const char *file_path,
+                     WriteDurability, const struct stat *base_stat,
+                     uint64_t *hash);
+Status fw_start(FileWriter **, GapBuffer *data, const char *file_path,
+                WriteDurability, const struct stat *base_stat,
+                int hash_content, int notify_fd);
+int fw_finished(FileWriter *);
+int fw_progress(FileWriter *);
+Status fw_finish(FileWriter *, char **file_path_ptr, uint64_t *hash);
+int fw_determine_durability(const char *durability_name, WriteDurability *);
+
+#endif
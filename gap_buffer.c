@@ -16,19 +16,65 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+/* MAP_ANONYMOUS and MADV_HUGEPAGE aren't part of POSIX */
+#define _DEFAULT_SOURCE
+
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "gap_buffer.h"
 #include "util.h"
+#include "byte_scan.h"
+
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+#define GB_HUGE_PAGES 1
+/* Allocations using huge pages are rounded up to a multiple of this */
+#define GB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
 
 static void gb_move_gap_to_point(GapBuffer *);
 static int gb_increase_gap_if_required(GapBuffer *, size_t new_size);
 static int gb_decrease_gap_if_required(GapBuffer *);
+static size_t gb_growth_gap(const GapBuffer *, size_t length);
+static size_t gb_alloc_size(const GapBuffer *, size_t size);
+static int gb_use_huge_pages(const GapBuffer *, size_t size);
+static char *gb_alloc_text(const GapBuffer *, size_t size, int *huge);
+static void gb_free_alloc(char *text, size_t size, int huge);
+static int gb_resize_text(GapBuffer *, size_t new_alloc, size_t keep);
 static size_t gb_internal_point(const GapBuffer *, size_t external_point);
 static size_t gb_external_point(const GapBuffer *, size_t internal_point);
+static int gb_to_piece_table(GapBuffer *);
+static int gb_from_piece_table(GapBuffer *);
+static int gb_materialize(GapBuffer *);
+static int gb_copy_text(GapBuffer *, size_t length);
+static void gb_free_text(GapBuffer *);
+static void gb_release_text(GapBuffer *);
+static int gb_resize_indexes(GapBuffer *, size_t allocated);
+static void gb_rebuild_indexes(GapBuffer *);
+static void gb_reindex_from(GapBuffer *, size_t start);
+static void gb_index_to(const GapBuffer *, size_t block);
+static void gb_index_lines(const GapBuffer *, size_t lines);
+static void gb_index_block(GapBuffer *);
+static void gb_add_indexed_block(GapBuffer *, size_t lines);
+static void gb_index_plain_to(const GapBuffer *, size_t block);
+static void gb_check_mapping(GapBuffer *);
+static void gb_update_indexes(GapBuffer *, size_t start, size_t end);
+static void gb_set_block_lines(GapBuffer *, size_t block, size_t lines);
+static size_t gb_count_lines(const GapBuffer *, size_t start, size_t end);
+static int gb_is_plain(const GapBuffer *, size_t start, size_t end);
+static int gb_is_plain_text(const char *text, size_t length);
+static void gb_record_change(GapBuffer *, size_t pos, size_t removed,
+                             size_t added);
+static void gb_add_dirty_range(GBDirtyRanges *, size_t start, size_t end);
+static void gb_span_move_gap(GBSpan *, size_t point);
+static int gb_insert_text(GapBuffer *, const char *str, size_t str_len);
+static int gb_delete_text(GapBuffer *, size_t byte_num);
 
 GapBuffer *gb_new(size_t size)
 {
@@ -42,6 +88,12 @@ GapBuffer *gb_new(size_t size)
 
     memset(buffer, 0, sizeof(GapBuffer));
 
+    buffer->policy = (GBAllocPolicy) {
+        .growth = GB_DEFAULT_GROWTH,
+        .shrink = GB_DEFAULT_SHRINK,
+        .huge_page_min = GB_DEFAULT_HUGE_PAGE_MIN
+    };
+
     buffer->text = malloc(size);
 
     if (buffer->text == NULL) {
@@ -52,6 +104,13 @@ GapBuffer *gb_new(size_t size)
     buffer->allocated = size;
     buffer->gap_end = size;
 
+    if (!gb_resize_indexes(buffer, size)) {
+        gb_free(buffer);
+        return NULL;
+    }
+
+    gb_rebuild_indexes(buffer);
+
     return buffer;
 }
 
@@ -61,20 +120,371 @@ void gb_free(GapBuffer *buffer)
         return;
     }
 
-    free(buffer->text);
+    pt_free(buffer->pt);
+    gb_release_text(buffer);
     free(buffer);
 }
 
+/* Create a copy of buffer in O(1) time which initially shares its text.
+ * Text is only copied when either buffer is next modified and when using
+ * a piece table only the pieces on the path to the modification are
+ * copied. This gives a consistent view of the buffer text which can be
+ * read while the original buffer continues to be edited. The snapshot
+ * is freed using gb_free. Reference counts aren't atomic so snapshots
+ * must be created and freed on the thread which modifies the buffer */
+GapBuffer *gb_snapshot(GapBuffer *buffer)
+{
+    GapBuffer *snapshot = malloc(sizeof(GapBuffer));
+
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    *snapshot = *buffer;
+
+    if (buffer->pt != NULL) {
+        snapshot->pt = pt_snapshot(buffer->pt);
+
+        if (snapshot->pt == NULL) {
+            free(snapshot);
+            return NULL;
+        }
+
+        return snapshot;
+    }
+
+    if (buffer->shared == NULL) {
+        buffer->shared = malloc(sizeof(size_t));
+
+        if (buffer->shared == NULL) {
+            free(snapshot);
+            return NULL;
+        }
+
+        *buffer->shared = 1;
+        snapshot->shared = buffer->shared;
+    }
+
+    (*buffer->shared)++;
+
+    return snapshot;
+}
+
 size_t gb_length(const GapBuffer *buffer)
 {
+    if (buffer->pt != NULL) {
+        return pt_length(buffer->pt);
+    }
+
     return buffer->allocated - gb_gap_size(buffer);
 }
 
 size_t gb_lines(const GapBuffer *buffer)
 {
+    if (buffer->pt != NULL) {
+        return pt_lines(buffer->pt);
+    } else if (buffer->lazy != NULL) {
+        gb_index_to(buffer, buffer->blocks);
+        return buffer->lazy->lines;
+    }
+
     return buffer->lines;
 }
 
+/* Return the number of new lines without indexing any more mapped
+ * text. complete is false when only the new lines in the blocks
+ * indexed so far are counted, which is a lower bound */
+size_t gb_lines_indexed(const GapBuffer *buffer, int *complete)
+{
+    if (buffer->pt == NULL && buffer->lazy != NULL &&
+        buffer->lazy->indexed < buffer->blocks) {
+        *complete = 0;
+        return buffer->lazy->lines;
+    }
+
+    *complete = 1;
+
+    return gb_lines(buffer);
+}
+
+GapBufferStorage gb_get_storage(const GapBuffer *buffer)
+{
+    return buffer->pt != NULL ? GBS_PIECE_TABLE : GBS_GAP;
+}
+
+/* Convert the layout used to store text. The buffer content
+ * and point are unchanged */
+int gb_set_storage(GapBuffer *buffer, GapBufferStorage storage)
+{
+    if (storage == gb_get_storage(buffer)) {
+        return 1;
+    } else if (storage == GBS_PIECE_TABLE) {
+        return gb_to_piece_table(buffer);
+    }
+
+    return gb_from_piece_table(buffer);
+}
+
+static int gb_to_piece_table(GapBuffer *buffer)
+{
+    PieceTable *pt = pt_new();
+
+    if (pt == NULL) {
+        return 0;
+    }
+
+    /* Insert the text after the gap first as pt_insert
+     * doesn't advance the point */
+    if (!pt_insert(pt, buffer->text + buffer->gap_end,
+                   buffer->allocated - buffer->gap_end) ||
+        !pt_insert(pt, buffer->text, buffer->gap_start)) {
+        pt_free(pt);
+        return 0;
+    }
+
+    pt_set_point(pt, gb_get_point(buffer));
+
+    gb_release_text(buffer);
+    buffer->point = buffer->gap_start = buffer->gap_end = 0;
+    buffer->allocated = buffer->lines = buffer->blocks = 0;
+    buffer->pt = pt;
+
+    return 1;
+}
+
+static int gb_from_piece_table(GapBuffer *buffer)
+{
+    PieceTable *pt = buffer->pt;
+    size_t length = pt_length(pt);
+    size_t alloc = gb_alloc_size(buffer,
+                                 length + gb_growth_gap(buffer, length));
+    int huge;
+    char *text = gb_alloc_text(buffer, alloc, &huge);
+
+    if (text == NULL) {
+        return 0;
+    }
+
+    if (!gb_resize_indexes(buffer, alloc)) {
+        gb_free_alloc(text, alloc, huge);
+        return 0;
+    }
+
+    pt_get_range(pt, 0, text, length);
+
+    buffer->text = text;
+    buffer->huge = huge;
+    buffer->allocated = alloc;
+    buffer->gap_start = length;
+    buffer->gap_end = alloc;
+    buffer->lines = pt_lines(pt);
+    buffer->point = pt_get_point(pt);
+    buffer->pt = NULL;
+
+    gb_rebuild_indexes(buffer);
+    pt_free(pt);
+
+    return 1;
+}
+
+/* Use a read only mapping of the file referenced by fd as the buffer
+ * text. This avoids copying the file into memory when it's loaded,
+ * instead text is read directly from the page cache as required.
+ * The line and plain text indexes are also only built for each block
+ * when it's first accessed, so opening a file doesn't read all of it.
+ * Counting every line (see gb_lines) still reads the whole file.
+ * The text is only copied into allocated memory when the buffer
+ * is first modified. The buffer must be empty.
+ *
+ * Reading a page of the mapping after the file has been truncated by
+ * another process raises SIGBUS. Truncation is checked for before
+ * blocks are indexed and before the text is copied, and any text past
+ * the new end of the file is then read as zeros. Text read at other
+ * times, e.g. when drawing, isn't checked */
+int gb_map_file(GapBuffer *buffer, int fd, size_t length)
+{
+    assert(gb_length(buffer) == 0);
+
+    if (buffer->pt != NULL || gb_length(buffer) != 0 || length == 0 ||
+        !gb_materialize(buffer)) {
+        return 0;
+    }
+
+    char *text = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (text == MAP_FAILED) {
+        return 0;
+    }
+
+    GBLazyIndex *lazy = malloc(sizeof(GBLazyIndex));
+
+    if (lazy == NULL || !gb_resize_indexes(buffer, length)) {
+        free(lazy);
+        munmap(text, length);
+        return 0;
+    }
+
+    gb_record_change(buffer, 0, 0, length);
+    gb_free_text(buffer);
+
+    /* The gap is empty so no text is ever written to the mapping */
+    buffer->text = text;
+    buffer->mapped = length;
+    /* Retain the file so unmodified text can be copied from it
+     * directly when written (see gb_mapped_fd) */
+    buffer->mapped_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    buffer->allocated = length;
+    buffer->gap_start = buffer->gap_end = length;
+    buffer->point = 0;
+    buffer->lines = 0;
+
+    /* Fenwick tree nodes accumulate the counts of their
+     * children as blocks are indexed in order */
+    memset(buffer->line_index, 0, (buffer->blocks + 1) * sizeof(size_t));
+    *lazy = (GBLazyIndex) { 0 };
+    buffer->lazy = lazy;
+
+    return 1;
+}
+
+int gb_is_mapped(const GapBuffer *buffer)
+{
+    return buffer->mapped != 0;
+}
+
+/* Returns a descriptor for the file mapped by gb_map_file, whose
+ * first gb_length bytes are the buffer text, or -1 if the buffer
+ * isn't mapped. The descriptor is owned by the buffer and remains
+ * valid until the buffer is modified or freed */
+int gb_mapped_fd(const GapBuffer *buffer)
+{
+    return buffer->mapped != 0 ? buffer->mapped_fd : -1;
+}
+
+/* Index mapped text using the new line counts of blocks first to
+ * first + block_num - 1 found by reading the file elsewhere, so the
+ * mapping itself needn't be read (see fl_start_counting). Blocks which
+ * are already indexed are skipped and nothing is done once the text is
+ * no longer mapped. As with gb_index_to this must only be called on the
+ * thread which modifies the buffer */
+void gb_add_block_lines(GapBuffer *buffer, size_t first,
+                        const size_t *block_lines, size_t block_num)
+{
+    if (buffer->lazy == NULL) {
+        return;
+    }
+
+    gb_index_to(buffer, first);
+    size_t end = MIN(first + block_num, buffer->blocks);
+
+    for (size_t k = buffer->lazy->indexed; k < end; k++) {
+        gb_add_indexed_block(buffer, block_lines[k - first]);
+    }
+}
+
+/* Ensure the buffer text can be modified. Mapped text is copied into
+ * allocated memory and text shared with a snapshot is copied so that
+ * the snapshot is unaffected */
+static int gb_materialize(GapBuffer *buffer)
+{
+    if (buffer->shared != NULL && *buffer->shared == 1) {
+        /* All other buffers sharing the text have been freed */
+        free(buffer->shared);
+        buffer->shared = NULL;
+    }
+
+    if (buffer->mapped == 0 && buffer->shared == NULL) {
+        return 1;
+    }
+
+    return gb_copy_text(buffer, gb_length(buffer));
+}
+
+/* Replace the text with allocated memory owned by this buffer
+ * containing a copy of the first length bytes of text */
+static int gb_copy_text(GapBuffer *buffer, size_t length)
+{
+    gb_check_mapping(buffer);
+
+    size_t alloc = gb_alloc_size(buffer,
+                                 length + gb_growth_gap(buffer, length));
+    GapBuffer copy;
+
+    memset(&copy, 0, sizeof(GapBuffer));
+    copy.policy = buffer->policy;
+    copy.stats = buffer->stats;
+    copy.dirty = buffer->dirty;
+    copy.text = gb_alloc_text(buffer, alloc, &copy.huge);
+
+    if (copy.text == NULL || !gb_resize_indexes(&copy, alloc)) {
+        if (copy.text != NULL) {
+            gb_free_alloc(copy.text, alloc, copy.huge);
+        }
+
+        free(copy.block_lines);
+        free(copy.line_index);
+        free(copy.plain_chunks);
+        return 0;
+    }
+
+    gb_get_range(buffer, 0, copy.text, length);
+
+    /* The gap is at the end so internal and external points are equal */
+    copy.point = MIN(gb_get_point(buffer), length);
+    copy.gap_start = length;
+    copy.gap_end = alloc;
+    copy.allocated = alloc;
+
+    gb_release_text(buffer);
+    *buffer = copy;
+
+    gb_rebuild_indexes(buffer);
+    buffer->lines = gb_lines_before(buffer, length);
+
+    return 1;
+}
+
+static void gb_free_text(GapBuffer *buffer)
+{
+    if (buffer->mapped != 0) {
+        munmap(buffer->text, buffer->mapped);
+
+        if (buffer->mapped_fd != -1) {
+            close(buffer->mapped_fd);
+        }
+
+        buffer->mapped = 0;
+    } else if (buffer->text != NULL) {
+        gb_free_alloc(buffer->text, buffer->allocated, buffer->huge);
+    }
+
+    buffer->text = NULL;
+    buffer->huge = 0;
+}
+
+/* Free the text and indexes unless they're
+ * still shared with another buffer */
+static void gb_release_text(GapBuffer *buffer)
+{
+    if (buffer->shared != NULL && --*buffer->shared > 0) {
+        buffer->text = NULL;
+        buffer->mapped = 0;
+        buffer->huge = 0;
+    } else {
+        free(buffer->shared);
+        gb_free_text(buffer);
+        free(buffer->block_lines);
+        free(buffer->line_index);
+        free(buffer->plain_chunks);
+        free(buffer->lazy);
+    }
+
+    buffer->shared = NULL;
+    buffer->block_lines = buffer->line_index = NULL;
+    buffer->plain_chunks = NULL;
+    buffer->lazy = NULL;
+}
+
 /* Move gap to point. This is necessary to 
  * insert and delete text */
 static void gb_move_gap_to_point(GapBuffer *buffer)
@@ -102,6 +512,11 @@ static void gb_move_gap_to_point(GapBuffer *buffer)
 
         buffer->gap_end -= byte_num;
         buffer->gap_start = buffer->point;
+
+        gb_update_indexes(buffer, buffer->gap_start,
+                          buffer->gap_start + byte_num);
+        gb_update_indexes(buffer, buffer->gap_end,
+                          buffer->gap_end + byte_num);
     } else {
         /* | T |   |   | e | s | t | */
         /* 0   1   2   3   4   5   6 */
@@ -123,27 +538,163 @@ static void gb_move_gap_to_point(GapBuffer *buffer)
         buffer->gap_start += byte_num;
         buffer->gap_end += byte_num;
         buffer->point = buffer->gap_start;
+
+        gb_update_indexes(buffer, buffer->gap_start - byte_num,
+                          buffer->gap_start);
+        gb_update_indexes(buffer, buffer->gap_end - byte_num,
+                          buffer->gap_end);
     } 
 }
 
 size_t gb_gap_size(const GapBuffer *buffer)
 {
+    if (buffer->pt != NULL) {
+        return 0;
+    }
+
     return buffer->gap_end - buffer->gap_start;
 }
 
+void gb_set_alloc_policy(GapBuffer *buffer, const GBAllocPolicy *policy)
+{
+    assert(policy->shrink >= 2);
+    buffer->policy = *policy;
+
+    if (buffer->policy.shrink < 2) {
+        buffer->policy.shrink = 2;
+    }
+}
+
+void gb_get_alloc_stats(const GapBuffer *buffer, GBAllocStats *stats)
+{
+    *stats = buffer->stats;
+    stats->allocated = buffer->pt != NULL ? 0 : buffer->allocated;
+    stats->huge_pages = buffer->huge;
+}
+
+/* Start tracking changes relative to the current text */
+void gb_track_changes(GapBuffer *buffer)
+{
+    buffer->dirty.tracking = 1;
+    buffer->dirty.base_length = gb_length(buffer);
+    buffer->dirty.range_num = 0;
+}
+
+void gb_untrack_changes(GapBuffer *buffer)
+{
+    buffer->dirty.tracking = 0;
+    buffer->dirty.range_num = 0;
+}
+
+/* Returns the text changed since gb_track_changes was
+ * called or NULL if changes aren't being tracked */
+const GBDirtyRanges *gb_dirty_ranges(const GapBuffer *buffer)
+{
+    return buffer->dirty.tracking ? &buffer->dirty : NULL;
+}
+
+/* Record that removed bytes at pos are about to be replaced by
+ * added bytes. A change which alters the text length moves all text
+ * after pos, which is then considered dirty up to the end of text */
+static void gb_record_change(GapBuffer *buffer, size_t pos, size_t removed,
+                             size_t added)
+{
+    GBDirtyRanges *dirty = &buffer->dirty;
+
+    if (!dirty->tracking) {
+        return;
+    }
+
+    size_t end = pos + added;
+
+    if (removed != added) {
+        end = gb_length(buffer) - removed + added;
+
+        /* Ranges after pos are covered by the new range */
+        while (dirty->range_num > 0 &&
+               dirty->ranges[dirty->range_num - 1].start >= pos) {
+            dirty->range_num--;
+        }
+
+        if (dirty->range_num > 0) {
+            GBRange *last = &dirty->ranges[dirty->range_num - 1];
+            last->end = MIN(last->end, pos);
+        }
+    }
+
+    if (end > pos) {
+        gb_add_dirty_range(dirty, pos, end);
+    }
+}
+
+static void gb_add_dirty_range(GBDirtyRanges *dirty, size_t start,
+                               size_t end)
+{
+    GBRange *ranges = dirty->ranges;
+    size_t range_num = dirty->range_num;
+    size_t first = 0;
+
+    while (first < range_num && ranges[first].end < start) {
+        first++;
+    }
+
+    size_t last = first;
+
+    /* Absorb ranges which overlap or are adjacent to the new range */
+    while (last < range_num && ranges[last].start <= end) {
+        start = MIN(start, ranges[last].start);
+        end = MAX(end, ranges[last].end);
+        last++;
+    }
+
+    if (first == last && range_num == GB_MAX_DIRTY_RANGES) {
+        /* Merge with the nearest range so the number of ranges
+         * doesn't increase */
+        if (first == range_num ||
+            (first > 0 && start - ranges[first - 1].end <
+                          ranges[first].start - end)) {
+            start = ranges[--first].start;
+        } else {
+            end = ranges[last++].end;
+        }
+    }
+
+    memmove(ranges + first + 1, ranges + last,
+            (range_num - last) * sizeof(GBRange));
+    ranges[first] = (GBRange) { .start = start, .end = end };
+    dirty->range_num = range_num - (last - first) + 1;
+}
+
 int gb_preallocate(GapBuffer *buffer, size_t size)
 {
+    if (buffer->pt != NULL) {
+        return 1;
+    } else if (!gb_materialize(buffer)) {
+        return 0;
+    }
+
     return gb_increase_gap_if_required(buffer, size);
 }
 
 /* This function moves the gap to the end of the buffer
  * which means buffer->text points to a continuous string
- * in memory. This allows buffer->text to be used with
- * libraries like PCRE */
-void gb_contiguous_storage(GapBuffer *buffer)
+ * in memory. This allows the buffer text to be used with
+ * libraries like PCRE. The returned pointer is valid until
+ * the buffer is next modified */
+const char *gb_contiguous_storage(GapBuffer *buffer)
 {
+    if (buffer->pt != NULL) {
+        return pt_contiguous_storage(buffer->pt);
+    } else if (buffer->gap_end != buffer->allocated &&
+               !gb_materialize(buffer)) {
+        /* Shared text can't be rearranged in place */
+        return NULL;
+    }
+
     gb_set_point(buffer, gb_length(buffer));
     gb_move_gap_to_point(buffer);
+
+    return buffer->text;
 }
 
 static int gb_increase_gap_if_required(GapBuffer *buffer, size_t new_size)
@@ -151,18 +702,22 @@ static int gb_increase_gap_if_required(GapBuffer *buffer, size_t new_size)
     size_t new_alloc;
 
     if (new_size > buffer->allocated) {
-        new_alloc = new_size + GAP_INCREMENT; 
+        new_alloc = gb_alloc_size(buffer, new_size +
+                                  gb_growth_gap(buffer, new_size)); 
     } else {
         return 1;
     }
 
-    void *ptr = realloc(buffer->text, new_alloc);
+    if (!gb_resize_indexes(buffer, new_alloc)) {
+        return 0;
+    }
 
-    if (ptr == NULL) {
+    if (!gb_resize_text(buffer, new_alloc, buffer->allocated)) {
+        gb_resize_indexes(buffer, buffer->allocated);
         return 0;
     }
 
-    buffer->text = ptr;
+    buffer->stats.grows++;
 
     size_t byte_num = buffer->allocated - buffer->gap_end;
 
@@ -182,6 +737,12 @@ static int gb_increase_gap_if_required(GapBuffer *buffer, size_t new_size)
     buffer->gap_end += size_increase;
     buffer->allocated = new_alloc;
 
+    /* Text after the gap has moved so recount the blocks from the gap
+     * onwards. The growth needn't be a whole number of blocks so their
+     * counts can't simply be shifted, but text before the gap is
+     * unchanged so isn't read again */
+    gb_reindex_from(buffer, buffer->gap_start);
+
     /* | T |   |   | e | s | t |   |   |   | */
     /* 0   1   2   3   4   5   6   7   8   9 */
     /*    GS      GE       P                 */
@@ -204,12 +765,18 @@ static int gb_increase_gap_if_required(GapBuffer *buffer, size_t new_size)
 
 static int gb_decrease_gap_if_required(GapBuffer *buffer)
 {
-    if (!(gb_gap_size(buffer) > (2 * GAP_INCREMENT))) {
+    size_t buffer_len = gb_length(buffer);
+    size_t gap = gb_growth_gap(buffer, buffer_len);
+
+    if (gb_gap_size(buffer) <= gap * buffer->policy.shrink) {
         return 1;
     }
 
-    size_t buffer_len = gb_length(buffer);
-    size_t new_alloc = buffer_len + GAP_INCREMENT;
+    size_t new_alloc = gb_alloc_size(buffer, buffer_len + gap);
+
+    if (new_alloc >= buffer->allocated) {
+        return 1;
+    }
 
     /* Move the gap to the end of the buffer so that
      * it is shrunk by the realloc */
@@ -218,87 +785,213 @@ static int gb_decrease_gap_if_required(GapBuffer *buffer)
 
     gb_move_gap_to_point(buffer);
 
-    void *ptr = realloc(buffer->text, new_alloc);
+    int resized = gb_resize_text(buffer, new_alloc, buffer_len);
 
     gb_set_point(buffer, point);
 
-    if (ptr == NULL) {
+    if (!resized) {
         return 0;
     }
 
-    buffer->text = ptr;
-    buffer->gap_end = buffer->gap_start + GAP_INCREMENT;
+    buffer->gap_end = new_alloc;
     buffer->allocated = new_alloc;
+    buffer->stats.shrinks++;
+
+    gb_resize_indexes(buffer, new_alloc);
+    gb_rebuild_indexes(buffer);
 
     return 1;
 }
 
-int gb_insert(GapBuffer *buffer, const char *str, size_t str_len)
+/* The size of the gap to leave after growing or shrinking
+ * the allocation for a buffer of length bytes */
+static size_t gb_growth_gap(const GapBuffer *buffer, size_t length)
 {
-    assert(str != NULL);
+    size_t gap = length / 100 * buffer->policy.growth;
 
-    if (str == NULL) {
-        return 0;
-    } else if (str_len == 0) {
-        return 1;
+    return gap > GAP_INCREMENT ? gap : GAP_INCREMENT;
+}
+
+/* Huge page backed allocations are rounded up to
+ * a whole number of huge pages */
+static size_t gb_alloc_size(const GapBuffer *buffer, size_t size)
+{
+#if GB_HUGE_PAGES
+    if (gb_use_huge_pages(buffer, size)) {
+        return (size + GB_HUGE_PAGE_SIZE - 1) /
+               GB_HUGE_PAGE_SIZE * GB_HUGE_PAGE_SIZE;
     }
+#else
+    (void)buffer;
+#endif
 
-    gb_move_gap_to_point(buffer);
+    return size;
+}
 
-    size_t new_length = gb_length(buffer) + str_len;
+static int gb_use_huge_pages(const GapBuffer *buffer, size_t size)
+{
+#if GB_HUGE_PAGES
+    return buffer->policy.huge_page_min != 0 &&
+           size >= buffer->policy.huge_page_min;
+#else
+    (void)buffer;
+    (void)size;
+    return 0;
+#endif
+}
 
-    if (!gb_increase_gap_if_required(buffer, new_length)) {
-        return 0;
+/* Allocate memory for text. Large allocations use an anonymous
+ * mapping which is advised to use huge pages */
+static char *gb_alloc_text(const GapBuffer *buffer, size_t size, int *huge)
+{
+#if GB_HUGE_PAGES
+    if (gb_use_huge_pages(buffer, size)) {
+        char *text = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        /* Fall back to malloc if the mapping can't be created */
+        if (text != MAP_FAILED) {
+            madvise(text, size, MADV_HUGEPAGE);
+            *huge = 1;
+            return text;
+        }
     }
+#else
+    (void)buffer;
+#endif
 
-    char *text = buffer->text + buffer->point;
+    *huge = 0;
 
-    for (size_t k = 0; k < str_len; k++) {
-        if (*str == '\n') {
-            buffer->lines++;
-        }
+    return malloc(size);
+}
 
-        *text++ = *str++;
+static void gb_free_alloc(char *text, size_t size, int huge)
+{
+    if (huge) {
+        munmap(text, size);
+    } else {
+        free(text);
     }
-
-    buffer->gap_start += str_len;
-    
-    return 1;
 }
 
-/* Same as gb_insert but also advance point */
-int gb_add(GapBuffer *buffer, const char *str, size_t str_len)
+/* Resize the text allocation to new_alloc bytes
+ * preserving the first keep bytes */
+static int gb_resize_text(GapBuffer *buffer, size_t new_alloc, size_t keep)
 {
-    if (!gb_insert(buffer, str, str_len)) {
+    if (!buffer->huge && !gb_use_huge_pages(buffer, new_alloc)) {
+        char *text = realloc(buffer->text, new_alloc);
+
+        if (text == NULL) {
+            return 0;
+        }
+
+        buffer->text = text;
+
+        return 1;
+    }
+
+    /* Mappings can't be resized portably so allocate new memory */
+    int huge;
+    char *text = gb_alloc_text(buffer, new_alloc, &huge);
+
+    if (text == NULL) {
         return 0;
     }
 
-    buffer->point += str_len;
+    memcpy(text, buffer->text, MIN(keep, new_alloc));
+    gb_free_text(buffer);
+
+    buffer->text = text;
+    buffer->huge = huge;
+
     return 1;
 }
 
-int gb_delete(GapBuffer *buffer, size_t byte_num)
+int gb_insert(GapBuffer *buffer, const char *str, size_t str_len)
 {
-    if (byte_num == 0) {
-        return 1;
+    if (str != NULL) {
+        gb_record_change(buffer, gb_get_point(buffer), 0, str_len);
+    }
+
+    return gb_insert_text(buffer, str, str_len);
+}
+
+static int gb_insert_text(GapBuffer *buffer, const char *str, size_t str_len)
+{
+    assert(str != NULL);
+
+    if (str == NULL) {
+        return 0;
+    } else if (str_len == 0) {
+        return 1;
+    } else if (buffer->pt != NULL) {
+        return pt_insert(buffer->pt, str, str_len);
+    } else if (!gb_materialize(buffer)) {
+        return 0;
     }
 
     gb_move_gap_to_point(buffer);
 
-    /* Ensure deletion size is valid */
-    if (buffer->gap_end + byte_num > buffer->allocated) {
-        byte_num = buffer->allocated - buffer->gap_end;
+    size_t new_length = gb_length(buffer) + str_len;
+
+    if (!gb_increase_gap_if_required(buffer, new_length)) {
+        return 0;
     }
 
-    char *text = buffer->text + buffer->gap_end;
+    memcpy(buffer->text + buffer->point, str, str_len);
+    buffer->lines += bs_count(str, str_len, '\n');
 
-    for (size_t k = 0; k < byte_num; k++) {
-        if (*text++ == '\n') {
-            buffer->lines--;
-        }
+    buffer->gap_start += str_len;
+    gb_update_indexes(buffer, buffer->gap_start - str_len,
+                      buffer->gap_start);
+    
+    return 1;
+}
+
+/* Same as gb_insert but also advance point */
+int gb_add(GapBuffer *buffer, const char *str, size_t str_len)
+{
+    if (!gb_insert(buffer, str, str_len)) {
+        return 0;
+    }
+
+    if (buffer->pt != NULL) {
+        return pt_set_point(buffer->pt, pt_get_point(buffer->pt) + str_len);
+    }
+
+    buffer->point += str_len;
+    return 1;
+}
+
+int gb_delete(GapBuffer *buffer, size_t byte_num)
+{
+    size_t point = gb_get_point(buffer);
+    gb_record_change(buffer, point,
+                     MIN(byte_num, gb_length(buffer) - point), 0);
+
+    return gb_delete_text(buffer, byte_num);
+}
+
+static int gb_delete_text(GapBuffer *buffer, size_t byte_num)
+{
+    if (byte_num == 0) {
+        return 1;
+    } else if (buffer->pt != NULL) {
+        return pt_delete(buffer->pt, byte_num);
+    } else if (!gb_materialize(buffer)) {
+        return 0;
+    }
+
+    gb_move_gap_to_point(buffer);
+
+    /* Ensure deletion size is valid */
+    if (buffer->gap_end + byte_num > buffer->allocated) {
+        byte_num = buffer->allocated - buffer->gap_end;
     }
 
+    buffer->lines -= bs_count(buffer->text + buffer->gap_end, byte_num, '\n');
     buffer->gap_end += byte_num;
+    gb_update_indexes(buffer, buffer->gap_end - byte_num, buffer->gap_end);
 
     gb_decrease_gap_if_required(buffer);
 
@@ -325,6 +1018,20 @@ int gb_replace(GapBuffer *buffer, size_t byte_num, const char *str,
         return 0;
     }
 
+    size_t point = gb_get_point(buffer);
+    gb_record_change(buffer, point,
+                     MIN(byte_num, gb_length(buffer) - point), str_len);
+
+    if (buffer->pt != NULL) {
+        /* Pieces are never modified in place so a replace
+         * is simply a delete followed by an insert */
+        return pt_delete(buffer->pt, byte_num) &&
+               gb_insert_text(buffer, str, str_len) &&
+               pt_set_point(buffer->pt, point + str_len);
+    } else if (!gb_materialize(buffer)) {
+        return 0;
+    }
+
     gb_move_gap_to_point(buffer);
 
     size_t buffer_len = gb_length(buffer);
@@ -337,29 +1044,28 @@ int gb_replace(GapBuffer *buffer, size_t byte_num, const char *str,
     size_t replace_bytes = MIN(after_gap_bytes, MIN(byte_num, str_len));
     char *text = buffer->text + buffer->gap_end;
 
-    for (size_t k = 0; k < replace_bytes; k++) {
-        if (*text == '\n') {
-            buffer->lines--; 
-        } 
+    buffer->lines -= bs_count(text, replace_bytes, '\n');
+    buffer->lines += bs_count(str, replace_bytes, '\n');
+    memcpy(text, str, replace_bytes);
 
-        if (str[k] == '\n') {
-            buffer->lines++;
-        }
-
-        *text++ = str[k];
-    }
+    gb_update_indexes(buffer, buffer->gap_end,
+                      buffer->gap_end + replace_bytes);
 
     if (replace_bytes > 0) {
         buffer->point += gb_gap_size(buffer) + replace_bytes;
     }
 
-    if (str_len - replace_bytes > 0 && 
-       !gb_add(buffer, str + replace_bytes, str_len - replace_bytes)) {
-        return 0;
+    if (str_len - replace_bytes > 0) {
+        if (!gb_insert_text(buffer, str + replace_bytes,
+                            str_len - replace_bytes)) {
+            return 0;
+        }
+
+        buffer->point += str_len - replace_bytes;
     }
 
     if (byte_num > str_len) {
-        return gb_delete(buffer, byte_num - str_len);
+        return gb_delete_text(buffer, byte_num - str_len);
     }
 
     return 1;
@@ -367,14 +1073,36 @@ int gb_replace(GapBuffer *buffer, size_t byte_num, const char *str,
 
 void gb_clear(GapBuffer *buffer)
 {
+    gb_record_change(buffer, 0, gb_length(buffer), 0);
+
+    if (buffer->pt != NULL) {
+        pt_clear(buffer->pt);
+        return;
+    } else if (buffer->mapped != 0 || buffer->shared != NULL) {
+        /* Release mapped or shared text rather than copying text
+         * that's about to be discarded. If this fails the buffer
+         * is left unchanged */
+        if (!gb_copy_text(buffer, 0)) {
+            return;
+        }
+    }
+
     buffer->point = 0;
     buffer->gap_start = 0;
     buffer->gap_end = buffer->allocated;
     buffer->lines = 0;
+
+    memset(buffer->block_lines, 0, buffer->blocks * sizeof(size_t));
+    memset(buffer->line_index, 0, (buffer->blocks + 1) * sizeof(size_t));
+    memset(buffer->plain_chunks, 1, buffer->chunks);
 }
 
 size_t gb_get_point(const GapBuffer *buffer)
 {
+    if (buffer->pt != NULL) {
+        return pt_get_point(buffer->pt);
+    }
+
     if (buffer->point > buffer->gap_end) {
         return buffer->point - gb_gap_size(buffer);
     }
@@ -388,7 +1116,9 @@ int gb_set_point(GapBuffer *buffer, size_t point)
 
     if (point > gb_length(buffer)) {
         return 0;
-    } 
+    } else if (buffer->pt != NULL) {
+        return pt_set_point(buffer->pt, point);
+    }
 
     buffer->point = gb_internal_point(buffer, point);
 
@@ -406,7 +1136,9 @@ char gb_get_at(const GapBuffer *buffer, size_t point)
 
     if (point >= gb_length(buffer)) {
         return '\0';
-    } 
+    } else if (buffer->pt != NULL) {
+        return pt_get_at(buffer->pt, point);
+    }
 
     point = gb_internal_point(buffer, point);
 
@@ -426,6 +1158,10 @@ unsigned char gb_getu_at(const GapBuffer *buffer, size_t point)
 size_t gb_get_range(const GapBuffer *buffer, size_t point, char *buf,
                     size_t num_bytes)
 {
+    if (buffer->pt != NULL) {
+        return pt_get_range(buffer->pt, point, buf, num_bytes);
+    }
+
     size_t buffer_len = gb_length(buffer);
     assert(buf != NULL);
     assert(point <= buffer_len);
@@ -464,6 +1200,182 @@ size_t gb_get_range(const GapBuffer *buffer, size_t point, char *buf,
     return num_bytes;
 }
 
+/* Set text to point to the buffer text at point and return the number
+ * of bytes that can be read contiguously from there */
+size_t gb_get_segment(const GapBuffer *buffer, size_t point, const char **text)
+{
+    assert(point <= gb_length(buffer));
+
+    if (buffer->pt != NULL) {
+        return pt_get_segment(buffer->pt, point, text);
+    }
+
+    if (point < buffer->gap_start) {
+        *text = buffer->text + point;
+        return buffer->gap_start - point;
+    }
+
+    point += gb_gap_size(buffer);
+
+    if (point >= buffer->allocated) {
+        return 0;
+    }
+
+    *text = buffer->text + point;
+
+    return buffer->allocated - point;
+}
+
+void gb_segment_iter_init(GBSegmentIter *iter, const GapBuffer *buffer,
+                          size_t point, size_t length)
+{
+    size_t buffer_len = gb_length(buffer);
+
+    iter->buffer = buffer;
+    iter->point = MIN(point, buffer_len);
+    iter->end = iter->point + MIN(length, buffer_len - iter->point);
+}
+
+/* Retrieve the next segment in the range. Returns 0 when
+ * the end of the range has been reached */
+int gb_segment_iter_next(GBSegmentIter *iter, const char **text,
+                         size_t *length)
+{
+    if (iter->point >= iter->end) {
+        return 0;
+    }
+
+    size_t segment_length = gb_get_segment(iter->buffer, iter->point, text);
+
+    if (segment_length == 0) {
+        return 0;
+    }
+
+    *length = MIN(segment_length, iter->end - iter->point);
+    iter->point += *length;
+
+    return 1;
+}
+
+void gb_cursor_init(GBCursor *cursor, const GapBuffer *buffer)
+{
+    *cursor = (GBCursor) {
+        .buffer = buffer
+    };
+}
+
+/* Cache the segment containing point. Returns 0
+ * if point is at or past the buffer end */
+int gb_cursor_load(GBCursor *cursor, size_t point)
+{
+    const GapBuffer *buffer = cursor->buffer;
+
+    if (point >= gb_length(buffer)) {
+        return 0;
+    }
+
+    if (buffer->pt != NULL) {
+        /* Determine the bounds of the piece containing point */
+        const char *text;
+        size_t before = pt_get_segment_before(buffer->pt, point + 1,
+                                              &cursor->text);
+        cursor->start = point + 1 - before;
+        cursor->length = before - 1 + pt_get_segment(buffer->pt, point,
+                                                     &text);
+    } else if (point < buffer->gap_start) {
+        cursor->text = buffer->text;
+        cursor->start = 0;
+        cursor->length = buffer->gap_start;
+    } else {
+        cursor->text = buffer->text + buffer->gap_end;
+        cursor->start = buffer->gap_start;
+        cursor->length = buffer->allocated - buffer->gap_end;
+    }
+
+    return 1;
+}
+
+/* Copy length bytes of buffer text from point into a span with room
+ * for max_insert more bytes to be inserted. Returns 0 when memory
+ * can't be allocated */
+int gb_span_init(GBSpan *span, const GapBuffer *buffer, size_t point,
+                 size_t length, size_t max_insert)
+{
+    size_t size = length + max_insert;
+
+    /* The gap starts after the copied text */
+    *span = (GBSpan) {
+        .text = malloc(MAX(size, 1)),
+        .size = size,
+        .gap_start = length,
+        .gap_end = size
+    };
+
+    if (span->text == NULL) {
+        return 0;
+    }
+
+    gb_get_range(buffer, point, span->text, length);
+
+    return 1;
+}
+
+void gb_span_insert(GBSpan *span, size_t point, const char *str,
+                    size_t str_len)
+{
+    assert(str_len <= span->gap_end - span->gap_start);
+    gb_span_move_gap(span, point);
+    memcpy(span->text + span->gap_start, str, str_len);
+    span->gap_start += str_len;
+}
+
+/* Delete byte_num bytes from point, copying them
+ * to deleted first when it isn't NULL */
+void gb_span_delete(GBSpan *span, size_t point, size_t byte_num,
+                    char *deleted)
+{
+    gb_span_move_gap(span, point);
+    assert(byte_num <= span->size - span->gap_end);
+
+    if (deleted != NULL) {
+        memcpy(deleted, span->text + span->gap_end, byte_num);
+    }
+
+    span->gap_end += byte_num;
+}
+
+/* Return the edited text, which is made contiguous
+ * by moving the gap to the end of the span */
+const char *gb_span_text(GBSpan *span, size_t *length)
+{
+    gb_span_move_gap(span, span->gap_start + span->size - span->gap_end);
+    *length = span->gap_start;
+
+    return span->text;
+}
+
+void gb_span_free(GBSpan *span)
+{
+    free(span->text);
+    span->text = NULL;
+}
+
+static void gb_span_move_gap(GBSpan *span, size_t point)
+{
+    if (point < span->gap_start) {
+        size_t move = span->gap_start - point;
+        memmove(span->text + span->gap_end - move, span->text + point, move);
+        span->gap_start -= move;
+        span->gap_end -= move;
+    } else if (point > span->gap_start) {
+        size_t move = point - span->gap_start;
+        memmove(span->text + span->gap_start, span->text + span->gap_end,
+                move);
+        span->gap_start += move;
+        span->gap_end += move;
+    }
+}
+
 static size_t gb_internal_point(const GapBuffer *buffer, size_t external_point)
 {
     if (external_point > buffer->gap_start) {
@@ -491,6 +1403,8 @@ int gb_find_next(const GapBuffer *buffer, size_t point, size_t *next, char c)
 
     if (next == NULL || point >= gb_length(buffer)) {
         return 0;
+    } else if (buffer->pt != NULL) {
+        return pt_find_next(buffer->pt, point, next, c);
     }
 
     point = gb_internal_point(buffer, point);
@@ -540,13 +1454,17 @@ int gb_find_prev(const GapBuffer *buffer, size_t point, size_t *prev, char c)
         point = buffer_len;
     }
 
+    if (buffer->pt != NULL) {
+        return pt_find_prev(buffer->pt, point, prev, c);
+    }
+
     point = gb_internal_point(buffer, point);
-    char *match;
+    const char *match;
     size_t offset;
 
     if (point > buffer->gap_end) {
-        match = memrch(buffer->text + buffer->gap_end, c,
-                        point - buffer->gap_end);
+        match = bs_find_rev(buffer->text + buffer->gap_end,
+                            point - buffer->gap_end, c);
 
         if (match != NULL) {
             offset = match - (buffer->text + buffer->gap_end);
@@ -559,7 +1477,7 @@ int gb_find_prev(const GapBuffer *buffer, size_t point, size_t *prev, char c)
         point = buffer->gap_start;
     }
 
-    match = memrch(buffer->text, c, point);
+    match = bs_find_rev(buffer->text, point, c);
 
     if (match != NULL) {
         offset = match - buffer->text;
@@ -569,3 +1487,478 @@ int gb_find_prev(const GapBuffer *buffer, size_t point, size_t *prev, char c)
 
     return 0;
 }
+
+/* Return the number of \r\n pairs contained
+ * in the length bytes starting at point */
+size_t gb_count_crlf(const GapBuffer *buffer, size_t point, size_t length)
+{
+    GBSegmentIter iter;
+    const char *text;
+    size_t segment_length;
+    size_t count = 0;
+    char last = '\0';
+
+    gb_segment_iter_init(&iter, buffer, point, length);
+
+    while (gb_segment_iter_next(&iter, &text, &segment_length)) {
+        /* Check for a pair spanning two segments */
+        if (last == '\r' && *text == '\n') {
+            count++;
+        }
+
+        count += bs_count_crlf(text, segment_length);
+        last = text[segment_length - 1];
+    }
+
+    return count;
+}
+
+/* Return the number of bytes, up to limit, from point which are
+ * printable ASCII characters. The run ends before the first line
+ * ending so each byte in it occupies a single column on the same
+ * line. Returns 0 for a piece table as no index is maintained */
+size_t gb_plain_run(const GapBuffer *buffer, size_t point, size_t limit)
+{
+    if (buffer->pt != NULL || point >= gb_length(buffer)) {
+        return 0;
+    }
+
+    limit = MIN(limit, gb_length(buffer) - point);
+
+    size_t run = 0;
+    size_t internal, segment;
+    const char *text, *match;
+
+    while (run < limit) {
+        internal = point + run;
+
+        if (internal >= buffer->gap_start) {
+            internal += gb_gap_size(buffer);
+        }
+
+        gb_index_plain_to(buffer, internal / GB_LINE_BLOCK_SIZE + 1);
+
+        if (!buffer->plain_chunks[internal / GB_PLAIN_CHUNK_SIZE]) {
+            break;
+        }
+
+        /* Scan to the end of the chunk or the start of the gap */
+        segment = GB_PLAIN_CHUNK_SIZE - internal % GB_PLAIN_CHUNK_SIZE;
+        segment = MIN(segment, limit - run);
+
+        if (internal < buffer->gap_start) {
+            segment = MIN(segment, buffer->gap_start - internal);
+        }
+
+        text = buffer->text + internal;
+
+        /* A plain chunk can only contain line endings */
+        if ((match = bs_find_non_printable(text, segment)) != NULL) {
+            return run + (match - text);
+        }
+
+        run += segment;
+    }
+
+    return run;
+}
+
+/* Return the number of new lines before point. This is
+ * the zero based index of the line point is on */
+size_t gb_lines_before(const GapBuffer *buffer, size_t point)
+{
+    assert(point <= gb_length(buffer));
+
+    if (buffer->pt != NULL) {
+        return pt_lines_before(buffer->pt, point);
+    }
+
+    point = gb_internal_point(buffer, MIN(point, gb_length(buffer)));
+
+    size_t block = point / GB_LINE_BLOCK_SIZE;
+    size_t lines = 0;
+
+    gb_index_to(buffer, block);
+
+    /* Sum the new lines in all blocks before the block containing point */
+    for (size_t k = block; k > 0; k -= k & -k) {
+        lines += buffer->line_index[k];
+    }
+
+    return lines + gb_count_lines(buffer, block * GB_LINE_BLOCK_SIZE, point);
+}
+
+/* Return the offset of the start of the line which has
+ * line new lines before it */
+size_t gb_line_start(const GapBuffer *buffer, size_t line)
+{
+    if (buffer->pt != NULL) {
+        return pt_line_start(buffer->pt, line);
+    }
+
+    size_t blocks = buffer->blocks;
+
+    if (buffer->lazy != NULL) {
+        /* Only the blocks up to the line need to be indexed */
+        gb_index_lines(buffer, line);
+        line = MIN(line, buffer->lazy->lines);
+        blocks = buffer->lazy->indexed;
+    } else {
+        line = MIN(line, buffer->lines);
+    }
+
+    if (line == 0) {
+        return 0;
+    }
+
+    size_t block = 0;
+    size_t step = 1;
+
+    while (step * 2 <= blocks) {
+        step *= 2;
+    }
+
+    /* Find the block containing the new line that ends the previous
+     * line by descending the Fenwick tree */
+    for (; step > 0; step /= 2) {
+        if (block + step <= blocks &&
+            buffer->line_index[block + step] < line) {
+            block += step;
+            line -= buffer->line_index[block];
+        }
+    }
+
+    size_t start = block * GB_LINE_BLOCK_SIZE;
+    size_t end = MIN(start + GB_LINE_BLOCK_SIZE, buffer->allocated);
+    const char *text, *match;
+    size_t length;
+
+    /* Scan the text before and after the gap in this block */
+    for (size_t k = 0; k < 2; k++) {
+        if (k == 0) {
+            text = buffer->text + start;
+            length = start < buffer->gap_start ?
+                     MIN(end, buffer->gap_start) - start : 0;
+        } else {
+            start = MAX(start, buffer->gap_end);
+            text = buffer->text + start;
+            length = end > start ? end - start : 0;
+        }
+
+        while (length > 0 && (match = memchr(text, '\n', length)) != NULL) {
+            if (--line == 0) {
+                return gb_external_point(buffer,
+                                         match - buffer->text) + 1;
+            }
+
+            length -= match + 1 - text;
+            text = match + 1;
+        }
+    }
+
+    assert(!"Line index is inconsistent with buffer text");
+
+    return gb_length(buffer);
+}
+
+/* Ensure enough blocks and chunks exist to cover allocated bytes */
+static int gb_resize_indexes(GapBuffer *buffer, size_t allocated)
+{
+    size_t blocks = (allocated + GB_LINE_BLOCK_SIZE - 1) / GB_LINE_BLOCK_SIZE;
+    size_t *block_lines = realloc(buffer->block_lines,
+                                  blocks * sizeof(size_t));
+
+    /* A failure when shrinking is harmless as the
+     * existing memory is large enough */
+    if (block_lines != NULL) {
+        buffer->block_lines = block_lines;
+    } else if (blocks > buffer->blocks) {
+        return 0;
+    }
+
+    size_t *line_index = realloc(buffer->line_index,
+                                 (blocks + 1) * sizeof(size_t));
+
+    if (line_index != NULL) {
+        buffer->line_index = line_index;
+    } else if (blocks > buffer->blocks) {
+        return 0;
+    }
+
+    buffer->blocks = blocks;
+
+    size_t chunks = (allocated + GB_PLAIN_CHUNK_SIZE - 1) /
+                    GB_PLAIN_CHUNK_SIZE;
+    unsigned char *plain_chunks = realloc(buffer->plain_chunks, chunks);
+
+    if (plain_chunks != NULL) {
+        buffer->plain_chunks = plain_chunks;
+    } else if (chunks > buffer->chunks) {
+        return 0;
+    }
+
+    buffer->chunks = chunks;
+
+    return 1;
+}
+
+/* Recount new lines in all blocks, rebuild Fenwick tree in O(n)
+ * and recheck which chunks are plain */
+static void gb_rebuild_indexes(GapBuffer *buffer)
+{
+    gb_reindex_from(buffer, 0);
+}
+
+/* Recount the blocks and recheck the chunks from internal position
+ * start to the end of allocated memory. A Fenwick tree node only
+ * depends on the blocks before it, so nodes before the first block
+ * recounted are unaffected and the rest are recalculated from their
+ * own block and their children, which precede them */
+static void gb_reindex_from(GapBuffer *buffer, size_t start)
+{
+    size_t chunk_start;
+
+    for (size_t k = start / GB_PLAIN_CHUNK_SIZE; k < buffer->chunks; k++) {
+        chunk_start = k * GB_PLAIN_CHUNK_SIZE;
+        buffer->plain_chunks[k] = gb_is_plain(
+                                    buffer, chunk_start,
+                                    MIN(chunk_start + GB_PLAIN_CHUNK_SIZE,
+                                        buffer->allocated));
+    }
+
+    size_t block_start;
+    buffer->line_index[0] = 0;
+
+    for (size_t k = start / GB_LINE_BLOCK_SIZE; k < buffer->blocks; k++) {
+        block_start = k * GB_LINE_BLOCK_SIZE;
+        buffer->block_lines[k] = gb_count_lines(
+                                    buffer, block_start,
+                                    MIN(block_start + GB_LINE_BLOCK_SIZE,
+                                        buffer->allocated));
+        buffer->line_index[k + 1] = buffer->block_lines[k];
+
+        for (size_t child = 1; child < ((k + 1) & -(k + 1)); child *= 2) {
+            buffer->line_index[k + 1] += buffer->line_index[k + 1 - child];
+        }
+    }
+}
+
+/* Index the blocks of mapped text before block. The indexes are a
+ * cache of information derived from the text so are built by functions
+ * which otherwise only read the buffer. Snapshots share the indexes so
+ * this must only be called on the thread which modifies the buffer */
+static void gb_index_to(const GapBuffer *buffer, size_t block)
+{
+    if (buffer->lazy == NULL || block <= buffer->lazy->indexed) {
+        return;
+    }
+
+    GapBuffer *indexed_buffer = (GapBuffer *)buffer;
+    block = MIN(block, buffer->blocks);
+    gb_check_mapping(indexed_buffer);
+
+    while (buffer->lazy->indexed < block) {
+        gb_index_block(indexed_buffer);
+    }
+}
+
+/* Index the blocks of mapped text until the indexed blocks
+ * contain the specified number of new lines */
+static void gb_index_lines(const GapBuffer *buffer, size_t lines)
+{
+    if (buffer->lazy == NULL || buffer->lazy->lines >= lines) {
+        return;
+    }
+
+    GapBuffer *indexed_buffer = (GapBuffer *)buffer;
+    gb_check_mapping(indexed_buffer);
+
+    while (buffer->lazy->lines < lines &&
+           buffer->lazy->indexed < buffer->blocks) {
+        gb_index_block(indexed_buffer);
+    }
+}
+
+/* Count the new lines in the next block of mapped text */
+static void gb_index_block(GapBuffer *buffer)
+{
+    size_t start = buffer->lazy->indexed * GB_LINE_BLOCK_SIZE;
+    size_t end = MIN(start + GB_LINE_BLOCK_SIZE, buffer->allocated);
+
+    gb_add_indexed_block(buffer, gb_count_lines(buffer, start, end));
+}
+
+/* Add the new line count of the next block of mapped text to the
+ * indexes. A Fenwick tree node is complete once its own block is
+ * added, as all its children precede it, and is then added to its
+ * parent */
+static void gb_add_indexed_block(GapBuffer *buffer, size_t lines)
+{
+    GBLazyIndex *lazy = buffer->lazy;
+    size_t block = lazy->indexed;
+    size_t node = block + 1;
+    size_t parent = node + (node & -node);
+
+    buffer->block_lines[block] = lines;
+    buffer->line_index[node] += lines;
+
+    if (parent <= buffer->blocks) {
+        buffer->line_index[parent] += buffer->line_index[node];
+    }
+
+    lazy->lines += lines;
+    lazy->indexed++;
+}
+
+/* Check the chunks of the blocks of mapped text before block for plain
+ * text. This is done separately from counting lines as counting all
+ * lines (see gb_lines) is much quicker than checking all text */
+static void gb_index_plain_to(const GapBuffer *buffer, size_t block)
+{
+    if (buffer->lazy == NULL || block <= buffer->lazy->plain_indexed) {
+        return;
+    }
+
+    GapBuffer *indexed_buffer = (GapBuffer *)buffer;
+    GBLazyIndex *lazy = buffer->lazy;
+    size_t first_chunk = lazy->plain_indexed * GB_LINE_BLOCK_SIZE /
+                         GB_PLAIN_CHUNK_SIZE;
+    size_t end = MIN(MIN(block, buffer->blocks) * GB_LINE_BLOCK_SIZE,
+                     buffer->allocated);
+    size_t last_chunk = (end + GB_PLAIN_CHUNK_SIZE - 1) /
+                        GB_PLAIN_CHUNK_SIZE;
+    size_t start;
+
+    gb_check_mapping(indexed_buffer);
+
+    for (size_t k = first_chunk; k < last_chunk; k++) {
+        start = k * GB_PLAIN_CHUNK_SIZE;
+        buffer->plain_chunks[k] = gb_is_plain(
+                                    buffer, start,
+                                    MIN(start + GB_PLAIN_CHUNK_SIZE, end));
+    }
+
+    lazy->plain_indexed = MIN(block, buffer->blocks);
+}
+
+/* Replace any pages of a mapping beyond the end of a file that has
+ * been truncated with zeros, as reading them would raise SIGBUS */
+static void gb_check_mapping(GapBuffer *buffer)
+{
+    struct stat file_stat;
+
+    if (buffer->mapped == 0 || buffer->mapped_fd == -1 ||
+        fstat(buffer->mapped_fd, &file_stat) == -1 ||
+        (size_t)file_stat.st_size >= buffer->mapped) {
+        return;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t keep = ((size_t)file_stat.st_size + page_size - 1) /
+                  page_size * page_size;
+
+    if (keep < buffer->mapped) {
+        mmap(buffer->text + keep, buffer->mapped - keep, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+}
+
+/* Recount new lines in the blocks and recheck the chunks
+ * overlapping internal positions start to end */
+static void gb_update_indexes(GapBuffer *buffer, size_t start, size_t end)
+{
+    if (start >= end) {
+        return;
+    }
+
+    size_t last_chunk = (end - 1) / GB_PLAIN_CHUNK_SIZE;
+    size_t chunk_start;
+
+    for (size_t k = start / GB_PLAIN_CHUNK_SIZE; k <= last_chunk; k++) {
+        chunk_start = k * GB_PLAIN_CHUNK_SIZE;
+        buffer->plain_chunks[k] = gb_is_plain(
+                                    buffer, chunk_start,
+                                    MIN(chunk_start + GB_PLAIN_CHUNK_SIZE,
+                                        buffer->allocated));
+    }
+
+    size_t last_block = (end - 1) / GB_LINE_BLOCK_SIZE;
+    size_t block_start;
+
+    for (size_t k = start / GB_LINE_BLOCK_SIZE; k <= last_block; k++) {
+        block_start = k * GB_LINE_BLOCK_SIZE;
+        gb_set_block_lines(buffer, k,
+                           gb_count_lines(buffer, block_start,
+                                          MIN(block_start + GB_LINE_BLOCK_SIZE,
+                                              buffer->allocated)));
+    }
+}
+
+static void gb_set_block_lines(GapBuffer *buffer, size_t block, size_t lines)
+{
+    size_t old_lines = buffer->block_lines[block];
+
+    if (lines == old_lines) {
+        return;
+    }
+
+    buffer->block_lines[block] = lines;
+
+    /* Unsigned arithmetic wraps so adding the difference
+     * also works when the line count has decreased */
+    for (size_t k = block + 1; k <= buffer->blocks; k += k & -k) {
+        buffer->line_index[k] += lines - old_lines;
+    }
+}
+
+/* Count new lines between internal positions start and end
+ * ignoring the gap */
+static size_t gb_count_lines(const GapBuffer *buffer, size_t start,
+                             size_t end)
+{
+    size_t lines = 0;
+
+    if (start < buffer->gap_start) {
+        lines += bs_count(buffer->text + start,
+                          MIN(end, buffer->gap_start) - start, '\n');
+    }
+
+    start = MAX(start, buffer->gap_end);
+
+    if (end > start) {
+        lines += bs_count(buffer->text + start, end - start, '\n');
+    }
+
+    return lines;
+}
+
+/* Check the text between internal positions start and end,
+ * ignoring the gap, only contains printable ASCII characters
+ * and line endings */
+static int gb_is_plain(const GapBuffer *buffer, size_t start, size_t end)
+{
+    if (start < buffer->gap_start &&
+        !gb_is_plain_text(buffer->text + start,
+                          MIN(end, buffer->gap_start) - start)) {
+        return 0;
+    }
+
+    start = MAX(start, buffer->gap_end);
+
+    return end <= start || gb_is_plain_text(buffer->text + start, end - start);
+}
+
+static int gb_is_plain_text(const char *text, size_t length)
+{
+    const char *end = text + length;
+
+    while ((text = bs_find_non_printable(text, end - text)) != NULL) {
+        if (*text != '\n' && *text != '\r') {
+            return 0;
+        }
+
+        text++;
+    }
+
+    return 1;
+}
@@ -20,11 +20,94 @@
 #define WED_GAP_BUFFER_H
 
 #include <stddef.h>
+#include "piece_table.h"
 
 #ifndef GAP_INCREMENT
 #define GAP_INCREMENT 1024
 #endif
 
+/* New lines are counted in blocks of GB_LINE_BLOCK_SIZE bytes
+ * of allocated memory to build the line index */
+#ifndef GB_LINE_BLOCK_SIZE
+#define GB_LINE_BLOCK_SIZE 4096
+#endif
+
+/* Allocated memory is also divided into chunks of GB_PLAIN_CHUNK_SIZE
+ * bytes to record which contain only printable ASCII and line endings */
+#ifndef GB_PLAIN_CHUNK_SIZE
+#define GB_PLAIN_CHUNK_SIZE 256
+#endif
+
+/* Default GBAllocPolicy values */
+#define GB_DEFAULT_GROWTH 50
+#define GB_DEFAULT_SHRINK 4
+#define GB_DEFAULT_HUGE_PAGE_MIN 0
+
+/* Controls how the memory allocated to hold text grows and shrinks.
+ * Geometric growth means a large number of insertions only causes
+ * a logarithmic number of reallocations and the shrink factor leaves
+ * a band in which deleting text doesn't immediately release memory
+ * that will be needed again */
+typedef struct {
+    size_t growth; /* When more space is required the gap is grown to
+                      this percentage of the buffer length (with a
+                      minimum of GAP_INCREMENT bytes). 0 means the gap
+                      is always GAP_INCREMENT bytes after growing */
+    size_t shrink; /* The allocation is only reduced once the gap is
+                      larger than this multiple of the gap growing
+                      would create. Must be at least 2 */
+    size_t huge_page_min; /* Allocations of at least this many bytes use
+                             huge pages where supported. 0 disables
+                             huge pages */
+} GBAllocPolicy;
+
+/* Maximum number of separate ranges tracked by GBDirtyRanges. Once
+ * reached, new ranges are merged with their nearest neighbour */
+#define GB_MAX_DIRTY_RANGES 32
+
+/* A range of buffer offsets */
+typedef struct {
+    size_t start; /* Offset of first byte in range */
+    size_t end; /* Offset after last byte in range */
+} GBRange;
+
+/* Tracks which text has changed since gb_track_changes was last called,
+ * typically when the buffer was loaded from or written to a file.
+ * Text before base_length which isn't in a dirty range is unchanged
+ * and at the same offset it was when tracking started */
+typedef struct {
+    int tracking; /* True if changes are being tracked */
+    size_t base_length; /* Length of text when tracking started */
+    size_t range_num; /* Number of dirty ranges */
+    GBRange ranges[GB_MAX_DIRTY_RANGES]; /* Dirty ranges ordered by
+                                            offset which don't overlap */
+} GBDirtyRanges;
+
+/* Allocation counts which can be used to tune GBAllocPolicy */
+typedef struct {
+    size_t grows; /* Number of times the allocation has been increased */
+    size_t shrinks; /* Number of times the allocation has been reduced */
+    size_t allocated; /* Bytes currently allocated to text */
+    int huge_pages; /* Text is allocated using huge pages */
+} GBAllocStats;
+
+/* The layout used to store text. A gap buffer is used by default
+ * but a buffer can be switched to use a piece table, which performs
+ * better when editing large buffers at many different positions */
+typedef enum {
+    GBS_GAP,
+    GBS_PIECE_TABLE
+} GapBufferStorage;
+
+/* Progress building the indexes of mapped text, which is shared with
+ * snapshots along with the indexes themselves (see gb_map_file) */
+typedef struct {
+    size_t indexed; /* Number of leading blocks whose lines are counted */
+    size_t lines; /* New lines in those blocks */
+    size_t plain_indexed; /* Number of leading blocks whose chunks
+                             have been checked for plain text */
+} GBLazyIndex;
+
 /* GapBuffer is the data structure used to
  * store text in wed */
 typedef struct {
@@ -34,15 +117,85 @@ typedef struct {
     size_t gap_end; /* Position gap ends */
     size_t allocated; /* Bytes allocated */
     size_t lines; /* Number of new line (\n) characters */
+    size_t *block_lines; /* New line count of each block */
+    size_t *line_index; /* Fenwick tree over block_lines which allows
+                           the number of new lines before any position
+                           to be calculated in O(log n) time */
+    size_t blocks; /* Number of blocks allocated memory is divided into */
+    unsigned char *plain_chunks; /* Non zero for each chunk whose text is
+                                    printable ASCII, \r or \n. Text in
+                                    these chunks can be processed without
+                                    UTF-8 decoding (see gb_plain_run) */
+    size_t chunks; /* Number of chunks allocated memory is divided into */
+    size_t mapped; /* When non zero text is a read only memory mapping
+                      of this many bytes (see gb_map_file) */
+    int mapped_fd; /* Descriptor of the mapped file when mapped is non
+                      zero or -1 if it couldn't be retained */
+    GBLazyIndex *lazy; /* When not NULL the text is mapped and blocks
+                          are only indexed when first accessed */
+    size_t *shared; /* When not NULL text and the indexes are shared
+                       with other buffers and this is the number of
+                       buffers sharing them (see gb_snapshot) */
+    int huge; /* Text is an anonymous mapping backed by huge pages */
+    GBAllocPolicy policy; /* Allocation policy */
+    GBAllocStats stats; /* Allocation counts */
+    GBDirtyRanges dirty; /* Text changed since tracking started */
+    PieceTable *pt; /* When not NULL text is stored in this piece table
+                       and the text fields above are unused */
 } GapBuffer;
 
+/* Iterates over a range of buffer text as a sequence of contiguous
+ * segments without copying the text. A segment is only valid until
+ * the buffer is next modified */
+typedef struct {
+    const GapBuffer *buffer; /* Buffer being iterated over */
+    size_t point; /* Start of next segment */
+    size_t end; /* End of range */
+} GBSegmentIter;
+
+/* Reads buffer text a byte at a time. The segment containing the last
+ * byte read is cached so sequential reads in either direction only
+ * need to locate the text again when crossing the gap or moving to
+ * another piece. A cursor is only valid until the buffer is next
+ * modified */
+typedef struct GBCursor {
+    const GapBuffer *buffer; /* Buffer being read */
+    const char *text; /* Cached segment */
+    size_t start; /* Buffer offset of first byte in segment */
+    size_t length; /* Segment length */
+} GBCursor;
+
+/* A copy of a range of buffer text with its own gap. A series of
+ * edits can be made to it away from the buffer, after which the
+ * result replaces the original range in one go */
+typedef struct {
+    char *text; /* Span text, which includes the gap */
+    size_t size; /* Bytes allocated */
+    size_t gap_start; /* Offset of the gap */
+    size_t gap_end; /* Offset of the first byte after the gap */
+} GBSpan;
+
 GapBuffer *gb_new(size_t size);
 void gb_free(GapBuffer *);
+GapBuffer *gb_snapshot(GapBuffer *);
 size_t gb_length(const GapBuffer *);
 size_t gb_lines(const GapBuffer *);
+size_t gb_lines_indexed(const GapBuffer *, int *complete);
 size_t gb_gap_size(const GapBuffer *);
 int gb_preallocate(GapBuffer *, size_t size);
-void gb_contiguous_storage(GapBuffer *);
+void gb_set_alloc_policy(GapBuffer *, const GBAllocPolicy *);
+void gb_get_alloc_stats(const GapBuffer *, GBAllocStats *);
+void gb_track_changes(GapBuffer *);
+void gb_untrack_changes(GapBuffer *);
+const GBDirtyRanges *gb_dirty_ranges(const GapBuffer *);
+int gb_map_file(GapBuffer *, int fd, size_t length);
+int gb_is_mapped(const GapBuffer *);
+int gb_mapped_fd(const GapBuffer *);
+void gb_add_block_lines(GapBuffer *, size_t first, const size_t *block_lines,
+                        size_t block_num);
+const char *gb_contiguous_storage(GapBuffer *);
+GapBufferStorage gb_get_storage(const GapBuffer *);
+int gb_set_storage(GapBuffer *, GapBufferStorage);
 int gb_insert(GapBuffer *, const char *str, size_t str_len);
 int gb_add(GapBuffer *, const char *str, size_t str_len);
 int gb_delete(GapBuffer *, size_t byte_num);
@@ -57,5 +210,41 @@ size_t gb_get_range(const GapBuffer *, size_t point, char *buf,
                     size_t num_bytes);
 int gb_find_next(const GapBuffer *, size_t point, size_t *next, char c);
 int gb_find_prev(const GapBuffer *, size_t point, size_t *prev, char c);
+size_t gb_lines_before(const GapBuffer *, size_t point);
+size_t gb_line_start(const GapBuffer *, size_t line);
+size_t gb_count_crlf(const GapBuffer *, size_t point, size_t length);
+size_t gb_plain_run(const GapBuffer *, size_t point, size_t limit);
+size_t gb_get_segment(const GapBuffer *, size_t point, const char **text);
+void gb_segment_iter_init(GBSegmentIter *, const GapBuffer *, size_t point,
+                          size_t length);
+int gb_segment_iter_next(GBSegmentIter *, const char **text, size_t *length);
+void gb_cursor_init(GBCursor *, const GapBuffer *);
+int gb_cursor_load(GBCursor *, size_t point);
+int gb_span_init(GBSpan *, const GapBuffer *, size_t point, size_t length,
+                 size_t max_insert);
+void gb_span_insert(GBSpan *, size_t point, const char *str,
+                    size_t str_len);
+void gb_span_delete(GBSpan *, size_t point, size_t byte_num,
+                    char *deleted);
+const char *gb_span_text(GBSpan *, size_t *length);
+void gb_span_free(GBSpan *);
+
+/* Return the byte at point or '\0' if point is at the buffer end */
+static inline unsigned char gb_cursor_getu_at(GBCursor *cursor, size_t point)
+{
+    /* When point < start the subtraction wraps so a
+     * single comparison checks both bounds */
+    if (point - cursor->start >= cursor->length &&
+        !gb_cursor_load(cursor, point)) {
+        return '\0';
+    }
+
+    return (unsigned char)cursor->text[point - cursor->start];
+}
+
+static inline char gb_cursor_get_at(GBCursor *cursor, size_t point)
+{
+    return (char)gb_cursor_getu_at(cursor, point);
+}
 
 #endif
@@ -33,15 +33,14 @@
 #include "util.h"
 #include "tui.h"
 
-#ifdef __MACH__
-#include <mach/clock.h>
-#include <mach/mach.h>
-#endif
-
 /* Limit the rate at which the screen is updated. At least
  * MIN_DRAW_INTERVAL_NS nano seconds must pass between
  * screen redraws */
 #define MIN_DRAW_INTERVAL_NS 200000
+/* Maximum amount of piped input added to a buffer before user input
+ * is checked again, so that the display stays responsive while a
+ * large amount of input is read */
+#define MAX_STREAM_READ_SIZE (64 * 1024)
 
 static Status ip_add_keystr_input(InputBuffer *, size_t pos,
                                   const char *keystr, size_t keystr_len);
@@ -57,14 +56,19 @@ static int ip_parse_key(const Session *, const char *keystr,
                         size_t *keystr_len, size_t *parsed_len);
 static void ip_handle_keypress(Session *, const char *keystr, int *finished,
                                struct timespec *last_draw, int *redraw_due);
+static void ip_request_redraw(Session *, struct timespec *last_draw,
+                              int *redraw_due);
 static void ip_handle_error(Session *);
+static void ip_process_events(Session *);
+static int ip_add_stream_fds(const Session *, fd_set *, int max_fd);
+static void ip_process_streams(Session *, const fd_set *,
+                               struct timespec *last_draw, int *redraw_due);
 static int ip_is_special_key(const TermKeyKey *);
 static int ip_is_wed_operation(const char *key, const char **next);
 
 static volatile int ip_window_resize_required = 0;
 static volatile int ip_continue_signal = 0;
 static volatile int ip_sigterm_signal = 0;
-static void ip_get_monotonic_time(struct timespec *);
 
 static void ip_sigwinch_handler(int signal)
 {
@@ -216,8 +220,10 @@ void ip_process_input(Session *sess)
     sigemptyset(&old_set);
     /* Use monotonic clock as we're only interested in
      * measuring time intervals that have passed */
-    ip_get_monotonic_time(&last_draw);
+    get_monotonic_time(&last_draw);
     fd_set fds;
+    int event_fd = sess->event_pipe[0];
+    int max_fd;
 
     if (sess->wed_opt.test_mode) {
         ip_process_input_buffer(sess, &finished, &last_draw, &redraw_due);
@@ -230,9 +236,14 @@ void ip_process_input(Session *sess)
         } else {
             FD_ZERO(&fds);
             FD_SET(STDIN_FILENO, &fds);
+            FD_SET(event_fd, &fds);
+            max_fd = ip_add_stream_fds(sess, &fds,
+                                       MAX(STDIN_FILENO, event_fd));
 
-            /* Wait for user input or signal */
-            pselect_res = pselect(1, &fds, NULL, NULL, timeout, &old_set);
+            /* Wait for user input, piped input, background task
+             * event or signal */
+            pselect_res = pselect(max_fd + 1, &fds, NULL, NULL, timeout,
+                                  &old_set);
 
             if (pselect_res == -1) {
                 /* pselect failed */
@@ -268,7 +279,11 @@ void ip_process_input(Session *sess)
                 }
 
                 timeout = NULL;
-            } else if (pselect_res > 0) {
+            } else if (FD_ISSET(event_fd, &fds)) {
+                ip_process_events(sess);
+            }
+
+            if (pselect_res > 0 && FD_ISSET(STDIN_FILENO, &fds)) {
                 input_buffer->arg = IA_INPUT_AVAILABLE_TO_READ;
                 sess->ui->get_input(sess->ui);
 
@@ -282,6 +297,10 @@ void ip_process_input(Session *sess)
                             &redraw_due);
                 }
             }
+
+            if (pselect_res > 0 && !finished) {
+                ip_process_streams(sess, &fds, &last_draw, &redraw_due);
+            }
         }
 
         if (redraw_due && timeout == NULL) {
@@ -322,6 +341,11 @@ static void ip_process_input_buffer(Session *sess, int *finished,
             return;
         }
     }
+
+    /* Undo history is kept within its memory budgets
+     * once the input received has been processed */
+    se_add_error(sess, se_limit_undo_memory(sess));
+    ip_handle_error(sess);
 }
 
 static Status ip_get_next_key(Session *sess, GapBuffer *buffer,
@@ -439,7 +463,6 @@ static void ip_handle_keypress(Session *sess, const char *keystr,
                                int *finished, struct timespec *last_draw,
                                int *redraw_due)
 {
-    static struct timespec now;
     /* This is where user input invokes a command */
     se_add_error(sess, cm_do_operation(sess, keystr, finished));
     /* Immediately display any errors that have occurred */
@@ -447,18 +470,25 @@ static void ip_handle_keypress(Session *sess, const char *keystr,
     se_save_key(sess, keystr);
 
     if (!*finished) {
-        ip_get_monotonic_time(&now);
+        ip_request_redraw(sess, last_draw, redraw_due);
+    }
+}
 
-        if (now.tv_nsec - last_draw->tv_nsec >= MIN_DRAW_INTERVAL_NS) {
-            sess->ui->update(sess->ui);
-            ip_get_monotonic_time(last_draw);
-        } else {
-            /* A redraw is due but wait longer to see if the user enters
-             * more input before refreshing screen. This allows us to deal
-             * with a user pasting a large amount of text into the terminal
-             * smoothly */
-            *redraw_due = 1;
-        }
+static void ip_request_redraw(Session *sess, struct timespec *last_draw,
+                              int *redraw_due)
+{
+    static struct timespec now;
+    get_monotonic_time(&now);
+
+    if (now.tv_nsec - last_draw->tv_nsec >= MIN_DRAW_INTERVAL_NS) {
+        sess->ui->update(sess->ui);
+        get_monotonic_time(last_draw);
+    } else {
+        /* A redraw is due but wait longer to see if the user enters
+         * more input before refreshing screen. This allows us to deal
+         * with a user pasting a large amount of text into the terminal
+         * smoothly */
+        *redraw_due = 1;
     }
 }
 
@@ -472,6 +502,56 @@ static void ip_handle_error(Session *sess)
     se_clear_errors(sess);
 }
 
+/* Complete background tasks which have finished and redraw
+ * so that progress is displayed */
+static void ip_process_events(Session *sess)
+{
+    se_process_events(sess);
+    sess->ui->update(sess->ui);
+    ip_handle_error(sess);
+}
+
+/* Watch the fds of buffers reading piped input */
+static int ip_add_stream_fds(const Session *sess, fd_set *fds, int max_fd)
+{
+    int fd;
+
+    for (const Buffer *buffer = sess->buffers; buffer != NULL;
+         buffer = buffer->next) {
+        if ((fd = bf_stream_fd(buffer)) != -1) {
+            FD_SET(fd, fds);
+            max_fd = MAX(max_fd, fd);
+        }
+    }
+
+    return max_fd;
+}
+
+/* Add available piped input to buffers. The amount read is bounded
+ * so that input arriving faster than it can be displayed doesn't
+ * prevent user input being handled */
+static void ip_process_streams(Session *sess, const fd_set *fds,
+                               struct timespec *last_draw, int *redraw_due)
+{
+    int input_read = 0;
+    int fd;
+
+    for (Buffer *buffer = sess->buffers; buffer != NULL;
+         buffer = buffer->next) {
+        if ((fd = bf_stream_fd(buffer)) != -1 && FD_ISSET(fd, fds)) {
+            se_add_error(sess, bf_continue_stream(buffer,
+                                                  MAX_STREAM_READ_SIZE));
+            se_check_large_file(sess, buffer);
+            input_read = 1;
+        }
+    }
+
+    if (input_read) {
+        ip_handle_error(sess);
+        ip_request_redraw(sess, last_draw, redraw_due);
+    }
+}
+
 /* Does key have string representation of the form <...>.
  * This function is used when parsing a key string
  * to distinguish between keys and strings.
@@ -514,20 +594,3 @@ static int ip_is_wed_operation(const char *key, const char **next)
 
     return 1;
 }
-
-static void ip_get_monotonic_time(struct timespec *time)
-{
-#ifdef __MACH__
-    clock_serv_t clock;
-    mach_timespec_t mach;
-
-    host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &clock);
-    clock_get_time(clock, &mach);
-    mach_port_deallocate(mach_task_self(), clock);
-
-    time->tv_sec = mach.tv_sec;
-    time->tv_nsec = mach.tv_nsec;
-#else
-    clock_gettime(CLOCK_MONOTONIC, time);
-#endif
-}
@@ -0,0 +1,670 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "journal.h"
+#include "util.h"
+
+/* The journal file starts with a header identifying the file content
+ * the edits apply to, followed by a record for each edit:
+ *
+ * | type (1) | offset (8) | length (8) | checksum (4) | text (length) |
+ *
+ * Text is only present for insertions. The checksum covers the rest
+ * of the record so a record partially written before a crash is
+ * detected and ignored, along with anything after it */
+#define JN_MAGIC "WEDJRNL1"
+#define JN_MAGIC_LENGTH 8
+#define JN_HEADER_SIZE (JN_MAGIC_LENGTH + sizeof(JournalBase))
+#define JN_RECORD_HEADER_SIZE (1 + 8 + 8 + 4)
+
+static void jn_get_base(const char *file_path, JournalBase *);
+static Status jn_add_record(Journal *, JournalRecordType, size_t offset,
+                            const char *text, size_t length);
+static void jn_encode_record_header(unsigned char *header, JournalRecordType,
+                                    size_t offset, const char *text,
+                                    size_t length);
+static uint32_t jn_checksum(uint32_t hash, const void *data, size_t length);
+static Status jn_create_file(Journal *);
+static Status jn_start_worker(Journal *);
+static void jn_stop_worker(Journal *);
+static void *jn_run(void *);
+static void jn_flush(Journal *, int sync);
+static int jn_write_all(int fd, const char *data, size_t length);
+static int jn_read_all(int fd, char *data, size_t length);
+
+/* Returns the path of the journal for file_path, which is a hidden
+ * file in the same directory. The caller frees the path */
+char *jn_journal_path(const char *file_path)
+{
+    const char *file_name = strrchr(file_path, '/');
+    file_name = file_name == NULL ? file_path : file_name + 1;
+    size_t dir_length = file_name - file_path;
+
+    size_t path_length = strlen(file_path) + 1 + strlen(JN_FILE_SUFFIX) + 1;
+    char *journal_path = malloc(path_length);
+
+    if (journal_path != NULL) {
+        snprintf(journal_path, path_length, "%.*s.%s%s", (int)dir_length,
+                 file_path, file_name, JN_FILE_SUFFIX);
+    }
+
+    return journal_path;
+}
+
+/* Create a journal for edits to file_path. When resume_length is non
+ * zero the existing journal has just been replayed and the records in
+ * its first resume_length bytes are kept */
+Status jn_new(Journal **journal_ptr, const char *file_path,
+              size_t resume_length)
+{
+    Journal *journal = malloc(sizeof(Journal));
+
+    if (journal == NULL) {
+        return OUT_OF_MEMORY("Unable to create journal");
+    }
+
+    memset(journal, 0, sizeof(Journal));
+    journal->fd = -1;
+    journal->file_path = strdup(file_path);
+    journal->journal_path = jn_journal_path(file_path);
+
+    if (journal->file_path == NULL || journal->journal_path == NULL) {
+        free(journal->file_path);
+        free(journal->journal_path);
+        free(journal);
+        return OUT_OF_MEMORY("Unable to create journal");
+    }
+
+    pthread_mutex_init(&journal->io_mutex, NULL);
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    jn_get_base(file_path, &journal->base);
+
+    Status status = STATUS_SUCCESS;
+
+    if (resume_length > JN_HEADER_SIZE) {
+        journal->fd = open(journal->journal_path, O_RDWR);
+
+        if (journal->fd == -1 ||
+            ftruncate(journal->fd, resume_length) == -1 ||
+            lseek(journal->fd, resume_length, SEEK_SET) == -1) {
+            status = st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                                  "Unable to open journal %s - %s",
+                                  journal->journal_path, strerror(errno));
+        } else {
+            fcntl(journal->fd, F_SETFD, FD_CLOEXEC);
+            journal->position = journal->written =
+                resume_length - JN_HEADER_SIZE;
+            status = jn_start_worker(journal);
+        }
+    }
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        jn_free(journal, 0);
+        return status;
+    }
+
+    *journal_ptr = journal;
+
+    return STATUS_SUCCESS;
+}
+
+static void jn_get_base(const char *file_path, JournalBase *base)
+{
+    struct stat file_stat;
+    memset(base, 0, sizeof(JournalBase));
+
+    if (stat(file_path, &file_stat) == -1) {
+        return;
+    }
+
+    base->exists = 1;
+    base->size = file_stat.st_size;
+    base->dev = file_stat.st_dev;
+    base->ino = file_stat.st_ino;
+    base->mtime_sec = file_stat.st_mtim.tv_sec;
+    base->mtime_nsec = file_stat.st_mtim.tv_nsec;
+}
+
+Status jn_add_insert(Journal *journal, size_t offset, const char *text,
+                     size_t length)
+{
+    return jn_add_record(journal, JRT_INSERT, offset, text, length);
+}
+
+Status jn_add_delete(Journal *journal, size_t offset, size_t length)
+{
+    return jn_add_record(journal, JRT_DELETE, offset, NULL, length);
+}
+
+/* Records are added to memory and written by the worker */
+static Status jn_add_record(Journal *journal, JournalRecordType type,
+                            size_t offset, const char *text, size_t length)
+{
+    if (length == 0 || jn_failed(journal)) {
+        return STATUS_SUCCESS;
+    }
+
+    if (journal->fd == -1) {
+        Status status = jn_create_file(journal);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            journal->failed = 1;
+            return status;
+        }
+    }
+
+    size_t record_length = JN_RECORD_HEADER_SIZE +
+                           (type == JRT_INSERT ? length : 0);
+
+    pthread_mutex_lock(&journal->mutex);
+
+    size_t required = journal->pending_length + record_length;
+
+    if (required > journal->pending_allocated) {
+        size_t allocated = MAX(required, journal->pending_allocated * 2);
+        char *pending = realloc(journal->pending, allocated);
+
+        if (pending == NULL) {
+            /* The journal is no longer complete */
+            journal->failed = 1;
+            pthread_mutex_unlock(&journal->mutex);
+            return OUT_OF_MEMORY("Unable to add edit to journal");
+        }
+
+        journal->pending = pending;
+        journal->pending_allocated = allocated;
+    }
+
+    unsigned char *record = (unsigned char *)journal->pending +
+                            journal->pending_length;
+    jn_encode_record_header(record, type, offset, text, length);
+
+    if (type == JRT_INSERT) {
+        memcpy(record + JN_RECORD_HEADER_SIZE, text, length);
+    }
+
+    journal->pending_length += record_length;
+    journal->position += record_length;
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    return STATUS_SUCCESS;
+}
+
+static void jn_encode_record_header(unsigned char *header,
+                                    JournalRecordType type, size_t offset,
+                                    const char *text, size_t length)
+{
+    uint64_t offset64 = offset;
+    uint64_t length64 = length;
+
+    header[0] = type;
+    memcpy(header + 1, &offset64, 8);
+    memcpy(header + 9, &length64, 8);
+
+    uint32_t checksum = jn_checksum(2166136261u, header, 17);
+
+    if (text != NULL) {
+        checksum = jn_checksum(checksum, text, length);
+    }
+
+    memcpy(header + 17, &checksum, 4);
+}
+
+/* FNV-1a */
+static uint32_t jn_checksum(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t k = 0; k < length; k++) {
+        hash ^= bytes[k];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static Status jn_create_file(Journal *journal)
+{
+    journal->fd = open(journal->journal_path,
+                       O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (journal->fd == -1) {
+        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                            "Unable to create journal %s - %s",
+                            journal->journal_path, strerror(errno));
+    }
+
+    fcntl(journal->fd, F_SETFD, FD_CLOEXEC);
+
+    char header[JN_HEADER_SIZE];
+    memcpy(header, JN_MAGIC, JN_MAGIC_LENGTH);
+    memcpy(header + JN_MAGIC_LENGTH, &journal->base, sizeof(JournalBase));
+
+    if (!jn_write_all(journal->fd, header, JN_HEADER_SIZE)) {
+        Status status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                                     "Unable to write journal %s - %s",
+                                     journal->journal_path, strerror(errno));
+        close(journal->fd);
+        unlink(journal->journal_path);
+        journal->fd = -1;
+        return status;
+    }
+
+    return jn_start_worker(journal);
+}
+
+static Status jn_start_worker(Journal *journal)
+{
+    journal->stop = 0;
+
+    /* Block all signals in the worker so they continue to be
+     * delivered to the main thread where pselect handles them */
+    sigset_t block_set, old_set;
+    sigfillset(&block_set);
+    pthread_sigmask(SIG_SETMASK, &block_set, &old_set);
+
+    int err = pthread_create(&journal->thread, NULL, jn_run, journal);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (err != 0) {
+        close(journal->fd);
+        journal->fd = -1;
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to start journal - %s", strerror(err));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Wait for the worker to write any pending records and exit */
+static void jn_stop_worker(Journal *journal)
+{
+    pthread_mutex_lock(&journal->mutex);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+
+    pthread_join(journal->thread, NULL);
+}
+
+static void *jn_run(void *arg)
+{
+    Journal *journal = arg;
+    struct timeval now;
+    struct timespec deadline;
+    int stop;
+
+    do {
+        gettimeofday(&now, NULL);
+        long long deadline_ns = (long long)now.tv_usec * 1000 +
+                                JN_SYNC_INTERVAL_NS;
+        deadline.tv_sec = now.tv_sec + deadline_ns / 1000000000;
+        deadline.tv_nsec = deadline_ns % 1000000000;
+
+        pthread_mutex_lock(&journal->mutex);
+
+        while (!journal->stop &&
+               pthread_cond_timedwait(&journal->cond, &journal->mutex,
+                                      &deadline) != ETIMEDOUT) {
+            /* Spurious wake up */
+        }
+
+        stop = journal->stop;
+        pthread_mutex_unlock(&journal->mutex);
+
+        jn_flush(journal, 1);
+    } while (!stop);
+
+    return NULL;
+}
+
+/* Write pending records to the journal file */
+static void jn_flush(Journal *journal, int sync)
+{
+    pthread_mutex_lock(&journal->io_mutex);
+    pthread_mutex_lock(&journal->mutex);
+
+    char *pending = journal->pending;
+    size_t pending_length = journal->pending_length;
+    int failed = journal->failed;
+
+    journal->pending = NULL;
+    journal->pending_length = journal->pending_allocated = 0;
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    if (pending_length > 0 && !failed) {
+        failed = !jn_write_all(journal->fd, pending, pending_length) ||
+                 (sync && fdatasync(journal->fd) == -1);
+
+        pthread_mutex_lock(&journal->mutex);
+        journal->written += pending_length;
+        journal->failed = failed;
+        pthread_mutex_unlock(&journal->mutex);
+    }
+
+    pthread_mutex_unlock(&journal->io_mutex);
+    free(pending);
+}
+
+static int jn_write_all(int fd, const char *data, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, data, length);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 0;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 1;
+}
+
+static int jn_read_all(int fd, char *data, size_t length)
+{
+    ssize_t bytes;
+
+    while (length > 0) {
+        bytes = read(fd, data, length);
+
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            return 0;
+        }
+
+        data += bytes;
+        length -= bytes;
+    }
+
+    return 1;
+}
+
+/* Returns the number of bytes of records added since the journal
+ * was last rebased, which can later be passed to jn_rebase */
+size_t jn_position(Journal *journal)
+{
+    pthread_mutex_lock(&journal->mutex);
+    size_t position = journal->position;
+    pthread_mutex_unlock(&journal->mutex);
+
+    return position;
+}
+
+/* True if records could not be written, in which case
+ * the journal can no longer be used for recovery */
+int jn_failed(Journal *journal)
+{
+    pthread_mutex_lock(&journal->mutex);
+    int failed = journal->failed;
+    pthread_mutex_unlock(&journal->mutex);
+
+    return failed;
+}
+
+/* The file now contains the text as it was after the records before
+ * position (as returned by jn_position) were added, typically because
+ * it was saved. Discard those records and apply the remaining records
+ * to the file as it is now. The journal file is removed if no records
+ * remain */
+Status jn_rebase(Journal *journal, size_t position)
+{
+    Status status = STATUS_SUCCESS;
+    jn_get_base(journal->file_path, &journal->base);
+
+    if (journal->fd == -1) {
+        journal->position = 0;
+        return STATUS_SUCCESS;
+    }
+
+    /* Write everything so the records being kept are all in the file */
+    jn_flush(journal, 0);
+
+    pthread_mutex_lock(&journal->io_mutex);
+
+    position = MIN(position, journal->written);
+    size_t kept_length = journal->written - position;
+    char *kept = malloc(JN_HEADER_SIZE + kept_length);
+
+    if (kept == NULL) {
+        status = OUT_OF_MEMORY("Unable to rebase journal");
+        goto cleanup;
+    }
+
+    memcpy(kept, JN_MAGIC, JN_MAGIC_LENGTH);
+    memcpy(kept + JN_MAGIC_LENGTH, &journal->base, sizeof(JournalBase));
+
+    /* Replace the journal file contents with the new header followed
+     * by the records being kept. Recovery is then only possible using
+     * the new header, which is correct as the file has changed */
+    if (lseek(journal->fd, JN_HEADER_SIZE + position, SEEK_SET) == -1 ||
+        !jn_read_all(journal->fd, kept + JN_HEADER_SIZE, kept_length) ||
+        ftruncate(journal->fd, 0) == -1 ||
+        lseek(journal->fd, 0, SEEK_SET) == -1 ||
+        !jn_write_all(journal->fd, kept, JN_HEADER_SIZE + kept_length) ||
+        fdatasync(journal->fd) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to rebase journal %s - %s",
+                              journal->journal_path, strerror(errno));
+        journal->failed = 1;
+    }
+
+    journal->written = journal->position = kept_length;
+
+cleanup:
+    pthread_mutex_unlock(&journal->io_mutex);
+    free(kept);
+
+    if (STATUS_IS_SUCCESS(status) && kept_length == 0) {
+        jn_stop_worker(journal);
+        close(journal->fd);
+        unlink(journal->journal_path);
+        journal->fd = -1;
+    }
+
+    return status;
+}
+
+/* Write and sync pending records now */
+Status jn_sync(Journal *journal)
+{
+    if (journal->fd != -1) {
+        jn_flush(journal, 1);
+    }
+
+    if (jn_failed(journal)) {
+        return st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                            "Unable to write journal %s",
+                            journal->journal_path);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Write any pending records and free the journal. The journal file is
+ * removed when remove_file is true, such as when the buffer is closed
+ * without error, otherwise it remains so it can be replayed */
+void jn_free(Journal *journal, int remove_file)
+{
+    if (journal == NULL) {
+        return;
+    }
+
+    if (journal->fd != -1) {
+        jn_stop_worker(journal);
+        close(journal->fd);
+
+        if (remove_file) {
+            unlink(journal->journal_path);
+        }
+    }
+
+    pthread_cond_destroy(&journal->cond);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_mutex_destroy(&journal->io_mutex);
+    free(journal->pending);
+    free(journal->file_path);
+    free(journal->journal_path);
+    free(journal);
+}
+
+/* Call replay_cb for each record in the journal for file_path, provided
+ * the journal applies to the current content of file_path. records is
+ * set to the number of records replayed and valid_length to the length
+ * of the journal up to the last complete record, or 0 if there is no
+ * journal */
+Status jn_replay(const char *file_path, JournalReplayCB replay_cb,
+                 void *context, size_t *records, size_t *valid_length)
+{
+    *records = *valid_length = 0;
+
+    char *journal_path = jn_journal_path(file_path);
+
+    if (journal_path == NULL) {
+        return OUT_OF_MEMORY("Unable to replay journal");
+    }
+
+    int fd = open(journal_path, O_RDONLY);
+
+    if (fd == -1) {
+        Status status = STATUS_SUCCESS;
+
+        if (errno != ENOENT) {
+            status = st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                                  "Unable to open journal %s - %s",
+                                  journal_path, strerror(errno));
+        }
+
+        free(journal_path);
+        return status;
+    }
+
+    Status status = STATUS_SUCCESS;
+    char header[JN_HEADER_SIZE];
+    JournalBase base, file_base;
+
+    jn_get_base(file_path, &file_base);
+
+    if (!jn_read_all(fd, header, JN_HEADER_SIZE) ||
+        memcmp(header, JN_MAGIC, JN_MAGIC_LENGTH) != 0) {
+        status = st_get_error(ERR_INVALID_JOURNAL,
+                              "Journal %s is invalid", journal_path);
+        goto cleanup;
+    }
+
+    memcpy(&base, header + JN_MAGIC_LENGTH, sizeof(JournalBase));
+
+    if (memcmp(&base, &file_base, sizeof(JournalBase)) != 0) {
+        status = st_get_error(ERR_JOURNAL_MISMATCH,
+                              "Journal %s doesn't match the current "
+                              "version of %s", journal_path, file_path);
+        goto cleanup;
+    }
+
+    struct stat journal_stat;
+
+    if (fstat(fd, &journal_stat) == -1) {
+        status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                              "Unable to read journal %s - %s",
+                              journal_path, strerror(errno));
+        goto cleanup;
+    }
+
+    size_t length = JN_HEADER_SIZE;
+    unsigned char record[JN_RECORD_HEADER_SIZE];
+    unsigned char expected[JN_RECORD_HEADER_SIZE];
+    char *text = NULL;
+    uint64_t offset, text_length;
+
+    /* A partially written record marks the end of the journal */
+    while (jn_read_all(fd, (char *)record, JN_RECORD_HEADER_SIZE)) {
+        memcpy(&offset, record + 1, 8);
+        memcpy(&text_length, record + 9, 8);
+
+        /* Check the length before trusting it to allocate memory */
+        if ((record[0] != JRT_INSERT && record[0] != JRT_DELETE) ||
+            text_length == 0 ||
+            (record[0] == JRT_INSERT &&
+             text_length > (uint64_t)journal_stat.st_size - length)) {
+            break;
+        }
+
+        if (record[0] == JRT_INSERT) {
+            text = malloc(text_length);
+
+            if (text == NULL) {
+                status = OUT_OF_MEMORY("Unable to replay journal");
+                break;
+            } else if (!jn_read_all(fd, text, text_length)) {
+                break;
+            }
+        }
+
+        jn_encode_record_header(expected, record[0], offset, text,
+                                text_length);
+
+        if (memcmp(record, expected, JN_RECORD_HEADER_SIZE) != 0) {
+            break;
+        }
+
+        status = replay_cb(context, record[0], offset, text, text_length);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            break;
+        }
+
+        free(text);
+        text = NULL;
+        length += JN_RECORD_HEADER_SIZE +
+                  (record[0] == JRT_INSERT ? text_length : 0);
+        (*records)++;
+    }
+
+    free(text);
+
+    if (STATUS_IS_SUCCESS(status)) {
+        *valid_length = length;
+    }
+
+cleanup:
+    close(fd);
+    free(journal_path);
+
+    return status;
+}
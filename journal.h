@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_JOURNAL_H
+#define WED_JOURNAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "status.h"
+
+/* Records are written and synced to disk at most this often */
+#define JN_SYNC_INTERVAL_NS 1000000000
+/* Appended to the file name to create the journal file name */
+#define JN_FILE_SUFFIX ".wedj"
+
+/* The type of edit a record describes */
+typedef enum {
+    JRT_INSERT = 'i',
+    JRT_DELETE = 'd'
+} JournalRecordType;
+
+/* Identifies the content of a file a journal applies to */
+typedef struct {
+    uint64_t exists; /* True if the file existed */
+    uint64_t size; /* File size */
+    uint64_t dev; /* Device containing file */
+    uint64_t ino; /* File inode */
+    uint64_t mtime_sec; /* Modification time */
+    uint64_t mtime_nsec;
+} JournalBase;
+
+/* Called for each record when a journal is replayed.
+ * text is NULL for deletions */
+typedef Status (*JournalReplayCB)(void *context, JournalRecordType,
+                                  size_t offset, const char *text,
+                                  size_t length);
+
+/* An append only log of the edits made to a buffer since its file was
+ * last loaded or saved, which allows unsaved changes to be recovered
+ * after a crash. Records are batched in memory then written and synced
+ * on a worker thread so editing is never blocked on disk. The journal
+ * file is only created once the first record is added */
+typedef struct {
+    char *file_path; /* File the journal applies to */
+    char *journal_path; /* Journal file path */
+    int fd; /* Journal file or -1 if not yet created */
+    JournalBase base; /* Content of file_path the edits apply to */
+    pthread_t thread; /* Worker thread, started with the journal file */
+    pthread_mutex_t io_mutex; /* Guards fd and the journal file */
+    pthread_mutex_t mutex; /* Guards fields below */
+    pthread_cond_t cond; /* Signalled to stop the worker */
+    char *pending; /* Records not yet written */
+    size_t pending_length; /* Number of bytes in pending */
+    size_t pending_allocated; /* Bytes allocated to pending */
+    size_t position; /* Total bytes of records added since the journal
+                        was last rebased */
+    size_t written; /* Bytes of records written to the journal file */
+    int stop; /* Set to stop the worker */
+    int failed; /* Set once writing fails, after which
+                   records are discarded */
+} Journal;
+
+char *jn_journal_path(const char *file_path);
+Status jn_new(Journal **, const char *file_path, size_t resume_length);
+Status jn_add_insert(Journal *, size_t offset, const char *text,
+                     size_t length);
+Status jn_add_delete(Journal *, size_t offset, size_t length);
+size_t jn_position(Journal *);
+int jn_failed(Journal *);
+Status jn_rebase(Journal *, size_t position);
+Status jn_sync(Journal *);
+void jn_free(Journal *, int remove_file);
+Status jn_replay(const char *file_path, JournalReplayCB, void *context,
+                 size_t *records, size_t *valid_length);
+
+#endif
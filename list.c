@@ -199,7 +199,7 @@ void *list_remove_at(List *list, size_t index)
     if (list->size && index < list->size) {
         value = list->values[index];
 
-        for (size_t k = index; k < list->size; k++) {
+        for (size_t k = index; k + 1 < list->size; k++) {
             list->values[k] = list->values[k + 1];   
         }
 
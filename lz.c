@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+/* Recent positions are found using a hash of the
+ * LZ_MIN_MATCH bytes at each position */
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+/* The search steps further ahead the longer it goes without finding
+ * a match, so incompressible text is passed over quickly */
+#define LZ_SKIP_SHIFT 6
+/* Each sequence starts with a token whose high nibble is the literal
+ * length and low nibble is the match length less LZ_MIN_MATCH. Values
+ * of LZ_NIBBLE_MAX continue in following bytes */
+#define LZ_NIBBLE_MAX 15
+
+static uint32_t lz_read32(const char *text);
+static size_t lz_hash(uint32_t bytes);
+static int lz_put_sequence(char *dst, size_t dst_size, size_t *out,
+                           const char *literals, size_t literal_length,
+                           size_t offset, size_t match_length);
+static int lz_put_length(char *dst, size_t dst_size, size_t *out,
+                         size_t length);
+static int lz_get_length(const unsigned char *src, size_t length,
+                         size_t *in, size_t *value);
+
+/* Compress length bytes of src into dst. Returns the
+ * compressed length or 0 if it doesn't fit in dst_size */
+size_t lz_compress(const char *src, size_t length, char *dst,
+                   size_t dst_size)
+{
+    /* Positions are stored plus one so that 0 marks an empty entry */
+    size_t *table = calloc(LZ_HASH_SIZE, sizeof(size_t));
+
+    if (table == NULL) {
+        return 0;
+    }
+
+    size_t pos = 0;
+    size_t anchor = 0;
+    size_t out = 0;
+    size_t hash, candidate, match_length;
+
+    while (pos + LZ_MIN_MATCH <= length) {
+        hash = lz_hash(lz_read32(src + pos));
+        candidate = table[hash];
+        table[hash] = pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+            memcmp(src + candidate - 1, src + pos, LZ_MIN_MATCH) != 0) {
+            pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        candidate--;
+        match_length = LZ_MIN_MATCH;
+
+        while (pos + match_length < length &&
+               src[candidate + match_length] == src[pos + match_length]) {
+            match_length++;
+        }
+
+        if (!lz_put_sequence(dst, dst_size, &out, src + anchor,
+                             pos - anchor, pos - candidate, match_length)) {
+            free(table);
+            return 0;
+        }
+
+        pos += match_length;
+        anchor = pos;
+    }
+
+    free(table);
+
+    /* The final sequence only contains literals */
+    if (!lz_put_sequence(dst, dst_size, &out, src + anchor,
+                         length - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return out;
+}
+
+/* Decompress length bytes of src which must produce exactly
+ * dst_length bytes. Returns 0 if src is invalid */
+int lz_decompress(const char *src, size_t length, char *dst,
+                  size_t dst_length)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    size_t pos = 0;
+    size_t out = 0;
+    size_t literal_length, match_length, offset;
+    unsigned char token;
+
+    while (pos < length) {
+        token = in[pos++];
+        literal_length = token >> 4;
+        match_length = token & LZ_NIBBLE_MAX;
+
+        if (literal_length == LZ_NIBBLE_MAX &&
+            !lz_get_length(in, length, &pos, &literal_length)) {
+            return 0;
+        }
+
+        if (length - pos < literal_length ||
+            dst_length - out < literal_length) {
+            return 0;
+        }
+
+        memcpy(dst + out, src + pos, literal_length);
+        pos += literal_length;
+        out += literal_length;
+
+        if (pos == length) {
+            break;
+        } else if (length - pos < 2) {
+            return 0;
+        }
+
+        offset = in[pos] | ((size_t)in[pos + 1] << 8);
+        pos += 2;
+
+        if (match_length == LZ_NIBBLE_MAX &&
+            !lz_get_length(in, length, &pos, &match_length)) {
+            return 0;
+        }
+
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || dst_length - out < match_length) {
+            return 0;
+        }
+
+        if (offset >= match_length) {
+            memcpy(dst + out, dst + out - offset, match_length);
+        } else {
+            /* The match overlaps the text it produces */
+            for (size_t k = 0; k < match_length; k++) {
+                dst[out + k] = dst[out - offset + k];
+            }
+        }
+
+        out += match_length;
+    }
+
+    return out == dst_length;
+}
+
+static uint32_t lz_read32(const char *text)
+{
+    uint32_t bytes;
+    memcpy(&bytes, text, sizeof(bytes));
+    return bytes;
+}
+
+static size_t lz_hash(uint32_t bytes)
+{
+    return (uint32_t)(bytes * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* A match_length of 0 writes the final sequence */
+static int lz_put_sequence(char *dst, size_t dst_size, size_t *out,
+                           const char *literals, size_t literal_length,
+                           size_t offset, size_t match_length)
+{
+    if (*out >= dst_size) {
+        return 0;
+    }
+
+    size_t match_extra = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    size_t token = *out;
+    dst[token] = (char)(
+            (literal_length < LZ_NIBBLE_MAX ? literal_length
+                                            : LZ_NIBBLE_MAX) << 4 |
+            (match_extra < LZ_NIBBLE_MAX ? match_extra : LZ_NIBBLE_MAX));
+    (*out)++;
+
+    if (literal_length >= LZ_NIBBLE_MAX &&
+        !lz_put_length(dst, dst_size, out,
+                       literal_length - LZ_NIBBLE_MAX)) {
+        return 0;
+    }
+
+    if (dst_size - *out < literal_length) {
+        return 0;
+    }
+
+    memcpy(dst + *out, literals, literal_length);
+    *out += literal_length;
+
+    if (match_length == 0) {
+        return 1;
+    } else if (dst_size - *out < 2) {
+        return 0;
+    }
+
+    dst[(*out)++] = (char)(offset & 0xFF);
+    dst[(*out)++] = (char)(offset >> 8);
+
+    if (match_extra >= LZ_NIBBLE_MAX &&
+        !lz_put_length(dst, dst_size, out, match_extra - LZ_NIBBLE_MAX)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Lengths are continued as bytes of 255 ended by a smaller byte */
+static int lz_put_length(char *dst, size_t dst_size, size_t *out,
+                         size_t length)
+{
+    while (length >= 255) {
+        if (*out >= dst_size) {
+            return 0;
+        }
+
+        dst[(*out)++] = (char)255;
+        length -= 255;
+    }
+
+    if (*out >= dst_size) {
+        return 0;
+    }
+
+    dst[(*out)++] = (char)length;
+
+    return 1;
+}
+
+static int lz_get_length(const unsigned char *src, size_t length,
+                         size_t *in, size_t *value)
+{
+    unsigned char byte;
+
+    do {
+        if (*in >= length) {
+            return 0;
+        }
+
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255);
+
+    return 1;
+}
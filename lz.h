@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_LZ_H
+#define WED_LZ_H
+
+#include <stddef.h>
+
+/* A fast LZ77 compressor used to reduce the memory taken by text that's
+ * unlikely to be needed soon, such as old undo history. Compressed data
+ * is a sequence of literal runs each followed by a back reference of at
+ * least LZ_MIN_MATCH bytes to text up to LZ_MAX_OFFSET bytes earlier */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+size_t lz_compress(const char *src, size_t length, char *dst,
+                   size_t dst_size);
+int lz_decompress(const char *src, size_t length, char *dst,
+                  size_t dst_length);
+
+#endif
@@ -0,0 +1,804 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "piece_table.h"
+#include "util.h"
+#include "byte_scan.h"
+
+static PTNode *pt_new_node(PieceTable *);
+static void pt_free_nodes(PTNode *);
+static int pt_own_path(PieceTable *, size_t point);
+static void pt_free_blocks(PTBlock *);
+static size_t pt_subtree_length(const PTNode *);
+static size_t pt_subtree_lines(const PTNode *);
+static void pt_update_node(PTNode *);
+static void pt_split(PTNode *, size_t offset, PTNode **left, PTNode **right,
+                     PTNode **spare);
+static PTNode *pt_merge(PTNode *left, PTNode *right);
+static int pt_extend_last_piece(PTNode *, const char *text, size_t length,
+                                size_t lines);
+static int pt_insert_piece(PieceTable *, size_t point, const char *text,
+                           size_t length, int continues_block);
+static const char *pt_append_text(PieceTable *, const char *str,
+                                  size_t str_len, size_t *appended,
+                                  int *continues_block);
+static const PTNode *pt_find_node(const PieceTable *, size_t point,
+                                  size_t *node_start);
+static void pt_invalidate(PieceTable *);
+static unsigned int pt_random(PieceTable *);
+
+PieceTable *pt_new(void)
+{
+    PieceTable *pt = malloc(sizeof(PieceTable));
+
+    if (pt == NULL) {
+        return NULL;
+    }
+
+    memset(pt, 0, sizeof(PieceTable));
+    pt->seed = 2463534242U;
+
+    return pt;
+}
+
+/* Create a snapshot of pt in O(1) time. The snapshot shares all pieces
+ * and blocks with pt. When either table is later modified the shared
+ * nodes on the path to the modification are copied rather than changed
+ * so the other table is unaffected */
+PieceTable *pt_snapshot(PieceTable *pt)
+{
+    PieceTable *snapshot = pt_new();
+
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    snapshot->root = pt->root;
+    snapshot->blocks = pt->blocks;
+    snapshot->point = pt->point;
+    snapshot->seed = pt->seed;
+
+    if (snapshot->root != NULL) {
+        snapshot->root->refs++;
+    }
+
+    if (snapshot->blocks != NULL) {
+        snapshot->blocks->refs++;
+    }
+
+    return snapshot;
+}
+
+void pt_free(PieceTable *pt)
+{
+    if (pt == NULL) {
+        return;
+    }
+
+    pt_free_nodes(pt->root);
+    pt_free_blocks(pt->blocks);
+    free(pt->flat);
+    free(pt);
+}
+
+static PTNode *pt_new_node(PieceTable *pt)
+{
+    PTNode *node = malloc(sizeof(PTNode));
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(PTNode));
+    node->priority = pt_random(pt);
+    node->refs = 1;
+
+    return node;
+}
+
+/* Release a reference to node, freeing it and its
+ * descendants once they're no longer referenced */
+static void pt_free_nodes(PTNode *node)
+{
+    if (node == NULL || --node->refs > 0) {
+        return;
+    }
+
+    pt_free_nodes(node->left);
+    pt_free_nodes(node->right);
+    free(node);
+}
+
+static void pt_free_blocks(PTBlock *block)
+{
+    PTBlock *next;
+
+    while (block != NULL && --block->refs == 0) {
+        next = block->next;
+        free(block->text);
+        free(block);
+        block = next;
+    }
+}
+
+size_t pt_length(const PieceTable *pt)
+{
+    return pt_subtree_length(pt->root);
+}
+
+size_t pt_lines(const PieceTable *pt)
+{
+    return pt_subtree_lines(pt->root);
+}
+
+static size_t pt_subtree_length(const PTNode *node)
+{
+    return node == NULL ? 0 : node->subtree_length;
+}
+
+static size_t pt_subtree_lines(const PTNode *node)
+{
+    return node == NULL ? 0 : node->subtree_lines;
+}
+
+static void pt_update_node(PTNode *node)
+{
+    node->subtree_length = pt_subtree_length(node->left) + node->length +
+                           pt_subtree_length(node->right);
+    node->subtree_lines = pt_subtree_lines(node->left) + node->lines +
+                          pt_subtree_lines(node->right);
+}
+
+/* Split tree into two trees where left contains the first offset
+ * bytes of text and right contains the remainder. If offset falls
+ * inside a piece then that piece is split in two and spare is
+ * used as the node for the second half */
+static void pt_split(PTNode *node, size_t offset, PTNode **left,
+                     PTNode **right, PTNode **spare)
+{
+    if (node == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+
+    size_t left_length = pt_subtree_length(node->left);
+
+    if (offset <= left_length) {
+        pt_split(node->left, offset, left, &node->left, spare);
+        pt_update_node(node);
+        *right = node;
+    } else if (offset >= left_length + node->length) {
+        pt_split(node->right, offset - left_length - node->length,
+                 &node->right, right, spare);
+        pt_update_node(node);
+        *left = node;
+    } else {
+        size_t split = offset - left_length;
+        PTNode *tail = *spare;
+        *spare = NULL;
+        assert(tail != NULL);
+
+        tail->text = node->text + split;
+        tail->length = node->length - split;
+
+        /* Only count the new lines in the smaller half */
+        if (split < tail->length) {
+            size_t head_lines = bs_count(node->text, split, '\n');
+            tail->lines = node->lines - head_lines;
+        } else {
+            tail->lines = bs_count(tail->text, tail->length, '\n');
+        }
+
+        /* The tail inherits the priority of the node it was split from
+         * so that it's still a valid root for node's right subtree */
+        tail->priority = node->priority;
+        tail->left = NULL;
+        tail->right = node->right;
+
+        node->length = split;
+        node->lines -= tail->lines;
+        node->right = NULL;
+
+        pt_update_node(node);
+        pt_update_node(tail);
+
+        *left = node;
+        *right = tail;
+    }
+}
+
+/* Join two trees where all text in left comes before right */
+static PTNode *pt_merge(PTNode *left, PTNode *right)
+{
+    if (left == NULL) {
+        return right;
+    } else if (right == NULL) {
+        return left;
+    }
+
+    if (left->priority > right->priority) {
+        left->right = pt_merge(left->right, right);
+        pt_update_node(left);
+        return left;
+    }
+
+    right->left = pt_merge(left, right->left);
+    pt_update_node(right);
+    return right;
+}
+
+/* When typing, text is appended to the current block directly after the
+ * text of the previous piece. In this case we can simply make the
+ * previous piece longer rather than creating a new piece */
+static int pt_extend_last_piece(PTNode *node, const char *text, size_t length,
+                                size_t lines)
+{
+    PTNode *last = node;
+
+    while (last != NULL && last->right != NULL) {
+        last = last->right;
+    }
+
+    if (last == NULL || last->text + last->length != text ||
+        last->length + length > PT_MAX_PIECE_SIZE) {
+        return 0;
+    }
+
+    last->length += length;
+    last->lines += lines;
+
+    while (node != NULL) {
+        node->subtree_length += length;
+        node->subtree_lines += lines;
+        node = node->right;
+    }
+
+    return 1;
+}
+
+static int pt_insert_piece(PieceTable *pt, size_t point, const char *text,
+                           size_t length, int continues_block)
+{
+    PTNode *spare = pt_new_node(pt);
+    PTNode *node = pt_new_node(pt);
+
+    if (spare == NULL || node == NULL) {
+        free(spare);
+        free(node);
+        return 0;
+    }
+
+    if (!pt_own_path(pt, point)) {
+        free(spare);
+        free(node);
+        return 0;
+    }
+
+    size_t lines = bs_count(text, length, '\n');
+    PTNode *left, *right;
+
+    pt_split(pt->root, point, &left, &right, &spare);
+
+    if (continues_block &&
+        pt_extend_last_piece(left, text, length, lines)) {
+        free(node);
+        node = NULL;
+    } else {
+        node->text = text;
+        node->length = length;
+        node->lines = lines;
+        pt_update_node(node);
+    }
+
+    pt->root = pt_merge(pt_merge(left, node), right);
+    free(spare);
+
+    return 1;
+}
+
+/* Copy as much of str as possible into the current block, allocating
+ * a new block if the current one is full */
+static const char *pt_append_text(PieceTable *pt, const char *str,
+                                  size_t str_len, size_t *appended,
+                                  int *continues_block)
+{
+    PTBlock *block = pt->blocks;
+
+    if (block == NULL || block->used == block->size) {
+        block = malloc(sizeof(PTBlock));
+
+        if (block == NULL) {
+            return NULL;
+        }
+
+        block->text = malloc(PT_BLOCK_SIZE);
+
+        if (block->text == NULL) {
+            free(block);
+            return NULL;
+        }
+
+        block->used = 0;
+        block->size = PT_BLOCK_SIZE;
+        block->refs = 1;
+        /* The new block takes over the table's reference
+         * to the previous block */
+        block->next = pt->blocks;
+        pt->blocks = block;
+    }
+
+    size_t bytes = MIN(str_len, MIN(block->size - block->used,
+                                    PT_MAX_PIECE_SIZE));
+    char *text = block->text + block->used;
+
+    memcpy(text, str, bytes);
+    *continues_block = block->used > 0;
+    block->used += bytes;
+    *appended = bytes;
+
+    return text;
+}
+
+int pt_insert(PieceTable *pt, const char *str, size_t str_len)
+{
+    assert(str != NULL);
+
+    if (str == NULL) {
+        return 0;
+    } else if (str_len == 0) {
+        return 1;
+    }
+
+    pt_invalidate(pt);
+
+    size_t point = pt->point;
+    size_t appended;
+    int continues_block;
+    const char *text;
+
+    while (str_len > 0) {
+        text = pt_append_text(pt, str, str_len, &appended, &continues_block);
+
+        if (text == NULL ||
+            !pt_insert_piece(pt, point, text, appended, continues_block)) {
+            return 0;
+        }
+
+        point += appended;
+        str += appended;
+        str_len -= appended;
+    }
+
+    return 1;
+}
+
+int pt_delete(PieceTable *pt, size_t byte_num)
+{
+    size_t length = pt_length(pt);
+
+    if (pt->point + byte_num > length) {
+        byte_num = length - pt->point;
+    }
+
+    if (byte_num == 0) {
+        return 1;
+    }
+
+    /* A split can occur at both ends of the deleted range */
+    PTNode *start_spare = pt_new_node(pt);
+    PTNode *end_spare = pt_new_node(pt);
+
+    pt_invalidate(pt);
+
+    if (start_spare == NULL || end_spare == NULL ||
+        !pt_own_path(pt, pt->point) ||
+        !pt_own_path(pt, pt->point + byte_num)) {
+        free(start_spare);
+        free(end_spare);
+        return 0;
+    }
+
+    PTNode *left, *rest, *middle, *right;
+
+    pt_split(pt->root, pt->point, &left, &rest, &start_spare);
+    pt_split(rest, byte_num, &middle, &right, &end_spare);
+    pt->root = pt_merge(left, right);
+
+    pt_free_nodes(middle);
+    free(start_spare);
+    free(end_spare);
+
+    return 1;
+}
+
+/* Copy any shared nodes on the path pt_split takes to reach point.
+ * The nodes a split and subsequent merge modify are all on this path
+ * so this ensures a modification doesn't affect any snapshots. Copying
+ * first means an allocation failure leaves the tree unchanged */
+static int pt_own_path(PieceTable *pt, size_t point)
+{
+    PTNode **link = &pt->root;
+    PTNode *node, *copy;
+    size_t left_length;
+
+    while ((node = *link) != NULL) {
+        if (node->refs > 1) {
+            copy = malloc(sizeof(PTNode));
+
+            if (copy == NULL) {
+                return 0;
+            }
+
+            *copy = *node;
+            copy->refs = 1;
+            node->refs--;
+
+            if (copy->left != NULL) {
+                copy->left->refs++;
+            }
+
+            if (copy->right != NULL) {
+                copy->right->refs++;
+            }
+
+            *link = node = copy;
+        }
+
+        left_length = pt_subtree_length(node->left);
+
+        if (point <= left_length) {
+            link = &node->left;
+        } else if (point >= left_length + node->length) {
+            point -= left_length + node->length;
+            link = &node->right;
+        } else {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+void pt_clear(PieceTable *pt)
+{
+    pt_invalidate(pt);
+    pt_free_nodes(pt->root);
+    pt_free_blocks(pt->blocks);
+    pt->root = NULL;
+    pt->blocks = NULL;
+    pt->point = 0;
+}
+
+size_t pt_get_point(const PieceTable *pt)
+{
+    return pt->point;
+}
+
+int pt_set_point(PieceTable *pt, size_t point)
+{
+    assert(point <= pt_length(pt));
+
+    if (point > pt_length(pt)) {
+        return 0;
+    }
+
+    pt->point = point;
+
+    return 1;
+}
+
+/* Find the piece containing point. The offset of the
+ * start of the piece in the buffer is stored in node_start */
+static const PTNode *pt_find_node(const PieceTable *pt, size_t point,
+                                  size_t *node_start)
+{
+    assert(point < pt_length(pt));
+
+    if (pt->cache_node != NULL && point >= pt->cache_start &&
+        point < pt->cache_start + pt->cache_node->length) {
+        *node_start = pt->cache_start;
+        return pt->cache_node;
+    }
+
+    const PTNode *node = pt->root;
+    size_t start = 0;
+    size_t left_length;
+
+    while (node != NULL) {
+        left_length = pt_subtree_length(node->left);
+
+        if (point < start + left_length) {
+            node = node->left;
+        } else if (point < start + left_length + node->length) {
+            start += left_length;
+            break;
+        } else {
+            start += left_length + node->length;
+            node = node->right;
+        }
+    }
+
+    assert(node != NULL);
+
+    /* The cache doesn't affect the text stored so it's
+     * safe to update when the PieceTable is const */
+    PieceTable *mutable_pt = (PieceTable *)pt;
+    mutable_pt->cache_node = node;
+    mutable_pt->cache_start = start;
+
+    *node_start = start;
+
+    return node;
+}
+
+char pt_get_at(const PieceTable *pt, size_t point)
+{
+    const char *text;
+
+    if (pt_get_segment(pt, point, &text) == 0) {
+        return '\0';
+    }
+
+    return *text;
+}
+
+/* Set text to the contiguous run of bytes starting at point
+ * and return its length */
+size_t pt_get_segment(const PieceTable *pt, size_t point, const char **text)
+{
+    if (point >= pt_length(pt)) {
+        return 0;
+    }
+
+    size_t node_start;
+    const PTNode *node = pt_find_node(pt, point, &node_start);
+    size_t node_offset = point - node_start;
+
+    *text = node->text + node_offset;
+
+    return node->length - node_offset;
+}
+
+/* Set text to the start of the contiguous run of bytes
+ * ending at point and return its length */
+size_t pt_get_segment_before(const PieceTable *pt, size_t point,
+                             const char **text)
+{
+    if (point == 0 || point > pt_length(pt)) {
+        return 0;
+    }
+
+    size_t node_start;
+    const PTNode *node = pt_find_node(pt, point - 1, &node_start);
+
+    *text = node->text;
+
+    return point - node_start;
+}
+
+size_t pt_get_range(const PieceTable *pt, size_t point, char *buf,
+                    size_t num_bytes)
+{
+    size_t length = pt_length(pt);
+    assert(buf != NULL);
+    assert(point <= length);
+
+    if (buf == NULL || point >= length || num_bytes == 0) {
+        return 0;
+    }
+
+    if (point + num_bytes > length) {
+        num_bytes = length - point;
+    }
+
+    size_t copied = 0;
+    size_t segment_length;
+    const char *text;
+
+    while (copied < num_bytes) {
+        segment_length = pt_get_segment(pt, point + copied, &text);
+        segment_length = MIN(segment_length, num_bytes - copied);
+        memcpy(buf + copied, text, segment_length);
+        copied += segment_length;
+    }
+
+    return num_bytes;
+}
+
+int pt_find_next(const PieceTable *pt, size_t point, size_t *next, char c)
+{
+    assert(next != NULL);
+    assert(point <= pt_length(pt));
+
+    if (next == NULL) {
+        return 0;
+    }
+
+    size_t segment_length;
+    const char *text;
+    const char *match;
+
+    while ((segment_length = pt_get_segment(pt, point, &text)) > 0) {
+        match = memchr(text, c, segment_length);
+
+        if (match != NULL) {
+            *next = point + (match - text);
+            return 1;
+        }
+
+        point += segment_length;
+    }
+
+    return 0;
+}
+
+int pt_find_prev(const PieceTable *pt, size_t point, size_t *prev, char c)
+{
+    assert(prev != NULL);
+
+    if (prev == NULL) {
+        return 0;
+    }
+
+    if (point > pt_length(pt)) {
+        point = pt_length(pt);
+    }
+
+    size_t segment_length;
+    const char *text;
+    const char *match;
+
+    while ((segment_length = pt_get_segment_before(pt, point, &text)) > 0) {
+        match = bs_find_rev(text, segment_length, c);
+
+        if (match != NULL) {
+            *prev = point - segment_length + (match - text);
+            return 1;
+        }
+
+        point -= segment_length;
+    }
+
+    return 0;
+}
+
+/* Return the number of new lines before point */
+size_t pt_lines_before(const PieceTable *pt, size_t point)
+{
+    assert(point <= pt_length(pt));
+
+    const PTNode *node = pt->root;
+    size_t lines = 0;
+    size_t left_length;
+
+    while (node != NULL) {
+        left_length = pt_subtree_length(node->left);
+
+        if (point <= left_length) {
+            node = node->left;
+        } else if (point <= left_length + node->length) {
+            return lines + pt_subtree_lines(node->left) +
+                   bs_count(node->text, point - left_length, '\n');
+        } else {
+            lines += pt_subtree_lines(node->left) + node->lines;
+            point -= left_length + node->length;
+            node = node->right;
+        }
+    }
+
+    return lines;
+}
+
+/* Return the offset of the start of the line
+ * which has line new lines before it */
+size_t pt_line_start(const PieceTable *pt, size_t line)
+{
+    if (line > pt_lines(pt)) {
+        line = pt_lines(pt);
+    }
+
+    if (line == 0) {
+        return 0;
+    }
+
+    const PTNode *node = pt->root;
+    size_t offset = 0;
+    size_t left_lines;
+
+    while (node != NULL) {
+        left_lines = pt_subtree_lines(node->left);
+
+        if (line <= left_lines) {
+            node = node->left;
+        } else if (line <= left_lines + node->lines) {
+            offset += pt_subtree_length(node->left);
+            line -= left_lines;
+            break;
+        } else {
+            line -= left_lines + node->lines;
+            offset += pt_subtree_length(node->left) + node->length;
+            node = node->right;
+        }
+    }
+
+    if (node == NULL) {
+        return pt_length(pt);
+    }
+
+    const char *text = node->text;
+    const char *end = node->text + node->length;
+
+    while ((text = memchr(text, '\n', end - text)) != NULL) {
+        if (--line == 0) {
+            return offset + (text - node->text) + 1;
+        }
+
+        text++;
+    }
+
+    assert(!"Piece line count is inconsistent with piece text");
+
+    return pt_length(pt);
+}
+
+/* Some libraries (e.g. PCRE) require the text they operate on to be
+ * in a single contiguous block of memory. This function creates a copy
+ * of the buffer text which is valid until the PieceTable is modified */
+const char *pt_contiguous_storage(PieceTable *pt)
+{
+    if (pt->flat != NULL) {
+        return pt->flat;
+    }
+
+    size_t length = pt_length(pt);
+    pt->flat = malloc(length + 1);
+
+    if (pt->flat == NULL) {
+        return NULL;
+    }
+
+    pt_get_range(pt, 0, pt->flat, length);
+    pt->flat[length] = '\0';
+
+    return pt->flat;
+}
+
+/* Called before any modification to discard state derived from
+ * the current text */
+static void pt_invalidate(PieceTable *pt)
+{
+    pt->cache_node = NULL;
+    free(pt->flat);
+    pt->flat = NULL;
+}
+
+/* xorshift generator used for treap priorities */
+static unsigned int pt_random(PieceTable *pt)
+{
+    unsigned int x = pt->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pt->seed = x;
+
+    return x;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_PIECE_TABLE_H
+#define WED_PIECE_TABLE_H
+
+#include <stddef.h>
+
+/* Maximum size of a single piece. Keeping pieces bounded means
+ * splitting a piece (which requires counting the new lines in
+ * one half) is a constant time operation */
+#ifndef PT_MAX_PIECE_SIZE
+#define PT_MAX_PIECE_SIZE 65536
+#endif
+
+/* Size of the append only blocks that inserted text is copied into */
+#ifndef PT_BLOCK_SIZE
+#define PT_BLOCK_SIZE 65536
+#endif
+
+/* Inserted text is copied into append only blocks. Text in a block
+ * is never modified or moved once written so pieces can safely
+ * reference it for the lifetime of the PieceTable and its snapshots */
+typedef struct PTBlock PTBlock;
+
+struct PTBlock {
+    char *text; /* Block memory */
+    size_t used; /* Bytes written to block */
+    size_t size; /* Bytes allocated to block */
+    PTBlock *next; /* Previously allocated block */
+    size_t refs; /* Number of tables and blocks referencing this block */
+};
+
+/* A piece references a contiguous range of text in a block. Pieces
+ * are stored in a treap ordered by buffer position where each node
+ * also stores the total length and new line count of its subtree.
+ * This allows an offset to be located and text to be inserted or
+ * deleted at any position in O(log n) expected time */
+typedef struct PTNode PTNode;
+
+struct PTNode {
+    PTNode *left; /* Pieces before this one */
+    PTNode *right; /* Pieces after this one */
+    const char *text; /* Start of piece text */
+    size_t length; /* Piece length */
+    size_t lines; /* Number of new line (\n) characters in piece */
+    size_t subtree_length; /* Length of all pieces in subtree */
+    size_t subtree_lines; /* New line count of all pieces in subtree */
+    unsigned int priority; /* Treap heap priority */
+    size_t refs; /* Number of parent nodes and tables referencing this
+                    node. A node with more than one reference is shared
+                    with a snapshot and is copied before being modified */
+};
+
+/* PieceTable is an alternative to the GapBuffer storage layout which
+ * performs well when making edits at random positions in large buffers.
+ * It's accessed through the GapBuffer interface rather than directly */
+typedef struct {
+    PTNode *root; /* Root of piece treap */
+    PTBlock *blocks; /* Most recently allocated block */
+    size_t point; /* Position in buffer */
+    unsigned int seed; /* Random state used to generate priorities */
+    /* Last piece looked up and its buffer offset. Sequential reads
+     * usually hit the same piece so this avoids a tree descent */
+    const PTNode *cache_node;
+    size_t cache_start;
+    char *flat; /* Contiguous copy of buffer text (see
+                   pt_contiguous_storage) */
+} PieceTable;
+
+PieceTable *pt_new(void);
+void pt_free(PieceTable *);
+PieceTable *pt_snapshot(PieceTable *);
+size_t pt_length(const PieceTable *);
+size_t pt_lines(const PieceTable *);
+int pt_insert(PieceTable *, const char *str, size_t str_len);
+int pt_delete(PieceTable *, size_t byte_num);
+void pt_clear(PieceTable *);
+size_t pt_get_point(const PieceTable *);
+int pt_set_point(PieceTable *, size_t point);
+char pt_get_at(const PieceTable *, size_t point);
+size_t pt_get_range(const PieceTable *, size_t point, char *buf,
+                    size_t num_bytes);
+size_t pt_get_segment(const PieceTable *, size_t point, const char **text);
+size_t pt_get_segment_before(const PieceTable *, size_t point,
+                             const char **text);
+int pt_find_next(const PieceTable *, size_t point, size_t *next, char c);
+int pt_find_prev(const PieceTable *, size_t point, size_t *prev, char c);
+size_t pt_lines_before(const PieceTable *, size_t point);
+size_t pt_line_start(const PieceTable *, size_t line);
+const char *pt_contiguous_storage(PieceTable *);
+
+#endif
@@ -19,7 +19,14 @@
 /* Extend search limit by REGEX_BUFFER_SIZE to allow patterns that start
  * before the limit and end after to be matched */
 #define REGEX_BUFFER_SIZE 8192
-
+/* Text stored in a piece table is searched in windows of this size,
+ * which are only copied when they span more than one piece */
+#define REGEX_WINDOW_SIZE 65536
+/* Text before a window included so lookbehind assertions, ^ and \b
+ * see the characters preceding it */
+#define REGEX_LOOKBEHIND_SIZE 256
+
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include "regex_search.h"
@@ -28,12 +35,28 @@
 #include "util.h"
 #include "build_config.h"
 
-static Status rs_find_prev_str(const char *str, size_t str_len, size_t point,
+/* Text being searched */
+typedef struct {
+    const GapBuffer *buffer;
+    const char *text; /* Contiguous buffer text, or NULL when the buffer
+                         is a piece table searched a window at a time */
+    size_t length; /* Buffer length */
+} RegexSubject;
+
+static Status rs_subject_init(RegexSubject *, const GapBuffer *);
+static Status rs_find_prev_str(const RegexSubject *, size_t point,
                                size_t limit, size_t *match_point,
                                int *found_match, RegexSearch *);
-static Status rs_find_next_str(const char *str, size_t point, size_t limit,
-                               size_t *match_point, int *found_match,
-                               RegexSearch *);
+static Status rs_find_next_str(const RegexSubject *, size_t point,
+                               size_t limit, size_t *match_point,
+                               int *found_match, RegexSearch *);
+static Status rs_find_next_in_windows(const RegexSubject *, size_t point,
+                                      size_t limit, size_t *match_point,
+                                      int *found_match, RegexSearch *);
+static const char *rs_get_window(RegexSearch *, const GapBuffer *,
+                                 size_t start, size_t length);
+static Status rs_exec(RegexSearch *, const char *str, size_t length,
+                      size_t point, int options);
 
 /* Initialise regex search */
 Status rs_init(RegexSearch *search, const SearchOptions *opt)
@@ -88,6 +111,10 @@ void rs_free(RegexSearch *search)
         pcre_free(search->regex);
         search->regex = NULL;
     }
+
+    free(search->window);
+    search->window = NULL;
+    search->window_size = 0;
 }
 
 Status rs_reinit(RegexSearch *search, const SearchOptions *opt)
@@ -104,9 +131,10 @@ Status rs_find_next(RegexSearch *search, const SearchOptions *opt,
     size_t regex_buffer = data->search_start_pos == NULL
                           ? REGEX_BUFFER_SIZE : 0;
     size_t limit;
+    RegexSubject subject;
     (void)opt;
 
-    gb_contiguous_storage((GapBuffer *)pos.data);
+    RETURN_IF_FAIL(rs_subject_init(&subject, pos.data));
 
     if (*data->wrapped) {
         /* Search has wrapped so set the limit to the search starting
@@ -117,7 +145,7 @@ Status rs_find_next(RegexSearch *search, const SearchOptions *opt,
         limit = buffer_len;
     }
 
-    RETURN_IF_FAIL(rs_find_next_str(pos.data->text, pos.offset, limit, 
+    RETURN_IF_FAIL(rs_find_next_str(&subject, pos.offset, limit,
                                     data->match_point, data->found_match,
                                     search));
 
@@ -135,7 +163,7 @@ Status rs_find_next(RegexSearch *search, const SearchOptions *opt,
         limit = data->search_start_pos->offset;
     }
 
-    RETURN_IF_FAIL(rs_find_next_str(pos.data->text, pos.offset,
+    RETURN_IF_FAIL(rs_find_next_str(&subject, pos.offset,
                                     MIN(limit + regex_buffer, buffer_len),
                                     data->match_point, data->found_match,
                                     search));
@@ -157,9 +185,10 @@ Status rs_find_prev(RegexSearch *search, const SearchOptions *opt,
         limit = 0;
     }
 
-    gb_contiguous_storage((GapBuffer *)pos.data);
+    RegexSubject subject;
+    RETURN_IF_FAIL(rs_subject_init(&subject, pos.data));
 
-    RETURN_IF_FAIL(rs_find_prev_str(pos.data->text, buffer_len, pos.offset, 
+    RETURN_IF_FAIL(rs_find_prev_str(&subject, pos.offset,
                                     limit, data->match_point,
                                     data->found_match, search));
 
@@ -175,17 +204,40 @@ Status rs_find_prev(RegexSearch *search, const SearchOptions *opt,
         limit = data->search_start_pos->offset;
     }
 
-    RETURN_IF_FAIL(rs_find_prev_str(pos.data->text, buffer_len, buffer_len, 
+    RETURN_IF_FAIL(rs_find_prev_str(&subject, buffer_len,
                                     limit, data->match_point,
                                     data->found_match, search));
 
     return STATUS_SUCCESS;
 }
 
-static Status rs_find_prev_str(const char *str, size_t str_len, size_t point,
+/* Buffers using a gap are made contiguous so they can be searched in
+ * place. A piece table would have to be copied in full, so is instead
+ * searched a window at a time */
+static Status rs_subject_init(RegexSubject *subject, const GapBuffer *buffer)
+{
+    subject->buffer = buffer;
+    subject->text = NULL;
+    subject->length = gb_length(buffer);
+
+    if (gb_get_storage(buffer) == GBS_PIECE_TABLE) {
+        return STATUS_SUCCESS;
+    }
+
+    subject->text = gb_contiguous_storage((GapBuffer *)buffer);
+
+    if (subject->text == NULL) {
+        return OUT_OF_MEMORY("Unable to perform regex search");
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status rs_find_prev_str(const RegexSubject *subject, size_t point,
                                size_t limit, size_t *match_point,
                                int *found_match, RegexSearch *search)
 {
+    size_t str_len = subject->length;
     size_t search_length, search_point;
     size_t mpoint = 0, mlength = 0;
     size_t start_point = point;
@@ -204,7 +256,8 @@ static Status rs_find_prev_str(const char *str, size_t str_len, size_t point,
         do {
             found = 0;
 
-            status = rs_find_next_str(str, search_point, point + search_length,
+            status = rs_find_next_str(subject, search_point,
+                                      point + search_length,
                                       match_point, &found, search);
 
             if (found && *match_point < start_point) {
@@ -231,7 +284,7 @@ static Status rs_find_prev_str(const char *str, size_t str_len, size_t point,
                 /* TODO Store match data in another way temporarily so that 
                  * it can simply be used at this point without the need
                  * for another search */
-                status = rs_find_next_str(str, mpoint, mpoint + mlength,
+                status = rs_find_next_str(subject, mpoint, mpoint + mlength,
                                           match_point, found_match, search);
             }
 
@@ -242,28 +295,143 @@ static Status rs_find_prev_str(const char *str, size_t str_len, size_t point,
     return status;
 }
 
-static Status rs_find_next_str(const char *str, size_t point, size_t limit,
-                               size_t *match_point, int *found_match,
-                               RegexSearch *search)
+static Status rs_find_next_str(const RegexSubject *subject, size_t point,
+                               size_t limit, size_t *match_point,
+                               int *found_match, RegexSearch *search)
 {
-    search->return_code = pcre_exec(search->regex, search->study, str, limit,
-                                    point, 0, search->output_vector,
-                                    OUTPUT_VECTOR_SIZE);
+    if (subject->text == NULL) {
+        return rs_find_next_in_windows(subject, point, limit, match_point,
+                                       found_match, search);
+    }
+
+    RETURN_IF_FAIL(rs_exec(search, subject->text, limit, point, 0));
+
+    if (search->return_code >= 0) {
+        *match_point = search->output_vector[0];
+        *found_match = 1;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Search a window at a time. Text preceding each window is included so
+ * it's matched in context, and a window is searched as a partial
+ * subject unless it ends at the limit. A partial match means a match
+ * may continue past the window, so the next window starts where the
+ * partial match did, growing if the partial match started the window */
+static Status rs_find_next_in_windows(const RegexSubject *subject,
+                                      size_t point, size_t limit,
+                                      size_t *match_point, int *found_match,
+                                      RegexSearch *search)
+{
+    const GapBuffer *buffer = subject->buffer;
+    size_t window_size = REGEX_WINDOW_SIZE;
+    size_t start, end;
+    const char *window;
+
+    limit = MIN(limit, subject->length);
+
+    while (point <= limit) {
+        /* Windows start and end on character boundaries so
+         * each is valid UTF-8 */
+        start = point - MIN(point, REGEX_LOOKBEHIND_SIZE);
+
+        while (start < point && (gb_getu_at(buffer, start) & 0xC0) == 0x80) {
+            start++;
+        }
+
+        end = MIN(limit, point + window_size);
 
-    if (search->return_code < 0) {
-        if (search->return_code == PCRE_ERROR_NOMATCH) {
+        while (end > point && end < limit &&
+               (gb_getu_at(buffer, end) & 0xC0) == 0x80) {
+            end--;
+        }
+
+        window = rs_get_window(search, buffer, start, end - start);
+
+        if (window == NULL) {
+            return OUT_OF_MEMORY("Unable to perform regex search");
+        }
+
+        RETURN_IF_FAIL(rs_exec(search, window, end - start, point - start,
+                               end < limit ? PCRE_PARTIAL_HARD : 0));
+
+        if (search->return_code >= 0) {
+            /* Offsets are relative to the buffer rather than the window */
+            int pairs = search->return_code > 0 ? search->return_code
+                                                : OUTPUT_VECTOR_SIZE / 3;
+
+            for (int k = 0; k < pairs * 2; k++) {
+                if (search->output_vector[k] >= 0) {
+                    search->output_vector[k] += start;
+                }
+            }
+
+            *match_point = search->output_vector[0];
+            *found_match = 1;
             return STATUS_SUCCESS;
+        } else if (search->return_code == PCRE_ERROR_PARTIAL) {
+            size_t partial_point = start + search->output_vector[0];
+
+            if (partial_point > point) {
+                point = partial_point;
+            } else {
+                window_size *= 2;
+            }
+        } else if (end == limit) {
+            break;
+        } else {
+            point = end;
         }
+    }
 
+    return STATUS_SUCCESS;
+}
+
+/* Return the text of a window, which can be read in place
+ * when it doesn't span more than one piece */
+static const char *rs_get_window(RegexSearch *search, const GapBuffer *buffer,
+                                 size_t start, size_t length)
+{
+    const char *text;
+
+    if (gb_get_segment(buffer, start, &text) >= length) {
+        return text;
+    }
+
+    if (length > search->window_size) {
+        char *window = realloc(search->window, length);
+
+        if (window == NULL) {
+            return NULL;
+        }
+
+        search->window = window;
+        search->window_size = length;
+    }
+
+    gb_get_range(buffer, start, search->window, length);
+
+    return search->window;
+}
+
+static Status rs_exec(RegexSearch *search, const char *str, size_t length,
+                      size_t point, int options)
+{
+    search->return_code = pcre_exec(search->regex, search->study, str,
+                                    length, point, options,
+                                    search->output_vector,
+                                    OUTPUT_VECTOR_SIZE);
+
+    if (search->return_code >= 0) {
+        search->match_length = search->output_vector[1] -
+                               search->output_vector[0];
+    } else if (search->return_code != PCRE_ERROR_NOMATCH &&
+               search->return_code != PCRE_ERROR_PARTIAL) {
         return st_get_error(ERR_REGEX_EXECUTION_FAILED,
                             "Regex execution failed. PCRE exit code: %d",
                             search->return_code);
     }
 
-    *match_point = search->output_vector[0];
-    search->match_length = search->output_vector[1] - search->output_vector[0];
-    *found_match = 1;
-
     return STATUS_SUCCESS;
 }
-
@@ -80,6 +80,8 @@ typedef struct {
     int output_vector[OUTPUT_VECTOR_SIZE]; /* Captured group data */
     int match_length; /* output_vector[1] - output_vector[0] for convenience */
     RegexReplace regex_replace; /* Backreference data */
+    char *window; /* Text copied when searching a piece table */
+    size_t window_size; /* Allocated size of window */
 } RegexSearch;
 
 Status rs_init(RegexSearch *, const SearchOptions *);
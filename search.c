@@ -210,7 +210,12 @@ size_t bs_match_length(const BufferSearch *search)
     return 0; 
 }
 
-Status bs_find_all(BufferSearch *search, const BufferPos *current_pos)
+/* Find all matches so they can be highlighted. If time_limit_ms is
+ * non-zero searching stops once that many milliseconds have passed,
+ * in which case, as when the match limit is reached, the matches found
+ * so far are kept and subsequent searches continue from the buffer */
+Status bs_find_all(BufferSearch *search, const BufferPos *current_pos,
+                   long time_limit_ms)
 {
     BufferPos pos = *current_pos;
     int orig_direction = search->opt.forward;
@@ -220,6 +225,12 @@ Status bs_find_all(BufferSearch *search, const BufferPos *current_pos)
     Status status = STATUS_SUCCESS;
     SearchMatches *matches = &search->matches; 
     int found_match;
+    int limit_reached = 0;
+    struct timespec search_start;
+
+    if (time_limit_ms > 0) {
+        get_monotonic_time(&search_start);
+    }
 
     do {
         status = bs_find_next(search, &pos, &found_match);
@@ -235,16 +246,23 @@ Status bs_find_all(BufferSearch *search, const BufferPos *current_pos)
                                  range->end.offset + bs_match_length(search));
 
             if (matches->match_num == MAX_SEARCH_MATCH_NUM) {
+                limit_reached = 1;
                 break;
             }
 
             pos = search->last_match_pos; 
         }
+
+        if (time_limit_ms > 0 && !search->finished &&
+            elapsed_ms(&search_start) >= time_limit_ms) {
+            limit_reached = 1;
+            break;
+        }
     } while (!search->finished);
 
     search->opt.forward = orig_direction;
 
-    if (matches->match_num == MAX_SEARCH_MATCH_NUM) {
+    if (limit_reached) {
         search->finished = 0;
         search->start_pos.line_no = 0;
         search->wrapped = 0;
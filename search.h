@@ -83,6 +83,7 @@ void bs_free(BufferSearch *);
 Status bs_find_next(BufferSearch *, const BufferPos *start_pos,
                     int *found_match);
 size_t bs_match_length(const BufferSearch *);
-Status bs_find_all(BufferSearch *, const BufferPos *current_pos);
+Status bs_find_all(BufferSearch *, const BufferPos *current_pos,
+                   long time_limit_ms);
 
 #endif
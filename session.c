@@ -17,8 +17,10 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
 #include "session.h"
 #include "status.h"
@@ -36,18 +38,26 @@
 static const char *se_get_empty_buffer_name(Session *);
 static Status se_add_to_history(List *, const char *text);
 static size_t se_populate_file_buf(const Buffer *, char *file_buf,
-                                   size_t file_buf_size);
+                                   size_t file_buf_size,
+                                   const char **file_start);
 static void se_determine_filetype(Session *, Buffer *);
 static void se_determine_fileformat(Session *, Buffer *);
 static int se_is_valid_config_def(Session *, HashMap *, ConfigType,
                                   const char *def_name);
 static int se_add_buffer_from_stdin(Session *);
+static int se_init_event_pipe(Session *);
+static int se_load_in_background(const Session *, const Buffer *,
+                                 int is_stdin);
+static int se_use_journal(const Session *, int is_stdin);
+static void se_start_journal(Session *, Buffer *);
+static int se_use_undo_file(const Session *, int is_stdin);
 
 Session *se_new(void)
 {
     Session *sess = malloc(sizeof(Session));
     RETURN_IF_NULL(sess);
     memset(sess, 0, sizeof(Session));
+    sess->event_pipe[0] = sess->event_pipe[1] = -1;
 
     return sess;
 }
@@ -142,6 +152,10 @@ int se_init(Session *sess, const WedOpt *wed_opt, char *buffer_paths[],
         return 0;
     }
 
+    if (!se_init_event_pipe(sess)) {
+        return 0;
+    }
+
 #if WED_FEATURE_LUA
     if ((sess->ls = ls_new(sess)) == 0) {
         return 0;
@@ -239,6 +253,12 @@ void se_free(Session *sess)
     ls_free(sess->ls);
 #endif
 
+    for (size_t k = 0; k < 2; k++) {
+        if (sess->event_pipe[k] != -1) {
+            close(sess->event_pipe[k]);
+        }
+    }
+
     free(sess);
 }
 
@@ -567,12 +587,26 @@ Status se_add_new_buffer(Session *sess, const char *file_path, int is_stdin)
         goto cleanup;
     }
 
-    status = bf_load_file(buffer);
+    if (se_load_in_background(sess, buffer, is_stdin)) {
+        status = bf_load_file_async(buffer, sess->event_pipe[1]);
+    } else {
+        status = bf_load_file(buffer);
+    }
 
     if (!STATUS_IS_SUCCESS(status)) {
         goto cleanup;
     }
 
+    se_check_large_file(sess, buffer);
+
+    if (se_use_journal(sess, is_stdin)) {
+        se_start_journal(sess, buffer);
+    }
+
+    if (se_use_undo_file(sess, is_stdin)) {
+        se_add_error(sess, bf_enable_undo_file(buffer));
+    }
+
     se_add_buffer(sess, buffer);
 
     return STATUS_SUCCESS;
@@ -587,6 +621,102 @@ cleanup:
     return status;
 }
 
+/* Large files are mapped, or when that isn't possible loaded in the
+ * background, so that the start of the file can be displayed
+ * immediately. bf_load_file_async falls back to loading in the
+ * background if mapping fails */
+static int se_load_in_background(const Session *sess, const Buffer *buffer,
+                                 int is_stdin)
+{
+    size_t min_size = (size_t)cf_int(sess->config, CV_PROGRESSIVELOAD) *
+                      1024 * 1024;
+
+    if (is_stdin || sess->wed_opt.test_mode ||
+        !fi_file_exists(&buffer->file_info) ||
+        fl_load_method(&buffer->file_info.file_stat,
+                       bf_can_map_file(buffer), min_size) == FLM_READ) {
+        return 0;
+    }
+
+    /* A journal can only be replayed once the whole file is loaded */
+    if (se_use_journal(sess, is_stdin)) {
+        char *journal_path = jn_journal_path(buffer->file_info.abs_path);
+        int has_journal = journal_path != NULL &&
+                          access(journal_path, F_OK) == 0;
+        free(journal_path);
+
+        if (has_journal) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Limit costly features in buffers above either large file threshold.
+ * Files still loading are checked against their size on disk so
+ * limits apply from the first draw */
+void se_check_large_file(const Session *sess, Buffer *buffer)
+{
+    if (bf_is_large_file(buffer)) {
+        return;
+    }
+
+    size_t min_size = sess->config_snapshot.largefile * 1024 * 1024;
+    size_t min_lines = sess->config_snapshot.largefilelines;
+    size_t size = bf_length(buffer);
+
+    if (bf_load_in_progress(buffer)) {
+        size = MAX(size, (size_t)buffer->file_info.file_stat.st_size);
+    }
+
+    /* While the lines of a mapped file are being counted this
+     * is checked again as the count increases */
+    int complete;
+
+    if ((min_size > 0 && size >= min_size) ||
+        (min_lines > 0 && bf_known_lines(buffer, &complete) >= min_lines)) {
+        bf_set_large_file(buffer, 1);
+    }
+}
+
+static int se_use_journal(const Session *sess, int is_stdin)
+{
+    return !is_stdin && !sess->wed_opt.test_mode &&
+           cf_bool(sess->config, CV_JOURNAL);
+}
+
+/* Recover any edits left in the journal by a previous session that
+ * didn't exit cleanly, then journal further edits */
+static void se_start_journal(Session *sess, Buffer *buffer)
+{
+    size_t records = 0;
+    size_t valid_length = 0;
+
+    if (!bf_load_in_progress(buffer)) {
+        Status status = bf_replay_journal(buffer, &records, &valid_length);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            se_add_error(sess, status);
+            records = valid_length = 0;
+        } else if (records > 0) {
+            char msg[MAX_MSG_SIZE];
+            snprintf(msg, MAX_MSG_SIZE, "Recovered %zu unsaved change%s "
+                     "to %s", records, records == 1 ? "" : "s",
+                     buffer->file_info.file_name);
+            se_add_msg(sess, msg);
+        }
+    }
+
+    se_add_error(sess, bf_enable_journal(buffer, valid_length));
+}
+
+static int se_use_undo_file(const Session *sess, int is_stdin)
+{
+    return !is_stdin && !sess->wed_opt.test_mode &&
+           cf_bool(sess->config, CV_UNDOFILE);
+}
+
 static const char *se_get_empty_buffer_name(Session *sess)
 {
     static char empty_buf_name[MAX_EMPTY_BUFFER_NAME_SIZE];
@@ -706,6 +836,7 @@ Status se_add_filetype_def(Session *sess, FileType *file_type)
     Buffer *buffer = sess->buffers;
     int re_enable_msgs = se_disable_msgs(sess);
     char file_buf[FILE_TYPE_FILE_BUF_SIZE];
+    const char *file_start;
     size_t file_buf_size;
     int matches;
 
@@ -715,10 +846,12 @@ Status se_add_filetype_def(Session *sess, FileType *file_type)
     while (buffer != NULL) {
         if (is_null_or_empty(cf_string(buffer->config, CV_FILETYPE))) {
             file_buf_size = se_populate_file_buf(buffer, file_buf,
-                                                 FILE_TYPE_FILE_BUF_SIZE);
+                                                 FILE_TYPE_FILE_BUF_SIZE,
+                                                 &file_start);
 
             se_add_error(sess, ft_matches(file_type, &buffer->file_info,
-                                          file_buf, file_buf_size, &matches));
+                                          file_start, file_buf_size,
+                                          &matches));
 
             if (matches) {
                 se_add_error(sess, cf_set_var(CE_VAL(sess, buffer), CL_BUFFER,
@@ -737,20 +870,31 @@ Status se_add_filetype_def(Session *sess, FileType *file_type)
     return STATUS_SUCCESS;
 }
 
+/* Set file_start to the first file_buf_size - 1 bytes of buffer text.
+ * The text is only copied into file_buf if it isn't contiguous */
 static size_t se_populate_file_buf(const Buffer *buffer, char *file_buf,
-                                   size_t file_buf_size)
+                                   size_t file_buf_size,
+                                   const char **file_start)
 {
-    BufferPos pos_start = buffer->pos;
-    bp_to_buffer_start(&pos_start);
-    file_buf_size = bf_get_text(buffer, &pos_start, file_buf,
-                                file_buf_size - 1);
-    file_buf[file_buf_size] = '\0';
+    size_t max_size = MIN(file_buf_size - 1, bf_length(buffer));
+    *file_start = file_buf;
+    file_buf_size = gb_get_segment(buffer->data, 0, file_start);
+
+    if (file_buf_size >= max_size) {
+        file_buf_size = max_size;
+    } else {
+        BufferPos pos_start = buffer->pos;
+        bp_to_buffer_start(&pos_start);
+        file_buf_size = bf_get_text(buffer, &pos_start, file_buf, max_size);
+        file_buf[file_buf_size] = '\0';
+        *file_start = file_buf;
+    }
 
     if (file_buf_size == 0) {
         return 0;
     }
 
-    /* If the regex below fails then file_buf contains an invalid UTF-8
+    /* If the regex below fails then file_start contains an invalid UTF-8
      * sequence and there is no point attempting to run the
      * file_content regex against it */
 
@@ -764,7 +908,7 @@ static size_t se_populate_file_buf(const Buffer *buffer, char *file_buf,
 
     if (!STATUS_IS_SUCCESS(
                 ru_exec(&regex_result, &regex_instance,
-                        file_buf, file_buf_size, 0)
+                        *file_start, file_buf_size, 0)
                 )) {
         return 0;
     }
@@ -788,15 +932,18 @@ static void se_determine_filetype(Session *sess, Buffer *buffer)
     int matches;
 
     char file_buf[FILE_TYPE_FILE_BUF_SIZE];
+    const char *file_start;
     size_t file_buf_size = se_populate_file_buf(buffer, file_buf,
-                                                FILE_TYPE_FILE_BUF_SIZE);
+                                                FILE_TYPE_FILE_BUF_SIZE,
+                                                &file_start);
 
     for (size_t k = 0; k < key_num; k++) {
         file_type = hashmap_get(filetypes, keys[k]);
 
         if (file_type != NULL) {
             se_add_error(sess, ft_matches(file_type, &buffer->file_info,
-                                          file_buf, file_buf_size, &matches));
+                                          file_start, file_buf_size,
+                                          &matches));
 
             if (matches) {
                 se_add_error(sess, cf_set_var(CE_VAL(sess, buffer), CL_BUFFER,
@@ -973,20 +1120,50 @@ const char *se_get_prev_key(const Session *sess)
     return sess->prev_key;
 }
 
+/* Piped input is read by the input loop as it arrives so that it's
+ * displayed immediately, even when produced slowly or continuously.
+ * Stdin is then reopened on the terminal for keyboard input */
 static int se_add_buffer_from_stdin(Session *sess)
 {
-    if (!STATUS_IS_SUCCESS(se_add_new_buffer(sess, "/dev/stdin", 1))) {
-        return 0;
+    Buffer *buffer;
+
+    if (sess->wed_opt.test_mode || isatty(STDIN_FILENO)) {
+        if (!STATUS_IS_SUCCESS(se_add_new_buffer(sess, "/dev/stdin", 1))) {
+            return 0;
+        }
+
+        buffer = sess->buffers;
+        FileInfo *file_info = &buffer->file_info;
+        fi_free(file_info);
+
+        if (!fi_init_empty(file_info, se_get_empty_buffer_name(sess))) {
+            return 0; 
+        }
+    } else {
+        int stream_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+
+        if (stream_fd == -1) {
+            return 0;
+        }
+
+        Status status = se_add_new_empty_buffer(sess);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            close(stream_fd);
+            st_free_status(status);
+            return 0;
+        }
+
+        buffer = sess->buffers;
+        status = bf_stream_file(buffer, stream_fd);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            st_free_status(status);
+            return 0;
+        }
     }
 
-    Buffer *buffer = sess->buffers;
     buffer->change_state.version++;
-    FileInfo *file_info = &buffer->file_info;
-    fi_free(file_info);
-    
-    if (!fi_init_empty(file_info, se_get_empty_buffer_name(sess))) {
-        return 0; 
-    }
 
     int fd = open("/dev/tty", O_RDONLY);
 
@@ -1046,3 +1223,195 @@ void se_determine_filetypes_if_unset(Session *sess, Buffer *buffer)
     }
 }
 
+
+static int se_init_event_pipe(Session *sess)
+{
+    if (pipe(sess->event_pipe) == -1) {
+        sess->event_pipe[0] = sess->event_pipe[1] = -1;
+        return 0;
+    }
+
+    /* Background tasks shouldn't block when the pipe is full
+     * and external commands shouldn't inherit it */
+    for (size_t k = 0; k < 2; k++) {
+        if (fcntl(sess->event_pipe[k], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(sess->event_pipe[k], F_SETFD, FD_CLOEXEC) == -1) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Save buffer to file_path. Unless wait is true the buffer is written
+ * in the background and the save is completed by se_process_events */
+Status se_save_buffer(Session *sess, Buffer *buffer, const char *file_path,
+                      int wait)
+{
+    /* Complete any save already in progress so its result isn't lost */
+    RETURN_IF_FAIL(se_finish_buffer_save(sess, buffer));
+    RETURN_IF_FAIL(bf_write_file_async(buffer, file_path,
+                                       sess->event_pipe[1]));
+
+    if (wait || sess->wed_opt.test_mode) {
+        return se_finish_buffer_save(sess, buffer);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Wait for a save in progress to complete then update
+ * the buffer file info to reflect the file written */
+Status se_finish_buffer_save(Session *sess, Buffer *buffer)
+{
+    if (!bf_write_in_progress(buffer)) {
+        return STATUS_SUCCESS;
+    }
+
+    size_t lines = gb_lines(buffer->writer->data) + 1;
+    size_t bytes = gb_length(buffer->writer->data);
+    char *file_path;
+
+    Status status = bf_finish_write_file(buffer, &file_path);
+    GOTO_IF_FAIL(status, cleanup);
+
+    if (!fi_file_exists(&buffer->file_info)) {
+        /* Now that file exists on disk, initalise FileInfo for it */
+        FileInfo tmp = buffer->file_info;
+        status = fi_init(&buffer->file_info, file_path);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            buffer->file_info = tmp;
+            goto cleanup;
+        }
+
+        fi_free(&tmp);
+        se_determine_filetypes_if_unset(sess, buffer);
+    } else {
+        fi_refresh_file_attributes(&buffer->file_info);
+    }
+
+    char msg[MAX_MSG_SIZE];
+    snprintf(msg, MAX_MSG_SIZE, "Save successful: %zu lines, %zu bytes written",
+             lines, bytes);
+    se_add_msg(sess, msg);
+
+cleanup:
+    free(file_path);
+
+    return status;
+}
+
+/* Called by the input loop when the event pipe is readable */
+void se_process_events(Session *sess)
+{
+    char events[64];
+
+    while (read(sess->event_pipe[0], events, sizeof(events)) > 0) {
+        /* Drain pipe */
+    }
+
+    for (Buffer *buffer = sess->buffers; buffer != NULL;
+         buffer = buffer->next) {
+        if (bf_write_finished(buffer)) {
+            se_add_error(sess, se_finish_buffer_save(sess, buffer));
+        }
+
+        if (bf_load_in_progress(buffer)) {
+            se_add_error(sess, bf_continue_load(buffer));
+            se_check_large_file(sess, buffer);
+        }
+
+        if (bf_counting_lines(buffer)) {
+            se_add_error(sess, bf_continue_line_count(buffer));
+            se_check_large_file(sess, buffer);
+        }
+
+        if (bf_following(buffer)) {
+            se_add_error(sess, bf_continue_follow(buffer));
+            se_check_large_file(sess, buffer);
+        }
+    }
+}
+
+/* Start or stop appending text added to the active buffer's file */
+Status se_toggle_buffer_follow(Session *sess)
+{
+    Buffer *buffer = sess->active_buffer;
+    char msg[MAX_MSG_SIZE];
+
+    if (bf_following(buffer)) {
+        bf_stop_follow(buffer);
+        snprintf(msg, MAX_MSG_SIZE, "Stopped following %s",
+                 buffer->file_info.file_name);
+    } else {
+        RETURN_IF_FAIL(bf_follow_file(buffer, sess->event_pipe[1]));
+        snprintf(msg, MAX_MSG_SIZE, "Following %s",
+                 buffer->file_info.file_name);
+    }
+
+    se_add_msg(sess, msg);
+
+    return STATUS_SUCCESS;
+}
+
+/* Keep the undo history of each buffer within its undomemory budget
+ * and of all buffers within the undosessionmemory budget. History in
+ * inactive buffers is reduced before that of the active buffer */
+Status se_limit_undo_memory(Session *sess)
+{
+    size_t session_budget = sess->config_snapshot.undosessionmemory *
+                            1024 * 1024;
+    size_t total = 0;
+
+    for (Buffer *buffer = sess->buffers; buffer != NULL;
+         buffer = buffer->next) {
+        RETURN_IF_FAIL(bf_limit_undo_memory(buffer, SIZE_MAX));
+        total += bf_undo_memory(buffer);
+    }
+
+    size_t memory, excess;
+
+    for (int active = 0; active < 2; active++) {
+        for (Buffer *buffer = sess->buffers;
+             buffer != NULL && session_budget > 0 && total > session_budget;
+             buffer = buffer->next) {
+            if ((buffer == sess->active_buffer) != active) {
+                continue;
+            }
+
+            memory = bf_undo_memory(buffer);
+            excess = total - session_budget;
+            RETURN_IF_FAIL(bf_limit_undo_memory(buffer, memory > excess ?
+                                                memory - excess : 0));
+            total -= memory - bf_undo_memory(buffer);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Stop loading the active buffer's file, keeping the text loaded so far */
+Status se_cancel_buffer_load(Session *sess)
+{
+    Buffer *buffer = sess->active_buffer;
+
+    if (!bf_load_in_progress(buffer)) {
+        return STATUS_SUCCESS;
+    }
+
+    int progress = bf_load_progress(buffer);
+    /* Keep the text which has already been read */
+    Status status = bf_continue_load(buffer);
+
+    if (STATUS_IS_SUCCESS(status) && bf_load_in_progress(buffer)) {
+        status = bf_cancel_load(buffer);
+
+        char msg[MAX_MSG_SIZE];
+        snprintf(msg, MAX_MSG_SIZE, "Loading cancelled: %d%% of %s loaded",
+                 progress, buffer->file_info.file_name);
+        se_add_msg(sess, msg);
+    }
+
+    return status;
+}
@@ -49,6 +49,8 @@ struct Session {
     KeyMap key_map; /* Maps keyboard inputs to commands */
     Clipboard clipboard; /* Handles copy and paste to system clipboard */
     HashMap *config; /* Stores config variables */
+    ConfigSnapshot config_snapshot; /* Typed copies of variables
+                                       read on hot paths */
     Prompt *prompt; /* Used to control prompt */
     CommandType exclude_cmd_types; /* Types of commands that shouldn't run */
     size_t buffer_num; /* Number of buffers being edited */
@@ -74,6 +76,8 @@ struct Session {
     WedOpt wed_opt; /* Command line option values */
     UI *ui; /* UI interface */
     InputBuffer input_buffer; /* Input is buffered in this structure */
+    int event_pipe[2]; /* Background tasks write to this pipe to wake
+                          the input loop */
 #if WED_FEATURE_LUA
     LuaState *ls;
 #endif
@@ -129,5 +133,12 @@ int se_session_finished(const Session *);
 void se_set_session_finished(Session *);
 const char *se_get_file_type_display_name(const Session *, const Buffer *);
 void se_determine_filetypes_if_unset(Session *, Buffer *);
+Status se_save_buffer(Session *, Buffer *, const char *file_path, int wait);
+Status se_finish_buffer_save(Session *, Buffer *);
+void se_process_events(Session *);
+Status se_cancel_buffer_load(Session *);
+Status se_toggle_buffer_follow(Session *);
+void se_check_large_file(const Session *, Buffer *);
+Status se_limit_undo_memory(Session *);
 
 #endif
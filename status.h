@@ -127,7 +127,22 @@ typedef enum {
     ERR_UNABLE_TO_INITIALISE_TERMEKEY,
     ERR_INVALID_KEY_MAPPING,
     ERR_LUA_ERROR,
-    ERR_SHELL_COMMAND_ERROR
+    ERR_SHELL_COMMAND_ERROR,
+    ERR_INVALID_TEXTSTORE,
+    ERR_INVALID_GAPGROWTH,
+    ERR_INVALID_GAPSHRINK,
+    ERR_INVALID_HUGEPAGEMIN,
+    ERR_INVALID_SAVEDURABILITY,
+    ERR_INVALID_PROGRESSIVELOAD,
+    ERR_FILE_LOAD_IN_PROGRESS,
+    ERR_FILE_LOAD_INCOMPLETE,
+    ERR_INVALID_JOURNAL,
+    ERR_JOURNAL_MISMATCH,
+    ERR_INVALID_LARGEFILE,
+    ERR_INVALID_BUDGET,
+    ERR_UNDO_SPILL_ERROR,
+    ERR_INVALID_UNDO_FILE,
+    ERR_FOLLOWED_FILE_REPLACED
 } ErrorCode;
 
 /* Structure used to represent success or failure */
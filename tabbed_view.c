@@ -29,6 +29,8 @@ static void tv_update_buffer_tabs(TabbedView *, const Session *);
 static void tv_update_status_bar(TabbedView *, Session *);
 static size_t tv_status_file_info(TabbedView *, const Session *,
                                   size_t max_segment_width);
+static void tv_status_large_file(const Buffer *, char *text,
+                                 size_t text_size);
 static size_t tv_status_pos_info(TabbedView *, const Session *,
                                  size_t max_segment_width);
 static void tv_status_general_info(TabbedView *, Session *,
@@ -81,12 +83,15 @@ static Status tv_update_buffer_view(TabbedView *tv, const Session *sess)
 
 static size_t tv_determine_line_no_width(const Buffer *buffer)
 {
-    if (!cf_bool(buffer->config, CV_LINENO)) {
+    if (!buffer->config_snapshot.lineno) {
         return 0;
     }
 
+    /* The width grows while the lines of a mapped file are counted */
+    int complete;
     char lineno_str[50];
-    return snprintf(lineno_str, sizeof(lineno_str), "%zu ", bf_lines(buffer));
+    return snprintf(lineno_str, sizeof(lineno_str), "%zu ",
+                    bf_known_lines(buffer, &complete));
 }
 
 static void tv_determine_prompt_data(TabbedView *tv, const Session *sess)
@@ -216,8 +221,28 @@ static size_t tv_status_file_info(TabbedView *tv, const Session *sess,
     const FileInfo *file_info = &sess->active_buffer->file_info;
 
     char *file_info_text = " ";
-
-    if (!fi_file_exists(file_info)) {
+    char progress[20];
+    char large_file[64];
+
+    if (bf_write_in_progress(sess->active_buffer)) {
+        snprintf(progress, sizeof(progress), " [saving %d%%%%] ",
+                 bf_write_progress(sess->active_buffer));
+        file_info_text = progress;
+    } else if (bf_load_in_progress(sess->active_buffer)) {
+        snprintf(progress, sizeof(progress), " [loading %d%%%%] ",
+                 bf_load_progress(sess->active_buffer));
+        file_info_text = progress;
+    } else if (bf_following(sess->active_buffer)) {
+        file_info_text = " [following] ";
+    } else if (bf_stream_fd(sess->active_buffer) != -1) {
+        file_info_text = " [reading] ";
+    } else if (bf_load_incomplete(sess->active_buffer)) {
+        file_info_text = " [partial] ";
+    } else if (bf_is_large_file(sess->active_buffer)) {
+        tv_status_large_file(sess->active_buffer, large_file,
+                             sizeof(large_file));
+        file_info_text = large_file;
+    } else if (!fi_file_exists(file_info)) {
         file_info_text = " [new] ";
     } else if (!fi_can_write_file(file_info)) {
         file_info_text = " [readonly] ";
@@ -254,6 +279,27 @@ static size_t tv_status_file_info(TabbedView *tv, const Session *sess,
     return file_info_size;
 }
 
+/* Lists the features degraded for exceeding their budget
+ * e.g. " [large -syntax -undo] " */
+static void tv_status_large_file(const Buffer *buffer, char *text,
+                                 size_t text_size)
+{
+    size_t length = snprintf(text, text_size, " [large");
+
+    for (size_t k = 0; k < LFF_ENTRY_NUM && length < text_size; k++) {
+        LargeFileFeature feature = 1 << k;
+
+        if (!bf_feature_enabled(buffer, feature)) {
+            length += snprintf(text + length, text_size - length, " -%s",
+                               bf_feature_name(feature));
+        }
+    }
+
+    if (length < text_size) {
+        snprintf(text + length, text_size - length, "] ");
+    }
+}
+
 static size_t tv_status_pos_info(TabbedView *tv, const Session *sess,
                                  size_t max_segment_width)
 {
@@ -263,7 +309,8 @@ static size_t tv_status_pos_info(TabbedView *tv, const Session *sess,
     const BufferPos *pos = &buffer->pos;
     char rel_pos[5] = { '\0' };
 
-    size_t line_num = bf_lines(buffer);
+    int lines_complete;
+    size_t line_num = bf_known_lines(buffer, &lines_complete);
     size_t lines_above = screen_start->line_no - 1;
     size_t lines_below;
 
@@ -273,7 +320,7 @@ static size_t tv_status_pos_info(TabbedView *tv, const Session *sess,
         lines_below = line_num - (screen_start->line_no + bv->rows - 1);
     }
 
-    if (lines_below == 0) {
+    if (lines_below == 0 && lines_complete) {
         if (lines_above == 0) {
             strcpy(rel_pos, "All");
         } else {
@@ -282,8 +329,17 @@ static size_t tv_status_pos_info(TabbedView *tv, const Session *sess,
     } else if (lines_above == 0) {
         strcpy(rel_pos, "Top");
     } else {
-        int pos_pct = (int)((lines_above /
-                            (double)(lines_above + lines_below)) * 100);
+        double fraction;
+
+        if (lines_complete) {
+            fraction = lines_above / (double)(lines_above + lines_below);
+        } else {
+            /* Until all lines of a mapped file are counted
+             * the position is estimated from its offset */
+            fraction = screen_start->offset / (double)bf_length(buffer);
+        }
+
+        int pos_pct = (int)(fraction * 100);
         snprintf(rel_pos, sizeof(rel_pos), "%2d%%%%", pos_pct);
     }
 
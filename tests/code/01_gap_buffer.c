@@ -11,16 +11,23 @@ static void gap_buffer_insert(GapBuffer *, const char *, size_t);
 static void gap_buffer_insert_2(GapBuffer *, const char *, size_t);
 static void gap_buffer_movement(GapBuffer *);
 static void gap_buffer_retrieval(GapBuffer *, const char *, size_t);
+static void gap_buffer_segments(GapBuffer *, const char *, size_t);
+static void gap_buffer_cursor(GapBuffer *);
 static void gap_buffer_delete(GapBuffer *);
 static void gap_buffer_replace(GapBuffer *);
+static void gap_buffer_span(GapBuffer *);
 static void gap_buffer_clear(GapBuffer *);
+static void gap_buffer_dirty_ranges(GapBufferStorage);
+static void gap_buffer_dirty_range_limit(void);
+static int dirty_ranges_equal(const GapBuffer *, const GBRange *,
+                              size_t range_num);
 
 int main(int argc, char *argv[])
 {
     (void)argc;
     (void)argv;
 
-    plan(74);
+    plan(98);
 
     GapBuffer *buffer = gb_new(GAP_INCREMENT);
 
@@ -36,9 +43,15 @@ int main(int argc, char *argv[])
     gap_buffer_insert_2(buffer, str, str_len);
     gap_buffer_movement(buffer);
     gap_buffer_retrieval(buffer, str, str_len);
+    gap_buffer_segments(buffer, str, str_len);
+    gap_buffer_cursor(buffer);
     gap_buffer_delete(buffer);
     gap_buffer_replace(buffer);
+    gap_buffer_span(buffer);
     gap_buffer_clear(buffer);
+    gap_buffer_dirty_ranges(GBS_GAP);
+    gap_buffer_dirty_ranges(GBS_PIECE_TABLE);
+    gap_buffer_dirty_range_limit();
 
     return exit_status();
 }
@@ -125,6 +138,59 @@ static void gap_buffer_retrieval(GapBuffer *buffer, const char *str, size_t str_
     ok(matches_original, "Text range retrieved matches original text");
 }
 
+static void gap_buffer_segments(GapBuffer *buffer, const char *str, size_t str_len)
+{
+    msg("Segments:");
+    /* Move gap between the two copies of str */
+    gb_set_point(buffer, str_len);
+    gb_insert(buffer, "x", 1);
+    gb_delete(buffer, 1);
+
+    GBSegmentIter iter;
+    const char *text;
+    size_t length;
+    size_t segments = 0;
+    int matches_original = 1;
+
+    gb_segment_iter_init(&iter, buffer, str_len - 5, 10);
+
+    while (gb_segment_iter_next(&iter, &text, &length)) {
+        matches_original &= length == 5 &&
+                            strncmp(text, str + (segments ? 0 : str_len - 5), 5) == 0;
+        segments++;
+    }
+
+    ok(segments == 2, "Range split into 2 segments by gap");
+    ok(matches_original, "Segments match original text");
+
+    gb_segment_iter_init(&iter, buffer, str_len, str_len * 4);
+    ok(gb_segment_iter_next(&iter, &text, &length) && length == str_len &&
+       !gb_segment_iter_next(&iter, &text, &length), "Range limited to buffer end");
+    ok(gb_get_segment(buffer, gb_length(buffer), &text) == 0, "No segment at buffer end");
+}
+
+static void gap_buffer_cursor(GapBuffer *buffer)
+{
+    msg("Cursor:");
+    size_t buffer_len = gb_length(buffer);
+    GBCursor cursor;
+    int forward_correct = 1, reverse_correct = 1;
+
+    gb_cursor_init(&cursor, buffer);
+
+    for (size_t k = 0; k < buffer_len; k++) {
+        forward_correct &= gb_cursor_get_at(&cursor, k) == gb_get_at(buffer, k);
+    }
+
+    for (size_t k = buffer_len; k > 0; k--) {
+        reverse_correct &= gb_cursor_get_at(&cursor, k - 1) == gb_get_at(buffer, k - 1);
+    }
+
+    ok(forward_correct, "Forward cursor reads match buffer");
+    ok(reverse_correct, "Reverse cursor reads match buffer");
+    ok(gb_cursor_get_at(&cursor, buffer_len) == '\0', "Cursor reads null at buffer end");
+}
+
 static void gap_buffer_delete(GapBuffer *buffer)
 {
     msg("Delete:");
@@ -170,6 +236,28 @@ static void gap_buffer_replace(GapBuffer *buffer)
     ok(strncmp(buf_start, buf_end, buffer_len) == 0, "Text range retrieved matches starting text");
 }
 
+static void gap_buffer_span(GapBuffer *buffer)
+{
+    msg("Span:");
+    GBSpan span;
+    char deleted[2];
+    size_t length;
+    size_t buffer_len = gb_length(buffer);
+
+    ok(gb_span_init(&span, buffer, 5, 7, 8), "Copied \"is test\" to span");
+    gb_span_delete(&span, 0, 2, deleted);
+    ok(strncmp(deleted, "is", 2) == 0, "Deleted text copied from span");
+    gb_span_insert(&span, 0, "was", 3);
+    gb_span_insert(&span, 8, "ed", 2);
+    gb_span_insert(&span, 3, "n't", 3);
+    const char *text = gb_span_text(&span, &length);
+    ok(length == 13 && strncmp(text, "wasn't tested", length) == 0,
+       "Span edited either side of its gap");
+    ok(gb_length(buffer) == buffer_len && gb_get_at(buffer, 5) == 'i',
+       "Buffer unchanged by span edits");
+    gb_span_free(&span);
+}
+
 static void gap_buffer_clear(GapBuffer *buffer)
 {
     msg("Clear:");
@@ -179,3 +267,107 @@ static void gap_buffer_clear(GapBuffer *buffer)
     ok(gb_lines(buffer) == 0, "No lines in buffer");
     ok(gb_gap_size(buffer) == buffer->allocated, "Gap size is all allocated space");
 }
+
+static void gap_buffer_dirty_ranges(GapBufferStorage storage)
+{
+    msg("Dirty ranges %s:", storage == GBS_GAP ? "gap buffer" : "piece table");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (buffer == NULL || !gb_set_storage(buffer, storage) ||
+        !gb_add(buffer, "abcdefghij", 10)) {
+        gb_free(buffer);
+        return;
+    }
+
+    ok(gb_dirty_ranges(buffer) == NULL, "Changes not tracked by default");
+    gb_track_changes(buffer);
+
+    gb_set_point(buffer, 2);
+    gb_replace(buffer, 2, "XY", 2);
+    gb_set_point(buffer, 6);
+    gb_replace(buffer, 1, "Z", 1);
+    ok(dirty_ranges_equal(buffer, (GBRange[]) { { 2, 4 }, { 6, 7 } }, 2),
+       "Replacing text of same length marks only replaced text dirty");
+
+    gb_set_point(buffer, 4);
+    gb_replace(buffer, 2, "PQ", 2);
+    ok(dirty_ranges_equal(buffer, (GBRange[]) { { 2, 7 } }, 1),
+       "Adjacent ranges merged");
+
+    gb_set_point(buffer, 10);
+    gb_insert(buffer, "kl", 2);
+    ok(dirty_ranges_equal(buffer, (GBRange[]) { { 2, 7 }, { 10, 12 } }, 2) &&
+       gb_dirty_ranges(buffer)->base_length == 10,
+       "Appended text is dirty");
+
+    gb_set_point(buffer, 8);
+    gb_delete(buffer, 1);
+    ok(dirty_ranges_equal(buffer, (GBRange[]) { { 2, 7 }, { 8, 11 } }, 2),
+       "Text after deletion is dirty");
+
+    gb_untrack_changes(buffer);
+    ok(gb_dirty_ranges(buffer) == NULL, "Stop tracking changes");
+
+    gb_free(buffer);
+}
+
+static void gap_buffer_dirty_range_limit(void)
+{
+    msg("Dirty range limit:");
+    size_t changes = GB_MAX_DIRTY_RANGES + 5;
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char text[(GB_MAX_DIRTY_RANGES + 5) * 3];
+
+    memset(text, 'a', sizeof(text));
+
+    if (buffer == NULL || !gb_add(buffer, text, sizeof(text))) {
+        gb_free(buffer);
+        return;
+    }
+
+    gb_track_changes(buffer);
+
+    for (size_t k = 0; k < changes; k++) {
+        gb_set_point(buffer, k * 3);
+        gb_replace(buffer, 1, "b", 1);
+    }
+
+    const GBDirtyRanges *dirty = gb_dirty_ranges(buffer);
+    int covered = 1;
+
+    for (size_t k = 0; k < changes; k++) {
+        size_t pos = k * 3;
+        int in_range = 0;
+
+        for (size_t r = 0; r < dirty->range_num; r++) {
+            in_range |= pos >= dirty->ranges[r].start &&
+                        pos < dirty->ranges[r].end;
+        }
+
+        covered &= in_range;
+    }
+
+    ok(dirty->range_num == GB_MAX_DIRTY_RANGES && covered,
+       "Ranges merged once limit reached");
+
+    gb_free(buffer);
+}
+
+static int dirty_ranges_equal(const GapBuffer *buffer, const GBRange *ranges,
+                              size_t range_num)
+{
+    const GBDirtyRanges *dirty = gb_dirty_ranges(buffer);
+
+    if (dirty == NULL || dirty->range_num != range_num) {
+        return 0;
+    }
+
+    for (size_t k = 0; k < range_num; k++) {
+        if (dirty->ranges[k].start != ranges[k].start ||
+            dirty->ranges[k].end != ranges[k].end) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
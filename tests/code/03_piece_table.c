@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+#define RANDOM_EDIT_NUM 5000
+#define LARGE_INSERT_SIZE (PT_BLOCK_SIZE * 2 + 100)
+
+static void piece_table_creation(GapBuffer *);
+static void piece_table_insert(GapBuffer *, const char *, size_t);
+static void piece_table_movement(GapBuffer *);
+static void piece_table_delete_replace(GapBuffer *, const char *, size_t);
+static void piece_table_conversion(GapBuffer *, const char *, size_t);
+static void piece_table_random_edits(void);
+static int buffers_equal(const GapBuffer *, const GapBuffer *);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(43);
+
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (!ok(buffer != NULL, "Create GapBuffer")) {
+        return exit_status();
+    }
+
+    const char *str = "This is test text.\nDon't change it.";
+    size_t str_len = strlen(str);
+
+    piece_table_creation(buffer);
+    piece_table_insert(buffer, str, str_len);
+    piece_table_movement(buffer);
+    piece_table_delete_replace(buffer, str, str_len);
+    piece_table_conversion(buffer, str, str_len);
+    piece_table_random_edits();
+
+    gb_free(buffer);
+
+    return exit_status();
+}
+
+static void piece_table_creation(GapBuffer *buffer)
+{
+    msg("Create:");
+    ok(gb_set_storage(buffer, GBS_PIECE_TABLE), "Convert to piece table");
+    ok(gb_get_storage(buffer) == GBS_PIECE_TABLE, "Storage is piece table");
+    ok(gb_length(buffer) == 0, "Length is 0");
+    ok(gb_get_point(buffer) == 0, "Point at buffer start");
+    ok(gb_lines(buffer) == 0, "No lines in buffer");
+}
+
+static void piece_table_insert(GapBuffer *buffer, const char *str,
+                               size_t str_len)
+{
+    msg("Insert:");
+    ok(gb_add(buffer, str, str_len), "Add text to buffer");
+    ok(gb_get_point(buffer) == str_len, "Point is at buffer end");
+    ok(gb_set_point(buffer, 0), "Set point to buffer start");
+    ok(gb_insert(buffer, str, str_len), "Insert text at buffer start");
+    ok(gb_get_point(buffer) == 0, "Point is unchanged by insert");
+    ok(gb_length(buffer) == str_len * 2, "Buffer length is total string length");
+    ok(gb_lines(buffer) == 2, "2 lines in buffer");
+
+    char buf[str_len * 2];
+    ok(gb_get_range(buffer, 0, buf, sizeof(buf)) == sizeof(buf), "Retrieved text range from buffer");
+    ok(strncmp(buf, str, str_len) == 0 &&
+       strncmp(buf + str_len, str, str_len) == 0, "Text range matches inserted text");
+}
+
+static void piece_table_movement(GapBuffer *buffer)
+{
+    msg("Movement:");
+    size_t point = 0;
+    ok(gb_find_next(buffer, 0, &point, '\n'), "Found 1st new line");
+    ok(gb_get_at(buffer, point) == '\n', "Point is at new line");
+    ok(gb_find_next(buffer, point + 1, &point, '\n'), "Found 2nd new line");
+    ok(!gb_find_next(buffer, point + 1, &point, '\n'), "Cannot find further new line");
+    ok(gb_find_prev(buffer, gb_length(buffer), &point, '\n'), "Found 2nd new line from end");
+    ok(gb_find_prev(buffer, point, &point, '\n'), "Found 1st new line from end");
+    ok(!gb_find_prev(buffer, point, &point, '\n'), "Cannot find further new line from end");
+}
+
+static void piece_table_delete_replace(GapBuffer *buffer, const char *str,
+                                       size_t str_len)
+{
+    msg("Delete/Replace:");
+    ok(gb_set_point(buffer, str_len), "Set point to 2nd string");
+    ok(gb_delete(buffer, str_len * 2), "Delete past buffer end");
+    ok(gb_length(buffer) == str_len &&
+       gb_get_at(buffer, str_len - 1) == str[str_len - 1],
+       "Delete limited to buffer end");
+    ok(gb_lines(buffer) == 1, "1 line in buffer");
+    ok(gb_set_point(buffer, 0), "Set point to buffer start");
+    ok(gb_replace(buffer, 4, "That", 4), "Replace first 4 bytes");
+    ok(gb_get_point(buffer) == 4, "Point advanced past replacement");
+    ok(gb_get_at(buffer, 0) == 'T' && gb_get_at(buffer, 2) == 'a', "Replace correct");
+    ok(gb_get_at(buffer, gb_length(buffer)) == '\0', "Null returned at buffer end");
+}
+
+static void piece_table_conversion(GapBuffer *buffer, const char *str,
+                                   size_t str_len)
+{
+    msg("Conversion:");
+    gb_clear(buffer);
+    ok(gb_length(buffer) == 0 && gb_lines(buffer) == 0, "Buffer is empty");
+    ok(gb_add(buffer, str, str_len), "Add text to buffer");
+    ok(gb_set_point(buffer, 5), "Set point");
+    ok(gb_set_storage(buffer, GBS_GAP), "Convert to gap buffer");
+    ok(gb_get_storage(buffer) == GBS_GAP, "Storage is gap buffer");
+    ok(gb_get_point(buffer) == 5, "Point is unchanged");
+    ok(gb_length(buffer) == str_len && gb_lines(buffer) == 1, "Length and lines are unchanged");
+
+    const char *text = gb_contiguous_storage(buffer);
+    ok(text != NULL && strncmp(text, str, str_len) == 0, "Text is unchanged");
+}
+
+/* Apply the same edits to a gap buffer and a piece table and
+ * verify both contain the same text */
+static void piece_table_random_edits(void)
+{
+    msg("Random edits:");
+    GapBuffer *gap = gb_new(GAP_INCREMENT);
+    GapBuffer *table = gb_new(GAP_INCREMENT);
+    char *large = malloc(LARGE_INSERT_SIZE);
+
+    if (!ok(gap != NULL && table != NULL && large != NULL &&
+            gb_set_storage(table, GBS_PIECE_TABLE), "Create buffers")) {
+        return;
+    }
+
+    for (size_t k = 0; k < LARGE_INSERT_SIZE; k++) {
+        large[k] = (k % 61 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    int success = gb_add(gap, large, LARGE_INSERT_SIZE) &&
+                  gb_add(table, large, LARGE_INSERT_SIZE);
+    const char *snippets[] = { "x", "\n", "abc\ndef", "longer text\n\n" };
+    size_t point, length, snippet;
+
+    srand(1);
+
+    for (size_t k = 0; success && k < RANDOM_EDIT_NUM; k++) {
+        length = gb_length(gap);
+        point = length == 0 ? 0 : (size_t)rand() % length;
+        snippet = (size_t)rand() % 4;
+
+        success &= gb_set_point(gap, point) && gb_set_point(table, point);
+
+        if (k % 3 == 0) {
+            size_t bytes = (size_t)rand() % 20;
+            success &= gb_delete(gap, bytes) && gb_delete(table, bytes);
+        } else if (k % 3 == 1) {
+            size_t bytes = strlen(snippets[snippet]);
+            success &= gb_add(gap, snippets[snippet], bytes) &&
+                       gb_add(table, snippets[snippet], bytes);
+        } else {
+            size_t bytes = strlen(snippets[snippet]);
+            success &= gb_replace(gap, 3, snippets[snippet], bytes) &&
+                       gb_replace(table, 3, snippets[snippet], bytes);
+        }
+
+        success &= gb_get_point(gap) == gb_get_point(table);
+    }
+
+    ok(success, "Random edits applied");
+    ok(buffers_equal(gap, table), "Piece table matches gap buffer");
+
+    GBCursor cursor;
+    int cursor_correct = 1;
+    length = gb_length(table);
+    gb_cursor_init(&cursor, table);
+
+    /* Read forwards then backwards across piece boundaries */
+    for (size_t k = 0; k < length * 2; k++) {
+        point = k < length ? k : length * 2 - k - 1;
+        cursor_correct &= gb_cursor_get_at(&cursor, point) ==
+                          gb_get_at(gap, point);
+    }
+
+    ok(cursor_correct && gb_cursor_get_at(&cursor, length) == '\0',
+       "Cursor reads match across pieces");
+
+    gb_free(gap);
+    gb_free(table);
+    free(large);
+}
+
+static int buffers_equal(const GapBuffer *buffer1, const GapBuffer *buffer2)
+{
+    size_t length = gb_length(buffer1);
+
+    if (length != gb_length(buffer2) ||
+        gb_lines(buffer1) != gb_lines(buffer2)) {
+        return 0;
+    }
+
+    char *text1 = malloc(length + 1);
+    char *text2 = malloc(length + 1);
+    int equal = text1 != NULL && text2 != NULL &&
+                gb_get_range(buffer1, 0, text1, length) == length &&
+                gb_get_range(buffer2, 0, text2, length) == length &&
+                memcmp(text1, text2, length) == 0;
+
+    size_t next1, next2;
+    int found1, found2;
+
+    /* Line lookups should also agree */
+    for (size_t k = 0; equal && k < length; k += 97) {
+        found1 = gb_find_next(buffer1, k, &next1, '\n');
+        found2 = gb_find_next(buffer2, k, &next2, '\n');
+        equal = found1 == found2 && (!found1 || next1 == next2);
+        found1 = gb_find_prev(buffer1, k, &next1, '\n');
+        found2 = gb_find_prev(buffer2, k, &next2, '\n');
+        equal &= found1 == found2 && (!found1 || next1 == next2);
+    }
+
+    free(text1);
+    free(text2);
+
+    return equal;
+}
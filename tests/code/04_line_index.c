@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+#define RANDOM_EDIT_NUM 2000
+#define LARGE_INSERT_SIZE (GB_LINE_BLOCK_SIZE * 8 + 100)
+
+static void line_index_basic(GapBuffer *);
+static void line_index_random_edits(GapBufferStorage);
+static int line_index_correct(const GapBuffer *);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(14);
+
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (!ok(buffer != NULL, "Create GapBuffer")) {
+        return exit_status();
+    }
+
+    line_index_basic(buffer);
+    line_index_random_edits(GBS_GAP);
+    line_index_random_edits(GBS_PIECE_TABLE);
+
+    gb_free(buffer);
+
+    return exit_status();
+}
+
+static void line_index_basic(GapBuffer *buffer)
+{
+    msg("Basic:");
+    const char *str = "one\ntwo\n\nfour";
+    ok(gb_add(buffer, str, strlen(str)), "Add text to buffer");
+    ok(gb_lines_before(buffer, 0) == 0, "No lines before buffer start");
+    ok(gb_lines_before(buffer, 4) == 1 && gb_lines_before(buffer, 3) == 0,
+       "Line count changes after new line");
+    ok(gb_lines_before(buffer, gb_length(buffer)) == 3, "3 lines before buffer end");
+    ok(gb_line_start(buffer, 0) == 0, "Line 1 starts at buffer start");
+    ok(gb_line_start(buffer, 1) == 4 && gb_line_start(buffer, 2) == 8 &&
+       gb_line_start(buffer, 3) == 9, "Line starts correct");
+    ok(gb_set_point(buffer, 2) && gb_delete(buffer, 4) &&
+       gb_lines_before(buffer, gb_length(buffer)) == 2 &&
+       gb_line_start(buffer, 1) == 4, "Line index updated after delete");
+    ok(gb_set_storage(buffer, GBS_PIECE_TABLE) &&
+       line_index_correct(buffer), "Piece table line index correct");
+    ok(gb_set_storage(buffer, GBS_GAP) &&
+       line_index_correct(buffer), "Line index correct after conversion");
+}
+
+/* Check the line index against a brute force count after
+ * applying random edits to a buffer spanning many blocks */
+static void line_index_random_edits(GapBufferStorage storage)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char *large = malloc(LARGE_INSERT_SIZE);
+
+    if (buffer == NULL || large == NULL || !gb_set_storage(buffer, storage)) {
+        ok(0, "Random edits applied");
+        gb_free(buffer);
+        free(large);
+        return;
+    }
+
+    for (size_t k = 0; k < LARGE_INSERT_SIZE; k++) {
+        large[k] = (k % 53 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    int success = gb_add(buffer, large, LARGE_INSERT_SIZE);
+    const char *snippets[] = { "x", "\n", "abc\ndef", "\n\n\n" };
+    size_t point, length, snippet;
+
+    srand(1);
+
+    for (size_t k = 0; success && k < RANDOM_EDIT_NUM; k++) {
+        length = gb_length(buffer);
+        point = length == 0 ? 0 : (size_t)rand() % length;
+        snippet = (size_t)rand() % 4;
+
+        success &= gb_set_point(buffer, point);
+
+        if (k % 3 == 0) {
+            success &= gb_delete(buffer, (size_t)rand() % 200);
+        } else if (k % 3 == 1) {
+            success &= gb_add(buffer, snippets[snippet],
+                              strlen(snippets[snippet]));
+        } else {
+            success &= gb_replace(buffer, 3, snippets[snippet],
+                                  strlen(snippets[snippet]));
+        }
+
+        if (k % 400 == 0) {
+            success &= line_index_correct(buffer);
+        }
+    }
+
+    ok(success, "Random edits applied");
+    ok(line_index_correct(buffer), "Line index matches buffer text");
+
+    gb_free(buffer);
+    free(large);
+}
+
+static int line_index_correct(const GapBuffer *buffer)
+{
+    size_t length = gb_length(buffer);
+    size_t lines = 0;
+
+    for (size_t k = 0; k <= length; k++) {
+        if (gb_lines_before(buffer, k) != lines) {
+            return 0;
+        }
+
+        if (k < length && gb_get_at(buffer, k) == '\n') {
+            if (gb_line_start(buffer, ++lines) != k + 1) {
+                return 0;
+            }
+        }
+    }
+
+    return lines == gb_lines(buffer) &&
+           gb_line_start(buffer, lines + 1) == gb_line_start(buffer, lines);
+}
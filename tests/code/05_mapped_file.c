@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+static int create_file(const char *text, size_t length);
+static void mapped_file_read(GapBuffer *, const char *, size_t);
+static void mapped_file_modify(GapBuffer *, const char *, size_t);
+static void mapped_file_clear(int fd, size_t length);
+static void mapped_file_snapshot(int fd, const char *, size_t);
+static void mapped_file_lazy_index(void);
+static void mapped_file_truncate(void);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(26);
+
+    const char *str = "This is test text.\nDon't change it.\n";
+    size_t str_len = strlen(str);
+    int fd = create_file(str, str_len);
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (!ok(fd != -1 && buffer != NULL, "Create file and GapBuffer")) {
+        return exit_status();
+    }
+
+    ok(gb_map_file(buffer, fd, str_len), "Map file into buffer");
+    mapped_file_read(buffer, str, str_len);
+    mapped_file_modify(buffer, str, str_len);
+    mapped_file_clear(fd, str_len);
+    mapped_file_snapshot(fd, str, str_len);
+    mapped_file_lazy_index();
+    mapped_file_truncate();
+
+    gb_free(buffer);
+    close(fd);
+
+    return exit_status();
+}
+
+static int create_file(const char *text, size_t length)
+{
+    char path[] = "/tmp/wedtestXXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (write(fd, text, length) != (ssize_t)length) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void mapped_file_read(GapBuffer *buffer, const char *str,
+                             size_t str_len)
+{
+    msg("Read:");
+    ok(gb_is_mapped(buffer), "Buffer is mapped");
+    ok(gb_length(buffer) == str_len, "Length matches file size");
+    ok(gb_lines(buffer) == 2, "2 lines in buffer");
+    ok(gb_line_start(buffer, 1) == 19, "Line index built");
+    ok(gb_get_at(buffer, 5) == 'i', "Read character from mapping");
+
+    char buf[str_len];
+    ok(gb_get_range(buffer, 0, buf, str_len) == str_len &&
+       memcmp(buf, str, str_len) == 0, "Text range matches file");
+
+    const char *text = gb_contiguous_storage(buffer);
+    ok(text != NULL && memcmp(text, str, str_len) == 0,
+       "Contiguous storage references mapping");
+    ok(gb_is_mapped(buffer), "Buffer is still mapped after reads");
+}
+
+static void mapped_file_modify(GapBuffer *buffer, const char *str,
+                               size_t str_len)
+{
+    msg("Modify:");
+    ok(gb_set_point(buffer, 19) && gb_insert(buffer, "New\n", 4),
+       "Insert text into mapped buffer");
+    ok(!gb_is_mapped(buffer), "Buffer is no longer mapped");
+    ok(gb_length(buffer) == str_len + 4 && gb_lines(buffer) == 3,
+       "Length and lines updated");
+
+    char buf[str_len + 4];
+    ok(gb_get_range(buffer, 0, buf, str_len + 4) == str_len + 4 &&
+       memcmp(buf, str, 19) == 0 && memcmp(buf + 19, "New\n", 4) == 0 &&
+       memcmp(buf + 23, str + 19, str_len - 19) == 0,
+       "Text is correct after insert");
+}
+
+static void mapped_file_clear(int fd, size_t length)
+{
+    msg("Clear:");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (buffer == NULL || !gb_map_file(buffer, fd, length)) {
+        ok(0, "Map file into buffer");
+        gb_free(buffer);
+        return;
+    }
+
+    gb_clear(buffer);
+    ok(!gb_is_mapped(buffer) && gb_length(buffer) == 0 &&
+       gb_lines(buffer) == 0, "Clear releases mapping");
+    ok(gb_add(buffer, "abc\n", 4) && gb_lines(buffer) == 1 &&
+       gb_line_start(buffer, 1) == 4, "Buffer usable after clear");
+
+    gb_free(buffer);
+}
+
+static void mapped_file_snapshot(int fd, const char *str, size_t str_len)
+{
+    msg("Snapshot:");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    GapBuffer *snapshot = NULL;
+
+    if (buffer == NULL || !gb_map_file(buffer, fd, str_len) ||
+        (snapshot = gb_snapshot(buffer)) == NULL) {
+        ok(0, "Snapshot mapped buffer");
+        gb_free(buffer);
+        return;
+    }
+
+    ok(gb_set_point(buffer, 0) && gb_delete(buffer, 5) &&
+       !gb_is_mapped(buffer) && gb_is_mapped(snapshot),
+       "Snapshot keeps mapping when buffer modified");
+
+    gb_free(buffer);
+
+    char buf[str_len];
+    ok(gb_get_range(snapshot, 0, buf, str_len) == str_len &&
+       memcmp(buf, str, str_len) == 0, "Snapshot reads mapping after buffer freed");
+
+    gb_free(snapshot);
+}
+
+static void mapped_file_lazy_index(void)
+{
+    msg("Lazy index:");
+    size_t length = GB_LINE_BLOCK_SIZE * 8;
+    char *text = malloc(length);
+    GapBuffer *mapped = gb_new(GAP_INCREMENT);
+    GapBuffer *copied = gb_new(GAP_INCREMENT);
+    int fd = -1;
+
+    if (text != NULL) {
+        /* Lines of varying length with non ASCII text in one block */
+        for (size_t k = 0; k < length; k++) {
+            text[k] = k % 37 == 0 || k % 101 == 0 ? '\n' : 'a' + k % 26;
+        }
+
+        memcpy(text + GB_LINE_BLOCK_SIZE * 5 + 10, "\xc3\xa9", 2);
+        fd = create_file(text, length);
+    }
+
+    if (fd == -1 || mapped == NULL || copied == NULL ||
+        !gb_map_file(mapped, fd, length) || !gb_add(copied, text, length)) {
+        ok(0, "Map file into buffer");
+        goto cleanup;
+    }
+
+    ok(mapped->lazy != NULL && mapped->lazy->indexed == 0 &&
+       mapped->lazy->plain_indexed == 0, "No blocks indexed when mapped");
+
+    ok(gb_lines_before(mapped, 100) == gb_lines_before(copied, 100) &&
+       gb_line_start(mapped, 2) == gb_line_start(copied, 2) &&
+       mapped->lazy->indexed <= 1, "Only leading blocks indexed for "
+       "text at start");
+
+    int match = 1;
+
+    for (size_t k = 0; k < length && match; k += 997) {
+        match = gb_lines_before(mapped, k) == gb_lines_before(copied, k) &&
+                gb_plain_run(mapped, k, 300) == gb_plain_run(copied, k, 300);
+    }
+
+    ok(match, "Lines before and plain runs match unmapped buffer");
+
+    size_t lines = gb_lines(copied);
+
+    for (size_t k = 0; k <= lines + 1 && match; k += 7) {
+        match = gb_line_start(mapped, k) == gb_line_start(copied, k);
+    }
+
+    ok(match && gb_lines(mapped) == lines && mapped->lazy->indexed ==
+       mapped->blocks, "Line starts and line count match unmapped buffer");
+
+cleanup:
+    gb_free(mapped);
+    gb_free(copied);
+    free(text);
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+static void mapped_file_truncate(void)
+{
+    msg("Truncate:");
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t length = page_size * 4;
+    char *text = malloc(length);
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    int fd = -1;
+
+    if (text != NULL) {
+        memset(text, 'a', length);
+        fd = create_file(text, length);
+    }
+
+    if (fd == -1 || buffer == NULL || !gb_map_file(buffer, fd, length) ||
+        ftruncate(fd, page_size) == -1) {
+        ok(0, "Map and truncate file");
+        goto cleanup;
+    }
+
+    ok(gb_lines(buffer) == 0, "Count lines of truncated file");
+    ok(gb_plain_run(buffer, 0, length) == page_size,
+       "Text removed from file is read as zeros");
+    ok(gb_set_point(buffer, length) && gb_insert(buffer, "\n", 1) &&
+       !gb_is_mapped(buffer) && gb_lines(buffer) == 1,
+       "Modify truncated file");
+    ok(gb_get_at(buffer, page_size - 1) == 'a' &&
+       gb_get_at(buffer, page_size) == '\0', "Copied text is correct");
+
+cleanup:
+    gb_free(buffer);
+    free(text);
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
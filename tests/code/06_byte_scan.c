@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../byte_scan.h"
+#include "../../gap_buffer.h"
+
+#define TEXT_SIZE 4096
+#define RANDOM_SCAN_NUM 2000
+
+static void byte_scan_kernel(ByteScanKernel, const char *kernel_name,
+                             const char *text, const char *plain_text);
+static void byte_scan_crlf_buffer(GapBufferStorage);
+static size_t count_ref(const char *text, size_t length, char c);
+static size_t count_crlf_ref(const char *text, size_t length);
+static const char *find_rev_ref(const char *text, size_t length, char c);
+static const char *find_non_printable_ref(const char *text, size_t length);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(16);
+
+    char *text = malloc(TEXT_SIZE);
+    char *plain_text = malloc(TEXT_SIZE);
+
+    if (!ok(text != NULL && plain_text != NULL, "Allocate text")) {
+        free(text);
+        free(plain_text);
+        return exit_status();
+    }
+
+    const char chars[] = { 'a', 'b', '\r', '\n', '\r', '\n', 'z', '\xff' };
+    srand(1);
+
+    for (size_t k = 0; k < TEXT_SIZE; k++) {
+        text[k] = chars[(size_t)rand() % sizeof(chars)];
+    }
+
+    /* Mostly printable ASCII with occasional control
+     * characters and bytes above 0x7F */
+    const char non_printable[] = { '\t', '\n', '\x7f', '\x80', '\xe9' };
+
+    for (size_t k = 0; k < TEXT_SIZE; k++) {
+        if ((size_t)rand() % 128 == 0) {
+            plain_text[k] = non_printable[(size_t)rand() %
+                                          sizeof(non_printable)];
+        } else {
+            plain_text[k] = (char)(0x20 + (size_t)rand() % 0x5F);
+        }
+    }
+
+    ByteScanKernel default_kernel = bs_get_kernel();
+    ok(bs_kernel_supported(default_kernel), "Default kernel is supported");
+
+    byte_scan_kernel(BSK_SCALAR, "Scalar", text, plain_text);
+    byte_scan_kernel(BSK_SSE2, "SSE2", text, plain_text);
+    byte_scan_kernel(BSK_AVX2, "AVX2", text, plain_text);
+    bs_set_kernel(default_kernel);
+
+    byte_scan_crlf_buffer(GBS_GAP);
+    byte_scan_crlf_buffer(GBS_PIECE_TABLE);
+
+    free(text);
+    free(plain_text);
+
+    return exit_status();
+}
+
+/* Compare kernel results with reference implementations
+ * using random offsets and lengths */
+static void byte_scan_kernel(ByteScanKernel kernel, const char *kernel_name,
+                             const char *text, const char *plain_text)
+{
+    msg("%s:", kernel_name);
+
+    if (!bs_set_kernel(kernel)) {
+        ok(!bs_kernel_supported(kernel), "Kernel not supported");
+        ok(1, "Skipped");
+        ok(1, "Skipped");
+        ok(1, "Skipped");
+        return;
+    }
+
+    int count_correct = 1;
+    int crlf_correct = 1;
+    int find_rev_correct = 1;
+    int non_printable_correct = 1;
+    size_t start, length;
+
+    for (size_t k = 0; k < RANDOM_SCAN_NUM; k++) {
+        start = (size_t)rand() % TEXT_SIZE;
+        length = (size_t)rand() % (TEXT_SIZE - start + 1);
+        char c = text[(size_t)rand() % TEXT_SIZE];
+
+        count_correct &= bs_count(text + start, length, c) ==
+                         count_ref(text + start, length, c);
+        crlf_correct &= bs_count_crlf(text + start, length) ==
+                        count_crlf_ref(text + start, length);
+        find_rev_correct &= bs_find_rev(text + start, length, c) ==
+                            find_rev_ref(text + start, length, c);
+        non_printable_correct &=
+            bs_find_non_printable(plain_text + start, length) ==
+            find_non_printable_ref(plain_text + start, length);
+    }
+
+    ok(count_correct, "Count matches reference");
+    ok(crlf_correct, "CRLF count matches reference");
+    ok(find_rev_correct, "Reverse find matches reference");
+    ok(non_printable_correct, "Non printable find matches reference");
+}
+
+static void byte_scan_crlf_buffer(GapBufferStorage storage)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    int success = buffer != NULL && gb_set_storage(buffer, storage) &&
+                  gb_add(buffer, "a\r\nb\r", 5) &&
+                  gb_add(buffer, "\nc\n\r\n", 5) &&
+                  gb_set_point(buffer, 5);
+
+    /* Position the gap between \r and \n */
+    success = success && gb_insert(buffer, "x", 1) && gb_delete(buffer, 1) &&
+              gb_count_crlf(buffer, 0, gb_length(buffer)) == 3 &&
+              gb_count_crlf(buffer, 2, 4) == 1 &&
+              gb_count_crlf(buffer, 5, 5) == 1;
+
+    ok(success, "CRLF pairs counted across %s segments",
+       storage == GBS_GAP ? "gap buffer" : "piece table");
+
+    gb_free(buffer);
+}
+
+static size_t count_ref(const char *text, size_t length, char c)
+{
+    size_t count = 0;
+
+    for (size_t k = 0; k < length; k++) {
+        count += text[k] == c;
+    }
+
+    return count;
+}
+
+static size_t count_crlf_ref(const char *text, size_t length)
+{
+    size_t count = 0;
+
+    for (size_t k = 1; k < length; k++) {
+        count += text[k - 1] == '\r' && text[k] == '\n';
+    }
+
+    return count;
+}
+
+static const char *find_rev_ref(const char *text, size_t length, char c)
+{
+    for (size_t k = length; k > 0; k--) {
+        if (text[k - 1] == c) {
+            return text + k - 1;
+        }
+    }
+
+    return NULL;
+}
+
+static const char *find_non_printable_ref(const char *text, size_t length)
+{
+    for (size_t k = 0; k < length; k++) {
+        if ((unsigned char)text[k] < 0x20 || (unsigned char)text[k] > 0x7E) {
+            return text + k;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+#define RANDOM_EDIT_NUM 1000
+#define SNAPSHOT_NUM 8
+#define LARGE_INSERT_SIZE (PT_MAX_PIECE_SIZE * 2 + 100)
+
+static void snapshot_basic(GapBufferStorage);
+static void snapshot_random_edits(GapBufferStorage);
+static int text_equals(const GapBuffer *, const char *text, size_t length);
+static char *copy_text(const GapBuffer *);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(20);
+
+    snapshot_basic(GBS_GAP);
+    snapshot_basic(GBS_PIECE_TABLE);
+    snapshot_random_edits(GBS_GAP);
+    snapshot_random_edits(GBS_PIECE_TABLE);
+
+    return exit_status();
+}
+
+static void snapshot_basic(GapBufferStorage storage)
+{
+    msg("%s:", storage == GBS_GAP ? "Gap buffer" : "Piece table");
+    const char *str = "This is test text.\nDon't change it.\n";
+    size_t str_len = strlen(str);
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (!ok(buffer != NULL && gb_set_storage(buffer, storage) &&
+            gb_add(buffer, str, str_len), "Create buffer")) {
+        gb_free(buffer);
+        return;
+    }
+
+    GapBuffer *snapshot = gb_snapshot(buffer);
+
+    ok(snapshot != NULL && text_equals(snapshot, str, str_len) &&
+       gb_lines(snapshot) == 2, "Snapshot matches buffer");
+    ok(gb_set_point(buffer, 19) && gb_insert(buffer, "New\n", 4) &&
+       gb_length(buffer) == str_len + 4 && gb_lines(buffer) == 3,
+       "Modify buffer");
+    ok(text_equals(snapshot, str, str_len) && gb_lines(snapshot) == 2 &&
+       gb_line_start(snapshot, 1) == 19, "Snapshot unchanged by modification");
+    ok(gb_set_point(snapshot, 0) && gb_delete(snapshot, 5) &&
+       gb_length(buffer) == str_len + 4 && gb_get_at(buffer, 0) == 'T',
+       "Buffer unchanged by modifying snapshot");
+
+    GapBuffer *snapshot2 = gb_snapshot(snapshot);
+    gb_free(snapshot);
+    gb_free(buffer);
+
+    ok(snapshot2 != NULL && text_equals(snapshot2, str + 5, str_len - 5),
+       "Snapshot readable after original freed");
+
+    gb_free(snapshot2);
+}
+
+/* Take snapshots at intervals while applying random edits and
+ * check each snapshot still matches the text at that point */
+static void snapshot_random_edits(GapBufferStorage storage)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    GapBuffer *snapshots[SNAPSHOT_NUM] = { NULL };
+    char *texts[SNAPSHOT_NUM] = { NULL };
+    char *large = malloc(LARGE_INSERT_SIZE);
+    int success = buffer != NULL && large != NULL &&
+                  gb_set_storage(buffer, storage);
+
+    for (size_t k = 0; success && k < LARGE_INSERT_SIZE; k++) {
+        large[k] = (k % 61 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    success = success && gb_add(buffer, large, LARGE_INSERT_SIZE);
+
+    const char *snippets[] = { "x", "\n", "abc\ndef", "\n\n\n" };
+    size_t point, length, snippet, taken = 0;
+
+    srand(1);
+
+    for (size_t k = 0; success && k < RANDOM_EDIT_NUM; k++) {
+        if (k % (RANDOM_EDIT_NUM / SNAPSHOT_NUM) == 0 &&
+            taken < SNAPSHOT_NUM) {
+            snapshots[taken] = gb_snapshot(buffer);
+            texts[taken] = copy_text(buffer);
+            success = snapshots[taken] != NULL && texts[taken] != NULL;
+            taken++;
+        }
+
+        length = gb_length(buffer);
+        point = length == 0 ? 0 : (size_t)rand() % length;
+        snippet = (size_t)rand() % 4;
+
+        success = success && gb_set_point(buffer, point);
+
+        if (k % 3 == 0) {
+            success = success && gb_delete(buffer, (size_t)rand() % 200);
+        } else if (k % 3 == 1) {
+            success = success && gb_add(buffer, snippets[snippet],
+                                        strlen(snippets[snippet]));
+        } else {
+            success = success && gb_replace(buffer, 3, snippets[snippet],
+                                            strlen(snippets[snippet]));
+        }
+
+        /* Free a snapshot while others are still in use */
+        if (k == RANDOM_EDIT_NUM / 2 && taken > 1) {
+            gb_free(snapshots[1]);
+            snapshots[1] = NULL;
+        }
+    }
+
+    ok(success && taken == SNAPSHOT_NUM, "Random edits applied");
+
+    int snapshots_correct = 1;
+    int lines_correct = 1;
+
+    for (size_t k = 0; k < taken; k++) {
+        if (snapshots[k] != NULL) {
+            snapshots_correct &= text_equals(snapshots[k], texts[k],
+                                             strlen(texts[k]));
+            lines_correct &= gb_lines_before(snapshots[k],
+                                             gb_length(snapshots[k])) ==
+                             gb_lines(snapshots[k]);
+        }
+    }
+
+    ok(snapshots_correct, "Snapshots match text when taken");
+    ok(lines_correct, "Snapshot line counts consistent");
+
+    char *text = copy_text(buffer);
+    ok(text != NULL && text_equals(buffer, text, strlen(text)),
+       "Buffer readable with snapshots outstanding");
+
+    for (size_t k = 0; k < SNAPSHOT_NUM; k++) {
+        gb_free(snapshots[k]);
+        free(texts[k]);
+    }
+
+    free(text);
+    free(large);
+    gb_free(buffer);
+}
+
+static int text_equals(const GapBuffer *buffer, const char *text,
+                       size_t length)
+{
+    if (gb_length(buffer) != length) {
+        return 0;
+    }
+
+    char *buf = malloc(length + 1);
+    int equal = buf != NULL &&
+                gb_get_range(buffer, 0, buf, length) == length &&
+                memcmp(buf, text, length) == 0;
+
+    free(buf);
+
+    return equal;
+}
+
+static char *copy_text(const GapBuffer *buffer)
+{
+    size_t length = gb_length(buffer);
+    char *text = malloc(length + 1);
+
+    if (text != NULL) {
+        gb_get_range(buffer, 0, text, length);
+        text[length] = '\0';
+    }
+
+    return text;
+}
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+#define INSERT_NUM 100000
+
+static void alloc_policy_growth(void);
+static void alloc_policy_growth_index(void);
+static void alloc_policy_shrink(void);
+static void alloc_policy_huge_pages(void);
+static GapBuffer *new_buffer(size_t growth, size_t shrink,
+                             size_t huge_page_min);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(10);
+
+    alloc_policy_growth();
+    alloc_policy_growth_index();
+    alloc_policy_shrink();
+    alloc_policy_huge_pages();
+
+    return exit_status();
+}
+
+static void alloc_policy_growth(void)
+{
+    msg("Growth:");
+    GapBuffer *linear = new_buffer(0, 2, 0);
+    GapBuffer *geometric = new_buffer(50, 4, 0);
+    int success = linear != NULL && geometric != NULL;
+
+    for (size_t k = 0; success && k < INSERT_NUM; k++) {
+        success = gb_add(linear, "abcdefgh", 8) &&
+                  gb_add(geometric, "abcdefgh", 8);
+    }
+
+    GBAllocStats linear_stats = { 0 }, geometric_stats = { 0 };
+
+    if (success) {
+        gb_get_alloc_stats(linear, &linear_stats);
+        gb_get_alloc_stats(geometric, &geometric_stats);
+    }
+
+    ok(success, "Text added to buffers");
+    ok(linear_stats.grows >= INSERT_NUM * 8 / (GAP_INCREMENT + 8),
+       "Linear growth allocates for every GAP_INCREMENT bytes");
+    ok(geometric_stats.grows < 40, "Geometric growth allocates logarithmically");
+
+    gb_free(linear);
+    gb_free(geometric);
+}
+
+/* Growing the gap only recounts the blocks from the gap onwards, so
+ * check the line index after many grows with text on both sides */
+static void alloc_policy_growth_index(void)
+{
+    msg("Growth index:");
+    GapBuffer *buffer = new_buffer(0, 2, 0);
+    size_t line_num = INSERT_NUM / 5;
+    int success = buffer != NULL;
+
+    for (size_t k = 0; success && k < line_num; k++) {
+        success = gb_set_point(buffer, k / 2 * 4) &&
+                  gb_insert(buffer, "abc\n", 4);
+    }
+
+    for (size_t k = 0; success && k < line_num; k += 997) {
+        success = gb_line_start(buffer, k) == k * 4 &&
+                  gb_lines_before(buffer, k * 4 + 2) == k &&
+                  gb_plain_run(buffer, k * 4, 4) == 3;
+    }
+
+    ok(success && gb_lines(buffer) == line_num,
+       "Indexes correct after linear growth");
+
+    gb_free(buffer);
+}
+
+static void alloc_policy_shrink(void)
+{
+    msg("Shrink:");
+    GapBuffer *buffer = new_buffer(50, 4, 0);
+    char *text = malloc(INSERT_NUM);
+
+    if (buffer == NULL || text == NULL) {
+        ok(0, "Buffer created");
+        gb_free(buffer);
+        free(text);
+        return;
+    }
+
+    memset(text, 'a', INSERT_NUM);
+    GBAllocStats stats;
+
+    int success = gb_add(buffer, text, INSERT_NUM) && gb_set_point(buffer, 0) &&
+                  gb_delete(buffer, INSERT_NUM / 2);
+    gb_get_alloc_stats(buffer, &stats);
+
+    ok(success && stats.shrinks == 0 &&
+       stats.allocated >= INSERT_NUM + INSERT_NUM / 2,
+       "Allocation kept within hysteresis band");
+
+    /* Deleting and reinserting the same text doesn't reallocate */
+    size_t grows = stats.grows;
+    success = gb_insert(buffer, text, INSERT_NUM / 2);
+    gb_get_alloc_stats(buffer, &stats);
+    ok(success && stats.grows == grows, "Reinserting text doesn't reallocate");
+
+    success = gb_delete(buffer, INSERT_NUM - 10);
+    gb_get_alloc_stats(buffer, &stats);
+    ok(success && stats.shrinks == 1 && stats.allocated < INSERT_NUM &&
+       gb_length(buffer) == 10, "Allocation shrunk after large delete");
+
+    gb_free(buffer);
+    free(text);
+}
+
+static void alloc_policy_huge_pages(void)
+{
+    msg("Huge pages:");
+    GapBuffer *buffer = new_buffer(50, 4, 64 * 1024);
+    char *text = malloc(INSERT_NUM);
+
+    if (buffer == NULL || text == NULL) {
+        ok(0, "Buffer created");
+        gb_free(buffer);
+        free(text);
+        return;
+    }
+
+    memset(text, '\n', INSERT_NUM);
+    GBAllocStats stats;
+
+    int success = gb_add(buffer, text, INSERT_NUM) &&
+                  gb_add(buffer, text, INSERT_NUM);
+    gb_get_alloc_stats(buffer, &stats);
+
+    /* Huge pages aren't supported on all platforms in which
+     * case normal allocations are used */
+    ok(success && gb_length(buffer) == INSERT_NUM * 2 &&
+       gb_lines(buffer) == INSERT_NUM * 2, "Text added above threshold");
+    ok(!stats.huge_pages || stats.allocated % (2 * 1024 * 1024) == 0,
+       "Huge page allocation is a whole number of pages");
+
+    success = gb_set_point(buffer, 0) &&
+              gb_delete(buffer, INSERT_NUM * 2 - 10);
+    gb_get_alloc_stats(buffer, &stats);
+    ok(success && !stats.huge_pages && gb_length(buffer) == 10 &&
+       gb_lines(buffer) == 10, "Small buffer no longer uses huge pages");
+
+    gb_free(buffer);
+    free(text);
+}
+
+static GapBuffer *new_buffer(size_t growth, size_t shrink,
+                             size_t huge_page_min)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (buffer != NULL) {
+        GBAllocPolicy policy = {
+            .growth = growth,
+            .shrink = shrink,
+            .huge_page_min = huge_page_min
+        };
+
+        gb_set_alloc_policy(buffer, &policy);
+    }
+
+    return buffer;
+}
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tap.h"
+#include "../../file_writer.h"
+#include "../../undo_file.h"
+
+#define TEXT_SIZE (FW_WRITE_CHUNK_SIZE * 3 + 100)
+
+static void file_writer_sync(void);
+static void file_writer_async(GapBufferStorage);
+static void file_writer_fragmented(void);
+static void file_writer_mapped(void);
+static void file_writer_incremental(void);
+static void file_writer_errors(void);
+static int file_equals(const char *file_path, const char *text,
+                       size_t length);
+static uint64_t text_hash(const char *text, size_t length);
+
+static char file_path[] = "/tmp/wed_file_writer_testXXXXXX";
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(24);
+
+    int fd = mkstemp(file_path);
+
+    if (!ok(fd != -1, "Create test file")) {
+        return exit_status();
+    }
+
+    close(fd);
+
+    file_writer_sync();
+    file_writer_async(GBS_GAP);
+    file_writer_async(GBS_PIECE_TABLE);
+    file_writer_fragmented();
+    file_writer_mapped();
+    file_writer_incremental();
+    file_writer_errors();
+
+    remove(file_path);
+
+    return exit_status();
+}
+
+static void file_writer_sync(void)
+{
+    msg("Sync:");
+    const char *str = "Line 1\nLine 2\n";
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    uint64_t hash = 0;
+
+    ok(buffer != NULL && gb_add(buffer, str, strlen(str)) &&
+       STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_DIRECTORY,
+                                       NULL, &hash)) &&
+       file_equals(file_path, str, strlen(str)), "Write file");
+    ok(hash == text_hash(str, strlen(str)), "Hash of text written");
+
+    gb_free(buffer);
+}
+
+/* Modify the buffer while a snapshot of it is being written */
+static void file_writer_async(GapBufferStorage storage)
+{
+    msg("Async %s:", storage == GBS_GAP ? "gap buffer" : "piece table");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char *text = malloc(TEXT_SIZE);
+    int success = buffer != NULL && text != NULL &&
+                  gb_set_storage(buffer, storage);
+
+    for (size_t k = 0; success && k < TEXT_SIZE; k++) {
+        text[k] = (k % 50 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    success = success && gb_add(buffer, text, TEXT_SIZE);
+
+    int fds[2] = { -1, -1 };
+    success = success && pipe(fds) == 0;
+
+    GapBuffer *snapshot = success ? gb_snapshot(buffer) : NULL;
+    FileWriter *writer = NULL;
+
+    success = snapshot != NULL &&
+              STATUS_IS_SUCCESS(fw_start(&writer, snapshot, file_path,
+                                         WD_FILE, NULL, 1, fds[1]));
+
+    if (!ok(success, "Start writer")) {
+        gb_free(snapshot);
+        gb_free(buffer);
+        free(text);
+        return;
+    }
+
+    success = gb_set_point(buffer, 0) && gb_delete(buffer, 100) &&
+              gb_set_point(buffer, TEXT_SIZE / 2) &&
+              gb_insert(buffer, "inserted", 8);
+
+    char byte;
+    int notified = read(fds[0], &byte, 1) == 1;
+
+    while (!fw_finished(writer)) {
+        notified = read(fds[0], &byte, 1) == 1;
+    }
+
+    ok(success && notified && fw_progress(writer) == 100,
+       "Writer finished with progress notifications");
+
+    char *written_path;
+    uint64_t hash = 0;
+    Status status = fw_finish(writer, &written_path, &hash);
+
+    ok(STATUS_IS_SUCCESS(status) && strcmp(written_path, file_path) == 0,
+       "Write successful");
+    ok(file_equals(file_path, text, TEXT_SIZE),
+       "File contains text from when snapshot was taken");
+    ok(hash == text_hash(text, TEXT_SIZE), "Hash of snapshot returned");
+
+    free(written_path);
+    close(fds[0]);
+    close(fds[1]);
+    gb_free(buffer);
+    free(text);
+}
+
+/* A piece table with many small pieces requires several
+ * writev calls, each gathering many segments */
+static void file_writer_fragmented(void)
+{
+    msg("Fragmented:");
+    size_t pieces = 1000;
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char *text = malloc(pieces * 2);
+    int success = buffer != NULL && text != NULL &&
+                  gb_set_storage(buffer, GBS_PIECE_TABLE);
+
+    /* Insert every other character first then fill
+     * in the rest so no two pieces can be merged */
+    for (size_t k = 0; success && k < pieces; k++) {
+        text[k * 2] = 'a' + (k % 26);
+        success = gb_insert(buffer, text + k * 2, 1) &&
+                  gb_set_point(buffer, k + 1);
+    }
+
+    for (size_t k = 0; success && k < pieces; k++) {
+        text[k * 2 + 1] = (k % 40 == 0) ? '\n' : 'A' + (k % 26);
+        success = gb_set_point(buffer, k * 2 + 1) &&
+                  gb_insert(buffer, text + k * 2 + 1, 1);
+    }
+
+    ok(success && gb_length(buffer) == pieces * 2 &&
+       STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE, NULL,
+                                       NULL)) &&
+       file_equals(file_path, text, pieces * 2), "Write fragmented text");
+
+    gb_free(buffer);
+    free(text);
+}
+
+/* An unmodified mapped buffer is copied from the file it was loaded
+ * from. Its snapshot can still be written after the buffer is
+ * modified, which releases the buffer's reference to the file */
+static void file_writer_mapped(void)
+{
+    msg("Mapped:");
+    char *text = malloc(TEXT_SIZE);
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    GapBuffer *snapshot = NULL;
+    int success = buffer != NULL && text != NULL;
+
+    for (size_t k = 0; success && k < TEXT_SIZE; k++) {
+        text[k] = (k % 60 == 0) ? '\n' : '0' + (k % 10);
+    }
+
+    success = success && gb_add(buffer, text, TEXT_SIZE) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              NULL, NULL));
+
+    gb_free(buffer);
+    buffer = success ? gb_new(GAP_INCREMENT) : NULL;
+    int fd = success ? open(file_path, O_RDONLY) : -1;
+
+    success = buffer != NULL && fd != -1 &&
+              gb_map_file(buffer, fd, TEXT_SIZE) &&
+              gb_mapped_fd(buffer) != -1;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    ok(success &&
+       STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE, NULL,
+                                       NULL)) &&
+       file_equals(file_path, text, TEXT_SIZE), "Write mapped text");
+
+    snapshot = success ? gb_snapshot(buffer) : NULL;
+    success = snapshot != NULL && gb_set_point(buffer, 0) &&
+              gb_delete(buffer, 1) && gb_mapped_fd(buffer) == -1;
+
+    ok(success && gb_mapped_fd(snapshot) != -1 &&
+       STATUS_IS_SUCCESS(fw_write_file(snapshot, file_path, WD_NONE,
+                                       NULL, NULL)) &&
+       file_equals(file_path, text, TEXT_SIZE),
+       "Write mapped snapshot of modified buffer");
+
+    gb_free(snapshot);
+    gb_free(buffer);
+    free(text);
+}
+
+/* Only text changed since the file was last written is written
+ * when the file is unchanged, which is demonstrated by modifying
+ * the file without changing its size or modification time */
+static void file_writer_incremental(void)
+{
+    msg("Incremental:");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char *text = malloc(TEXT_SIZE + 10);
+    struct stat base_stat;
+    int success = buffer != NULL && text != NULL;
+
+    for (size_t k = 0; success && k < TEXT_SIZE; k++) {
+        text[k] = (k % 70 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    success = success && gb_add(buffer, text, TEXT_SIZE) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              NULL, NULL)) &&
+              stat(file_path, &base_stat) == 0;
+
+    if (!ok(success, "Write initial file")) {
+        gb_free(buffer);
+        free(text);
+        return;
+    }
+
+    gb_track_changes(buffer);
+
+    /* Overwrite the first byte of the file in place */
+    int fd = open(file_path, O_WRONLY);
+    struct timespec times[2] = { base_stat.st_atim, base_stat.st_mtim };
+    success = fd != -1 && write(fd, "#", 1) == 1 &&
+              futimens(fd, times) == 0;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    memcpy(text + TEXT_SIZE / 2, "12345", 5);
+    memcpy(text + TEXT_SIZE, "appended\n", 9);
+    success = success && gb_set_point(buffer, TEXT_SIZE / 2) &&
+              gb_replace(buffer, 5, "12345", 5) &&
+              gb_set_point(buffer, TEXT_SIZE) &&
+              gb_insert(buffer, "appended\n", 9) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              &base_stat, NULL));
+
+    text[0] = '#';
+    ok(success && file_equals(file_path, text, TEXT_SIZE + 9),
+       "Only changed text written");
+
+    /* Deleting from the end of the buffer truncates the file */
+    success = stat(file_path, &base_stat) == 0;
+    gb_track_changes(buffer);
+    text[0] = '\n';
+
+    success = success && gb_set_point(buffer, 0) &&
+              gb_replace(buffer, 1, "\n", 1) &&
+              gb_set_point(buffer, TEXT_SIZE - 100) &&
+              gb_delete(buffer, 109) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              &base_stat, NULL));
+
+    ok(success && file_equals(file_path, text, TEXT_SIZE - 100),
+       "File truncated");
+
+    /* The whole file is written once it has been modified */
+    fd = open(file_path, O_WRONLY | O_APPEND);
+    success = fd != -1 && write(fd, "extra", 5) == 5;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    memcpy(text + 50, "ABC", 3);
+    success = success && gb_set_point(buffer, 50) &&
+              gb_replace(buffer, 3, "ABC", 3) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              &base_stat, NULL));
+
+    ok(success && file_equals(file_path, text, TEXT_SIZE - 100),
+       "Modified file rewritten");
+
+    /* Changes which move most of the text are written in full */
+    success = stat(file_path, &base_stat) == 0;
+    gb_track_changes(buffer);
+    memmove(text, text + 10, TEXT_SIZE - 110);
+
+    success = success && gb_set_point(buffer, 0) &&
+              gb_delete(buffer, 10) &&
+              STATUS_IS_SUCCESS(fw_write_file(buffer, file_path, WD_NONE,
+                                              &base_stat, NULL));
+
+    ok(success && file_equals(file_path, text, TEXT_SIZE - 110),
+       "Moved text rewritten");
+
+    gb_free(buffer);
+    free(text);
+}
+
+static void file_writer_errors(void)
+{
+    msg("Errors:");
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    Status status = STATUS_SUCCESS;
+
+    if (buffer != NULL) {
+        status = fw_write_file(buffer, "/nonexistent_wed_dir/file", WD_NONE,
+                               NULL, NULL);
+    }
+
+    ok(buffer != NULL && !STATUS_IS_SUCCESS(status),
+       "Writing to missing directory fails");
+    st_free_status(status);
+    gb_free(buffer);
+
+    WriteDurability durability = WD_NONE;
+    ok(fw_determine_durability("directory", &durability) &&
+       durability == WD_DIRECTORY, "Parse durability");
+    ok(!fw_determine_durability("always", &durability),
+       "Invalid durability rejected");
+}
+
+static int file_equals(const char *path, const char *text, size_t length)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    char *buf = malloc(length + 1);
+    int equal = buf != NULL && fread(buf, 1, length + 1, file) == length &&
+                memcmp(buf, text, length) == 0;
+
+    free(buf);
+    fclose(file);
+
+    return equal;
+}
+
+static uint64_t text_hash(const char *text, size_t length)
+{
+    UndoFileHash content_hash;
+    uf_hash_init(&content_hash);
+    uf_hash_update(&content_hash, text, length);
+
+    return uf_hash_final(&content_hash);
+}
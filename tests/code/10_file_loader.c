@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "tap.h"
+#include "../../file_loader.h"
+#include "../../util.h"
+
+#define TEXT_SIZE (FL_READ_CHUNK_SIZE * (FL_MAX_QUEUED_CHUNKS + 3) + 100)
+
+static void file_loader_load(void);
+static void file_loader_cancel(void);
+static void file_loader_errors(void);
+static void file_loader_count(void);
+static void file_loader_method(void);
+static void sleep_ms(long ms);
+
+static char file_path[] = "/tmp/wed_file_loader_testXXXXXX";
+static char *text;
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(16);
+
+    int fd = mkstemp(file_path);
+    text = malloc(TEXT_SIZE);
+
+    if (!ok(fd != -1 && text != NULL, "Create test file")) {
+        return exit_status();
+    }
+
+    for (size_t k = 0; k < TEXT_SIZE; k++) {
+        text[k] = (k % 50 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    int written = write(fd, text, TEXT_SIZE) == TEXT_SIZE;
+    close(fd);
+
+    if (!ok(written, "Populate test file")) {
+        remove(file_path);
+        free(text);
+        return exit_status();
+    }
+
+    file_loader_load();
+    file_loader_cancel();
+    file_loader_errors();
+    file_loader_count();
+    file_loader_method();
+
+    remove(file_path);
+    free(text);
+
+    return exit_status();
+}
+
+/* Read the start of the file then load the rest in the background,
+ * collecting chunks as notifications are received */
+static void file_loader_load(void)
+{
+    msg("Load:");
+    int fd = open(file_path, O_RDONLY);
+    char *loaded = malloc(TEXT_SIZE);
+    int fds[2] = { -1, -1 };
+    int success = fd != -1 && loaded != NULL && pipe(fds) == 0 &&
+                  read(fd, loaded, FL_INITIAL_READ_SIZE) ==
+                  FL_INITIAL_READ_SIZE;
+
+    FileLoader *loader = NULL;
+
+    success = success &&
+              STATUS_IS_SUCCESS(fl_start(&loader, fd, FL_INITIAL_READ_SIZE,
+                                         TEXT_SIZE, fds[1]));
+
+    if (!ok(success, "Start loader")) {
+        free(loaded);
+        return;
+    }
+
+    size_t length = FL_INITIAL_READ_SIZE;
+    size_t max_queued = 0;
+    int in_order = 1;
+    FLChunk *chunks;
+    char byte;
+
+    while (!fl_finished(loader)) {
+        if (read(fds[0], &byte, 1) != 1) {
+            continue;
+        }
+
+        /* Give the worker a chance to fill the queue */
+        sleep_ms(1);
+        chunks = fl_take_chunks(loader);
+        size_t queued = 0;
+
+        for (FLChunk *chunk = chunks; chunk != NULL; chunk = chunk->next) {
+            if (length + chunk->length > TEXT_SIZE) {
+                in_order = 0;
+                break;
+            }
+
+            memcpy(loaded + length, chunk->text, chunk->length);
+            length += chunk->length;
+            queued++;
+        }
+
+        max_queued = MAX(max_queued, queued);
+        fl_free_chunks(chunks);
+    }
+
+    ok(in_order && length == TEXT_SIZE &&
+       memcmp(loaded, text, TEXT_SIZE) == 0, "Loaded text matches file");
+    ok(max_queued <= FL_MAX_QUEUED_CHUNKS, "Queued chunks are bounded");
+    ok(fl_progress(loader) == 100, "Progress complete");
+    ok(STATUS_IS_SUCCESS(fl_finish(loader)), "Load successful");
+
+    close(fds[0]);
+    close(fds[1]);
+    free(loaded);
+}
+
+/* A worker blocked on a full queue exits when cancelled */
+static void file_loader_cancel(void)
+{
+    msg("Cancel:");
+    int fd = open(file_path, O_RDONLY);
+    FileLoader *loader = NULL;
+
+    if (!ok(fd != -1 &&
+            STATUS_IS_SUCCESS(fl_start(&loader, fd, 0, TEXT_SIZE, -1)),
+            "Start loader")) {
+        return;
+    }
+
+    sleep_ms(10);
+
+    ok(fl_progress(loader) < 100 &&
+       STATUS_IS_SUCCESS(fl_finish(loader)), "Cancel partial load");
+}
+
+static void file_loader_errors(void)
+{
+    msg("Errors:");
+    int fd = open("/", O_RDONLY);
+    FileLoader *loader = NULL;
+    int started = fd != -1 &&
+                  STATUS_IS_SUCCESS(fl_start(&loader, fd, 0, 1, -1));
+
+    while (started && !fl_finished(loader)) {
+        sleep_ms(1);
+    }
+
+    Status status = STATUS_SUCCESS;
+
+    if (started) {
+        status = fl_finish(loader);
+    }
+
+    ok(started && !STATUS_IS_SUCCESS(status), "Reading directory fails");
+    st_free_status(status);
+}
+
+/* Counting stops at the given size, which is the length of the
+ * mapping being indexed, rather than at the end of the file */
+static void file_loader_count(void)
+{
+    msg("Count:");
+    size_t block_size = 4096;
+    size_t size = TEXT_SIZE - 100;
+    int fd = open(file_path, O_RDONLY);
+    FileLoader *loader = NULL;
+    int started = fd != -1 &&
+                  STATUS_IS_SUCCESS(fl_start_counting(&loader, fd, size,
+                                                      block_size, -1));
+    size_t expected = 0;
+    size_t lines = 0;
+    size_t blocks = 0;
+    int in_order = 1;
+    FLChunk *chunks;
+
+    for (size_t k = 0; k < size; k++) {
+        expected += text[k] == '\n';
+    }
+
+    while (started && !fl_finished(loader)) {
+        sleep_ms(1);
+        chunks = fl_take_chunks(loader);
+
+        for (FLChunk *chunk = chunks; chunk != NULL; chunk = chunk->next) {
+            in_order = in_order && chunk->first_block == blocks;
+            blocks += chunk->block_num;
+
+            for (size_t k = 0; k < chunk->block_num; k++) {
+                lines += chunk->block_lines[k];
+            }
+        }
+
+        fl_free_chunks(chunks);
+    }
+
+    ok(started && STATUS_IS_SUCCESS(fl_finish(loader)) && in_order &&
+       lines == expected && blocks == (size + block_size - 1) / block_size,
+       "Lines counted in each block");
+}
+
+/* Large files are mapped whenever possible regardless of the
+ * size from which files are loaded in the background */
+static void file_loader_method(void)
+{
+    msg("Load method:");
+    size_t progressive_min = 64 * 1024 * 1024;
+    struct stat file_stat = { 0 };
+    file_stat.st_mode = S_IFREG;
+    file_stat.st_size = progressive_min * 2;
+
+    ok(fl_load_method(&file_stat, 1, progressive_min) == FLM_MAP,
+       "File larger than progressive load size is mapped");
+    ok(fl_load_method(&file_stat, 0, progressive_min) == FLM_PROGRESSIVE,
+       "File which can't be mapped is loaded in the background");
+
+    file_stat.st_size = FL_MAP_MIN_SIZE;
+    ok(fl_load_method(&file_stat, 1, progressive_min) == FLM_MAP,
+       "File smaller than progressive load size is mapped");
+
+    file_stat.st_size = FL_MAP_MIN_SIZE - 1;
+    ok(fl_load_method(&file_stat, 1, progressive_min) == FLM_READ,
+       "Small file is read");
+
+    file_stat.st_mode = S_IFCHR;
+    file_stat.st_size = progressive_min;
+    ok(fl_load_method(&file_stat, 1, progressive_min) == FLM_PROGRESSIVE,
+       "Special file is loaded in the background");
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec duration = { 0, ms * 1000000 };
+    nanosleep(&duration, NULL);
+}
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tap.h"
+#include "../../journal.h"
+#include "../../gap_buffer.h"
+
+static void journal_replay(void);
+static void journal_torn_record(void);
+static void journal_rebase(void);
+static void journal_mismatch(void);
+static Status apply_record(void *context, JournalRecordType, size_t offset,
+                           const char *text, size_t length);
+static int replay_equals(const char *text, size_t expected_records);
+static int write_file(const char *path, const char *text, int append);
+static size_t file_size(const char *path);
+
+static char file_path[] = "/tmp/wed_journal_testXXXXXX";
+static char *journal_path;
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(12);
+
+    int fd = mkstemp(file_path);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    journal_path = jn_journal_path(file_path);
+
+    if (!ok(fd != -1 && journal_path != NULL &&
+            write_file(file_path, "Hello world\n", 0), "Create test file")) {
+        return exit_status();
+    }
+
+    journal_replay();
+    journal_torn_record();
+    journal_rebase();
+    journal_mismatch();
+
+    remove(journal_path);
+    remove(file_path);
+    free(journal_path);
+
+    return exit_status();
+}
+
+/* Edits made to the buffer are recorded and can be replayed
+ * against the file to recreate the buffer text */
+static void journal_replay(void)
+{
+    msg("Replay:");
+    Journal *journal = NULL;
+
+    if (!ok(STATUS_IS_SUCCESS(jn_new(&journal, file_path, 0)) &&
+            access(journal_path, F_OK) == -1,
+            "Journal file not created until first edit")) {
+        return;
+    }
+
+    jn_add_insert(journal, 6, "big ", 4);
+    jn_add_delete(journal, 0, 6);
+    jn_add_insert(journal, 9, "!", 1);
+
+    ok(STATUS_IS_SUCCESS(jn_sync(journal)) &&
+       access(journal_path, F_OK) == 0, "Sync creates journal file");
+
+    /* Simulate a crash by leaving the journal file in place */
+    jn_free(journal, 0);
+
+    ok(replay_equals("big world!\n", 3), "Replay edits");
+}
+
+/* A record partially written before a crash is ignored
+ * and journaling resumes from the last complete record */
+static void journal_torn_record(void)
+{
+    msg("Torn record:");
+    size_t length = file_size(journal_path);
+    size_t records, valid_length;
+
+    write_file(journal_path, "i\1\0\0", 1);
+
+    Status status = jn_replay(file_path, apply_record, NULL, &records,
+                              &valid_length);
+
+    ok(STATUS_IS_SUCCESS(status) && records == 3 &&
+       valid_length == length, "Ignore partial record");
+
+    Journal *journal = NULL;
+
+    if (!ok(STATUS_IS_SUCCESS(jn_new(&journal, file_path, valid_length)),
+            "Resume journal")) {
+        return;
+    }
+
+    jn_add_delete(journal, 0, 4);
+    jn_free(journal, 0);
+
+    ok(replay_equals("world!\n", 4), "Replay resumed journal");
+}
+
+/* Once the file is saved only the edits made after the
+ * saved text was taken need to be kept */
+static void journal_rebase(void)
+{
+    msg("Rebase:");
+    Journal *journal = NULL;
+    size_t records, valid_length;
+
+    if (!ok(STATUS_IS_SUCCESS(jn_replay(file_path, apply_record, NULL,
+                                        &records, &valid_length)) &&
+            STATUS_IS_SUCCESS(jn_new(&journal, file_path, valid_length)),
+            "Resume journal")) {
+        return;
+    }
+
+    size_t saved_position = jn_position(journal);
+    jn_add_insert(journal, 0, "Hello ", 6);
+
+    write_file(file_path, "world!\n", 0);
+
+    ok(STATUS_IS_SUCCESS(jn_rebase(journal, saved_position)) &&
+       STATUS_IS_SUCCESS(jn_sync(journal)) &&
+       replay_equals("Hello world!\n", 1), "Keep edits made after save");
+
+    write_file(file_path, "Hello world!\n", 0);
+
+    ok(STATUS_IS_SUCCESS(jn_rebase(journal, jn_position(journal))) &&
+       access(journal_path, F_OK) == -1,
+       "Journal file removed when no edits remain");
+
+    jn_add_delete(journal, 0, 6);
+    jn_free(journal, 1);
+
+    ok(access(journal_path, F_OK) == -1, "Journal file removed when freed");
+}
+
+/* A journal is only replayed against the version of the file it
+ * was created for */
+static void journal_mismatch(void)
+{
+    msg("Mismatch:");
+    Journal *journal = NULL;
+    size_t records, valid_length;
+
+    if (STATUS_IS_SUCCESS(jn_new(&journal, file_path, 0))) {
+        jn_add_delete(journal, 0, 6);
+        jn_free(journal, 0);
+    }
+
+    write_file(file_path, "Changed elsewhere\n", 0);
+
+    Status status = jn_replay(file_path, apply_record, NULL, &records,
+                              &valid_length);
+
+    ok(!STATUS_IS_SUCCESS(status) &&
+       status.error_code == ERR_JOURNAL_MISMATCH && records == 0,
+       "Journal for different file content not replayed");
+    st_free_status(status);
+}
+
+static Status apply_record(void *context, JournalRecordType type,
+                           size_t offset, const char *text, size_t length)
+{
+    GapBuffer *buffer = context;
+
+    if (buffer == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    gb_set_point(buffer, offset);
+
+    if (type == JRT_INSERT) {
+        gb_insert(buffer, text, length);
+    } else {
+        gb_delete(buffer, length);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Replay the journal against the current file content */
+static int replay_equals(const char *text, size_t expected_records)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    int fd = open(file_path, O_RDONLY);
+
+    if (buffer == NULL || fd == -1) {
+        gb_free(buffer);
+        return 0;
+    }
+
+    char file_text[64];
+    ssize_t bytes = read(fd, file_text, sizeof(file_text));
+    close(fd);
+
+    size_t records, valid_length;
+    size_t length = strlen(text);
+    char replayed[64];
+
+    int equal = bytes >= 0 && gb_add(buffer, file_text, bytes) &&
+                STATUS_IS_SUCCESS(jn_replay(file_path, apply_record, buffer,
+                                            &records, &valid_length)) &&
+                records == expected_records &&
+                gb_length(buffer) == length &&
+                gb_get_range(buffer, 0, replayed, length) == length &&
+                memcmp(replayed, text, length) == 0;
+
+    gb_free(buffer);
+
+    return equal;
+}
+
+static int write_file(const char *path, const char *text, int append)
+{
+    FILE *file = fopen(path, append ? "ab" : "wb");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    size_t length = strlen(text);
+    int written = fwrite(text, 1, length, file) == length;
+
+    return fclose(file) == 0 && written;
+}
+
+static size_t file_size(const char *path)
+{
+    struct stat file_stat;
+
+    if (stat(path, &file_stat) == -1) {
+        return 0;
+    }
+
+    return file_stat.st_size;
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "tap.h"
+#include "../../file_follower.h"
+
+#define MAX_TEXT_SIZE 256
+/* Long enough for the worker to notice changes by polling even
+ * when file system events aren't available */
+#define WAIT_TIMEOUT_MS (FF_POLL_INTERVAL_MS * 3)
+
+static void file_follower_append(void);
+static void file_follower_truncate(void);
+static void file_follower_rotate(void);
+static int wait_for_text(const char *expected, int expect_restart);
+static int write_file(const char *path, const char *text, int append);
+
+static char file_path[] = "/tmp/wed_file_follower_testXXXXXX";
+static char rotated_path[sizeof(file_path) + 4];
+static FileFollower *follower;
+static int fds[2] = { -1, -1 };
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(6);
+
+    int fd = mkstemp(file_path);
+    snprintf(rotated_path, sizeof(rotated_path), "%s.old", file_path);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (!ok(fd != -1 && pipe(fds) == 0 &&
+            fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0 &&
+            write_file(file_path, "Line 1\n", 0) &&
+            STATUS_IS_SUCCESS(ff_start(&follower, file_path, 7, fds[1])),
+            "Start following file")) {
+        remove(file_path);
+        return exit_status();
+    }
+
+    file_follower_append();
+    file_follower_truncate();
+    file_follower_rotate();
+
+    ff_stop(follower);
+    close(fds[0]);
+    close(fds[1]);
+    remove(file_path);
+    remove(rotated_path);
+
+    return exit_status();
+}
+
+/* Only text added after the offset already read is queued */
+static void file_follower_append(void)
+{
+    msg("Append:");
+    write_file(file_path, "Line 2\n", 1);
+    ok(wait_for_text("Line 2\n", 0), "Appended text queued");
+
+    write_file(file_path, "Line 3\nLine 4\n", 1);
+    ok(wait_for_text("Line 3\nLine 4\n", 0), "Further text queued");
+}
+
+/* Reading starts again from the beginning of a truncated file */
+static void file_follower_truncate(void)
+{
+    msg("Truncate:");
+    write_file(file_path, "New\n", 0);
+    ok(wait_for_text("New\n", 1), "Truncated file restarted");
+}
+
+/* A file replaced by a new file at the same path is followed
+ * from the beginning of the new file */
+static void file_follower_rotate(void)
+{
+    msg("Rotate:");
+    int rotated = rename(file_path, rotated_path) == 0 &&
+                  write_file(file_path, "Rotated\n", 0);
+    ok(rotated && wait_for_text("Rotated\n", 1), "Rotated file restarted");
+
+    write_file(file_path, "More\n", 1);
+    ok(wait_for_text("More\n", 0), "Rotated file followed");
+}
+
+/* Collect queued text until it matches expected or timeout */
+static int wait_for_text(const char *expected, int expect_restart)
+{
+    char text[MAX_TEXT_SIZE];
+    size_t length = 0;
+    size_t expected_length = strlen(expected);
+    int restarted = 0, chunk_restarted;
+    struct pollfd poll_fd = { .fd = fds[0], .events = POLLIN };
+    char events[64];
+
+    while (poll(&poll_fd, 1, WAIT_TIMEOUT_MS) > 0) {
+        if (read(fds[0], events, sizeof(events)) <= 0) {
+            continue;
+        }
+
+        FLChunk *chunks = ff_take_chunks(follower, &chunk_restarted);
+
+        if (chunk_restarted) {
+            restarted = 1;
+            length = 0;
+        }
+
+        for (FLChunk *chunk = chunks; chunk != NULL; chunk = chunk->next) {
+            if (length + chunk->length > MAX_TEXT_SIZE) {
+                fl_free_chunks(chunks);
+                return 0;
+            }
+
+            memcpy(text + length, chunk->text, chunk->length);
+            length += chunk->length;
+        }
+
+        fl_free_chunks(chunks);
+
+        if (length >= expected_length && restarted == expect_restart) {
+            break;
+        }
+    }
+
+    return restarted == expect_restart && length == expected_length &&
+           memcmp(text, expected, length) == 0;
+}
+
+static int write_file(const char *path, const char *text, int append)
+{
+    FILE *file = fopen(path, append ? "ab" : "wb");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    size_t length = strlen(text);
+    int written = fwrite(text, 1, length, file) == length;
+
+    return fclose(file) == 0 && written;
+}
@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "tap.h"
+#include "../../unicode.h"
+
+static void unicode_width(void);
+static void unicode_combining(void);
+static void unicode_grapheme_break(void);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(16);
+
+    unicode_width();
+    unicode_combining();
+    unicode_grapheme_break();
+
+    return exit_status();
+}
+
+static void unicode_width(void)
+{
+    msg("Width:");
+    ok(UC_WIDTH(uc_properties('a')) == 1, "ASCII");
+    ok(UC_WIDTH(uc_properties(0xE9)) == 1, "Latin-1");
+    ok(UC_WIDTH(uc_properties(0x4E2D)) == 2, "CJK ideograph");
+    ok(UC_WIDTH(uc_properties(0x3401)) == 2, "CJK extension");
+    ok(UC_WIDTH(uc_properties(0xD55C)) == 2, "Hangul syllable");
+    ok(UC_WIDTH(uc_properties(0x1F600)) == 2, "Emoji");
+    ok(UC_WIDTH(uc_properties(0x1F3FD)) == 0, "Emoji modifier");
+    ok(UC_WIDTH(uc_properties(0x200B)) == 0, "Zero width space");
+    ok(UC_WIDTH(uc_properties(0xAD)) == 1, "Soft hyphen");
+    ok(UC_WIDTH(uc_properties(UC_MAX_CODE_POINT + 1)) == 1,
+       "Beyond Unicode range");
+}
+
+static void unicode_combining(void)
+{
+    msg("Combining:");
+    unsigned char acute = uc_properties(0x301);
+    ok((acute & UC_COMBINING) && UC_WIDTH(acute) == 0,
+       "Combining acute accent");
+    ok(!(uc_properties('e') & UC_COMBINING), "Letter not combining");
+}
+
+static void unicode_grapheme_break(void)
+{
+    msg("Grapheme break:");
+    ok(UC_GRAPHEME_BREAK(uc_properties(0x200D)) == UGB_ZWJ,
+       "Zero width joiner");
+    ok(UC_GRAPHEME_BREAK(uc_properties(0x1F1EC)) == UGB_REGIONAL_INDICATOR,
+       "Regional indicator");
+    ok(UC_GRAPHEME_BREAK(uc_properties(0xAC00)) == UGB_LV,
+       "Hangul LV syllable");
+    ok(uc_properties(0x1F44D) & UC_EXTENDED_PICTOGRAPHIC,
+       "Extended pictographic");
+}
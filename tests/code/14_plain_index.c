@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "tap.h"
+#include "../../gap_buffer.h"
+
+#define RANDOM_EDIT_NUM 2000
+#define LARGE_INSERT_SIZE (GB_PLAIN_CHUNK_SIZE * 40 + 100)
+
+static void plain_index_basic(GapBuffer *);
+static void plain_index_random_edits(void);
+static void plain_index_snapshot(void);
+static size_t plain_run_ref(const GapBuffer *, size_t point, size_t limit);
+static int plain_index_correct(const GapBuffer *);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(10);
+
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+
+    if (!ok(buffer != NULL, "Create GapBuffer")) {
+        return exit_status();
+    }
+
+    plain_index_basic(buffer);
+    plain_index_random_edits();
+    plain_index_snapshot();
+
+    gb_free(buffer);
+
+    return exit_status();
+}
+
+static void plain_index_basic(GapBuffer *buffer)
+{
+    msg("Basic:");
+    char text[GB_PLAIN_CHUNK_SIZE + 4];
+    memset(text, 'a', sizeof(text));
+    memcpy(text, "plain text\r\n", 12);
+    /* Place non ASCII text in the second chunk */
+    memcpy(text + GB_PLAIN_CHUNK_SIZE, "\t\xC3\xA9x", 4);
+
+    ok(gb_add(buffer, text, sizeof(text)), "Add text to buffer");
+    ok(gb_plain_run(buffer, 0, SIZE_MAX) == 10 &&
+       gb_plain_run(buffer, 2, 3) == 3,
+       "Run ends before line ending or at limit");
+    ok(gb_plain_run(buffer, 12, SIZE_MAX) == GB_PLAIN_CHUNK_SIZE - 12,
+       "Run ends at chunk containing other characters");
+    ok(gb_plain_run(buffer, GB_PLAIN_CHUNK_SIZE + 3, SIZE_MAX) == 0,
+       "No run in chunk containing non ASCII text");
+    ok(gb_set_point(buffer, GB_PLAIN_CHUNK_SIZE) && gb_delete(buffer, 3) &&
+       gb_plain_run(buffer, 12, SIZE_MAX) == GB_PLAIN_CHUNK_SIZE - 11,
+       "Run continues after gap once non ASCII text deleted");
+    ok(gb_set_storage(buffer, GBS_PIECE_TABLE) &&
+       gb_plain_run(buffer, 0, SIZE_MAX) == 0,
+       "No runs in piece table");
+    ok(gb_set_storage(buffer, GBS_GAP) &&
+       plain_index_correct(buffer), "Index correct after conversion");
+}
+
+/* Check runs against a brute force scan after applying
+ * random edits to a buffer spanning many chunks */
+static void plain_index_random_edits(void)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    char *large = malloc(LARGE_INSERT_SIZE);
+
+    if (buffer == NULL || large == NULL) {
+        ok(0, "Random edits applied");
+        gb_free(buffer);
+        free(large);
+        return;
+    }
+
+    for (size_t k = 0; k < LARGE_INSERT_SIZE; k++) {
+        large[k] = (k % 97 == 0) ? '\n' : 'a' + (k % 26);
+    }
+
+    int success = gb_add(buffer, large, LARGE_INSERT_SIZE);
+    const char *snippets[] = { "x", "\r\n", "\t", "\xC3\xA9", "abc def" };
+    size_t snippet_num = sizeof(snippets) / sizeof(snippets[0]);
+    size_t point, length, snippet;
+
+    srand(1);
+
+    for (size_t k = 0; success && k < RANDOM_EDIT_NUM; k++) {
+        length = gb_length(buffer);
+        point = length == 0 ? 0 : (size_t)rand() % length;
+        snippet = (size_t)rand() % snippet_num;
+
+        success &= gb_set_point(buffer, point);
+
+        if (k % 3 == 0) {
+            success &= gb_delete(buffer, (size_t)rand() % 200);
+        } else if (k % 3 == 1) {
+            success &= gb_add(buffer, snippets[snippet],
+                              strlen(snippets[snippet]));
+        } else {
+            success &= gb_replace(buffer, 3, snippets[snippet],
+                                  strlen(snippets[snippet]));
+        }
+
+        if (k % 400 == 0) {
+            success &= plain_index_correct(buffer);
+        }
+    }
+
+    ok(success && plain_index_correct(buffer),
+       "Index matches text after random edits");
+
+    gb_free(buffer);
+    free(large);
+}
+
+/* A snapshot shares the index and keeps it
+ * when the original buffer is modified */
+static void plain_index_snapshot(void)
+{
+    GapBuffer *buffer = gb_new(GAP_INCREMENT);
+    GapBuffer *snapshot = NULL;
+    const char *str = "abc\ndef";
+
+    int success = buffer != NULL && gb_add(buffer, str, strlen(str)) &&
+                  (snapshot = gb_snapshot(buffer)) != NULL &&
+                  gb_set_point(buffer, 1) &&
+                  gb_insert(buffer, "\t", 1);
+
+    ok(success && gb_plain_run(buffer, 0, SIZE_MAX) == 0 &&
+       gb_plain_run(snapshot, 0, SIZE_MAX) == 3 &&
+       plain_index_correct(buffer) && plain_index_correct(snapshot),
+       "Snapshot index unaffected by edit");
+
+    gb_free(snapshot);
+    gb_free(buffer);
+}
+
+static size_t plain_run_ref(const GapBuffer *buffer, size_t point,
+                            size_t limit)
+{
+    size_t length = gb_length(buffer);
+    size_t run = 0;
+    unsigned char c;
+
+    while (point + run < length && run < limit) {
+        c = gb_getu_at(buffer, point + run);
+
+        if (c < 0x20 || c > 0x7E) {
+            break;
+        }
+
+        run++;
+    }
+
+    return run;
+}
+
+/* Check each chunk against its text ignoring the gap and
+ * that a run is only cut short by a chunk which isn't plain */
+static int plain_index_correct(const GapBuffer *buffer)
+{
+    size_t gap_size = buffer->gap_end - buffer->gap_start;
+    size_t start, end, internal, run;
+    unsigned char c;
+    int plain;
+
+    for (size_t k = 0; k < buffer->chunks; k++) {
+        start = k * GB_PLAIN_CHUNK_SIZE;
+        end = start + GB_PLAIN_CHUNK_SIZE;
+        end = end < buffer->allocated ? end : buffer->allocated;
+        plain = 1;
+
+        for (size_t pos = start; pos < end; pos++) {
+            if (pos >= buffer->gap_start && pos < buffer->gap_end) {
+                continue;
+            }
+
+            c = (unsigned char)buffer->text[pos];
+            plain &= (c >= 0x20 && c <= 0x7E) || c == '\n' || c == '\r';
+        }
+
+        if (!buffer->plain_chunks[k] != !plain) {
+            return 0;
+        }
+    }
+
+    for (size_t k = 0; k < gb_length(buffer); k++) {
+        run = gb_plain_run(buffer, k, SIZE_MAX);
+
+        if (run > plain_run_ref(buffer, k, SIZE_MAX)) {
+            return 0;
+        } else if (run < plain_run_ref(buffer, k, SIZE_MAX)) {
+            internal = k + run;
+
+            if (internal >= buffer->gap_start) {
+                internal += gap_size;
+            }
+
+            if (buffer->plain_chunks[internal / GB_PLAIN_CHUNK_SIZE]) {
+                return 0;
+            }
+        }
+    }
+
+    return gb_plain_run(buffer, gb_length(buffer), SIZE_MAX) == 0;
+}
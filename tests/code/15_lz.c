@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../lz.h"
+
+#define TEXT_SIZE (256 * 1024)
+
+static int lz_round_trip(const char *text, size_t length);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(7);
+
+    char *text = malloc(TEXT_SIZE);
+
+    if (!ok(text != NULL, "Allocate text")) {
+        return exit_status();
+    }
+
+    ok(lz_round_trip("", 0) && lz_round_trip("abc", 3),
+       "Text shorter than a match round trips");
+
+    /* Lines of code like text repeated with small variations */
+    for (size_t k = 0; k < TEXT_SIZE; k++) {
+        text[k] = "    int value = 0;\n"[k % 19] + (k % 1000 == 0);
+    }
+
+    ok(lz_round_trip(text, TEXT_SIZE), "Repetitive text round trips");
+
+    memset(text, 'a', TEXT_SIZE);
+    ok(lz_round_trip(text, TEXT_SIZE),
+       "Single character run with overlapping matches round trips");
+
+    srand(1);
+
+    for (size_t k = 0; k < TEXT_SIZE; k++) {
+        text[k] = (char)rand();
+    }
+
+    char *compressed = malloc(TEXT_SIZE);
+
+    if (compressed == NULL) {
+        free(text);
+        return exit_status();
+    }
+
+    ok(lz_compress(text, TEXT_SIZE, compressed, TEXT_SIZE) == 0,
+       "Random text doesn't fit in its own length");
+
+    memset(text, 'b', TEXT_SIZE);
+    size_t length = lz_compress(text, TEXT_SIZE, compressed, TEXT_SIZE);
+
+    ok(length > 0 && length < TEXT_SIZE / 100 &&
+       lz_decompress(compressed, length, text, TEXT_SIZE - 1) == 0,
+       "Decompressing to the wrong length fails");
+
+    /* Point the first match before the start of the text */
+    compressed[2] = (char)0xFF;
+    compressed[3] = (char)0xFF;
+
+    ok(lz_decompress(compressed, length, text, TEXT_SIZE) == 0 &&
+       lz_decompress(compressed, length / 2, text, TEXT_SIZE) == 0,
+       "Corrupt and truncated input is rejected");
+
+    free(compressed);
+    free(text);
+
+    return exit_status();
+}
+
+static int lz_round_trip(const char *text, size_t length)
+{
+    size_t dst_size = length + length / 255 + 16;
+    char *compressed = malloc(dst_size);
+    char *decompressed = malloc(length + 1);
+    int success = 0;
+
+    if (compressed != NULL && decompressed != NULL) {
+        size_t compressed_length = lz_compress(text, length, compressed,
+                                               dst_size);
+        success = compressed_length > 0 &&
+                  lz_decompress(compressed, compressed_length,
+                                decompressed, length) &&
+                  memcmp(text, decompressed, length) == 0;
+    }
+
+    free(compressed);
+    free(decompressed);
+
+    return success;
+}
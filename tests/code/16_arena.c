@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "tap.h"
+#include "../../arena.h"
+
+#define ALLOC_NUM 20000
+#define MAX_ALLOC_SIZE 1024
+
+static void arena_reuse(Arena *);
+static void arena_random(Arena *);
+static void arena_realloc(Arena *);
+static void arena_reclaim(Arena *);
+static void arena_child(Arena *);
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(13);
+
+    Arena arena;
+    ar_init(&arena);
+
+    arena_reuse(&arena);
+    arena_random(&arena);
+    arena_realloc(&arena);
+    arena_reclaim(&arena);
+    arena_child(&arena);
+
+    ar_release(&arena);
+    ok(arena.allocated == 0 && arena.blocks == NULL && arena.large == NULL,
+       "Release frees all allocations");
+
+    return exit_status();
+}
+
+static void arena_reuse(Arena *arena)
+{
+    msg("Reuse:");
+    void *small = ar_alloc(arena, 40);
+    void *other = ar_alloc(arena, 40);
+
+    ok(small != NULL && other != NULL && small != other &&
+       (uintptr_t)small % AR_ALIGNMENT == 0 &&
+       (uintptr_t)other % AR_ALIGNMENT == 0,
+       "Small allocations are distinct and aligned");
+
+    ar_free(arena, small, 40);
+
+    ok(ar_alloc(arena, 33) == small,
+       "Freed allocation reused for same size class");
+
+    size_t allocated = arena->allocated;
+    void *large = ar_alloc(arena, AR_MAX_SMALL_SIZE + 1);
+
+    ok(large != NULL && (uintptr_t)large % AR_ALIGNMENT == 0 &&
+       arena->allocated == allocated + AR_MAX_SMALL_SIZE + 1,
+       "Large allocation is aligned and counted");
+
+    ar_free(arena, large, AR_MAX_SMALL_SIZE + 1);
+
+    ok(arena->allocated == allocated && arena->large == NULL,
+       "Large allocation freed");
+}
+
+/* Fill allocations of random sizes with a pattern, free
+ * half then allocate again and check nothing overlaps */
+static void arena_random(Arena *arena)
+{
+    msg("Random:");
+    unsigned char **ptrs = malloc(sizeof(unsigned char *) * ALLOC_NUM);
+    size_t *sizes = malloc(sizeof(size_t) * ALLOC_NUM);
+    int success = ptrs != NULL && sizes != NULL;
+
+    srand(1);
+
+    for (size_t k = 0; success && k < ALLOC_NUM; k++) {
+        sizes[k] = 1 + (size_t)rand() % MAX_ALLOC_SIZE;
+        ptrs[k] = ar_alloc(arena, sizes[k]);
+        success = ptrs[k] != NULL;
+
+        if (success) {
+            memset(ptrs[k], (int)(k & 0xFF), sizes[k]);
+        }
+    }
+
+    for (size_t k = 0; success && k < ALLOC_NUM; k += 2) {
+        ar_free(arena, ptrs[k], sizes[k]);
+        sizes[k] = 1 + (size_t)rand() % MAX_ALLOC_SIZE;
+        ptrs[k] = ar_alloc(arena, sizes[k]);
+        success = ptrs[k] != NULL;
+
+        if (success) {
+            memset(ptrs[k], (int)(k & 0xFF), sizes[k]);
+        }
+    }
+
+    for (size_t k = 0; success && k < ALLOC_NUM; k++) {
+        for (size_t i = 0; i < sizes[k]; i++) {
+            if (ptrs[k][i] != (k & 0xFF)) {
+                success = 0;
+                break;
+            }
+        }
+    }
+
+    ok(success, "Allocations don't overlap after reuse");
+
+    free(ptrs);
+    free(sizes);
+}
+
+static void arena_realloc(Arena *arena)
+{
+    msg("Realloc:");
+    char *str = ar_alloc(arena, 10);
+    int success = str != NULL;
+
+    if (success) {
+        memcpy(str, "0123456789", 10);
+    }
+
+    /* Grow through small and large sizes keeping the contents */
+    size_t size = 10;
+
+    for (size_t new_size = 20; success && new_size < 4096; new_size *= 2) {
+        str = ar_realloc(arena, str, size, new_size);
+        success = str != NULL && memcmp(str, "0123456789", 10) == 0;
+        size = new_size;
+    }
+
+    ok(success, "Contents kept as allocation grows");
+
+    str = ar_realloc(arena, str, size, 10);
+    success &= str != NULL && memcmp(str, "0123456789", 10) == 0;
+    ar_free(arena, str, 10);
+
+    ok(success, "Contents kept as allocation shrinks");
+}
+
+/* Blocks are released once everything allocated from them is freed,
+ * except for one block of each size class kept for reuse */
+static void arena_reclaim(Arena *arena)
+{
+    msg("Reclaim:");
+    size_t alloc_num = AR_BLOCK_SIZE / 48 * 8;
+    void **ptrs = malloc(sizeof(void *) * alloc_num);
+    size_t allocated = arena->allocated;
+    int success = ptrs != NULL;
+
+    for (size_t k = 0; success && k < alloc_num; k++) {
+        ptrs[k] = ar_alloc(arena, 48);
+        success = ptrs[k] != NULL;
+    }
+
+    ok(success && arena->allocated >= allocated + AR_BLOCK_SIZE * 7,
+       "Blocks allocated");
+
+    /* Free alternate allocations first so no block empties until
+     * the second pass, leaving every block with space at once */
+    for (size_t k = 0; success && k < alloc_num; k += 2) {
+        ar_free(arena, ptrs[k], 48);
+    }
+
+    for (size_t k = 1; success && k < alloc_num; k += 2) {
+        ar_free(arena, ptrs[k], 48);
+    }
+
+    ok(success && arena->allocated <= allocated + AR_BLOCK_SIZE,
+       "Blocks released when their allocations are freed");
+
+    free(ptrs);
+}
+
+static void arena_child(Arena *arena)
+{
+    msg("Child:");
+    Arena *child = ar_new_child(arena);
+    void *small = NULL, *large = NULL;
+
+    if (child != NULL) {
+        small = ar_alloc(child, 48);
+        large = ar_alloc(child, AR_MAX_SMALL_SIZE * 2);
+    }
+
+    ok(small != NULL && large != NULL && arena->children == child &&
+       ar_owner(child, sizeof(Arena)) == arena &&
+       ar_owner(small, 48) == child &&
+       ar_owner(large, AR_MAX_SMALL_SIZE * 2) == child,
+       "Child arena allocations belong to child");
+
+    void *parent_small = ar_alloc(arena, 48);
+
+    ok(parent_small != NULL && ar_owner(parent_small, 48) == arena,
+       "Parent allocations belong to parent");
+
+    ar_free(arena, parent_small, 48);
+    ar_free_child(arena, child);
+
+    ok(arena->children == NULL, "Child arena released");
+}
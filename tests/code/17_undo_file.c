@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tap.h"
+#include "../../undo_file.h"
+
+#define SEGMENT_TEXT_SIZE 64
+
+static void undo_file_hash(void);
+static void undo_file_append(void);
+static void undo_file_torn_segment(void);
+static void undo_file_rewrite(void);
+static void undo_file_mismatch(void);
+static int save(UndoFile *, const char *file_text, const char *changes,
+                int rewrite);
+static Status load_segment(void *context, const char *changes,
+                           size_t length);
+static int load_equals(const char *file_text, const char *expected);
+static uint64_t hash_text(const char *text);
+static uint64_t hash_bytes(const char *text, size_t length);
+static int write_file(const char *path, const char *text);
+static size_t file_size(const char *path);
+
+static char file_path[] = "/tmp/wed_undo_file_testXXXXXX";
+static char *undo_path;
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(12);
+
+    int fd = mkstemp(file_path);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    undo_path = uf_undo_path(file_path);
+
+    if (!ok(fd != -1 && undo_path != NULL &&
+            write_file(file_path, "Hello\n"), "Create test file")) {
+        return exit_status();
+    }
+
+    undo_file_hash();
+    undo_file_append();
+    undo_file_torn_segment();
+    undo_file_rewrite();
+    undo_file_mismatch();
+
+    remove(undo_path);
+    remove(file_path);
+    free(undo_path);
+
+    return exit_status();
+}
+
+static void undo_file_hash(void)
+{
+    msg("Hash:");
+    const char *text = "The quick brown fox jumps over the lazy dog";
+    size_t length = strlen(text);
+    uint64_t hash = hash_text(text);
+    int same = 1;
+
+    /* Text is split differently between segments of a gap buffer */
+    for (size_t split = 0; split <= length; split++) {
+        UndoFileHash content_hash;
+        uf_hash_init(&content_hash);
+        uf_hash_update(&content_hash, text, split / 3);
+        uf_hash_update(&content_hash, text + split / 3, split - split / 3);
+        uf_hash_update(&content_hash, text + split, length - split);
+        same &= uf_hash_final(&content_hash) == hash;
+    }
+
+    ok(same, "Hash doesn't depend on how text is split");
+    ok(hash_bytes("abcdefgh", 8) != hash_bytes("abcdefgh", 9) &&
+       hash_text("Hello\n") != hash_text("Hello!"),
+       "Different text hashes differently");
+}
+
+/* Each save appends a segment, leaving earlier segments in place */
+static void undo_file_append(void)
+{
+    msg("Append:");
+    UndoFile *undo_file = NULL;
+
+    if (!ok(STATUS_IS_SUCCESS(uf_new(&undo_file, file_path)) &&
+            access(undo_path, F_OK) == -1,
+            "Undo file not created until first save")) {
+        return;
+    }
+
+    struct stat file_stat;
+    stat(file_path, &file_stat);
+    uf_attach(undo_file, &file_stat);
+
+    int saved = save(undo_file, "Hello world\n", "first", 0);
+    size_t first_size = file_size(undo_path);
+    saved &= save(undo_file, "Hello big world\n", "second", 0);
+
+    ok(saved && file_size(undo_path) > first_size,
+       "Saves append to undo file");
+    uf_free(undo_file);
+
+    ok(load_equals("Hello big world\n", "first|second|"),
+       "Reopened file loads history oldest first");
+    ok(load_equals("Hello world\n", ""),
+       "Content that doesn't match the last save loads nothing");
+}
+
+/* A segment partially written is ignored along with anything after */
+static void undo_file_torn_segment(void)
+{
+    msg("Torn segment:");
+    size_t size = file_size(undo_path);
+    int fd = open(undo_path, O_WRONLY | O_APPEND);
+    char torn[] = { 100, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5 };
+
+    if (fd != -1) {
+        write(fd, torn, sizeof(torn));
+        close(fd);
+    }
+
+    ok(file_size(undo_path) == size + sizeof(torn) &&
+       load_equals("Hello big world\n", "first|second|"),
+       "Torn segment ignored");
+
+    UndoFile *undo_file = NULL;
+    struct stat file_stat;
+
+    stat(file_path, &file_stat);
+    uf_new(&undo_file, file_path);
+    uf_attach(undo_file, &file_stat);
+
+    ok(save(undo_file, "Hello big world!\n", "third", 0) &&
+       load_equals("Hello big world!\n", "first|second|third|"),
+       "Torn segment replaced by next save");
+
+    uf_free(undo_file);
+}
+
+/* History that diverges after loading replaces the segments written
+ * since the oldest change in memory */
+static void undo_file_rewrite(void)
+{
+    msg("Rewrite:");
+    UndoFile *undo_file = NULL;
+    struct stat file_stat;
+    char history[SEGMENT_TEXT_SIZE * 4] = "";
+
+    stat(file_path, &file_stat);
+    uf_new(&undo_file, file_path);
+    uf_attach(undo_file, &file_stat);
+    save(undo_file, "Hello big world!!\n", "fourth", 0);
+
+    /* Nothing is written by earlier sessions until history is loaded */
+    ok(save(undo_file, "Hello big world?\n", "third,fourth", 1) &&
+       load_equals("Hello big world?\n",
+                   "first|second|third|third,fourth|"),
+       "Rewrite keeps history of earlier sessions");
+
+    /* Loaded once the buffer is back to the content it was opened with */
+    uf_load(undo_file, hash_text("Hello big world!\n"), load_segment,
+            history);
+    save(undo_file, "Hello\n", "all", 1);
+
+    ok(load_equals("Hello\n", "all|"),
+       "Rewrite after loading replaces all history");
+
+    uf_free(undo_file);
+}
+
+/* History is discarded once the file is changed by something else */
+static void undo_file_mismatch(void)
+{
+    msg("Mismatch:");
+    write_file(file_path, "Changed elsewhere\n");
+
+    UndoFile *undo_file = NULL;
+    struct stat file_stat;
+
+    stat(file_path, &file_stat);
+    uf_new(&undo_file, file_path);
+    uf_attach(undo_file, &file_stat);
+    save(undo_file, "Changed\n", "new", 0);
+    uf_free(undo_file);
+
+    ok(load_equals("Changed\n", "new|"),
+       "Undo file started again when file changed elsewhere");
+}
+
+/* Write file_text to the file then record changes in the undo file */
+static int save(UndoFile *undo_file, const char *file_text,
+                const char *changes, int rewrite)
+{
+    struct stat file_stat;
+
+    if (!write_file(file_path, file_text) ||
+        stat(file_path, &file_stat) == -1) {
+        return 0;
+    }
+
+    Status status = uf_append(undo_file, &file_stat, hash_text(file_text),
+                              changes, strlen(changes), rewrite);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        st_free_status(status);
+        return 0;
+    }
+
+    return 1;
+}
+
+static Status load_segment(void *context, const char *changes,
+                           size_t length)
+{
+    char *history = context;
+    size_t history_length = strlen(history);
+
+    if (history_length + length + 2 <= SEGMENT_TEXT_SIZE * 4) {
+        memcpy(history + history_length, changes, length);
+        memcpy(history + history_length + length, "|", 2);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Open the file as a new session would and load its history */
+static int load_equals(const char *file_text, const char *expected)
+{
+    UndoFile *undo_file = NULL;
+    struct stat file_stat;
+    char history[SEGMENT_TEXT_SIZE * 4] = "";
+
+    if (stat(file_path, &file_stat) == -1 ||
+        !STATUS_IS_SUCCESS(uf_new(&undo_file, file_path))) {
+        return 0;
+    }
+
+    Status status = uf_attach(undo_file, &file_stat);
+
+    if (STATUS_IS_SUCCESS(status)) {
+        status = uf_load(undo_file, hash_text(file_text), load_segment,
+                         history);
+    }
+
+    uf_free(undo_file);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        st_free_status(status);
+        return 0;
+    }
+
+    return strcmp(history, expected) == 0;
+}
+
+static uint64_t hash_text(const char *text)
+{
+    return hash_bytes(text, strlen(text));
+}
+
+static uint64_t hash_bytes(const char *text, size_t length)
+{
+    UndoFileHash content_hash;
+    uf_hash_init(&content_hash);
+    uf_hash_update(&content_hash, text, length);
+    return uf_hash_final(&content_hash);
+}
+
+static int write_file(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    size_t length = strlen(text);
+    int success = fwrite(text, 1, length, file) == length;
+
+    return fclose(file) == 0 && success;
+}
+
+static size_t file_size(const char *path)
+{
+    struct stat file_stat;
+
+    if (stat(path, &file_stat) == -1) {
+        return 0;
+    }
+
+    return file_stat.st_size;
+}
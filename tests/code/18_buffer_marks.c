@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "../../buffer.h"
+#include "../../config.h"
+#include "../../hashmap.h"
+#include "../../util.h"
+
+#define MARK_NUM 64
+#define EDIT_NUM 500
+#define BATCH_NUM 50
+#define BATCH_EDITS 24
+#define REGION_START 1024
+#define REGION_SIZE 512
+
+static void buffer_marks_edits(Buffer *);
+static void buffer_marks_moved(Buffer *);
+static void buffer_marks_batches(Buffer *);
+static int apply_batch(Buffer *, int order);
+static size_t next_edit(int order, size_t prev_offset, size_t length,
+                        int is_insert, BufferEdit *);
+static void map_offsets(size_t *expected, const MarkProperties *,
+                        const BufferEdit *);
+static int check_marks(const BufferPos *, const size_t *expected);
+
+static BufferPos positions[MARK_NUM];
+static size_t offsets[MARK_NUM];
+static BufferPos batch_positions[MARK_NUM];
+static size_t batch_offsets[MARK_NUM];
+static MarkProperties batch_props[MARK_NUM];
+static char insert_text[] = "abcdefgh";
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(10);
+
+    HashMap *config = new_hashmap();
+    Buffer *buffer = NULL;
+
+    if (config != NULL && cf_populate_config(NULL, config, CL_SESSION)) {
+        buffer = bf_new_empty("marks", config);
+    }
+
+    if (!ok(buffer != NULL, "Create buffer")) {
+        return exit_status();
+    }
+
+    buffer_marks_edits(buffer);
+    buffer_marks_moved(buffer);
+    buffer_marks_batches(buffer);
+
+    bf_free(buffer);
+    cf_free_config(config);
+
+    return exit_status();
+}
+
+/* Random inserts and deletes are made with marks spread throughout
+ * the buffer. Each mark is compared with an offset updated the same
+ * way after every edit */
+static void buffer_marks_edits(Buffer *buffer)
+{
+    msg("Edits:");
+    char text[4096];
+
+    for (size_t k = 0; k < sizeof(text); k++) {
+        text[k] = k % 40 == 39 ? '\n' : 'a' + k % 26;
+    }
+
+    bf_insert_string(buffer, text, sizeof(text), 0);
+    srand(21);
+
+    int added = 1;
+
+    for (size_t k = 0; k < MARK_NUM && added; k++) {
+        offsets[k] = (size_t)rand() % (sizeof(text) + 1);
+        positions[k] = bp_init_from_offset(offsets[k], &buffer->pos);
+        added = STATUS_IS_SUCCESS(bf_add_new_mark(buffer, &positions[k],
+                                                  MP_NONE));
+    }
+
+    ok(added, "Add marks");
+
+    Status status = bf_add_new_mark(buffer, &positions[MARK_NUM / 2],
+                                    MP_NONE);
+    ok(!STATUS_IS_SUCCESS(status), "Duplicate mark found");
+    st_free_status(status);
+
+    int valid = 1;
+    size_t offset, length, buffer_len;
+    BufferPos pos;
+
+    for (size_t k = 0; k < EDIT_NUM && valid; k++) {
+        buffer_len = bf_length(buffer);
+        offset = (size_t)rand() % (buffer_len + 1);
+        length = 1 + (size_t)rand() % 64;
+        pos = bp_init_from_offset(offset, &buffer->pos);
+        bf_set_bp(buffer, &pos);
+
+        if (rand() % 2 == 0 || offset == buffer_len) {
+            bf_insert_string(buffer, text, length, 0);
+
+            for (size_t j = 0; j < MARK_NUM; j++) {
+                if (offsets[j] >= offset) {
+                    offsets[j] += length;
+                }
+            }
+        } else {
+            length = MIN(length, buffer_len - offset);
+            bf_delete(buffer, length);
+
+            for (size_t j = 0; j < MARK_NUM; j++) {
+                if (offsets[j] >= offset + length) {
+                    offsets[j] -= length;
+                } else if (offsets[j] > offset) {
+                    offsets[j] = offset;
+                }
+            }
+        }
+
+        valid = check_marks(positions, offsets);
+    }
+
+    ok(valid, "Marks updated by inserts and deletes");
+}
+
+/* A mark moved directly by its owner from the start of the buffer
+ * to the end is found and updated once the buffer has been told */
+static void buffer_marks_moved(Buffer *buffer)
+{
+    msg("Moved:");
+    size_t first = 0;
+
+    for (size_t k = 1; k < MARK_NUM; k++) {
+        if (offsets[k] < offsets[first]) {
+            first = k;
+        }
+    }
+
+    size_t buffer_len = bf_length(buffer);
+    positions[first] = bp_init_from_offset(buffer_len, &buffer->pos);
+    offsets[first] = buffer_len;
+    bf_marks_moved(buffer);
+
+    Status status = bf_add_new_mark(buffer, &positions[first], MP_NONE);
+    ok(!STATUS_IS_SUCCESS(status), "Moved mark found");
+    st_free_status(status);
+
+    size_t offset = buffer_len / 2;
+    BufferPos pos = bp_init_from_offset(offset, &buffer->pos);
+    bf_set_bp(buffer, &pos);
+    bf_insert_string(buffer, "new\n", 4, 0);
+
+    for (size_t k = 0; k < MARK_NUM; k++) {
+        if (offsets[k] >= offset) {
+            offsets[k] += 4;
+        }
+    }
+
+    ok(check_marks(positions, offsets), "Moved mark updated by insert");
+}
+
+/* Batches of edits made in order of offset, in reverse order and in no
+ * order are each applied at once. Offsets are multiples of 4 so edits
+ * often start where marks are, and half the marks aren't moved by an
+ * insert at their offset. The text, the deleted text, the marks and the
+ * cursor are compared with the result of applying each edit in turn */
+static void buffer_marks_batches(Buffer *buffer)
+{
+    msg("Batches:");
+    int added = 1;
+
+    for (size_t k = 0; k < MARK_NUM && added; k++) {
+        batch_offsets[k] = REGION_START + 4 * ((size_t)rand() %
+                                               (REGION_SIZE / 4));
+        batch_props[k] = k % 2 == 0 ? MP_NONE : MP_NO_ADJUST_ON_BUFFER_POS;
+        batch_positions[k] = bp_init_from_offset(batch_offsets[k],
+                                                 &buffer->pos);
+        added = STATUS_IS_SUCCESS(bf_add_new_mark(buffer, &batch_positions[k],
+                                                  batch_props[k]));
+    }
+
+    ok(added, "Add marks at edit offsets");
+
+    const char *orders[] = {
+        "Batches made in order of offset",
+        "Batches made in reverse order of offset",
+        "Batches made in no order"
+    };
+
+    for (int order = 0; order < 3; order++) {
+        int valid = 1;
+
+        for (size_t k = 0; k < BATCH_NUM && valid; k++) {
+            valid = apply_batch(buffer, order);
+        }
+
+        ok(valid, "%s", orders[order]);
+    }
+}
+
+static int apply_batch(Buffer *buffer, int order)
+{
+    size_t length = bf_length(buffer);
+    char *text = malloc(length + BATCH_EDITS * 8);
+    char *result = malloc(length + BATCH_EDITS * 8);
+    char deleted[BATCH_EDITS][8];
+    char expected_deleted[BATCH_EDITS][8];
+    BufferEdit edits[BATCH_EDITS];
+    BufferEdit *edit;
+    size_t edit_num = 0;
+    size_t offset = order == 1 ? REGION_START + REGION_SIZE : REGION_START;
+    int valid = 0;
+
+    if (text == NULL || result == NULL) {
+        goto cleanup;
+    }
+
+    gb_get_range(buffer->data, 0, text, length);
+
+    for (size_t k = 0; k < BATCH_EDITS; k++) {
+        edit = &edits[edit_num];
+        int is_insert = rand() % 2;
+        offset = next_edit(order, offset, 4 + 4 * (size_t)(rand() % 2),
+                           is_insert, edit);
+
+        if (edit->offset > length ||
+            (!is_insert && edit->length > length - edit->offset)) {
+            break;
+        } else if (is_insert) {
+            memmove(text + edit->offset + edit->length, text + edit->offset,
+                    length - edit->offset);
+            memcpy(text + edit->offset, edit->text, edit->length);
+            length += edit->length;
+        } else {
+            memcpy(expected_deleted[edit_num], text + edit->offset,
+                   edit->length);
+            memmove(text + edit->offset, text + edit->offset + edit->length,
+                    length - edit->offset - edit->length);
+            edit->text = deleted[edit_num];
+            length -= edit->length;
+        }
+
+        map_offsets(offsets, NULL, edit);
+        map_offsets(batch_offsets, batch_props, edit);
+        edit_num++;
+    }
+
+    if (edit_num == 0) {
+        valid = 1;
+        goto cleanup;
+    }
+
+    if (!STATUS_IS_SUCCESS(bf_apply_edits(buffer, edits, edit_num)) ||
+        bf_length(buffer) != length) {
+        goto cleanup;
+    }
+
+    gb_get_range(buffer->data, 0, result, length);
+    valid = memcmp(text, result, length) == 0 &&
+            check_marks(positions, offsets) &&
+            check_marks(batch_positions, batch_offsets) &&
+            buffer->pos.offset == edits[edit_num - 1].offset;
+
+    for (size_t k = 0; k < edit_num && valid; k++) {
+        if (edits[k].change_type == TCT_DELETE) {
+            valid = memcmp(deleted[k], expected_deleted[k],
+                           edits[k].length) == 0;
+        }
+    }
+
+cleanup:
+    free(text);
+    free(result);
+
+    return valid;
+}
+
+/* Create an edit positioned according to order relative to the previous
+ * edit and return the offset the edit after it is positioned from */
+static size_t next_edit(int order, size_t prev_offset, size_t length,
+                        int is_insert, BufferEdit *edit)
+{
+    size_t gap = 4 * (size_t)(rand() % 4);
+
+    *edit = (BufferEdit) {
+        .change_type = is_insert ? TCT_INSERT : TCT_DELETE,
+        .length = length,
+        .text = is_insert ? insert_text : NULL
+    };
+
+    if (order == 0) {
+        /* At or after the end of the previous edit */
+        edit->offset = prev_offset + gap;
+        return edit->offset + (is_insert ? length : 0);
+    } else if (order == 1) {
+        /* Entirely before the previous edit */
+        size_t before = gap + (is_insert ? 0 : length);
+        edit->offset = prev_offset - MIN(before, prev_offset);
+        return edit->offset;
+    }
+
+    edit->offset = REGION_START + 4 * ((size_t)rand() % (REGION_SIZE / 4));
+
+    return edit->offset;
+}
+
+/* Update expected mark offsets for an edit, not moving marks with
+ * MP_NO_ADJUST_ON_BUFFER_POS set which are at an insert */
+static void map_offsets(size_t *expected, const MarkProperties *props,
+                        const BufferEdit *edit)
+{
+    for (size_t k = 0; k < MARK_NUM; k++) {
+        if (expected[k] < edit->offset) {
+            continue;
+        } else if (edit->change_type == TCT_INSERT) {
+            if (props == NULL || !(props[k] & MP_NO_ADJUST_ON_BUFFER_POS) ||
+                expected[k] != edit->offset) {
+                expected[k] += edit->length;
+            }
+        } else if (expected[k] < edit->offset + edit->length) {
+            expected[k] = edit->offset;
+        } else {
+            expected[k] -= edit->length;
+        }
+    }
+}
+
+static int check_marks(const BufferPos *marked, const size_t *expected)
+{
+    for (size_t k = 0; k < MARK_NUM; k++) {
+        if (marked[k].offset != expected[k]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tap.h"
+#include "../../session.h"
+#include "../../tabbed_view.h"
+#include "../../util.h"
+
+#define LINE_LENGTH 80
+#define LINE_NUM (64 * 1024)
+/* The blocks drawing may index, which cover the detected file format
+ * lines (see bf_detect_fileformat) and the first screen */
+#define VISIBLE_BLOCKS 16
+
+static int create_file(void);
+static void mapped_file_draw(Session *, Buffer *);
+static void mapped_file_count(Session *, Buffer *);
+static void sleep_ms(long ms);
+
+static char file_path[] = "/tmp/wed_mapped_draw_testXXXXXX";
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    plan(8);
+
+    Session *sess = se_new();
+    WedOpt wed_opt = { .test_mode = 1 };
+    FileInfo file_info;
+    Buffer *buffer = NULL;
+    int created = create_file();
+
+    /* The UI is initialised as by ip_edit, which in test mode
+     * doesn't use the terminal */
+    if (created && sess != NULL && se_init(sess, &wed_opt, NULL, 0) &&
+        STATUS_IS_SUCCESS(sess->ui->init(sess->ui)) &&
+        STATUS_IS_SUCCESS(fi_init(&file_info, file_path))) {
+        buffer = bf_new(&file_info, sess->config);
+    }
+
+    if (!ok(buffer != NULL, "Create session and buffer")) {
+        if (created) {
+            remove(file_path);
+        }
+
+        return exit_status();
+    }
+
+    Status status = bf_load_file_async(buffer, -1);
+    int loaded = STATUS_IS_SUCCESS(status) && gb_is_mapped(buffer->data) &&
+                 se_add_buffer(sess, buffer) &&
+                 se_set_active_buffer(sess, sess->buffer_num - 1);
+    st_free_status(status);
+
+    if (ok(loaded && bf_counting_lines(buffer), "Map file and count lines")) {
+        mapped_file_draw(sess, buffer);
+        mapped_file_count(sess, buffer);
+    }
+
+    remove(file_path);
+    se_free(sess);
+
+    return exit_status();
+}
+
+static int create_file(void)
+{
+    int fd = mkstemp(file_path);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    char line[LINE_LENGTH];
+    memset(line, 'a', LINE_LENGTH - 1);
+    line[LINE_LENGTH - 1] = '\n';
+    int written = 1;
+
+    for (size_t k = 0; k < LINE_NUM && written; k++) {
+        written = write(fd, line, LINE_LENGTH) == LINE_LENGTH;
+    }
+
+    close(fd);
+
+    if (!written) {
+        remove(file_path);
+    }
+
+    return written;
+}
+
+/* Lines counted by the worker aren't collected here, so only
+ * blocks indexed by drawing on the main thread are indexed */
+static void mapped_file_draw(Session *sess, Buffer *buffer)
+{
+    msg("Draw:");
+    TabbedView tv;
+    tv_init(&tv, 24, 80);
+    Status status = tv_update(&tv, sess);
+    GBLazyIndex *lazy = buffer->data->lazy;
+
+    ok(STATUS_IS_SUCCESS(status) && lazy != NULL &&
+       lazy->indexed <= VISIBLE_BLOCKS,
+       "Drawing doesn't index past the visible blocks");
+    ok(strstr(tv.status_bar[2], "Top") != NULL,
+       "Status bar shows position before lines are counted");
+    ok(!bp_at_last_line(&buffer->pos) && lazy->indexed <= VISIBLE_BLOCKS,
+       "Checking for last line doesn't index all blocks");
+
+    st_free_status(status);
+    tv_free(&tv);
+}
+
+static void mapped_file_count(Session *sess, Buffer *buffer)
+{
+    msg("Count:");
+    Status status = STATUS_SUCCESS;
+
+    for (size_t k = 0; k < 5000 && bf_counting_lines(buffer); k++) {
+        sleep_ms(1);
+        status = bf_continue_line_count(buffer);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    int complete;
+    size_t lines = bf_known_lines(buffer, &complete);
+
+    ok(STATUS_IS_SUCCESS(status) && !bf_counting_lines(buffer),
+       "Lines counted in background");
+    ok(complete && lines == LINE_NUM + 1 &&
+       gb_is_mapped(buffer->data) && buffer->data->lazy->indexed ==
+       buffer->data->blocks,
+       "Counted lines index mapped text");
+
+    TabbedView tv;
+    tv_init(&tv, 24, 80);
+    st_free_status(tv_update(&tv, sess));
+
+    ok(strstr(tv.status_bar[2], "Top") != NULL &&
+       gb_line_start(buffer->data, LINE_NUM - 1) ==
+       (LINE_NUM - 1) * LINE_LENGTH,
+       "Line starts found from counted lines");
+
+    st_free_status(status);
+    tv_free(&tv);
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec duration = { 0, ms * 1000000 };
+    nanosleep(&duration, NULL);
+}
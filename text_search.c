@@ -34,6 +34,9 @@ static int ts_find_next_str(const GapBuffer *, size_t point, size_t *next,
 static int ts_find_next_str_in_range(const char *text, size_t *start_point,
                                      size_t limit, size_t *next,
                                      const TextSearch *);
+static int ts_find_next_str_in_pieces(const GapBuffer *, size_t point,
+                                      size_t *next, size_t limit,
+                                      const TextSearch *);
 static void ts_populate_bad_char_table(size_t bad_char_table[ALPHABET_SIZE],
                                        const char *pattern, size_t pattern_len);
 static void ts_update_search_chars(int case_insensitive);
@@ -88,6 +91,15 @@ Status ts_init(TextSearch *search, const SearchOptions *opt)
         return OUT_OF_MEMORY("Unable to copy pattern");
     }
 
+    /* Holds text either side of a boundary between pieces */
+    search->window = malloc(opt->pattern_len * 2);
+
+    if (search->window == NULL) {
+        free(search->pattern);
+        search->pattern = NULL;
+        return OUT_OF_MEMORY("Unable to allocate search window");
+    }
+
     memcpy(search->pattern, opt->pattern, opt->pattern_len);
     search->pattern[opt->pattern_len] = '\0';
 
@@ -119,6 +131,8 @@ void ts_free(TextSearch *search)
 {
     free(search->pattern);
     search->pattern = NULL;
+    free(search->window);
+    search->window = NULL;
 }
 
 Status ts_find_next(TextSearch *search, const SearchOptions *opt,
@@ -282,6 +296,11 @@ static int ts_find_next_str(const GapBuffer *buffer, size_t point,
         limit = buffer_len;
     }
 
+    if (gb_get_storage(buffer) == GBS_PIECE_TABLE) {
+        return ts_find_next_str_in_pieces(buffer, point, next, limit,
+                                          search);
+    }
+
     size_t limit_ext = limit;
     point = ts_gb_internal_point(buffer, point);
     limit = ts_gb_internal_point(buffer, limit);
@@ -347,6 +366,63 @@ static int ts_find_next_str(const GapBuffer *buffer, size_t point,
     return 0;
 }
 
+/* Text stored in a piece table is searched a piece at a time in place.
+ * Matches spanning pieces are found by searching a window holding the
+ * last pattern_len - 1 bytes before each piece followed by the start
+ * of the piece. A match starting in the first part of the window must
+ * span the boundary as any earlier match would have already been found */
+static int ts_find_next_str_in_pieces(const GapBuffer *buffer, size_t point,
+                                      size_t *next, size_t limit,
+                                      const TextSearch *search)
+{
+    size_t overlap = search->pattern_len - 1;
+    char *window = search->window;
+    size_t tail = 0;
+    size_t segment_point, segment_length, bridge_length, window_point;
+    const char *segment;
+    GBSegmentIter iter;
+
+    gb_segment_iter_init(&iter, buffer, point, limit - point);
+
+    while (gb_segment_iter_next(&iter, &segment, &segment_length)) {
+        if (tail > 0) {
+            bridge_length = MIN(segment_length, overlap);
+            memcpy(window + tail, segment, bridge_length);
+            window_point = 0;
+
+            if (ts_find_next_str_in_range(window, &window_point,
+                                          tail + bridge_length, next,
+                                          search) && *next < tail) {
+                *next += point - tail;
+                return 1;
+            }
+        }
+
+        segment_point = 0;
+
+        if (ts_find_next_str_in_range(segment, &segment_point,
+                                      segment_length, next, search)) {
+            *next += point;
+            return 1;
+        }
+
+        /* Keep the text a match spanning the next piece could start in */
+        if (segment_length >= overlap) {
+            tail = overlap;
+            memcpy(window, segment + segment_length - overlap, overlap);
+        } else {
+            size_t keep = MIN(tail, overlap - segment_length);
+            memmove(window, window + tail - keep, keep);
+            memcpy(window + keep, segment, segment_length);
+            tail = keep + segment_length;
+        }
+
+        point += segment_length;
+    }
+
+    return 0;
+}
+
 /* Search string using Boyer–Moore–Horspool algorithm */
 static int ts_find_next_str_in_range(const char *text, size_t *start_point,
                                      size_t limit, size_t *next,
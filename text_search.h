@@ -41,6 +41,7 @@ typedef struct {
     size_t bad_char_table[ALPHABET_SIZE]; /* Array populated with pattern
                                              shift lengths for each character
                                              in the alphabet */
+    char *window; /* Text either side of a boundary between pieces */
 } TextSearch;
 
 Status ts_init(TextSearch *, const SearchOptions *);
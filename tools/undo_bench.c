@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Times undoing and redoing a replace all made as a single grouped
+ * change. Build with "make tools/undo_bench" and run as:
+ *
+ *     tools/undo_bench [LINES] [MATCHES]
+ *
+ * LINES is the number of lines which each contain one match (default
+ * 100000) and MATCHES the number of matches on a single line (default
+ * LINES / 10). The undone and redone text is checked against the text
+ * before and after the replace */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../buffer.h"
+#include "../config.h"
+#include "../hashmap.h"
+#include "../undo.h"
+
+#define UNIT "foo bar"
+
+static int run(const char *name, size_t match_num, int one_line);
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    size_t lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t matches = argc > 2 ? strtoul(argv[2], NULL, 10) : lines / 10;
+
+    int valid = run("lines", lines, 0);
+    valid = run("one-line", matches, 1) && valid;
+
+    return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Replace "foo" with "bazz" in match_num copies of UNIT, which are
+ * separated by spaces when one_line is set and new lines otherwise */
+static int run(const char *name, size_t match_num, int one_line)
+{
+    HashMap *config = new_hashmap();
+    Buffer *buffer = NULL;
+
+    if (config != NULL && cf_populate_config(NULL, config, CL_SESSION)) {
+        buffer = bf_new_empty(name, config);
+    }
+
+    size_t unit_len = sizeof(UNIT);
+    size_t length = match_num * unit_len;
+    char *text = malloc(length + 1);
+
+    if (buffer == NULL || text == NULL) {
+        fprintf(stderr, "Unable to create buffer\n");
+        free(text);
+        bf_free(buffer);
+        cf_free_config(config);
+        return 0;
+    }
+
+    for (size_t k = 0; k < match_num; k++) {
+        memcpy(text + k * unit_len, UNIT, unit_len - 1);
+        text[(k + 1) * unit_len - 1] = one_line ? ' ' : '\n';
+    }
+
+    text[length] = '\n';
+
+    /* The initial text isn't part of the history */
+    bc_disable(&buffer->changes);
+    bf_insert_string(buffer, text, length + 1, 0);
+    bc_enable(&buffer->changes);
+    bf_to_buffer_start(buffer, 0);
+
+    char *original = bf_to_string(buffer);
+    size_t offset = 0;
+    BufferPos pos;
+
+    double replace_start = now();
+    bc_start_grouped_changes(&buffer->changes);
+
+    for (size_t k = 0; k < match_num; k++) {
+        pos = bp_init_from_offset(offset, &buffer->pos);
+        bf_set_bp(buffer, &pos);
+        bf_replace_string(buffer, 3, "bazz", 4, 1);
+        offset += unit_len + 1;
+    }
+
+    bc_end_grouped_changes(&buffer->changes);
+    double replace_end = now();
+    char *replaced = bf_to_string(buffer);
+
+    double undo_start = now();
+    Status undo_status = bc_undo(&buffer->changes, buffer);
+    double undo_end = now();
+    char *undone = bf_to_string(buffer);
+
+    double redo_start = now();
+    Status redo_status = bc_redo(&buffer->changes, buffer);
+    double redo_end = now();
+    char *redone = bf_to_string(buffer);
+
+    int valid = STATUS_IS_SUCCESS(undo_status) &&
+                STATUS_IS_SUCCESS(redo_status) &&
+                original != NULL && replaced != NULL &&
+                undone != NULL && redone != NULL &&
+                strcmp(undone, original) == 0 &&
+                strcmp(redone, replaced) == 0;
+
+    printf("%-8s matches %-8zu replace %.3fs undo %.3fs redo %.3fs %s\n",
+           name, match_num, replace_end - replace_start,
+           undo_end - undo_start, redo_end - redo_start,
+           valid ? "ok" : "FAILED");
+
+    st_free_status(undo_status);
+    st_free_status(redo_status);
+    free(text);
+    free(original);
+    free(replaced);
+    free(undone);
+    free(redone);
+    bf_free(buffer);
+    cf_free_config(config);
+
+    return valid;
+}
+
+static double now(void)
+{
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+
+    return current.tv_sec + current.tv_nsec / 1e9;
+}
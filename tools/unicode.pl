@@ -23,18 +23,42 @@ use strict;
 use warnings;
 
 use File::Basename;
-use LWP::Simple;
+use Getopt::Long;
+
+# Grapheme_Cluster_Break values in the order of
+# UnicodeGraphemeBreak in unicode.h
+my @grapheme_break_values = qw(
+    Other CR LF Control Extend ZWJ Regional_Indicator Prepend
+    SpacingMark L V T LV LVT
+);
+
+# Layout of the property byte generated for each code point.
+# Must match the UC_ definitions in unicode.h
+my $width_mask = 0x03;
+my $combining_flag = 0x04;
+my $extended_pictographic_flag = 0x08;
+my $grapheme_break_shift = 4;
+
+my $max_code_point = 0x10FFFF;
 
 main();
 
 sub main {
+    my $download = 1;
+
+    GetOptions('download!' => \$download)
+        or die "Usage: $0 [--no-download]\n";
+
     my $script_name = chdir_to_script_dir();
     my $cfg = get_config();
     my %uni_data;
 
-    download_unicode_files($cfg);
+    if ($download) {
+        download_unicode_files($cfg);
+    }
+
     parse_files($cfg, \%uni_data);
-    write_uni_data($cfg, \%uni_data, $script_name, 'unicode.c');
+    write_uni_data(\%uni_data, $script_name, '../unicode.c');
 }
 
 sub chdir_to_script_dir {
@@ -44,41 +68,31 @@ sub chdir_to_script_dir {
 }
 
 sub get_config {
+    my $ucd_url = 'http://www.unicode.org/Public/UCD/latest/ucd';
     my %cfg = (
-        combining => {
-            url => 'http://www.unicode.org/Public/UNIDATA/UnicodeData.txt',
+        general_category => {
+            url => "$ucd_url/UnicodeData.txt",
             filename => 'UnicodeData.txt',
             field_num => 15,
-            parse_line_func => \&parse_line_combining,
-            write_output_func => \&write_1d_array
+            parse_line_func => \&parse_line_general_category
         },
-        uppercase => {
-            url => 'http://www.unicode.org/Public/UNIDATA/UnicodeData.txt',
-            filename => 'UnicodeData.txt',
-            field_num => 15,
-            parse_line_func => \&parse_line_uppercase,
-            write_output_func => \&write_2d_array
-        },
-        lowercase => {
-            url => 'http://www.unicode.org/Public/UNIDATA/UnicodeData.txt',
-            filename => 'UnicodeData.txt',
-            field_num => 15,
-            parse_line_func => \&parse_line_lowercase,
-            write_output_func => \&write_2d_array
+        east_asian_width => {
+            url => "$ucd_url/EastAsianWidth.txt",
+            filename => 'EastAsianWidth.txt',
+            field_num => 2,
+            parse_line_func => \&parse_line_range_value
         },
-        case_folding => {
-            url => 'http://www.unicode.org/Public/UNIDATA/CaseFolding.txt',
-            filename => 'CaseFolding.txt',
-            field_num => 4,
-            parse_line_func => \&parse_line_case_folding,
-            write_output_func => \&write_2d_array
+        grapheme_break => {
+            url => "$ucd_url/auxiliary/GraphemeBreakProperty.txt",
+            filename => 'GraphemeBreakProperty.txt',
+            field_num => 2,
+            parse_line_func => \&parse_line_range_value
         },
-        double_width => {
-            url => 'http://www.unicode.org/Public/UNIDATA/EastAsianWidth.txt',
-            filename => 'EastAsianWidth.txt',
+        emoji => {
+            url => "$ucd_url/emoji/emoji-data.txt",
+            filename => 'emoji-data.txt',
             field_num => 2,
-            parse_line_func => \&parse_double_width,
-            write_output_func => \&write_2d_array
+            parse_line_func => \&parse_line_range_value
         }
     );
 
@@ -87,6 +101,10 @@ sub get_config {
 
 sub download_unicode_files {
     my $cfg = shift;
+
+    # Only needed when downloading
+    require LWP::Simple;
+
     my %url_filename = map { $cfg->{$_}->{url} => $cfg->{$_}->{filename} } keys %$cfg;
 
     for my $url (keys %url_filename) {
@@ -123,22 +141,157 @@ sub parse_files {
 }
 
 sub write_uni_data {
-    my ($cfg, $uni_data, $script_name, $output_file) = @_;
-    
-    open(my $fh, '>', $output_file) 
+    my ($uni_data, $script_name, $output_file) = @_;
+    my $properties = build_properties($uni_data);
+    my ($shift, $block_index, $blocks) = build_multi_stage_table($properties);
+
+    open(my $fh, '>', $output_file)
         or die "Unable to open file $output_file for writing: $!";
 
     print "Writing $output_file\n";
 
-    print $fh "/* Generated by $script_name */\n";
+    my $index_type = @$blocks >> $shift > 256 ? 'unsigned short'
+                                               : 'unsigned char';
 
-    for my $cfg_type (keys %$cfg) {
-        $cfg->{$cfg_type}->{write_output_func}($fh, $cfg_type, $uni_data->{$cfg_type});
+    print $fh "/* Generated by $script_name */\n\n";
+    print $fh "#include \"unicode.h\"\n\n";
+    print $fh "#define UC_BLOCK_SHIFT $shift\n";
+    print $fh "#define UC_BLOCK_MASK ((1 << UC_BLOCK_SHIFT) - 1)\n";
+
+    write_array($fh, "static const $index_type", 'uc_block_index',
+                $block_index);
+    write_array($fh, 'static const unsigned char', 'uc_blocks', $blocks);
+
+    print $fh <<'END';
+
+/* Look up the properties of a code point in two stages. The first stage
+ * maps each block of code points to a block of property values. Blocks
+ * with identical values, such as unassigned or CJK ranges, are shared */
+unsigned char uc_properties(unsigned int code_point)
+{
+    if (code_point > UC_MAX_CODE_POINT) {
+        return 1;
     }
 
+    unsigned int block = uc_block_index[code_point >> UC_BLOCK_SHIFT];
+
+    return uc_blocks[(block << UC_BLOCK_SHIFT) +
+                     (code_point & UC_BLOCK_MASK)];
+}
+END
+
     close($fh);
 }
 
+sub build_properties {
+    my $uni_data = shift;
+    my @width = (1) x ($max_code_point + 1);
+    my @properties = (0) x ($max_code_point + 1);
+    my %grapheme_break_num;
+    @grapheme_break_num{@grapheme_break_values} =
+        (0..$#grapheme_break_values);
+
+    # Unassigned code points in these ranges default to wide
+    for my $range ([0x3400, 0x4DBF], [0x4E00, 0x9FFF], [0xF900, 0xFAFF],
+                   [0x20000, 0x2FFFD], [0x30000, 0x3FFFD]) {
+        my ($start, $end) = @$range;
+        @width[$start..$end] = (2) x ($end - $start + 1);
+    }
+
+    for my $range (@{$uni_data->{east_asian_width}}) {
+        my ($start, $end, $value) = @$range;
+
+        if ($value eq 'W' or $value eq 'F') {
+            @width[$start..$end] = (2) x ($end - $start + 1);
+        }
+    }
+
+    for my $range (@{$uni_data->{emoji}}) {
+        my ($start, $end, $value) = @$range;
+
+        if ($value eq 'Extended_Pictographic') {
+            $properties[$_] |= $extended_pictographic_flag for $start..$end;
+        }
+    }
+
+    for my $range (@{$uni_data->{grapheme_break}}) {
+        my ($start, $end, $value) = @$range;
+
+        die "Unknown grapheme break value $value"
+            unless exists($grapheme_break_num{$value});
+
+        for my $code_point ($start..$end) {
+            $properties[$code_point] |=
+                $grapheme_break_num{$value} << $grapheme_break_shift;
+
+            # Characters which extend the preceding character, such as
+            # emoji modifiers and medial Hangul jamo, take up no columns
+            if ($value =~ /^(Extend|ZWJ|V|T)$/) {
+                $width[$code_point] = 0;
+            }
+        }
+    }
+
+    for my $char (@{$uni_data->{general_category}}) {
+        my ($code_point, $category) = @$char;
+
+        if ($category =~ /^M(c|e|n)$/) {
+            $properties[$code_point] |= $combining_flag;
+        }
+
+        # Format characters are invisible except for the soft hyphen
+        # and those such as Arabic number signs which prefix a character
+        if ($category =~ /^(Mn|Me)$/ ||
+            ($category eq 'Cf' && $code_point != 0xAD &&
+             ($properties[$code_point] >> $grapheme_break_shift) !=
+                 $grapheme_break_num{Prepend})) {
+            $width[$code_point] = 0;
+        }
+    }
+
+    for my $code_point (0..$max_code_point) {
+        $properties[$code_point] |= $width[$code_point] & $width_mask;
+    }
+
+    return \@properties;
+}
+
+# Split the properties into blocks, storing each distinct block once.
+# The block size which results in the smallest tables is used
+sub build_multi_stage_table {
+    my $properties = shift;
+    my ($best_size, @best);
+
+    for my $shift (4..10) {
+        my $block_size = 1 << $shift;
+        my (%block_nums, @block_index, @blocks);
+
+        for (my $start = 0; $start <= $max_code_point; $start += $block_size) {
+            my @block = @{$properties}[$start..$start + $block_size - 1];
+            my $key = pack('C*', @block);
+
+            if (!exists($block_nums{$key})) {
+                $block_nums{$key} = scalar(@blocks) >> $shift;
+                push(@blocks, @block);
+            }
+
+            push(@block_index, $block_nums{$key});
+        }
+
+        my $index_size = (@blocks >> $shift) > 256 ? 2 : 1;
+        my $size = @block_index * $index_size + @blocks;
+
+        if (!defined($best_size) || $size < $best_size) {
+            $best_size = $size;
+            @best = ($shift, \@block_index, \@blocks);
+        }
+    }
+
+    print "Generated tables of $best_size bytes\n";
+
+    return @best;
+}
+
 sub download_file {
     my ($url, $filename) = @_;
 
@@ -146,9 +299,9 @@ sub download_file {
         unlink($filename) or die "Unable to unlink $filename: $!"
     }
 
-    my $return_code = getstore($url, $filename);
+    my $return_code = LWP::Simple::getstore($url, $filename);
 
-    if (is_error($return_code)) {
+    if (LWP::Simple::is_error($return_code)) {
         die "Unable to download file at $url. Return code $return_code";
     }
 
@@ -190,63 +343,36 @@ sub parse_file {
     close($fh);
 }
 
-sub parse_line_combining {
+sub parse_line_general_category {
     my ($fields, $cfg_type, $uni_data) = @_;
 
-    if ($fields->[2] =~ /M(c|e|n)/) {
-        push(@{$uni_data->{$cfg_type}}, "0x$fields->[0]");
-    }
+    push(@{$uni_data->{$cfg_type}}, [hex($fields->[0]), $fields->[2]]);
 }
 
-sub parse_line_uppercase {
+sub parse_line_range_value {
     my ($fields, $cfg_type, $uni_data) = @_;
+    my ($start, $end);
 
-    if ($fields->[12]) {
-       push(@{$uni_data->{$cfg_type}}, ["0x$fields->[0]", "0x$fields->[12]"]); 
+    if ($fields->[0] =~ /^([A-F0-9]+)\.\.([A-F0-9]+)$/i) {
+        ($start, $end) = (hex($1), hex($2));
+    } else {
+        $start = $end = hex($fields->[0]);
     }
-}
 
-sub parse_line_lowercase {
-    my ($fields, $cfg_type, $uni_data) = @_;
-
-    if ($fields->[13]) {
-       push(@{$uni_data->{$cfg_type}}, ["0x$fields->[0]", "0x$fields->[13]"]); 
-    }
+    push(@{$uni_data->{$cfg_type}}, [$start, $end, $fields->[1]]);
 }
 
-sub parse_line_case_folding {
-    my ($fields, $cfg_type, $uni_data) = @_;
-
-    if ($fields->[1] eq 'C' or $fields->[1] eq 'S') {
-        push(@{$uni_data->{$cfg_type}}, ["0x$fields->[0]", "0x$fields->[2]"]);
-    }
-}
+sub write_array {
+    my ($fh, $type, $name, $values) = @_;
+    my @lines;
 
-sub parse_double_width {
-    my ($fields, $cfg_type, $uni_data) = @_;
-    
-    if ($fields->[1] eq 'W' or $fields->[1] eq 'F') {
-        if ($fields->[0] =~ /([A-Z0-9]+)\.\.([A-Z0-9]+)/i) {
-            push(@{$uni_data->{$cfg_type}}, ["0x$1", "0x$2"]);
-        } else {
-            push(@{$uni_data->{$cfg_type}}, ["0x$fields->[0]", "0x$fields->[0]"]);
-        }
+    for (my $k = 0; $k < @$values; $k += 12) {
+        my $end = $k + 11 < $#$values ? $k + 11 : $#$values;
+        push(@lines, join(', ', map { sprintf('0x%02X', $_) }
+                                    @{$values}[$k..$end]));
     }
-}
-
-sub write_1d_array {
-    my ($fh, $cfg_type, $data) = @_;
-
-    print $fh "\nstatic unsigned int ${cfg_type}[] = {\n    ";
-    print $fh join(",\n    ", @$data);
-    print $fh "\n};\n";
-}
-
-sub write_2d_array {
-    my ($fh, $cfg_type, $data) = @_;
-    my @values = map { '{ ' . join(', ', @$_) . ' }' } @$data;
 
-    print $fh "\nstatic unsigned int ${cfg_type}[][2] = {\n    ";
-    print $fh join(",\n    ", @values);
+    print $fh "\n$type ${name}[] = {\n    ";
+    print $fh join(",\n    ", @lines);
     print $fh "\n};\n";
 }
@@ -19,15 +19,66 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "undo.h"
 #include "buffer.h"
 #include "util.h"
+#include "lz.h"
 
-#define LIST_CHILDREN_INIT 4
-
-static TextChange *bc_tc_new(TextChangeType, const char *str, size_t str_len,
+/* Changes are encoded by bc_save_changes as a count followed by each
+ * change, oldest first. Numbers are variable length, 7 bits per byte:
+ *
+ * insert:  | 'i' | offset | length |
+ * delete:  | 'd' | offset | length | stored length | text |
+ * grouped: | 'g' | child count | children |
+ *
+ * The text of a delete is compressed when stored length is less than
+ * length. Children are also encoded oldest first */
+#define BC_ENCODED_INSERT 'i'
+#define BC_ENCODED_DELETE 'd'
+#define BC_ENCODED_GROUP 'g'
+
+/* A grouped change with this many children allocates the rest from an
+ * arena of its own, so large groups such as those made by replace all
+ * are released at once rather than freed change by change */
+#define BC_GROUP_ARENA_MIN_CHILDREN 128
+
+/* Memory changes are encoded into */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t allocated;
+} BCEncoder;
+
+/* Encoded changes being decoded */
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    size_t position;
+} BCDecoder;
+
+static TextChange *bc_tc_new(BufferChanges *, TextChangeType,
+                             const char *str, size_t str_len,
                              const BufferPos *);
-static void bc_tc_free(TextChange *);
+static void bc_tc_free(BufferChanges *, TextChange *);
+static size_t bc_tc_memory(const TextChange *);
+static size_t bc_tc_spilled(const TextChange *);
+static void bc_tc_account(BufferChanges *, const TextChange *, int add);
+static void bc_tc_release(BufferChanges *, TextChange *,
+                          const Arena *released);
+static Arena *bc_tc_arena(const TextChange *);
+static Status bc_tc_load(BufferChanges *, TextChange *);
+static void bc_tc_compress(BufferChanges *, TextChange *);
+static Status bc_tc_spill(BufferChanges *, TextChange *);
+static Status bc_spill_write(BufferChanges *, const char *data,
+                             size_t length, off_t *offset);
+static Status bc_open_spill_file(BufferChanges *);
+static void bc_reclaim_spill_file(BufferChanges *);
 static Status bc_add_text_change_to_prev(BufferChanges *, TextChangeType, 
                                          const char *str, size_t str_len,
                                          const BufferPos *,
@@ -35,31 +86,90 @@ static Status bc_add_text_change_to_prev(BufferChanges *, TextChangeType,
 static Status bc_add_text_change(BufferChanges *, TextChangeType,
                                  const char *str, size_t str_len,
                                  const BufferPos *);
-static BufferChange *bc_new(BufferChangeType, Change);
-static void bc_free_change(BufferChangeType, Change);
-static void bc_free_buffer_change(BufferChange *);
-static void bc_free_stack(BufferChange *);
+static BufferChange *bc_new(BufferChanges *, Arena *, BufferChangeType,
+                            Change);
+static void bc_free_change(BufferChanges *, BufferChangeType, Change);
+static void bc_free_buffer_change(BufferChanges *, BufferChange *,
+                                  const Arena *released);
+static void bc_free_stack(BufferChanges *, BufferChange *);
+static void bc_release_stack(BufferChanges *, BufferChange *,
+                             const Arena *released);
+static Arena *bc_arena(BufferChanges *);
 static Status bc_add_change(BufferChanges *, BufferChangeType, Change);
-static Status bc_apply(BufferChange *, Buffer *, int redo);
-static Status bc_tc_apply(TextChange *, Buffer *, int redo);
+static Status bc_apply(BufferChanges *, BufferChange *, Buffer *, int redo);
+static size_t bc_batch_size(const BufferChange *, const Buffer *);
+static Status bc_apply_batch(BufferChanges *, BufferChange *, Buffer *,
+                             size_t child_num, int redo);
+static Status bc_tc_apply(BufferChanges *, TextChange *, Buffer *,
+                          int redo);
+static BufferChange *bc_reverse_changes(BufferChange *);
+static Status bc_compact_change(BufferChanges *, BufferChange *,
+                                size_t keep, size_t *kept, int spill);
+static Status bc_compact(BufferChanges *, size_t keep, int spill);
+static size_t bc_change_size(const BufferChange *);
+static int bc_drop_history(BufferChanges *, size_t history_limit);
+static void bc_add_change_stats(const BufferChange *, UndoMemoryStats *);
+static int bc_is_state(const BufferChange *, BufferChangeState);
+static char *bc_encode_reserve(BCEncoder *, size_t length);
+static int bc_encode_varint(BCEncoder *, uint64_t value);
+static Status bc_encode_change(BufferChanges *, BCEncoder *, BufferChange *);
+static Status bc_encode_text(BufferChanges *, BCEncoder *,
+                             const TextChange *);
+static int bc_decode_varint(BCDecoder *, uint64_t *value);
+static Status bc_decode_change(BufferChanges *, BCDecoder *, int is_child,
+                               BufferChange **buffer_change_ptr);
+static Status bc_decode_text(BufferChanges *, BCDecoder *,
+                             TextChangeType, BufferChange **);
+static Status bc_invalid_history(void);
 
 void bc_init(BufferChanges *changes)
 {
     assert(changes != NULL);
     memset(changes, 0, sizeof(BufferChanges));
+    changes->spill_fd = -1;
+    ar_init(&changes->arena);
     bc_enable(changes);
 }
 
+/* All changes are allocated from the arena, or arenas created from it
+ * by grouped changes, so they're released at once rather than freed
+ * individually */
 void bc_free(BufferChanges *changes)
 {
-    bc_free_stack(changes->undo);
-    bc_free_stack(changes->redo);
+    ar_release(&changes->arena);
+    changes->undo = changes->redo = NULL;
+    changes->memory = changes->spilled = 0;
+
+    if (changes->spill_fd != -1) {
+        close(changes->spill_fd);
+        changes->spill_fd = -1;
+        changes->spill_size = 0;
+    }
+}
+
+/* Discard all undo and redo history. A grouped change
+ * in progress continues in a new container */
+Status bc_clear(BufferChanges *changes)
+{
+    int group_changes = changes->group_changes;
+
+    bc_free(changes);
+    changes->undo = changes->redo = NULL;
+    changes->group_changes = 0;
+
+    if (group_changes) {
+        return bc_start_grouped_changes(changes);
+    }
+
+    return STATUS_SUCCESS;
 }
 
-static TextChange *bc_tc_new(TextChangeType change_type, const char *str,
+static TextChange *bc_tc_new(BufferChanges *changes,
+                             TextChangeType change_type, const char *str,
                              size_t str_len, const BufferPos *pos)
 {
-    TextChange *text_change = malloc(sizeof(TextChange));
+    Arena *arena = bc_arena(changes);
+    TextChange *text_change = ar_alloc(arena, sizeof(TextChange));
     RETURN_IF_NULL(text_change);
 
     memset(text_change, 0, sizeof(TextChange));
@@ -67,12 +177,14 @@ static TextChange *bc_tc_new(TextChangeType change_type, const char *str,
     /* Keep a copy of the text being deleted so that
      * we can insert it again into the buffer if necessary.
      * For inserts str will be NULL as we don't need a copy
-     * of the text because it already exists in the buffer */
-    if (change_type == TCT_DELETE) {
-        text_change->str = malloc(str_len);
+     * of the text because it already exists in the buffer.
+     * Deleted text which is spilled straight away is also
+     * passed as NULL (see bc_add_spilled_text_delete) */
+    if (change_type == TCT_DELETE && str != NULL) {
+        text_change->str = ar_alloc(arena, str_len);
 
         if (text_change->str == NULL) {
-            free(text_change);
+            ar_free(arena, text_change, sizeof(TextChange));
             return NULL;
         }
 
@@ -86,14 +198,269 @@ static TextChange *bc_tc_new(TextChangeType change_type, const char *str,
     return text_change;
 }
 
-static void bc_tc_free(TextChange *text_change)
+static void bc_tc_free(BufferChanges *changes, TextChange *text_change)
 {
     if (text_change == NULL) {
         return;
     }
 
-    free(text_change->str);
-    free(text_change);
+    bc_tc_release(changes, text_change, NULL);
+    bc_reclaim_spill_file(changes);
+}
+
+/* Remove a change from the usage totals and free it, unless it was
+ * allocated from the arena being released, which frees it anyway */
+static void bc_tc_release(BufferChanges *changes, TextChange *text_change,
+                          const Arena *released)
+{
+    bc_tc_account(changes, text_change, 0);
+    Arena *arena = bc_tc_arena(text_change);
+
+    if (arena != released) {
+        ar_free(arena, text_change->str, bc_tc_memory(text_change));
+        ar_free(arena, text_change, sizeof(TextChange));
+    }
+}
+
+/* The text of a change is always allocated from
+ * the same arena as the change itself */
+static Arena *bc_tc_arena(const TextChange *text_change)
+{
+    return ar_owner(text_change, sizeof(TextChange));
+}
+
+/* Bytes of memory used to store the text of a change */
+static size_t bc_tc_memory(const TextChange *text_change)
+{
+    if (text_change->str == NULL) {
+        return 0;
+    } else if (text_change->storage == TCS_COMPRESSED) {
+        return text_change->stored_len;
+    }
+
+    return text_change->str_len;
+}
+
+/* Bytes of the spill file used to store the text of a change */
+static size_t bc_tc_spilled(const TextChange *text_change)
+{
+    if (text_change->storage == TCS_SPILLED) {
+        return text_change->stored_len;
+    }
+
+    return 0;
+}
+
+/* Add or remove the text of a change from the usage totals. Called
+ * before and after the storage of a change's text is modified */
+static void bc_tc_account(BufferChanges *changes,
+                          const TextChange *text_change, int add)
+{
+    if (add) {
+        changes->memory += bc_tc_memory(text_change);
+        changes->spilled += bc_tc_spilled(text_change);
+    } else {
+        changes->memory -= bc_tc_memory(text_change);
+        changes->spilled -= bc_tc_spilled(text_change);
+    }
+}
+
+/* Restore the text of a compressed or spilled change into memory */
+static Status bc_tc_load(BufferChanges *changes, TextChange *text_change)
+{
+    if (text_change->storage == TCS_MEMORY) {
+        return STATUS_SUCCESS;
+    }
+
+    Arena *arena = bc_tc_arena(text_change);
+    char *str = ar_alloc(arena, text_change->str_len);
+
+    if (str == NULL) {
+        return OUT_OF_MEMORY("Unable to restore undo history");
+    }
+
+    const char *stored = text_change->str;
+    void *map = NULL;
+    size_t map_length = 0;
+
+    if (text_change->storage == TCS_SPILLED) {
+        /* Only map the pages containing the text */
+        off_t page_size = sysconf(_SC_PAGESIZE);
+        off_t map_offset = text_change->spill_offset -
+                           text_change->spill_offset % page_size;
+        map_length = text_change->stored_len +
+                     (text_change->spill_offset - map_offset);
+        map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE,
+                   changes->spill_fd, map_offset);
+
+        if (map == MAP_FAILED) {
+            ar_free(arena, str, text_change->str_len);
+            return st_get_error(ERR_UNDO_SPILL_ERROR,
+                                "Unable to read undo history: %s",
+                                strerror(errno));
+        }
+
+        stored = (char *)map + (text_change->spill_offset - map_offset);
+    }
+
+    int valid = 1;
+
+    if (text_change->stored_len == text_change->str_len) {
+        memcpy(str, stored, text_change->str_len);
+    } else {
+        valid = lz_decompress(stored, text_change->stored_len,
+                              str, text_change->str_len);
+    }
+
+    if (map != NULL) {
+        munmap(map, map_length);
+    }
+
+    if (!valid) {
+        ar_free(arena, str, text_change->str_len);
+        return st_get_error(ERR_UNDO_SPILL_ERROR,
+                            "Unable to read undo history: "
+                            "Stored text is corrupt");
+    }
+
+    bc_tc_account(changes, text_change, 0);
+    ar_free(arena, text_change->str, bc_tc_memory(text_change));
+    text_change->str = str;
+    text_change->storage = TCS_MEMORY;
+    text_change->stored_len = 0;
+    bc_tc_account(changes, text_change, 1);
+    bc_reclaim_spill_file(changes);
+
+    return STATUS_SUCCESS;
+}
+
+/* Compress the text of a change held in memory. Text that doesn't
+ * shrink is kept as is but marked compressed so it isn't retried */
+static void bc_tc_compress(BufferChanges *changes, TextChange *text_change)
+{
+    if (text_change->str == NULL || text_change->storage != TCS_MEMORY) {
+        return;
+    }
+
+    Arena *arena = bc_tc_arena(text_change);
+    char *compressed = ar_alloc(arena, text_change->str_len);
+
+    if (compressed == NULL) {
+        return;
+    }
+
+    /* The compressed text must be strictly smaller so that it can be
+     * distinguished from text that's held as is */
+    size_t stored_len = lz_compress(text_change->str, text_change->str_len,
+                                    compressed, text_change->str_len - 1);
+    char *shrunk = NULL;
+
+    if (stored_len > 0) {
+        shrunk = ar_realloc(arena, compressed, text_change->str_len,
+                            stored_len);
+    }
+
+    bc_tc_account(changes, text_change, 0);
+
+    if (shrunk == NULL) {
+        ar_free(arena, compressed, text_change->str_len);
+        text_change->stored_len = text_change->str_len;
+    } else {
+        ar_free(arena, text_change->str, text_change->str_len);
+        text_change->str = shrunk;
+        text_change->stored_len = stored_len;
+    }
+
+    text_change->storage = TCS_COMPRESSED;
+    bc_tc_account(changes, text_change, 1);
+}
+
+/* Move the compressed text of a change to the spill file */
+static Status bc_tc_spill(BufferChanges *changes, TextChange *text_change)
+{
+    if (text_change->storage != TCS_COMPRESSED) {
+        return STATUS_SUCCESS;
+    }
+
+    off_t offset;
+    RETURN_IF_FAIL(bc_spill_write(changes, text_change->str,
+                                  text_change->stored_len, &offset));
+
+    bc_tc_account(changes, text_change, 0);
+    ar_free(bc_tc_arena(text_change), text_change->str,
+            text_change->stored_len);
+    text_change->str = NULL;
+    text_change->spill_offset = offset;
+    text_change->storage = TCS_SPILLED;
+    bc_tc_account(changes, text_change, 1);
+
+    return STATUS_SUCCESS;
+}
+
+/* Append data to the spill file, setting offset to its position */
+static Status bc_spill_write(BufferChanges *changes, const char *data,
+                             size_t length, off_t *offset)
+{
+    if (changes->spill_fd == -1) {
+        RETURN_IF_FAIL(bc_open_spill_file(changes));
+    }
+
+    off_t end = changes->spill_size;
+    ssize_t written;
+
+    while (length > 0) {
+        written = pwrite(changes->spill_fd, data, length, end);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return st_get_error(ERR_UNDO_SPILL_ERROR,
+                                "Unable to spill undo history: %s",
+                                strerror(errno));
+        }
+
+        data += written;
+        length -= written;
+        end += written;
+    }
+
+    *offset = changes->spill_size;
+    changes->spill_size = end;
+
+    return STATUS_SUCCESS;
+}
+
+/* The spill file is removed from the file system as soon as it's
+ * created so it's cleaned up however wed exits */
+static Status bc_open_spill_file(BufferChanges *changes)
+{
+    FILE *file = tmpfile();
+
+    if (file != NULL) {
+        changes->spill_fd = fcntl(fileno(file), F_DUPFD_CLOEXEC, 0);
+        fclose(file);
+    }
+
+    if (changes->spill_fd == -1) {
+        return st_get_error(ERR_UNDO_SPILL_ERROR,
+                            "Unable to create undo spill file: %s",
+                            strerror(errno));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Text is only appended to the spill file, so its space is
+ * reclaimed once no change has text stored in it */
+static void bc_reclaim_spill_file(BufferChanges *changes)
+{
+    if (changes->spilled == 0 && changes->spill_size > 0) {
+        if (ftruncate(changes->spill_fd, 0) == 0) {
+            changes->spill_size = 0;
+        }
+    }
 }
 
 /* Changes that take place in sequence can be grouped together
@@ -113,14 +480,20 @@ static Status bc_add_text_change_to_prev(BufferChanges *changes,
 {
     *added_to_prev_change = 0;
 
+    /* A change that's been saved to an undo file is left as it was */
     if (changes->undo == NULL ||
-        changes->undo->change_type != BCT_TEXT_CHANGE) {
+        changes->undo->change_type != BCT_TEXT_CHANGE ||
+        changes->undo->id == changes->sealed_id) {
         return STATUS_SUCCESS;
     }
 
     TextChange *prev_change = changes->undo->change.text_change; 
 
-    if (prev_change->change_type != change_type) {
+    /* Compressed or spilled text isn't appended to, nor is a change
+     * loaded from an undo file that hasn't been applied yet */
+    if (prev_change->change_type != change_type ||
+        prev_change->storage != TCS_MEMORY ||
+        prev_change->pos.data == NULL) {
         return STATUS_SUCCESS;
     }
 
@@ -158,7 +531,9 @@ static Status bc_add_text_change_to_prev(BufferChanges *changes,
         } else if (change_type == TCT_DELETE) {
             /* Append the new change text to the previous change text */
             size_t new_str_len = prev_change->str_len + str_len;
-            char *new_str = realloc(prev_change->str, new_str_len);
+            char *new_str = ar_realloc(bc_tc_arena(prev_change),
+                                       prev_change->str,
+                                       prev_change->str_len, new_str_len);
 
             if (new_str == NULL) {
                 return OUT_OF_MEMORY("Unable to save undo history");
@@ -167,6 +542,7 @@ static Status bc_add_text_change_to_prev(BufferChanges *changes,
             prev_change->str = new_str;
             memcpy(prev_change->str + prev_change->str_len, str, str_len);
             prev_change->str_len = new_str_len;
+            changes->memory += str_len;
         }
 
         changes->undo->version++;
@@ -189,6 +565,64 @@ Status bc_add_text_delete(BufferChanges *changes, const char *str,
     return bc_add_text_change(changes, TCT_DELETE, str, str_len, pos);
 }
 
+/* Add a deletion whose text is compressed and written straight to the
+ * spill file from str, rather than first being copied into memory and
+ * spilled later, for example when it's too large to be worth keeping
+ * in memory. If it can't be spilled the text is kept in memory */
+Status bc_add_spilled_text_delete(BufferChanges *changes, const char *str,
+                                  size_t str_len, const BufferPos *pos)
+{
+    assert(str != NULL);
+    assert(str_len > 0);
+
+    if (str_len == 0 || !bc_enabled(changes)) {
+        return STATUS_SUCCESS;
+    }
+
+    /* The compressed text must be strictly smaller, as in
+     * bc_tc_compress, otherwise the text is spilled as is */
+    char *compressed = malloc(str_len);
+    size_t stored_len = 0;
+
+    if (compressed != NULL) {
+        stored_len = lz_compress(str, str_len, compressed, str_len - 1);
+    }
+
+    const char *stored = stored_len > 0 ? compressed : str;
+    stored_len = stored_len > 0 ? stored_len : str_len;
+    off_t offset;
+    Status status = bc_spill_write(changes, stored, stored_len, &offset);
+    free(compressed);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        Status added = bc_add_text_delete(changes, str, str_len, pos);
+
+        if (!STATUS_IS_SUCCESS(added)) {
+            st_free_status(status);
+            return added;
+        }
+
+        return status;
+    }
+
+    TextChange *text_change = bc_tc_new(changes, TCT_DELETE, NULL, str_len,
+                                        pos);
+
+    if (text_change == NULL) {
+        bc_reclaim_spill_file(changes);
+        return OUT_OF_MEMORY("Unable to save text change");
+    }
+
+    text_change->storage = TCS_SPILLED;
+    text_change->stored_len = stored_len;
+    text_change->spill_offset = offset;
+    bc_tc_account(changes, text_change, 1);
+
+    Change change = { .text_change = text_change };
+
+    return bc_add_change(changes, BCT_TEXT_CHANGE, change);
+}
+
 static Status bc_add_text_change(BufferChanges *changes,
                                  TextChangeType change_type,
                                  const char *str, size_t str_len,
@@ -210,35 +644,41 @@ static Status bc_add_text_change(BufferChanges *changes,
         return status;
     }
 
-    TextChange *text_change = bc_tc_new(change_type, str, str_len, pos);
+    TextChange *text_change = bc_tc_new(changes, change_type, str, str_len,
+                                        pos);
 
     if (text_change == NULL) {
         return OUT_OF_MEMORY("Unable to save text change");
     }
 
+    bc_tc_account(changes, text_change, 1);
+
     Change change = { .text_change = text_change };
 
     return bc_add_change(changes, BCT_TEXT_CHANGE, change);
 }
 
-static BufferChange *bc_new(BufferChangeType change_type, Change change)
+static BufferChange *bc_new(BufferChanges *changes, Arena *arena,
+                            BufferChangeType change_type, Change change)
 {
-    BufferChange *buffer_change = malloc(sizeof(BufferChange));
+    BufferChange *buffer_change = ar_alloc(arena, sizeof(BufferChange));
     RETURN_IF_NULL(buffer_change);
 
     memset(buffer_change, 0, sizeof(BufferChange));
     buffer_change->change_type = change_type;
     buffer_change->change = change;
+    buffer_change->id = ++changes->last_id;
 
     return buffer_change;
 }
 
-static void bc_free_change(BufferChangeType change_type, Change change)
+static void bc_free_change(BufferChanges *changes,
+                           BufferChangeType change_type, Change change)
 {
     switch (change_type) {
         case BCT_TEXT_CHANGE: 
             {
-                bc_tc_free(change.text_change);
+                bc_tc_free(changes, change.text_change);
                 break;
             }
         default:
@@ -248,47 +688,69 @@ static void bc_free_change(BufferChangeType change_type, Change change)
     }
 }
 
-static void bc_free_buffer_change(BufferChange *buffer_change)
+/* Free a change and its children. Allocations from the arena being
+ * released are freed with it, so only their usage is accounted for */
+static void bc_free_buffer_change(BufferChanges *changes,
+                                  BufferChange *buffer_change,
+                                  const Arena *released)
 {
     if (buffer_change == NULL) {
         return;
     }
 
-    bc_free_change(buffer_change->change_type, buffer_change->change);
-
-    if (buffer_change->children != NULL) {
-        size_t child_num = list_size(buffer_change->children);
-        BufferChange *child;
+    if (buffer_change->change_type == BCT_TEXT_CHANGE) {
+        bc_tc_release(changes, buffer_change->change.text_change, released);
+    } else {
+        Arena *group_arena = buffer_change->change.arena;
+        bc_release_stack(changes, buffer_change->children, group_arena);
+        ar_free_child(&changes->arena, group_arena);
+    }
 
-        for (size_t k = 0; k < child_num; k++) {
-            child = list_get(buffer_change->children, k);
-            bc_free_buffer_change(child);
-        }
+    Arena *arena = ar_owner(buffer_change, sizeof(BufferChange));
 
-        list_free(buffer_change->children);
+    if (arena != released) {
+        ar_free(arena, buffer_change, sizeof(BufferChange));
     }
+}
 
-    free(buffer_change);
+static void bc_free_stack(BufferChanges *changes,
+                          BufferChange *buffer_change)
+{
+    bc_release_stack(changes, buffer_change, NULL);
+    bc_reclaim_spill_file(changes);
 }
 
-static void bc_free_stack(BufferChange *buffer_change)
+static void bc_release_stack(BufferChanges *changes,
+                             BufferChange *buffer_change,
+                             const Arena *released)
 {
     BufferChange *next;
 
     while (buffer_change != NULL) {
         next = buffer_change->next;
-        bc_free_buffer_change(buffer_change);
+        bc_free_buffer_change(changes, buffer_change, released);
         buffer_change = next;
     }
 }
 
+/* The arena new changes are allocated from */
+static Arena *bc_arena(BufferChanges *changes)
+{
+    if (changes->group_changes && changes->undo->change.arena != NULL) {
+        return changes->undo->change.arena;
+    }
+
+    return &changes->arena;
+}
+
 static Status bc_add_change(BufferChanges *changes,
                             BufferChangeType change_type, Change change)
 {
-    BufferChange *buffer_change = bc_new(change_type, change);    
+    BufferChange *buffer_change = bc_new(changes, bc_arena(changes),
+                                         change_type, change);
 
     if (buffer_change == NULL) {
-        bc_free_change(change_type, change);
+        bc_free_change(changes, change_type, change);
         return OUT_OF_MEMORY("Unable to save buffer change");
     }
 
@@ -296,8 +758,15 @@ static Status bc_add_change(BufferChanges *changes,
         assert(changes->undo != NULL);
         assert(changes->undo->change_type == BCT_GROUPED_CHANGE);
 
-        if (!list_add(changes->undo->children, buffer_change)) {
-            return OUT_OF_MEMORY("Unable to save buffer change");
+        /* Children are stored with the latest first */
+        BufferChange *group = changes->undo;
+        buffer_change->next = group->children;
+        group->children = buffer_change;
+
+        /* Without an arena of its own the
+         * group's children are freed individually */
+        if (++changes->group_size == BC_GROUP_ARENA_MIN_CHILDREN) {
+            group->change.arena = ar_new_child(&changes->arena);
         }
     } else {
         /* Add the change to the top of the undo stack */
@@ -308,7 +777,7 @@ static Status bc_add_change(BufferChanges *changes,
         changes->undo = buffer_change;
     }
 
-    bc_free_stack(changes->redo);
+    bc_free_stack(changes, changes->redo);
     changes->redo = NULL;
 
     return STATUS_SUCCESS;
@@ -337,20 +806,12 @@ Status bc_start_grouped_changes(BufferChanges *changes)
         return STATUS_SUCCESS;
     }
 
-    List *children = list_new_prealloc(LIST_CHILDREN_INIT);
-
-    if (children == NULL) {
-        return OUT_OF_MEMORY("Unable to save buffer changes");
-    }
-
     /* Create a new grouped change to act as a container for its children */
     Change change = { NULL };
     RETURN_IF_FAIL(bc_add_change(changes, BCT_GROUPED_CHANGE, change));
-    
-    BufferChange *buffer_change = changes->undo;
-    buffer_change->children = children;
 
     changes->group_changes = 1;
+    changes->group_size = 0;
 
     return STATUS_SUCCESS;
 }
@@ -372,9 +833,9 @@ Status bc_end_grouped_changes(BufferChanges *changes)
 
     /* If no changes were made when the grouped change
      * container was active then remove it */
-    if (list_size(buffer_change->children) == 0) {
+    if (buffer_change->children == NULL) {
         changes->undo = buffer_change->next;
-        bc_free_buffer_change(buffer_change);
+        bc_free_buffer_change(changes, buffer_change, NULL);
     }
 
     return STATUS_SUCCESS;
@@ -393,7 +854,7 @@ Status bc_undo(BufferChanges *changes, Buffer *buffer)
      * as the act of performing the undo creates new
      * changes */
     bc_disable(changes);
-    Status status = bc_apply(buffer_change, buffer, 0);
+    Status status = bc_apply(changes, buffer_change, buffer, 0);
     bc_enable(changes);
 
     if (!STATUS_IS_SUCCESS(status)) {
@@ -418,7 +879,7 @@ Status bc_redo(BufferChanges *changes, Buffer *buffer)
     BufferChange *buffer_change = changes->redo;
 
     bc_disable(changes);
-    Status status = bc_apply(buffer_change, buffer, 1);
+    Status status = bc_apply(changes, buffer_change, buffer, 1);
     bc_enable(changes);
 
     if (!STATUS_IS_SUCCESS(status)) {
@@ -434,20 +895,28 @@ Status bc_redo(BufferChanges *changes, Buffer *buffer)
 }
 
 /* Determine the change type and undo/redo it */
-static Status bc_apply(BufferChange *buffer_change, Buffer *buffer, int redo)
+static Status bc_apply(BufferChanges *changes, BufferChange *buffer_change,
+                       Buffer *buffer, int redo)
 {
     Status status = STATUS_SUCCESS;
 
     switch (buffer_change->change_type) {
         case BCT_TEXT_CHANGE:
             {
-                status = bc_tc_apply(buffer_change->change.text_change,
+                status = bc_tc_apply(changes,
+                                     buffer_change->change.text_change,
                                      buffer, redo);
                 break;
             }
         case BCT_GROUPED_CHANGE:
             {
-                size_t child_num = list_size(buffer_change->children);
+                size_t child_num = bc_batch_size(buffer_change, buffer);
+
+                if (child_num > 0) {
+                    status = bc_apply_batch(changes, buffer_change, buffer,
+                                            child_num, redo);
+                    break;
+                }
 
                 /* To undo child changes we start with the latest
                  * and go back until the first has been undone. To redo
@@ -455,22 +924,22 @@ static Status bc_apply(BufferChange *buffer_change, Buffer *buffer, int redo)
                  * were originally applied by the user.
                  * This is necessary as the buffer has to be in the same state
                  * it was after/before the change in order for it to be
-                 * undone/redone respectively. */
+                 * undone/redone respectively. Children are stored with the
+                 * latest first so are reversed while being redone */
+                if (redo) {
+                    buffer_change->children =
+                        bc_reverse_changes(buffer_change->children);
+                }
+
+                for (BufferChange *child = buffer_change->children;
+                     child != NULL && STATUS_IS_SUCCESS(status);
+                     child = child->next) {
+                    status = bc_apply(changes, child, buffer, redo);
+                }
+
                 if (redo) {
-                    for (size_t k = 0;
-                         k < child_num && STATUS_IS_SUCCESS(status);
-                         k++) {
-                        status = bc_apply(list_get(buffer_change->children, k),
-                                          buffer, redo);
-                    }
-                } else {
-                    for (size_t k = child_num;
-                         k > 0 && STATUS_IS_SUCCESS(status);
-                         k--) {
-                        status = bc_apply(list_get(buffer_change->children,
-                                                   k - 1),
-                                          buffer, redo);
-                    }
+                    buffer_change->children =
+                        bc_reverse_changes(buffer_change->children);
                 }
 
                 break;
@@ -484,14 +953,152 @@ static Status bc_apply(BufferChange *buffer_change, Buffer *buffer, int redo)
     return status;
 }
 
-static Status bc_tc_apply(TextChange *text_change, Buffer *buffer, int redo)
+static BufferChange *bc_reverse_changes(BufferChange *buffer_change)
+{
+    BufferChange *reversed = NULL;
+    BufferChange *next;
+
+    while (buffer_change != NULL) {
+        next = buffer_change->next;
+        buffer_change->next = reversed;
+        reversed = buffer_change;
+        buffer_change = next;
+    }
+
+    return reversed;
+}
+
+/* Returns the number of children of a grouped change that can be
+ * applied together by bf_apply_edits, or 0 if they're applied one at
+ * a time. Groups of text changes are batched unless the buffer is
+ * stored as a piece table, which keeps many small edits cheaper than
+ * rebuilding the text between them */
+static size_t bc_batch_size(const BufferChange *buffer_change,
+                            const Buffer *buffer)
+{
+    if (gb_get_storage(buffer->data) != GBS_GAP) {
+        return 0;
+    }
+
+    size_t child_num = 0;
+
+    for (const BufferChange *child = buffer_change->children;
+         child != NULL; child = child->next) {
+        if (child->change_type != BCT_TEXT_CHANGE) {
+            return 0;
+        }
+
+        child_num++;
+    }
+
+    return child_num > 1 ? child_num : 0;
+}
+
+/* Undo/redo the children of a grouped change in a single pass. The
+ * text each child deletes is still kept so the change can be
+ * reversed, and the text each inserts is freed once in the buffer */
+static Status bc_apply_batch(BufferChanges *changes,
+                             BufferChange *buffer_change, Buffer *buffer,
+                             size_t child_num, int redo)
+{
+    BufferEdit *edits = malloc(sizeof(BufferEdit) * child_num);
+
+    if (edits == NULL) {
+        return OUT_OF_MEMORY("Unable to apply changes");
+    }
+
+    Status status = STATUS_SUCCESS;
+    size_t edit_num = 0;
+    TextChange *text_change;
+    BufferEdit *edit;
+
+    /* Children are stored latest first, which is the order they're
+     * undone in, so are added from the end when being redone */
+    for (BufferChange *child = buffer_change->children;
+         child != NULL; child = child->next, edit_num++) {
+        text_change = child->change.text_change;
+        edit = &edits[redo ? child_num - edit_num - 1 : edit_num];
+        edit->offset = text_change->pos.offset;
+        edit->length = text_change->str_len;
+
+        /* Redoing a delete is the same as undoing an insert */
+        if (redo == (text_change->change_type == TCT_DELETE)) {
+            edit->change_type = TCT_DELETE;
+            edit->text = ar_alloc(bc_tc_arena(text_change),
+                                  text_change->str_len);
+
+            if (edit->text == NULL) {
+                status = OUT_OF_MEMORY("Unable to save deleted text");
+                break;
+            }
+        } else {
+            edit->change_type = TCT_INSERT;
+            edit->text = NULL;
+            status = bc_tc_load(changes, text_change);
+
+            if (!STATUS_IS_SUCCESS(status)) {
+                break;
+            }
+
+            edit->text = text_change->str;
+        }
+    }
+
+    if (STATUS_IS_SUCCESS(status)) {
+        status = bf_apply_edits(buffer, edits, child_num);
+    }
+
+    size_t k = 0;
+
+    for (BufferChange *child = buffer_change->children;
+         child != NULL && k < edit_num; child = child->next, k++) {
+        text_change = child->change.text_change;
+        edit = &edits[redo ? child_num - k - 1 : k];
+
+        if (edit->change_type == TCT_INSERT) {
+            if (STATUS_IS_SUCCESS(status)) {
+                /* The text is now stored in the buffer */
+                bc_tc_account(changes, text_change, 0);
+                ar_free(bc_tc_arena(text_change), text_change->str,
+                        text_change->str_len);
+                text_change->str = NULL;
+            }
+        } else if (STATUS_IS_SUCCESS(status)) {
+            text_change->str = edit->text;
+            text_change->storage = TCS_MEMORY;
+            bc_tc_account(changes, text_change, 1);
+        } else if (edit->text != NULL) {
+            ar_free(bc_tc_arena(text_change), edit->text,
+                    text_change->str_len);
+        }
+    }
+
+    free(edits);
+
+    return status;
+}
+
+static Status bc_tc_apply(BufferChanges *changes, TextChange *text_change,
+                          Buffer *buffer, int redo)
 {
+    /* Changes loaded from an undo file only record their offset */
+    if (text_change->pos.data == NULL) {
+        if (text_change->pos.offset > bf_length(buffer)) {
+            return st_get_error(ERR_INVALID_BUFFERPOS,
+                                "Invalid Buffer Position");
+        }
+
+        text_change->pos = bp_init_from_offset(text_change->pos.offset,
+                                               &buffer->pos);
+    }
+
     /* Redoing a delete is the same as undoing an insert */
     if ((redo && text_change->change_type == TCT_DELETE) ||
         (!redo && text_change->change_type == TCT_INSERT)) {
         /* We need to take a copy of the text we're deleting
          * so that this change can be reversed */
-        char *str = malloc(text_change->str_len);
+        char *str = ar_alloc(bc_tc_arena(text_change),
+                             text_change->str_len);
 
         if (str == NULL) {
             return OUT_OF_MEMORY("Unable to save deleted text");
@@ -500,6 +1107,8 @@ static Status bc_tc_apply(TextChange *text_change, Buffer *buffer, int redo)
         gb_get_range(buffer->data, text_change->pos.offset,
                      str, text_change->str_len);
         text_change->str = str;
+        text_change->storage = TCS_MEMORY;
+        bc_tc_account(changes, text_change, 1);
 
         RETURN_IF_FAIL(bf_set_bp(buffer, &text_change->pos));
         RETURN_IF_FAIL(bf_delete(buffer, text_change->str_len));
@@ -507,13 +1116,15 @@ static Status bc_tc_apply(TextChange *text_change, Buffer *buffer, int redo)
         /* Redoing an insert is the same as undoing a delete */
     } else if ((redo && text_change->change_type == TCT_INSERT) || 
                (!redo && text_change->change_type == TCT_DELETE)) {
-
+        RETURN_IF_FAIL(bc_tc_load(changes, text_change));
         RETURN_IF_FAIL(bf_set_bp(buffer, &text_change->pos));
         RETURN_IF_FAIL(bf_insert_string(buffer, text_change->str,
                                         text_change->str_len, 0));
 
         /* The text is now stored in the buffer so we can free it */
-        free(text_change->str);
+        bc_tc_account(changes, text_change, 0);
+        ar_free(bc_tc_arena(text_change), text_change->str,
+                text_change->str_len);
         text_change->str = NULL;
     }
 
@@ -541,7 +1152,8 @@ BufferChangeState bc_get_current_state(const BufferChanges *changes)
 {
     BufferChangeState change_state = {
         .change = changes->undo,
-        .version = (changes->undo == NULL ? 0 : changes->undo->version)
+        .version = (changes->undo == NULL ? 0 : changes->undo->version),
+        .id = (changes->undo == NULL ? 0 : changes->undo->id)
     };
 
     return change_state;
@@ -553,9 +1165,666 @@ int bc_has_state_changed(const BufferChanges *changes,
     if (changes->undo != change_state.change) {
         return 1;
     } else if (change_state.change != NULL) {
-        return change_state.version != changes->undo->version;
+        return change_state.id != changes->undo->id ||
+               change_state.version != changes->undo->version;
     }
 
     return change_state.version > 0;
 }
 
+
+/* Returns true if the state can still be reached by undo or redo */
+int bc_has_state(const BufferChanges *changes,
+                 BufferChangeState change_state)
+{
+    /* Once history has been dropped undoing every change
+     * no longer returns the buffer to its original state */
+    if (change_state.change == NULL) {
+        return 0;
+    }
+
+    const BufferChange *stacks[] = { changes->undo, changes->redo };
+
+    for (size_t k = 0; k < ARRAY_SIZE(stacks, const BufferChange *); k++) {
+        for (const BufferChange *buffer_change = stacks[k];
+             buffer_change != NULL;
+             buffer_change = buffer_change->next) {
+            if (buffer_change == change_state.change) {
+                return buffer_change->id == change_state.id;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Keep the text held in memory by changes within memory_budget bytes.
+ * The text of older changes is compressed, then spilled to disk,
+ * leaving the most recent half of the budget untouched so recent
+ * changes can be undone quickly. The oldest changes are dropped once
+ * the text of all undo changes exceeds history_limit bytes */
+Status bc_limit_memory(BufferChanges *changes, size_t memory_budget,
+                       size_t history_limit, int *history_dropped)
+{
+    *history_dropped = 0;
+
+    if (changes->memory > memory_budget) {
+        RETURN_IF_FAIL(bc_compact(changes, memory_budget / 2, 0));
+    }
+
+    if (changes->memory > memory_budget) {
+        RETURN_IF_FAIL(bc_compact(changes, memory_budget / 2, 1));
+    }
+
+    if (changes->memory > memory_budget) {
+        RETURN_IF_FAIL(bc_compact(changes, 0, 1));
+    }
+
+    if (changes->memory + changes->spilled > history_limit) {
+        *history_dropped = bc_drop_history(changes, history_limit);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Compact the text of changes once the text of more
+ * recent changes has used keep bytes of memory */
+static Status bc_compact(BufferChanges *changes, size_t keep, int spill)
+{
+    size_t kept = 0;
+    const BufferChange *stacks[] = { changes->undo, changes->redo };
+
+    for (size_t k = 0; k < ARRAY_SIZE(stacks, const BufferChange *); k++) {
+        for (BufferChange *buffer_change = (BufferChange *)stacks[k];
+             buffer_change != NULL;
+             buffer_change = buffer_change->next) {
+            RETURN_IF_FAIL(bc_compact_change(changes, buffer_change,
+                                             keep, &kept, spill));
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static Status bc_compact_change(BufferChanges *changes,
+                                BufferChange *buffer_change,
+                                size_t keep, size_t *kept, int spill)
+{
+    if (buffer_change->change_type == BCT_TEXT_CHANGE) {
+        TextChange *text_change = buffer_change->change.text_change;
+
+        if (*kept < keep) {
+            *kept += bc_tc_memory(text_change);
+            return STATUS_SUCCESS;
+        }
+
+        bc_tc_compress(changes, text_change);
+
+        if (spill) {
+            return bc_tc_spill(changes, text_change);
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    /* Children are visited from the most recent */
+    for (BufferChange *child = buffer_change->children; child != NULL;
+         child = child->next) {
+        RETURN_IF_FAIL(bc_compact_change(changes, child, keep, kept, spill));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Bytes of memory and spill file used by the text of a change */
+static size_t bc_change_size(const BufferChange *buffer_change)
+{
+    if (buffer_change->change_type == BCT_TEXT_CHANGE) {
+        const TextChange *text_change = buffer_change->change.text_change;
+        return bc_tc_memory(text_change) + bc_tc_spilled(text_change);
+    }
+
+    size_t size = 0;
+
+    for (const BufferChange *child = buffer_change->children; child != NULL;
+         child = child->next) {
+        size += bc_change_size(child);
+    }
+
+    return size;
+}
+
+/* Remove the oldest undo changes so that the remaining changes use no
+ * more than history_limit bytes. A grouped change that's still being
+ * added to is always kept. Returns true if any change was dropped */
+static int bc_drop_history(BufferChanges *changes, size_t history_limit)
+{
+    BufferChange *prev = NULL;
+    BufferChange *buffer_change = changes->undo;
+    size_t size = 0;
+
+    if (changes->group_changes && buffer_change != NULL) {
+        size = bc_change_size(buffer_change);
+        prev = buffer_change;
+        buffer_change = buffer_change->next;
+    }
+
+    while (buffer_change != NULL) {
+        size += bc_change_size(buffer_change);
+
+        if (size > history_limit) {
+            break;
+        }
+
+        prev = buffer_change;
+        buffer_change = buffer_change->next;
+    }
+
+    if (buffer_change == NULL) {
+        return 0;
+    } else if (prev == NULL) {
+        changes->undo = NULL;
+    } else {
+        prev->next = NULL;
+    }
+
+    bc_free_stack(changes, buffer_change);
+
+    return 1;
+}
+
+void bc_get_memory_stats(const BufferChanges *changes,
+                         UndoMemoryStats *stats)
+{
+    memset(stats, 0, sizeof(UndoMemoryStats));
+    stats->memory = changes->memory;
+    stats->spilled = changes->spilled;
+
+    const BufferChange *stacks[] = { changes->undo, changes->redo };
+
+    for (size_t k = 0; k < ARRAY_SIZE(stacks, const BufferChange *); k++) {
+        for (const BufferChange *buffer_change = stacks[k];
+             buffer_change != NULL;
+             buffer_change = buffer_change->next) {
+            stats->changes++;
+            bc_add_change_stats(buffer_change, stats);
+        }
+    }
+}
+
+static void bc_add_change_stats(const BufferChange *buffer_change,
+                                UndoMemoryStats *stats)
+{
+    if (buffer_change->change_type == BCT_TEXT_CHANGE) {
+        stats->compressed += buffer_change->change.text_change->storage ==
+                             TCS_COMPRESSED;
+    } else {
+        for (const BufferChange *child = buffer_change->children;
+             child != NULL; child = child->next) {
+            bc_add_change_stats(child, stats);
+        }
+    }
+}
+
+/* Further changes aren't merged into the latest change. Used once
+ * the latest change has been saved to an undo file */
+void bc_seal(BufferChanges *changes)
+{
+    changes->sealed_id = changes->undo == NULL ? 0 : changes->undo->id;
+}
+
+static int bc_is_state(const BufferChange *buffer_change,
+                       BufferChangeState change_state)
+{
+    return buffer_change == change_state.change &&
+           buffer_change->id == change_state.id;
+}
+
+/* Encode the undo changes made after state from up to and including
+ * state to. found is false if to is no longer on the undo stack. If
+ * from isn't below to on the undo stack then history has diverged
+ * since from was saved, so every undo change up to to is encoded and
+ * rewrite is set. The caller frees data */
+Status bc_save_changes(BufferChanges *changes, BufferChangeState from,
+                       BufferChangeState to, char **data, size_t *length,
+                       int *found, int *rewrite)
+{
+    *data = NULL;
+    *length = 0;
+    *found = *rewrite = 0;
+
+    BufferChange *top = changes->undo;
+
+    while (top != NULL && !bc_is_state(top, to)) {
+        top = top->next;
+    }
+
+    if ((top == NULL && to.change != NULL) ||
+        (top != NULL && top->version != to.version)) {
+        return STATUS_SUCCESS;
+    }
+
+    size_t change_num = 0;
+    BufferChange *bottom = top;
+
+    while (bottom != NULL && !bc_is_state(bottom, from)) {
+        bottom = bottom->next;
+        change_num++;
+    }
+
+    *found = 1;
+    *rewrite = from.change != NULL &&
+               (bottom == NULL || bottom->version != from.version);
+
+    BufferChange **ordered = NULL;
+
+    if (change_num > 0) {
+        ordered = malloc(sizeof(BufferChange *) * change_num);
+
+        if (ordered == NULL) {
+            return OUT_OF_MEMORY("Unable to save undo history");
+        }
+    }
+
+    /* The undo stack has the latest change first */
+    size_t index = change_num;
+
+    for (BufferChange *buffer_change = top; index > 0;
+         buffer_change = buffer_change->next) {
+        ordered[--index] = buffer_change;
+    }
+
+    BCEncoder encoder = { NULL, 0, 0 };
+    Status status = STATUS_SUCCESS;
+
+    if (!bc_encode_varint(&encoder, change_num)) {
+        status = OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    for (size_t k = 0; k < change_num && STATUS_IS_SUCCESS(status); k++) {
+        status = bc_encode_change(changes, &encoder, ordered[k]);
+    }
+
+    free(ordered);
+
+    if (!STATUS_IS_SUCCESS(status)) {
+        free(encoder.data);
+        return status;
+    }
+
+    *data = encoder.data;
+    *length = encoder.length;
+
+    return STATUS_SUCCESS;
+}
+
+/* Returns space for length bytes at the end of the encoded data */
+static char *bc_encode_reserve(BCEncoder *encoder, size_t length)
+{
+    if (encoder->allocated - encoder->length < length) {
+        size_t allocated = encoder->allocated * 2;
+
+        if (allocated < encoder->length + length) {
+            allocated = encoder->length + length + 1024;
+        }
+
+        char *data = realloc(encoder->data, allocated);
+
+        if (data == NULL) {
+            return NULL;
+        }
+
+        encoder->data = data;
+        encoder->allocated = allocated;
+    }
+
+    char *reserved = encoder->data + encoder->length;
+    encoder->length += length;
+
+    return reserved;
+}
+
+static int bc_encode_varint(BCEncoder *encoder, uint64_t value)
+{
+    unsigned char bytes[10];
+    size_t length = 0;
+
+    do {
+        bytes[length] = value & 0x7F;
+        value >>= 7;
+
+        if (value > 0) {
+            bytes[length] |= 0x80;
+        }
+
+        length++;
+    } while (value > 0);
+
+    char *reserved = bc_encode_reserve(encoder, length);
+
+    if (reserved == NULL) {
+        return 0;
+    }
+
+    memcpy(reserved, bytes, length);
+
+    return 1;
+}
+
+static Status bc_encode_change(BufferChanges *changes, BCEncoder *encoder,
+                               BufferChange *buffer_change)
+{
+    if (buffer_change->change_type == BCT_TEXT_CHANGE) {
+        return bc_encode_text(changes, encoder,
+                              buffer_change->change.text_change);
+    }
+
+    size_t child_num = 0;
+
+    for (BufferChange *child = buffer_change->children; child != NULL;
+         child = child->next) {
+        child_num++;
+    }
+
+    char *type = bc_encode_reserve(encoder, 1);
+
+    if (type == NULL) {
+        return OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    *type = BC_ENCODED_GROUP;
+
+    if (!bc_encode_varint(encoder, child_num)) {
+        return OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    /* Children are stored with the latest first */
+    buffer_change->children = bc_reverse_changes(buffer_change->children);
+    Status status = STATUS_SUCCESS;
+
+    for (BufferChange *child = buffer_change->children;
+         child != NULL && STATUS_IS_SUCCESS(status); child = child->next) {
+        status = bc_encode_change(changes, encoder, child);
+    }
+
+    buffer_change->children = bc_reverse_changes(buffer_change->children);
+
+    return status;
+}
+
+static Status bc_encode_text(BufferChanges *changes, BCEncoder *encoder,
+                             const TextChange *text_change)
+{
+    char *type = bc_encode_reserve(encoder, 1);
+
+    if (type == NULL) {
+        return OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    *type = text_change->change_type == TCT_INSERT ? BC_ENCODED_INSERT :
+                                                     BC_ENCODED_DELETE;
+
+    if (!bc_encode_varint(encoder, text_change->pos.offset) ||
+        !bc_encode_varint(encoder, text_change->str_len)) {
+        return OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    if (text_change->change_type == TCT_INSERT) {
+        return STATUS_SUCCESS;
+    }
+
+    const char *stored = text_change->str;
+    size_t stored_len = text_change->stored_len;
+    char *compressed = NULL;
+
+    /* Text held in memory is compressed as it's written */
+    if (text_change->storage == TCS_MEMORY) {
+        stored_len = text_change->str_len;
+        compressed = malloc(text_change->str_len);
+
+        if (compressed != NULL) {
+            size_t compressed_len = lz_compress(text_change->str,
+                                                text_change->str_len,
+                                                compressed,
+                                                text_change->str_len - 1);
+
+            if (compressed_len > 0) {
+                stored = compressed;
+                stored_len = compressed_len;
+            }
+        }
+    }
+
+    char *reserved = NULL;
+
+    if (bc_encode_varint(encoder, stored_len)) {
+        reserved = bc_encode_reserve(encoder, stored_len);
+    }
+
+    if (reserved == NULL) {
+        free(compressed);
+        return OUT_OF_MEMORY("Unable to save undo history");
+    }
+
+    if (text_change->storage != TCS_SPILLED) {
+        memcpy(reserved, stored, stored_len);
+        free(compressed);
+        return STATUS_SUCCESS;
+    }
+
+    off_t offset = text_change->spill_offset;
+    ssize_t bytes;
+
+    while (stored_len > 0) {
+        bytes = pread(changes->spill_fd, reserved, stored_len, offset);
+
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            return st_get_error(ERR_UNDO_SPILL_ERROR,
+                                "Unable to read undo history: %s",
+                                bytes == 0 ? "Unexpected end of file" :
+                                strerror(errno));
+        }
+
+        reserved += bytes;
+        stored_len -= bytes;
+        offset += bytes;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* Decode changes encoded by bc_save_changes, adding them to
+ * history, which is a stack of changes with the latest first.
+ * On failure the caller frees any changes already added */
+Status bc_load_changes(BufferChanges *changes, BufferChange **history,
+                       const char *data, size_t length)
+{
+    BCDecoder decoder = { (const unsigned char *)data, length, 0 };
+    uint64_t change_num;
+
+    /* Every change takes at least three bytes */
+    if (!bc_decode_varint(&decoder, &change_num) ||
+        change_num > length / 3) {
+        return bc_invalid_history();
+    }
+
+    BufferChange *buffer_change;
+
+    for (uint64_t k = 0; k < change_num; k++) {
+        RETURN_IF_FAIL(bc_decode_change(changes, &decoder, 0,
+                                        &buffer_change));
+        buffer_change->next = *history;
+        *history = buffer_change;
+    }
+
+    if (decoder.position != decoder.length) {
+        return bc_invalid_history();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static int bc_decode_varint(BCDecoder *decoder, uint64_t *value)
+{
+    *value = 0;
+
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        if (decoder->position == decoder->length) {
+            return 0;
+        }
+
+        unsigned char byte = decoder->data[decoder->position++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static Status bc_decode_change(BufferChanges *changes, BCDecoder *decoder,
+                               int is_child,
+                               BufferChange **buffer_change_ptr)
+{
+    if (decoder->position == decoder->length) {
+        return bc_invalid_history();
+    }
+
+    unsigned char type = decoder->data[decoder->position++];
+
+    if (type == BC_ENCODED_INSERT) {
+        return bc_decode_text(changes, decoder, TCT_INSERT,
+                              buffer_change_ptr);
+    } else if (type == BC_ENCODED_DELETE) {
+        return bc_decode_text(changes, decoder, TCT_DELETE,
+                              buffer_change_ptr);
+    }
+
+    uint64_t child_num;
+
+    /* Grouped changes aren't nested */
+    if (type != BC_ENCODED_GROUP || is_child ||
+        !bc_decode_varint(decoder, &child_num) || child_num == 0 ||
+        child_num > (decoder->length - decoder->position) / 3) {
+        return bc_invalid_history();
+    }
+
+    Change change = { NULL };
+    BufferChange *group = bc_new(changes, &changes->arena,
+                                 BCT_GROUPED_CHANGE, change);
+
+    if (group == NULL) {
+        return OUT_OF_MEMORY("Unable to load undo history");
+    }
+
+    BufferChange *child;
+
+    for (uint64_t k = 0; k < child_num; k++) {
+        Status status = bc_decode_change(changes, decoder, 1, &child);
+
+        if (!STATUS_IS_SUCCESS(status)) {
+            bc_free_buffer_change(changes, group, NULL);
+            return status;
+        }
+
+        child->next = group->children;
+        group->children = child;
+    }
+
+    *buffer_change_ptr = group;
+
+    return STATUS_SUCCESS;
+}
+
+/* Decoded text changes only have the offset of their position set,
+ * which is resolved when they're applied */
+static Status bc_decode_text(BufferChanges *changes, BCDecoder *decoder,
+                             TextChangeType change_type,
+                             BufferChange **buffer_change_ptr)
+{
+    uint64_t offset, str_len, stored_len = 0;
+
+    if (!bc_decode_varint(decoder, &offset) ||
+        !bc_decode_varint(decoder, &str_len) ||
+        str_len == 0 || offset > SIZE_MAX || str_len > SIZE_MAX) {
+        return bc_invalid_history();
+    }
+
+    if (change_type == TCT_DELETE &&
+        (!bc_decode_varint(decoder, &stored_len) || stored_len == 0 ||
+         stored_len > str_len ||
+         stored_len > decoder->length - decoder->position)) {
+        return bc_invalid_history();
+    }
+
+    TextChange *text_change = ar_alloc(&changes->arena, sizeof(TextChange));
+
+    if (text_change == NULL) {
+        return OUT_OF_MEMORY("Unable to load undo history");
+    }
+
+    memset(text_change, 0, sizeof(TextChange));
+    text_change->change_type = change_type;
+    text_change->pos.offset = offset;
+    text_change->str_len = str_len;
+
+    /* Deleted text is kept as it was stored, so
+     * it's only decompressed if it's undone */
+    if (change_type == TCT_DELETE) {
+        text_change->str = ar_alloc(&changes->arena, stored_len);
+
+        if (text_change->str == NULL) {
+            ar_free(&changes->arena, text_change, sizeof(TextChange));
+            return OUT_OF_MEMORY("Unable to load undo history");
+        }
+
+        memcpy(text_change->str, decoder->data + decoder->position,
+               stored_len);
+        decoder->position += stored_len;
+        text_change->storage = TCS_COMPRESSED;
+        text_change->stored_len = stored_len;
+    }
+
+    bc_tc_account(changes, text_change, 1);
+
+    Change change = { .text_change = text_change };
+    BufferChange *buffer_change = bc_new(changes, &changes->arena,
+                                         BCT_TEXT_CHANGE, change);
+
+    if (buffer_change == NULL) {
+        bc_tc_free(changes, text_change);
+        return OUT_OF_MEMORY("Unable to load undo history");
+    }
+
+    *buffer_change_ptr = buffer_change;
+
+    return STATUS_SUCCESS;
+}
+
+static Status bc_invalid_history(void)
+{
+    return st_get_error(ERR_INVALID_UNDO_FILE,
+                        "Unable to load undo history: Undo file is invalid");
+}
+
+/* Place history, a stack of older changes with the latest first,
+ * below the changes on the undo stack */
+void bc_add_history(BufferChanges *changes, BufferChange *history)
+{
+    BufferChange **bottom = &changes->undo;
+
+    while (*bottom != NULL) {
+        bottom = &(*bottom)->next;
+    }
+
+    *bottom = history;
+}
+
+void bc_free_history(BufferChanges *changes, BufferChange *history)
+{
+    bc_free_stack(changes, history);
+}
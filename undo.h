@@ -20,11 +20,13 @@
 #define WED_UNDO_H
 
 #include <stddef.h>
-#include "list.h"
+#include <sys/types.h>
+#include "arena.h"
 #include "status.h"
 #include "buffer_pos.h"
 
-/* An unlimited linear undo/redo implementation */
+/* A linear undo/redo implementation. History is unlimited unless a
+ * limit is passed to bc_limit_memory */
 
 /* All operations on the text in a buffer can be thought of
  * as a sequence of insertions and deletions. That is, there are two
@@ -40,6 +42,18 @@ typedef enum {
     TCT_DELETE
 } TextChangeType;
 
+/* Where the text of a change is stored. The text of older changes
+ * is compressed then spilled to disk to keep undo history within its
+ * memory budget (see bc_limit_memory) */
+typedef enum {
+    TCS_MEMORY, /* str holds the text */
+    TCS_COMPRESSED, /* str holds stored_len bytes of compressed text.
+                       When stored_len equals str_len the text couldn't
+                       be compressed and is held as is */
+    TCS_SPILLED /* stored_len bytes of compressed text are held in the
+                   spill file at spill_offset and str is NULL */
+} TextChangeStorage;
+
 typedef struct TextChange TextChange;
 
 /* The properties of a text change
@@ -53,6 +67,9 @@ struct TextChange {
                   str is NULL for insert because the buffer already stores
                   the text that has been inserted, so storing it here also
                   would be unnecessary duplication */
+    TextChangeStorage storage; /* How str is stored when not NULL */
+    size_t stored_len; /* Bytes used to store a compressed or spilled str */
+    off_t spill_offset; /* Position of a spilled str in the spill file */
 };
 
 /* Text changes aren't the only possible changes that we could want
@@ -74,6 +91,9 @@ typedef enum {
  * to be tracked */
 typedef union {
     TextChange *text_change;
+    Arena *arena; /* For a grouped change, the arena its later children
+                     are allocated from once it has enough of them, or
+                     NULL (see BC_GROUP_ARENA_MIN_CHILDREN) */
 } Change;
 
 typedef struct BufferChange BufferChange;
@@ -82,18 +102,21 @@ typedef struct BufferChange BufferChange;
 struct BufferChange {
     BufferChangeType change_type; /* The type of change */
     BufferChange *next; /* Changes are stored in a linked list */
-    List *children; /* If this is not a grouped change then 
-                       children will be NULL, otherwise this is a list
-                       of all the child BufferChange changes this 
-                       grouped change is composed of */
-    Change change; /* The actual change details and data. For a grouped
-                      change this is NULL (i.e. the pointers in the union
-                      are NULL) as this change is simply a container for
-                      its child changes */
+    BufferChange *children; /* If this is not a grouped change then
+                               children will be NULL, otherwise this is
+                               a linked list of all the child BufferChange
+                               changes this grouped change is composed of,
+                               starting with the latest */
+    Change change; /* The actual change details and data. A grouped
+                      change is simply a container for its child changes
+                      so only stores the arena they may use */
     size_t version; /* Set to 0 and incremented when a sequential change is
                        grouped to this change. This is used by the
                        BufferChangeState struct to determine if a buffer has
                        been modified */
+    size_t id; /* Unique among the changes of a buffer. The memory of a
+                  freed change is soon reused so the id distinguishes a
+                  new change from one a BufferChangeState refers to */
 };
 
 /* This is the top level struct containing undo and redo stacks
@@ -104,10 +127,23 @@ typedef struct {
     int group_changes; /* When true all subsequent BufferChange's are
                           grouped together as children of a single
                           BufferChange until set to false */
+    size_t group_size; /* Children added to the current grouped change */
     int accept_new_changes; /* Set true by default. When false all further
                                changes are ignored. This is used when
                                actually applying an undo/redo which
                                will require inserting/deleting text */
+    size_t memory; /* Bytes of text held in memory by changes */
+    size_t spilled; /* Bytes of text held in the spill file by changes */
+    int spill_fd; /* Unlinked temporary file the text of old changes is
+                     spilled to, or -1 if nothing has been spilled */
+    off_t spill_size; /* Bytes written to the spill file. Space is only
+                         reclaimed once no change is stored in it */
+    Arena arena; /* Changes and their text are allocated from this arena,
+                    or a child arena of a large grouped change, so that
+                    they're released together by bc_free */
+    size_t last_id; /* Id of the most recently created change */
+    size_t sealed_id; /* Id of a change that further changes aren't
+                         merged into as it's been saved to disk */
 } BufferChanges;
 
 /* Stores the most recent change on the undo stack. This can be used to take
@@ -120,15 +156,27 @@ typedef struct {
                                    as it could point to freed memory */
     size_t version; /* The version of the most recent change on the undo
                        stack */
+    size_t id; /* The id of the most recent change on the undo stack */
 } BufferChangeState;
 
+/* Undo memory usage as displayed by the meminfo command */
+typedef struct {
+    size_t changes; /* Number of changes on the undo and redo stacks */
+    size_t memory; /* Bytes of text held in memory */
+    size_t compressed; /* Changes whose text is compressed in memory */
+    size_t spilled; /* Bytes of text held in the spill file */
+} UndoMemoryStats;
+
 struct Buffer;
 
 void bc_init(BufferChanges *);
 void bc_free(BufferChanges *);
+Status bc_clear(BufferChanges *);
 Status bc_add_text_insert(BufferChanges *, size_t str_len, const BufferPos *);
 Status bc_add_text_delete(BufferChanges *, const char *str, size_t str_len,
                           const BufferPos *);
+Status bc_add_spilled_text_delete(BufferChanges *, const char *str,
+                                  size_t str_len, const BufferPos *);
 int bc_can_undo(const BufferChanges *);
 int bc_can_redo(const BufferChanges *);
 int bc_grouped_changes_started(const BufferChanges *);
@@ -141,5 +189,17 @@ void bc_disable(BufferChanges *);
 void bc_enable(BufferChanges *);
 BufferChangeState bc_get_current_state(const BufferChanges *);
 int bc_has_state_changed(const BufferChanges *, BufferChangeState);
+int bc_has_state(const BufferChanges *, BufferChangeState);
+Status bc_limit_memory(BufferChanges *, size_t memory_budget,
+                       size_t history_limit, int *history_dropped);
+void bc_get_memory_stats(const BufferChanges *, UndoMemoryStats *);
+void bc_seal(BufferChanges *);
+Status bc_save_changes(BufferChanges *, BufferChangeState from,
+                       BufferChangeState to, char **data, size_t *length,
+                       int *found, int *rewrite);
+Status bc_load_changes(BufferChanges *, BufferChange **history,
+                       const char *data, size_t length);
+void bc_add_history(BufferChanges *, BufferChange *history);
+void bc_free_history(BufferChanges *, BufferChange *history);
 
 #endif
@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "undo_file.h"
+
+/* The undo file starts with a magic number followed by a segment
+ * for each save:
+ *
+ * | length (8) | checksum (4) | base (40) | hash (8) | changes |
+ *
+ * length is the number of bytes following the checksum. base and
+ * hash identify the content of the file once the changes have been
+ * applied, so the last segment identifies the file's current content.
+ * The checksum covers the rest of the segment so a segment partially
+ * written is detected and ignored, along with anything after it */
+#define UF_MAGIC "WEDUNDO1"
+#define UF_HEADER_SIZE 8
+#define UF_SEGMENT_HEADER_SIZE (8 + 4)
+#define UF_PAYLOAD_HEADER_SIZE (sizeof(UndoFileBase) + 8)
+
+#define UF_HASH_OFFSET 14695981039346656037ULL
+#define UF_HASH_PRIME 1099511628211ULL
+
+static void uf_get_base(const struct stat *, UndoFileBase *);
+static uint32_t uf_checksum(uint32_t hash, const void *data, size_t length);
+static int uf_next_segment(const char *data, size_t length, size_t *offset,
+                           const char **payload, size_t *payload_length);
+static int uf_write_all(int fd, const char *data, size_t length,
+                        off_t offset);
+static Status uf_map(const UndoFile *, int *fd_ptr, size_t map_length,
+                     char **map_ptr, size_t *mapped_length);
+
+/* Returns the path of the undo file for file_path, which is a hidden
+ * file in the same directory. The caller frees the path */
+char *uf_undo_path(const char *file_path)
+{
+    const char *file_name = strrchr(file_path, '/');
+    file_name = file_name == NULL ? file_path : file_name + 1;
+    size_t dir_length = file_name - file_path;
+
+    size_t path_length = strlen(file_path) + 1 + strlen(UF_FILE_SUFFIX) + 1;
+    char *undo_path = malloc(path_length);
+
+    if (undo_path != NULL) {
+        snprintf(undo_path, path_length, "%.*s.%s%s", (int)dir_length,
+                 file_path, file_name, UF_FILE_SUFFIX);
+    }
+
+    return undo_path;
+}
+
+/* The undo file isn't accessed until history is saved or loaded */
+Status uf_new(UndoFile **undo_file_ptr, const char *file_path)
+{
+    UndoFile *undo_file = malloc(sizeof(UndoFile));
+
+    if (undo_file == NULL) {
+        return OUT_OF_MEMORY("Unable to create undo file");
+    }
+
+    memset(undo_file, 0, sizeof(UndoFile));
+    undo_file->file_path = strdup(file_path);
+    undo_file->undo_path = uf_undo_path(file_path);
+
+    if (undo_file->file_path == NULL || undo_file->undo_path == NULL) {
+        uf_free(undo_file);
+        return OUT_OF_MEMORY("Unable to create undo file");
+    }
+
+    *undo_file_ptr = undo_file;
+
+    return STATUS_SUCCESS;
+}
+
+void uf_free(UndoFile *undo_file)
+{
+    if (undo_file == NULL) {
+        return;
+    }
+
+    free(undo_file->file_path);
+    free(undo_file->undo_path);
+    free(undo_file);
+}
+
+/* The file has been reloaded so the undo file is checked
+ * against its new content when next used */
+void uf_reset(UndoFile *undo_file)
+{
+    undo_file->attached = 0;
+    undo_file->end_offset = 0;
+    undo_file->session_offset = 0;
+    undo_file->base_offset = 0;
+    undo_file->loaded = 0;
+    memset(&undo_file->persisted, 0, sizeof(BufferChangeState));
+}
+
+/* The oldest changes in memory have been discarded, so the history
+ * that remains no longer follows on from the undo file, which is
+ * started again when next written */
+void uf_history_dropped(UndoFile *undo_file)
+{
+    uf_reset(undo_file);
+    undo_file->attached = 1;
+    undo_file->loaded = 1;
+}
+
+int uf_can_load(const UndoFile *undo_file)
+{
+    return !undo_file->loaded;
+}
+
+static void uf_get_base(const struct stat *file_stat, UndoFileBase *base)
+{
+    memset(base, 0, sizeof(UndoFileBase));
+    base->size = file_stat->st_size;
+    base->dev = file_stat->st_dev;
+    base->ino = file_stat->st_ino;
+    base->mtime_sec = file_stat->st_mtim.tv_sec;
+    base->mtime_nsec = file_stat->st_mtim.tv_nsec;
+}
+
+/* Determine whether the undo file ends with the content of the file
+ * as it was opened, as described by file_stat. If so the history it
+ * contains can be loaded and later changes are appended to it,
+ * otherwise it's replaced when next written */
+Status uf_attach(UndoFile *undo_file, const struct stat *file_stat)
+{
+    if (undo_file->attached) {
+        return STATUS_SUCCESS;
+    }
+
+    undo_file->attached = 1;
+
+    if (file_stat == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    int fd;
+    char *map;
+    size_t mapped_length;
+
+    RETURN_IF_FAIL(uf_map(undo_file, &fd, 0, &map, &mapped_length));
+
+    if (map == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    size_t offset = UF_HEADER_SIZE;
+    const char *payload, *last_payload = NULL;
+    size_t payload_length;
+
+    while (uf_next_segment(map, mapped_length, &offset, &payload,
+                           &payload_length)) {
+        last_payload = payload;
+    }
+
+    UndoFileBase base;
+    uf_get_base(file_stat, &base);
+
+    if (last_payload != NULL &&
+        memcmp(last_payload, &base, sizeof(UndoFileBase)) == 0) {
+        undo_file->end_offset = offset;
+        undo_file->session_offset = offset;
+        undo_file->base_offset = offset;
+    }
+
+    munmap(map, mapped_length);
+    close(fd);
+
+    return STATUS_SUCCESS;
+}
+
+/* Add a segment containing the encoded changes made since the last
+ * segment was written. When rewrite is set the changes follow on from
+ * the oldest change in memory rather than the last segment, so the
+ * segments written since then are replaced */
+Status uf_append(UndoFile *undo_file, const struct stat *saved_stat,
+                 uint64_t hash, const char *changes, size_t length,
+                 int rewrite)
+{
+    if (rewrite) {
+        undo_file->end_offset = undo_file->base_offset;
+    }
+
+    int fd = open(undo_file->undo_path, O_WRONLY | O_CREAT, 0600);
+
+    if (fd == -1) {
+        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                            "Unable to open undo file %s - %s",
+                            undo_file->undo_path, strerror(errno));
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    unsigned char header[UF_SEGMENT_HEADER_SIZE + UF_PAYLOAD_HEADER_SIZE];
+    UndoFileBase base;
+    uint64_t segment_length = UF_PAYLOAD_HEADER_SIZE + length;
+
+    uf_get_base(saved_stat, &base);
+    memcpy(header, &segment_length, 8);
+    memcpy(header + UF_SEGMENT_HEADER_SIZE, &base, sizeof(UndoFileBase));
+    memcpy(header + UF_SEGMENT_HEADER_SIZE + sizeof(UndoFileBase), &hash, 8);
+
+    uint32_t checksum = uf_checksum(2166136261u, header, 8);
+    checksum = uf_checksum(checksum, header + UF_SEGMENT_HEADER_SIZE,
+                           UF_PAYLOAD_HEADER_SIZE);
+    checksum = uf_checksum(checksum, changes, length);
+    memcpy(header + 8, &checksum, 4);
+
+    int success = 1;
+    struct stat undo_stat;
+
+    /* Later segments don't depend on earlier ones, so if the undo file
+     * has been removed or truncated it's started again */
+    if (fstat(fd, &undo_stat) == 0 &&
+        undo_stat.st_size < undo_file->end_offset) {
+        undo_file->end_offset = 0;
+        undo_file->session_offset = 0;
+        undo_file->base_offset = 0;
+    }
+
+    /* A new undo file, or one that doesn't match the file, is started
+     * again. Anything after the valid content is discarded */
+    if (undo_file->end_offset < UF_HEADER_SIZE) {
+        success = ftruncate(fd, 0) == 0 &&
+                  uf_write_all(fd, UF_MAGIC, UF_HEADER_SIZE, 0);
+        undo_file->end_offset = UF_HEADER_SIZE;
+    } else {
+        success = ftruncate(fd, undo_file->end_offset) == 0;
+    }
+
+    if (undo_file->base_offset < UF_HEADER_SIZE) {
+        undo_file->base_offset = UF_HEADER_SIZE;
+    }
+
+    off_t offset = undo_file->end_offset;
+
+    success = success &&
+              uf_write_all(fd, (char *)header, sizeof(header), offset) &&
+              uf_write_all(fd, changes, length, offset + sizeof(header));
+
+    Status status = STATUS_SUCCESS;
+
+    if (success) {
+        undo_file->end_offset += sizeof(header) + length;
+    } else {
+        status = st_get_error(ERR_UNABLE_TO_WRITE_TO_FILE,
+                              "Unable to write undo file %s - %s",
+                              undo_file->undo_path, strerror(errno));
+        /* Whatever was written can't be relied on */
+        undo_file->end_offset = 0;
+        undo_file->session_offset = 0;
+        undo_file->base_offset = 0;
+    }
+
+    close(fd);
+
+    return status;
+}
+
+/* Pass the changes written by earlier sessions to load_cb, oldest
+ * first. Nothing is loaded unless hash matches the hash of the
+ * content the changes were last saved with, which is the current
+ * content of the buffer. History can only be loaded once */
+Status uf_load(UndoFile *undo_file, uint64_t hash, UndoFileLoadCB load_cb,
+               void *context)
+{
+    if (undo_file->loaded) {
+        return STATUS_SUCCESS;
+    }
+
+    undo_file->loaded = 1;
+
+    if (undo_file->session_offset == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    int fd;
+    char *map;
+    size_t mapped_length;
+    size_t length = undo_file->session_offset;
+
+    RETURN_IF_FAIL(uf_map(undo_file, &fd, length, &map, &mapped_length));
+
+    if (map == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    Status status = STATUS_SUCCESS;
+    size_t offset = UF_HEADER_SIZE;
+    const char *payload, *last_payload = NULL;
+    size_t payload_length;
+
+    while (uf_next_segment(map, length, &offset, &payload,
+                           &payload_length)) {
+        last_payload = payload;
+    }
+
+    if (offset != length || last_payload == NULL) {
+        status = st_get_error(ERR_INVALID_UNDO_FILE,
+                              "Undo file %s is invalid",
+                              undo_file->undo_path);
+    } else if (memcmp(last_payload + sizeof(UndoFileBase), &hash, 8) == 0) {
+        offset = UF_HEADER_SIZE;
+
+        while (STATUS_IS_SUCCESS(status) &&
+               uf_next_segment(map, length, &offset, &payload,
+                               &payload_length)) {
+            status = load_cb(context, payload + UF_PAYLOAD_HEADER_SIZE,
+                             payload_length - UF_PAYLOAD_HEADER_SIZE);
+        }
+
+        /* The oldest change in memory is now the oldest saved */
+        if (STATUS_IS_SUCCESS(status)) {
+            undo_file->base_offset = UF_HEADER_SIZE;
+        }
+    }
+
+    munmap(map, mapped_length);
+    close(fd);
+
+    return status;
+}
+
+/* Map the first map_length bytes of the undo file, or all of it when
+ * map_length is 0. map_ptr is set to NULL if the undo file doesn't
+ * exist, is too short or doesn't start with the magic number */
+static Status uf_map(const UndoFile *undo_file, int *fd_ptr,
+                     size_t map_length, char **map_ptr, size_t *mapped_length)
+{
+    *map_ptr = NULL;
+    int fd = open(undo_file->undo_path, O_RDONLY);
+
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return STATUS_SUCCESS;
+        }
+
+        return st_get_error(ERR_UNABLE_TO_OPEN_FILE,
+                            "Unable to open undo file %s - %s",
+                            undo_file->undo_path, strerror(errno));
+    }
+
+    struct stat undo_stat;
+
+    if (fstat(fd, &undo_stat) == -1) {
+        Status status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                                     "Unable to read undo file %s - %s",
+                                     undo_file->undo_path, strerror(errno));
+        close(fd);
+        return status;
+    }
+
+    size_t size = undo_stat.st_size;
+
+    if (map_length == 0) {
+        map_length = size;
+    }
+
+    if (map_length < UF_HEADER_SIZE || map_length > size) {
+        close(fd);
+        return STATUS_SUCCESS;
+    }
+
+    char *map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED) {
+        Status status = st_get_error(ERR_UNABLE_TO_READ_FILE,
+                                     "Unable to read undo file %s - %s",
+                                     undo_file->undo_path, strerror(errno));
+        close(fd);
+        return status;
+    }
+
+    if (memcmp(map, UF_MAGIC, UF_HEADER_SIZE) != 0) {
+        munmap(map, map_length);
+        close(fd);
+        return STATUS_SUCCESS;
+    }
+
+    *fd_ptr = fd;
+    *map_ptr = map;
+    *mapped_length = map_length;
+
+    return STATUS_SUCCESS;
+}
+
+/* Returns true if a complete segment starts at offset,
+ * which is then advanced past it */
+static int uf_next_segment(const char *data, size_t length, size_t *offset,
+                           const char **payload, size_t *payload_length)
+{
+    if (length - *offset < UF_SEGMENT_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint64_t segment_length;
+    uint32_t checksum;
+    const char *segment = data + *offset;
+
+    memcpy(&segment_length, segment, 8);
+    memcpy(&checksum, segment + 8, 4);
+
+    /* Check the length before trusting it to read the segment */
+    if (segment_length < UF_PAYLOAD_HEADER_SIZE ||
+        segment_length > length - *offset - UF_SEGMENT_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t expected = uf_checksum(2166136261u, segment, 8);
+    expected = uf_checksum(expected, segment + UF_SEGMENT_HEADER_SIZE,
+                           segment_length);
+
+    if (checksum != expected) {
+        return 0;
+    }
+
+    *payload = segment + UF_SEGMENT_HEADER_SIZE;
+    *payload_length = segment_length;
+    *offset += UF_SEGMENT_HEADER_SIZE + segment_length;
+
+    return 1;
+}
+
+static uint32_t uf_checksum(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t k = 0; k < length; k++) {
+        hash ^= bytes[k];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int uf_write_all(int fd, const char *data, size_t length,
+                        off_t offset)
+{
+    ssize_t written;
+
+    while (length > 0) {
+        written = pwrite(fd, data, length, offset);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 0;
+        }
+
+        data += written;
+        length -= written;
+        offset += written;
+    }
+
+    return 1;
+}
+
+void uf_hash_init(UndoFileHash *content_hash)
+{
+    content_hash->hash = UF_HASH_OFFSET;
+    content_hash->pending_length = 0;
+}
+
+/* Text is combined into the hash eight bytes at a time,
+ * which keeps hashing large buffers fast */
+void uf_hash_update(UndoFileHash *content_hash, const char *text,
+                    size_t length)
+{
+    uint64_t hash = content_hash->hash;
+    uint64_t word;
+
+    if (content_hash->pending_length > 0) {
+        size_t fill = 8 - content_hash->pending_length;
+        fill = fill < length ? fill : length;
+        memcpy(content_hash->pending + content_hash->pending_length,
+               text, fill);
+        content_hash->pending_length += fill;
+        text += fill;
+        length -= fill;
+
+        if (content_hash->pending_length < 8) {
+            return;
+        }
+
+        memcpy(&word, content_hash->pending, 8);
+        hash = (hash ^ word) * UF_HASH_PRIME;
+        content_hash->pending_length = 0;
+    }
+
+    for (; length >= 8; text += 8, length -= 8) {
+        memcpy(&word, text, 8);
+        hash = (hash ^ word) * UF_HASH_PRIME;
+    }
+
+    memcpy(content_hash->pending, text, length);
+    content_hash->pending_length = length;
+    content_hash->hash = hash;
+}
+
+uint64_t uf_hash_final(UndoFileHash *content_hash)
+{
+    uint64_t hash = content_hash->hash;
+
+    for (size_t k = 0; k < content_hash->pending_length; k++) {
+        hash = (hash ^ content_hash->pending[k]) * UF_HASH_PRIME;
+    }
+
+    hash ^= content_hash->pending_length;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/* Hash of all the text in data, which identifies
+ * the content of a saved file */
+uint64_t uf_hash_text(const GapBuffer *data)
+{
+    UndoFileHash content_hash;
+    GBSegmentIter iter;
+    const char *text;
+    size_t length;
+
+    uf_hash_init(&content_hash);
+    gb_segment_iter_init(&iter, data, 0, gb_length(data));
+
+    while (gb_segment_iter_next(&iter, &text, &length)) {
+        uf_hash_update(&content_hash, text, length);
+    }
+
+    return uf_hash_final(&content_hash);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_UNDO_FILE_H
+#define WED_UNDO_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "gap_buffer.h"
+#include "status.h"
+#include "undo.h"
+
+/* Appended to the file name to create the undo file name */
+#define UF_FILE_SUFFIX ".wedu"
+
+/* Identifies the content of a file as it was saved */
+typedef struct {
+    uint64_t size; /* File size */
+    uint64_t dev; /* Device containing file */
+    uint64_t ino; /* File inode */
+    uint64_t mtime_sec; /* Modification time */
+    uint64_t mtime_nsec;
+} UndoFileBase;
+
+/* Hash of text which is independent of how the text is split
+ * between calls to uf_hash_update */
+typedef struct {
+    uint64_t hash;
+    unsigned char pending[8]; /* Bytes not yet combined into hash */
+    size_t pending_length;
+} UndoFileHash;
+
+/* Called with the encoded changes of each segment of
+ * history when an undo file is loaded, oldest first */
+typedef Status (*UndoFileLoadCB)(void *context, const char *changes,
+                                 size_t length);
+
+/* Keeps the undo history of a file between sessions. Each time the file
+ * is saved the changes made since the last save are appended to the
+ * undo file as a segment, along with the attributes and a hash of the
+ * saved content. An undo file is only read when it's first written to,
+ * to check it follows on from the file as it was opened, and when
+ * history from earlier sessions is loaded */
+typedef struct {
+    char *file_path; /* File the history applies to */
+    char *undo_path; /* Undo file path */
+    int attached; /* Set once the undo file has been checked against
+                     the file as it was opened */
+    off_t end_offset; /* Length of the valid content of the undo file */
+    off_t session_offset; /* Length of the history written by earlier
+                             sessions which can be loaded, or 0 */
+    off_t base_offset; /* Offset the history of the oldest change in
+                          memory is written from */
+    BufferChangeState persisted; /* Latest change written */
+    int loaded; /* History from earlier sessions has been loaded or
+                   is no longer available */
+} UndoFile;
+
+char *uf_undo_path(const char *file_path);
+Status uf_new(UndoFile **, const char *file_path);
+void uf_free(UndoFile *);
+void uf_reset(UndoFile *);
+void uf_history_dropped(UndoFile *);
+int uf_can_load(const UndoFile *);
+Status uf_attach(UndoFile *, const struct stat *file_stat);
+Status uf_append(UndoFile *, const struct stat *saved_stat, uint64_t hash,
+                 const char *changes, size_t length, int rewrite);
+Status uf_load(UndoFile *, uint64_t hash, UndoFileLoadCB, void *context);
+void uf_hash_init(UndoFileHash *);
+void uf_hash_update(UndoFileHash *, const char *text, size_t length);
+uint64_t uf_hash_final(UndoFileHash *);
+uint64_t uf_hash_text(const GapBuffer *);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 Richard Burke
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WED_UNICODE_H
+#define WED_UNICODE_H
+
+/* The tables in unicode.c are generated by tools/unicode.pl. The
+ * properties of each code point are packed into a single byte */
+
+#define UC_MAX_CODE_POINT 0x10FFFF
+
+/* Number of columns the code point takes up: 0, 1 or 2 */
+#define UC_WIDTH_MASK 0x03
+/* Combining mark i.e. general category Mn, Mc or Me */
+#define UC_COMBINING 0x04
+/* Emoji and other pictographs */
+#define UC_EXTENDED_PICTOGRAPHIC 0x08
+/* Grapheme_Cluster_Break value stored in the upper four bits */
+#define UC_GRAPHEME_BREAK_SHIFT 4
+
+#define UC_WIDTH(properties) ((properties) & UC_WIDTH_MASK)
+#define UC_GRAPHEME_BREAK(properties) \
+    ((UnicodeGraphemeBreak)((properties) >> UC_GRAPHEME_BREAK_SHIFT))
+
+/* Grapheme_Cluster_Break property values. The order
+ * must match @grapheme_break_values in tools/unicode.pl */
+typedef enum {
+    UGB_OTHER,
+    UGB_CR,
+    UGB_LF,
+    UGB_CONTROL,
+    UGB_EXTEND,
+    UGB_ZWJ,
+    UGB_REGIONAL_INDICATOR,
+    UGB_PREPEND,
+    UGB_SPACING_MARK,
+    UGB_L,
+    UGB_V,
+    UGB_T,
+    UGB_LV,
+    UGB_LVT
+} UnicodeGraphemeBreak;
+
+unsigned char uc_properties(unsigned int code_point);
+
+#endif
@@ -20,6 +20,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef __MACH__
+#include <mach/clock.h>
+#include <mach/mach.h>
+#endif
 #include "util.h"
 
 void warn(const char *error_msg)
@@ -214,3 +218,30 @@ void bytes_to_str(size_t bytes, char *buf, size_t buf_len)
     snprintf(buf, buf_len, "%.*Lf %s", decimal_places, size, units[unit_index]);
 }
 
+
+void get_monotonic_time(struct timespec *time)
+{
+#ifdef __MACH__
+    clock_serv_t clock;
+    mach_timespec_t mach;
+
+    host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &clock);
+    clock_get_time(clock, &mach);
+    mach_port_deallocate(mach_task_self(), clock);
+
+    time->tv_sec = mach.tv_sec;
+    time->tv_nsec = mach.tv_nsec;
+#else
+    clock_gettime(CLOCK_MONOTONIC, time);
+#endif
+}
+
+/* Milliseconds passed since start was taken using get_monotonic_time */
+long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    get_monotonic_time(&now);
+
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}